@@ -35,11 +35,17 @@
 #include <utime.h>
 #include <time.h>
 
+#ifdef _POSIX_THREADS
+# include <pthread.h>
+# include <sys/socket.h>
+#endif
+
 #ifdef WITH_DMALLOC
 # include <dmalloc.h>
 #endif
 
 #include "libzsync/zsync.h"
+#include "librcksum/rcksum.h"
 
 #include "url.h"
 
@@ -51,8 +57,113 @@ struct zsync_client_state
     unsigned random_seed;
     char *referrer;
     long long http_down;
+    FILE *control;      /* The .zsync, while it is still being read */
+    struct control_fetch *fetch;
 };
 
+#ifdef _POSIX_THREADS
+/* For options->progressive, the .zsync is downloaded by another thread, which
+ * passes it on through a socket as it comes in; so that we can start on the
+ * seed files before it is all here. */
+struct control_fetch {
+    pthread_t thread;
+    struct zsync_http_routines *http;
+    const char *url;
+    const char *fn;
+    int sd;
+    FILE *f;            /* As http_get_tee returns */
+    char *referrer;
+};
+
+static void *control_fetch_thread(void *arg) {
+    struct control_fetch *cf = arg;
+
+    cf->f = cf->http->http_get_tee(cf->url, &cf->referrer, cf->fn, cf->sd);
+    return NULL;
+}
+
+/* f = start_control_fetch(cs, url, filename)
+ * Starts downloading the .zsync at the given URL (saving it to the given
+ * filename, if not NULL) in another thread, and returns a stream from which it
+ * can be read as it comes in; or NULL if that can't be done. */
+static FILE *start_control_fetch(struct zsync_client_state *cs, const char *url,
+                                 const char *fn) {
+    struct control_fetch *cf;
+    int sv[2];
+    FILE *f;
+
+    if (!cs->http_routines->http_get_tee)
+        return NULL;
+    cf = calloc(1, sizeof *cf);
+    if (!cf)
+        return NULL;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        free(cf);
+        return NULL;
+    }
+    f = fdopen(sv[0], "r");
+    if (!f) {
+        close(sv[0]);
+        close(sv[1]);
+        free(cf);
+        return NULL;
+    }
+    cf->http = cs->http_routines;
+    cf->url = url;
+    cf->fn = fn;
+    cf->sd = sv[1];
+    if (pthread_create(&cf->thread, NULL, control_fetch_thread, cf) != 0) {
+        fclose(f);
+        close(sv[1]);
+        free(cf);
+        return NULL;
+    }
+    cs->fetch = cf;
+    return f;
+}
+
+/* end_control_fetch(cs)
+ * Waits for the download started by start_control_fetch to finish. Returns 0,
+ * or -1 if it failed. */
+static int end_control_fetch(struct zsync_client_state *cs) {
+    struct control_fetch *cf = cs->fetch;
+    int rc = -1;
+
+    pthread_join(cf->thread, NULL);
+    if (cf->f) {
+        fclose(cf->f);
+        free(cs->referrer);
+        cs->referrer = cf->referrer;
+        rc = 0;
+    }
+    else {
+        fprintf(stderr, "could not read control file from URL %s\n", cf->url);
+        free(cf->referrer);
+    }
+    free(cf);
+    cs->fetch = NULL;
+    return rc;
+}
+#endif
+
+/* finish_control_file(cs, zs)
+ * Where the .zsync was still being read, waits for the rest of it, and closes
+ * it. Returns 0, or -1 if it couldn't be read. */
+static int finish_control_file(struct zsync_client_state *cs,
+                               struct zsync_state *zs) {
+    int rc = zsync_load_blocksums(zs, 1) == 1 ? 0 : -1;
+
+    if (cs->control) {
+        fclose(cs->control);
+        cs->control = NULL;
+    }
+#ifdef _POSIX_THREADS
+    if (cs->fetch && end_control_fetch(cs) != 0)
+        rc = -1;
+#endif
+    return rc;
+}
+
 /* FILE* f = open_zcat_pipe(file_str)
  * Returns a (popen) filehandle which when read returns the un-gzipped content
  * of the given file. Or NULL on error; or the filehandle may fail to read. It
@@ -110,8 +221,9 @@ static void read_seed_file(struct zsync_client_state *cs, struct zsync_state *z,
              * content */
             zsync_submit_source_file(z, f, !cs->quiet);
 
-            /* Close and check for errors */
-            if (pclose(f) != 0) {
+            /* Close and check for errors; except that if we have the whole
+             * target, we may not have read it all, and zcat will complain */
+            if (pclose(f) != 0 && zsync_status(z) < 2) {
                 perror("close");
             }
         }
@@ -154,9 +266,12 @@ static void read_seed_file(struct zsync_client_state *cs, struct zsync_state *z,
  * and it starts with a URL scheme ; only http URLs are supported.
  * Second parameter is a filename in which to locally save the content of the
  * .zsync _if it is retrieved from a URL_; can be NULL in which case no local
- * copy is made.
+ * copy is made. Third is the client options (see zsync_client_options), or
+ * NULL; for the directory for index files of the block checksums and whether
+ * to read them in place from the file, or to read it as it is downloaded (in
+ * which case it is left in cs->control until finish_control_file).
  */
-static struct zsync_state *read_zsync_control_file(struct zsync_client_state *cs, const char *p, const char *fn, zs_return *error) {
+static struct zsync_state *read_zsync_control_file(struct zsync_client_state *cs, const char *p, const char *fn, const struct zsync_client_options *options, zs_return *error) {
     FILE *f;
     struct zsync_state *zs;
     char *lastpath = NULL;
@@ -171,29 +286,49 @@ static struct zsync_state *read_zsync_control_file(struct zsync_client_state *cs
             return NULL;
         }
 
-        /* Try URL fetch */
-        if(cs->http_routines->http_get) {
+        /* Try URL fetch; in the background, if we're to read it as it comes */
+#ifdef _POSIX_THREADS
+        if (options && options->progressive)
+            f = start_control_fetch(cs, p, fn);
+#endif
+        if (!f && cs->http_routines->http_get) {
             f = cs->http_routines->http_get(p, &lastpath, fn);
+            if (f) {
+                free(cs->referrer);
+                cs->referrer = lastpath;
+            }
         }
         if (!f) {
             fprintf(stderr, "could not read control file from URL %s\n", p);
             *error = zs_download_receive_err;
             return NULL;
         }
-        free(cs->referrer);
-        cs->referrer = lastpath;
     }
 
     /* Read the .zsync */
-    if ((zs = zsync_begin(f)) == NULL) {
+    if ((zs = zsync_begin_with_options(f, options ? options->index_cache : NULL,
+                                       (options && options->map_control_file
+                                        ? ZSYNC_MAP_BLOCKSUMS : 0)
+                                       | (cs->fetch ? ZSYNC_PROGRESSIVE : 0)))
+        == NULL) {
         *error = zs_read_control_file_err;
     }
 
+    /* Where the rest of it is still to be read, it's kept open until then */
+    if (zs && cs->fetch) {
+        cs->control = f;
+        return zs;
+    }
+
     /* And close it */
     if (fclose(f) != 0) {
         perror("fclose");
         *error = zs_download_local_err;
     }
+#ifdef _POSIX_THREADS
+    if (cs->fetch)
+        end_control_fetch(cs);
+#endif
     return zs;
 }
 
@@ -422,6 +557,36 @@ static int fetch_remaining_blocks(struct zsync_client_state *cs, struct zsync_st
     return 0;
 }
 
+/* print_stats(&stats, local_used, http_down)
+ * Prints the statistics of librcksum's work, and how much of the target we
+ * got locally and how much we downloaded, as JSON on stdout */
+static void print_stats(const struct rcksum_stats *st, long long local_used,
+                        long long http_down) {
+    static const char *const phases[RCKSUM_PHASES] =
+        { "index", "aligned", "scan" };
+    int i;
+
+    printf("{\n  \"bytes_scanned\": %lld,\n", st->bytes_scanned);
+    printf("  \"hash_hits\": %lld,\n  \"weak_hits\": %lld,\n"
+           "  \"weak_false_positives\": %lld,\n"
+           "  \"weak_false_positive_rate\": %.6f,\n",
+           st->hashhit, st->weakhit, st->weakmiss,
+           st->weakhit ? (double)st->weakmiss / st->weakhit : 0.0);
+    printf("  \"strong_hits\": %lld,\n  \"checksummed\": %lld,\n",
+           st->stronghit, st->checksummed);
+    printf("  \"chain_lengths\": [");
+    for (i = 0; i < RCKSUM_CHAIN_BUCKETS; i++)
+        printf("%s%lld", i ? ", " : "", st->chain[i]);
+    printf("],\n  \"writes\": %lld,\n  \"bytes_written\": %lld,\n",
+           st->writes, st->bytes_written);
+    printf("  \"phases\": {");
+    for (i = 0; i < RCKSUM_PHASES; i++)
+        printf("%s\n    \"%s\": { \"wall\": %.6f, \"cpu\": %.6f }",
+               i ? "," : "", phases[i], st->wall[i], st->cpu[i]);
+    printf("\n  },\n  \"local_used\": %lld,\n  \"http_down\": %lld\n}\n",
+           local_used, http_down);
+}
+
 static int set_mtime(const char* filename, time_t mtime) {
     struct stat s;
     struct utimbuf u;
@@ -450,13 +615,17 @@ zs_return zsync_client(const char *control_file_location,
                        const int nseedfiles,
                        bool quiet,
                        struct zsync_http_routines *http_routines,
-                       struct zsync_progress_routines *progress_routines) {
+                       struct zsync_progress_routines *progress_routines,
+                       const struct zsync_client_options *options) {
     zs_return ret = zs_ok;
     
     struct zsync_client_state cs = { 0 };
     struct zsync_state *zs = NULL;
     char *temp_file = NULL;
     long long local_used = 0;
+    struct rcksum_stats stats;
+    int have_stats = 0;
+    int fetched;
 
     cs.http_routines = http_routines;
     cs.progress_routines = progress_routines;
@@ -470,7 +639,8 @@ zs_return zsync_client(const char *control_file_location,
     }
     
     /* STEP 1: Read the zsync control file */
-    zs = read_zsync_control_file(&cs, control_file_location, keep_control_file_path, &ret);
+    zs = read_zsync_control_file(&cs, control_file_location, keep_control_file_path,
+                                 options, &ret);
     if(ret != zs_ok) {
         goto bail;
     } else if (zs == NULL) {
@@ -478,6 +648,8 @@ zs_return zsync_client(const char *control_file_location,
         goto bail;
     }
     
+    if (options)
+        zsync_set_threads(zs, options->threads);
 
     /* Get eventual filename for output, and filename to write to while working */
     if (!output_file_path)
@@ -488,25 +660,57 @@ zs_return zsync_client(const char *control_file_location,
 
     {   /* STEP 2: read available local data and fill in what we know in the
          *target file */
-        int i;
+        const char **seeds = malloc((nseedfiles + 2) * sizeof *seeds);
+        char *early = calloc(nseedfiles + 2, 1);
+        int i, n = 0;
 
-        /* Try any seed files supplied by the command line */
-        for (i = 0; i < nseedfiles; i++) {
-            read_seed_file(&cs, zs, seedfiles[i]);
+        if (!seeds || !early) {
+            free(seeds);
+            free(early);
+            ret = zs_download_local_err;
+            goto bail;
         }
+
+        /* Try any seed files supplied by the command line */
+        for (i = 0; i < nseedfiles; i++)
+            seeds[n++] = seedfiles[i];
         /* If the target file already exists, we're probably updating that file
          * - so it's a seed file */
-        if (!access(output_file_path, R_OK)) {
-            read_seed_file(&cs, zs, output_file_path);
-        }
+        if (!access(output_file_path, R_OK))
+            seeds[n++] = output_file_path;
         /* If the .part file exists, it's probably an interrupted earlier
          * effort; a normal HTTP client would 'resume' from where it got to,
          * but zsync can't (because we don't know this data corresponds to the
          * current version on the remote) and doesn't need to, because we can
          * treat it like any other local source of data. Use it now. */
-        if (!access(temp_file, R_OK)) {
-            read_seed_file(&cs, zs, temp_file);
+        if (!access(temp_file, R_OK))
+            seeds[n++] = temp_file;
+
+        /* Read them in turn; but once we have all of the target, there's no
+         * need to look at any more. Note those read while the .zsync was
+         * still coming in, so without all of its blocks to look for. */
+        for (i = 0; i < n && zsync_status(zs) < 2; i++) {
+            int loaded = zsync_load_blocksums(zs, 0);
+
+            if (loaded < 0)
+                break;
+            early[i] = !loaded;
+            read_seed_file(&cs, zs, seeds[i]);
+        }
+
+        /* Then wait for the rest of it, and read those again for the blocks
+         * that we weren't looking for before */
+        if (finish_control_file(&cs, zs) != 0) {
+            free(seeds);
+            free(early);
+            ret = zs_read_control_file_err;
+            goto bail;
         }
+        for (i = 0; i < n && zsync_status(zs) < 2; i++)
+            if (early[i])
+                read_seed_file(&cs, zs, seeds[i]);
+        free(seeds);
+        free(early);
 
         /* Show how far that got us */
         zsync_progress(zs, &local_used, NULL);
@@ -534,8 +738,14 @@ zs_return zsync_client(const char *control_file_location,
         goto bail;
     }
 
-    /* STEP 3: fetch remaining blocks via the URLs from the .zsync */
-    if (fetch_remaining_blocks(&cs, zs) != 0) {
+    /* STEP 3: fetch remaining blocks via the URLs from the .zsync; that's
+     * all the work done by librcksum, so get its stats now */
+    fetched = fetch_remaining_blocks(&cs, zs);
+    if (options && options->stats) {
+        zsync_get_stats(zs, &stats);
+        have_stats = 1;
+    }
+    if (fetched != 0) {
         fprintf(stderr,
                 "failed to retrieve all remaining blocks - no valid download URLs remain. Incomplete transfer left in %s.\n(If this is the download filename with .part appended, zsync will automatically pick this up and reuse the data it has already done if you retry in this dir.)\n",
                 temp_file);
@@ -618,8 +828,12 @@ zs_return zsync_client(const char *control_file_location,
 
 bail:
     /* Final stats and cleanup */
+    if (cs.control)
+        finish_control_file(&cs, zs);
     if (!cs.quiet)
         printf("used %lld local, fetched %lld\n", local_used, cs.http_down);
+    if (have_stats)
+        print_stats(&stats, local_used, cs.http_down);
     
     free(cs.referrer);
     free(temp_file);
@@ -53,6 +53,11 @@ struct zsync_http_routines {
     // Called after a set of range fetches is complete.
     // Takes a status blob (which should become invalid after this call).
     void(*range_fetch_end)(void *rf);
+
+    // As http_get, but also sends the content, as it comes in, on the given
+    // socket, and then closes it; see zsync_client_options.progressive. Is
+    // called from a thread of its own. May be NULL.
+    FILE*(*http_get_tee)(const char *orig_url, char **track_referrer, const char *tfname, int tee_fd);
 };
 
 struct zsync_progress_routines {
@@ -69,6 +74,26 @@ struct zsync_progress_routines {
     void(*end_progress)(void* p, int done);    
 };
 
+struct zsync_client_options {
+    // Number of threads to read each seed file with; 0 or 1 for just one.
+    int threads;
+
+    // Directory to keep indexes of targets' block checksums in, or NULL.
+    const char *index_cache;
+
+    // Read the block checksums in place from the .zsync rather than loading
+    // them into memory; it must not change while zsync runs.
+    int map_control_file;
+
+    // Print statistics of the work done, as JSON on stdout, at the end.
+    int stats;
+
+    // Where the .zsync is downloaded, start reading the seed files while it
+    // is still coming in (with http_get_tee); those read before it was all in
+    // are read again for the rest of the blocks.
+    int progressive;
+};
+
 #define zs_ok 0
 #define zs_read_control_file_err 1
 #define zs_download_local_err 2
@@ -77,7 +102,7 @@ struct zsync_progress_routines {
 #define zs_backup_old_file_err 5
 typedef int zs_return;
 
-/* progress may be NULL if quiet is true */
+/* progress may be NULL if quiet is true; options may be NULL for the defaults */
 zs_return zsync_client(const char *control_file_location, 
                        const char *keep_control_file_path, 
                        const char *output_file_path, 
@@ -86,4 +111,5 @@ zs_return zsync_client(const char *control_file_location,
                        const int nseedfiles,
                        bool quiet,
                        struct zsync_http_routines *http,
-                       struct zsync_progress_routines *progress);
+                       struct zsync_progress_routines *progress,
+                       const struct zsync_client_options *options);
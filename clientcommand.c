@@ -26,6 +26,7 @@
 #include <string.h>
 
 #include <unistd.h>
+#include <getopt.h>
 #include <sys/types.h>
 
 #include "progress.h"
@@ -63,11 +64,17 @@ int main(int argc, char **argv) {
     char *zfname = NULL;
     char *referrer = NULL;
     int no_progress = 0;
+    struct zsync_client_options options = { 0 };
     
     {   /* Option parsing */
+        static const struct option long_options[] = {
+            { "stats", no_argument, NULL, 'S' },
+            { NULL, 0, NULL, 0 }
+        };
         int opt;
         
-        while ((opt = getopt(argc, argv, "A:k:o:i:Vsqu:")) != -1) {
+        while ((opt = getopt_long(argc, argv, "A:k:o:i:I:j:MPVsqu:",
+                                  long_options, NULL)) != -1) {
             switch (opt) {
                 case 'A':           /* Authentication options for remote server */
                     {               /* Scan string as hostname=username:password */
@@ -97,6 +104,25 @@ int main(int argc, char **argv) {
                 case 'i':
                     seedfiles = (char **)append_ptrlist(&nseedfiles, (void **)seedfiles, optarg);
                     break;
+                case 'I':
+                    options.index_cache = optarg;
+                    break;
+                case 'M':
+                    options.map_control_file = 1;
+                    break;
+                case 'P':
+                    options.progressive = 1;
+                    break;
+                case 'j':
+                    options.threads = atoi(optarg);
+                    if (options.threads < 1) {
+                        fprintf(stderr, "-j takes a number of threads\n");
+                        return 1;
+                    }
+                    break;
+                case 'S':
+                    options.stats = 1;
+                    break;
                 case 'V':
                     printf(PACKAGE " v" VERSION " (compiled " __DATE__ " " __TIME__
                            ")\n" "By Colin Phipps <cph@moria.org.uk>\n"
@@ -144,7 +170,8 @@ int main(int argc, char **argv) {
         range_fetch_addranges,
         get_range_block,
         range_fetch_bytes_down,
-        range_fetch_end
+        range_fetch_end,
+        http_get_tee
     };
     
     struct zsync_progress_routines progress_routines = 
@@ -154,7 +181,9 @@ int main(int argc, char **argv) {
         end_progress
     };
     
-    no_http_progress = no_progress;
+    /* With -P, the .zsync comes in while the seed files are read, so only
+     * the progress of those is shown */
+    no_http_progress = no_progress || options.progressive;
     
-    return zsync_client(argv[optind], zfname, filename, referrer, seedfiles, nseedfiles, no_progress, &http_routines, &progress_routines);
+    return zsync_client(argv[optind], zfname, filename, referrer, seedfiles, nseedfiles, no_progress, &http_routines, &progress_routines, &options);
 }
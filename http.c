@@ -254,7 +254,58 @@ static char *http_date_string(time_t t, char *const buf, const int blen) {
     return NULL;
 }
 
+/* tee_send(socket, buf, len)
+ * Sends all of buf[] on the given socket; returns 0, or -1 if it can't (as
+ * when the other end has been closed, which mustn't raise SIGPIPE) */
+static int tee_send(int sd, const void *buf, size_t len) {
+#ifndef MSG_NOSIGNAL
+# define MSG_NOSIGNAL 0
+#endif
+    const char *p = buf;
+
+    while (len) {
+        ssize_t r = send(sd, p, len, MSG_NOSIGNAL);
+
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        p += r;
+        len -= r;
+    }
+    return 0;
+}
+
+/* tee_file(stream, socket)
+ * Sends the content of the given file on the socket, leaving the stream at
+ * its end; returns 0, or -1 if it can't be sent */
+static int tee_file(FILE * g, int sd) {
+    char buf[4096];
+    size_t r;
+    int rc = 0;
+
+    rewind(g);
+    while (rc == 0 && (r = fread(buf, 1, sizeof(buf), g)) > 0)
+        rc = tee_send(sd, buf, r);
+    fseek(g, 0, SEEK_END);
+    return rc;
+}
+
+/* http_get(url, &referrer, filename)
+ * Retrieves the given URL, saving it to the given filename (if not NULL; and
+ * only getting what is new, if we have a copy already), and returns a stream
+ * for it from the start; or NULL on error. */
 FILE *http_get(const char *orig_url, char **track_referrer, const char *tfname) {
+    return http_get_tee(orig_url, track_referrer, tfname, -1);
+}
+
+/* http_get_tee(url, &referrer, filename, socket)
+ * As http_get, and also sends the content, as it is received, on the given
+ * socket (if not -1), which is then closed; so that another thread can read
+ * it from the other end while it downloads. If that end is closed, the rest
+ * is still downloaded. */
+FILE *http_get_tee(const char *orig_url, char **track_referrer,
+                   const char *tfname, int tee) {
     int allow_redirects = 5;
     char *url;
     FILE *f = NULL;
@@ -300,6 +351,8 @@ FILE *http_get(const char *orig_url, char **track_referrer, const char *tfname)
     url = strdup(orig_url);
     if (!url) {
         free(fname);
+        if (tee != -1)
+            close(tee);
         return NULL;
     }
 
@@ -408,12 +461,21 @@ FILE *http_get(const char *orig_url, char **track_referrer, const char *tfname)
     if (code == 304) {
         fclose(f);
         free(fname);
+        if (tee != -1) {
+            if (g)
+                tee_file(g, tee);
+            close(tee);
+            if (g)
+                rewind(g);
+        }
         return g;
     }
 
     /* Return errors from the above loop */
     if (!f) {
         fprintf(stderr, "failed on url %s\n", url ? url : "(missing redirect)");
+        if (tee != -1)
+            close(tee);
         return NULL;
     }
 
@@ -421,9 +483,17 @@ FILE *http_get(const char *orig_url, char **track_referrer, const char *tfname)
     if (!g) {
         fclose(f);
         perror("fopen");
+        if (tee != -1)
+            close(tee);
         return NULL;
     }
 
+    /* Where we are adding to what we had, that comes first */
+    if (tee != -1 && code == 206 && tee_file(g, tee) != 0) {
+        close(tee);
+        tee = -1;
+    }
+
     {   /* Read data returned by the request above, writing to the output file */
         size_t len = 0;
         {   /* Skip headers. TODO support content-encodings, Content-Location etc */
@@ -464,6 +534,10 @@ FILE *http_get(const char *orig_url, char **track_referrer, const char *tfname)
                         fprintf(stderr, "short write on %s\n", fname);
                         break;
                     }
+                    if (tee != -1 && tee_send(tee, buf, r) != 0) {
+                        close(tee);
+                        tee = -1;
+                    }
 
                     /* And maintain progress indication */
                     got += r;
@@ -475,6 +549,8 @@ FILE *http_get(const char *orig_url, char **track_referrer, const char *tfname)
                 end_progress(p, feof(f) ? 2 : 0);
         }
         fclose(f);
+        if (tee != -1)
+            close(tee);
     }
 
     /* The caller wants the content we just downloaded; return the handle to
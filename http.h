@@ -20,6 +20,7 @@ extern int no_http_progress;
 int set_proxy_from_string(const char* s);
 
 FILE* http_get(const char* orig_url, char** track_referrer, const char* tfname);
+FILE* http_get_tee(const char* orig_url, char** track_referrer, const char* tfname, int tee);
 
 void* range_fetch_start(const char* orig_url, const char *referrer);
 void range_fetch_addranges(void* rf, off_t* ranges, int nranges);
@@ -0,0 +1,249 @@
+/*
+ *   rcksum/lib - library for using the rsync algorithm to determine
+ *               which parts of a file you have and which you need.
+ *   Copyright (C) 2004,2005,2007,2009 Colin Phipps <cph@moria.org.uk>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* The BLAKE3 hash, as an alternative strong checksum for blocks. This is the
+ * plain one-shot form of the algorithm (no keyed or extended output modes):
+ * the input is split into 1024 byte chunks, each hashed as a chain of 64 byte
+ * blocks, and the chunks' chaining values are combined up a binary tree.
+ *
+ * As with MD4 (see md4batch.c), blocks are checksummed several at a time, one
+ * per lane of a vector: all the blocks have the same length, so they have the
+ * same number of chunks and the same tree shape, and every lane does exactly
+ * the same steps.
+ */
+
+#include "zsglobal.h"
+
+#include <string.h>
+#include <sys/types.h>
+
+#ifdef WITH_DMALLOC
+# include <dmalloc.h>
+#endif
+
+#include "blake3.h"
+#include "rcksum.h"
+#include "internal.h"
+
+#define CHUNK_START 1
+#define CHUNK_END 2
+#define PARENT 4
+#define ROOT 8
+
+/* Most levels of the tree of chunks we can need, for any size_t length */
+#define MAX_DEPTH 54
+
+static const uint32_t blake3_iv[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+/* The order that each round takes the message words in */
+static const unsigned char blake3_sigma[7][16] = {
+    { 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15},
+    { 2,  6,  3, 10,  7,  0,  4, 13,  1, 11, 12,  5,  9, 14, 15,  8},
+    { 3,  4, 10, 12, 13,  2,  7, 14,  6,  5,  9,  0, 11, 15,  8,  1},
+    {10,  7, 12,  9, 14,  3, 13, 15,  4,  0, 11,  2,  5,  8,  1,  6},
+    {12, 13,  9, 11, 15, 10, 14,  8,  7,  2,  5,  3,  0,  1,  6,  4},
+    { 9, 14, 11,  5,  8, 12, 15,  1, 13,  3,  0, 10,  2,  6,  4,  7},
+    {11, 15,  5,  0,  1,  9,  8,  6, 14, 10,  2, 12,  3,  4,  7, 13},
+};
+
+/* The round function, written so as to work on plain words or on vectors */
+#define ROTR32(x, n) ((x) >> (n) | (x) << (32 - (n)))
+#define G(v, a, b, c, d, x, y) do { \
+        v[a] += v[b] + (x); v[d] = ROTR32(v[d] ^ v[a], 16); \
+        v[c] += v[d];       v[b] = ROTR32(v[b] ^ v[c], 12); \
+        v[a] += v[b] + (y); v[d] = ROTR32(v[d] ^ v[a], 8); \
+        v[c] += v[d];       v[b] = ROTR32(v[b] ^ v[c], 7); } while (0)
+#define ROUND(v, m, s) do { \
+        G(v, 0, 4,  8, 12, m[s[ 0]], m[s[ 1]]); \
+        G(v, 1, 5,  9, 13, m[s[ 2]], m[s[ 3]]); \
+        G(v, 2, 6, 10, 14, m[s[ 4]], m[s[ 5]]); \
+        G(v, 3, 7, 11, 15, m[s[ 6]], m[s[ 7]]); \
+        G(v, 0, 5, 10, 15, m[s[ 8]], m[s[ 9]]); \
+        G(v, 1, 6, 11, 12, m[s[10]], m[s[11]]); \
+        G(v, 2, 7,  8, 13, m[s[12]], m[s[13]]); \
+        G(v, 3, 4,  9, 14, m[s[14]], m[s[15]]); } while (0)
+
+/* compress(out[], cv[], m[], counter, block_len, flags)
+ * The compression function; out[] gets the first 8 words of the result, which
+ * is all that we need, either as the next chaining value or as the hash. */
+static void compress(uint32_t out[8], const uint32_t cv[8],
+                     const uint32_t m[16], uint64_t counter,
+                     uint32_t block_len, uint32_t flags) {
+    uint32_t v[16];
+    int i;
+
+    memcpy(v, cv, 8 * sizeof *v);
+    memcpy(v + 8, blake3_iv, 4 * sizeof *v);
+    v[12] = (uint32_t) counter;
+    v[13] = (uint32_t) (counter >> 32);
+    v[14] = block_len;
+    v[15] = flags;
+
+    for (i = 0; i < 7; i++)
+        ROUND(v, m, blake3_sigma[i]);
+
+    for (i = 0; i < 8; i++)
+        out[i] = v[i] ^ v[i + 8];
+}
+
+/* load_block(m[], data, len)
+ * Load up to a block of data as message words, 0 padded */
+static void load_block(uint32_t m[16], const uint8_t *data, size_t len) {
+    uint8_t buf[BLAKE3_BLOCK_LENGTH];
+    int i;
+
+    memset(buf, 0, sizeof buf);
+    memcpy(buf, data, len);
+    for (i = 0; i < 16; i++)
+        m[i] = buf[4 * i] | (uint32_t) buf[4 * i + 1] << 8
+            | (uint32_t) buf[4 * i + 2] << 16 | (uint32_t) buf[4 * i + 3] << 24;
+}
+
+/* blake3(out, data, len)
+ * Returns in out[] the BLAKE3 hash of the given data */
+void blake3(uint8_t out[BLAKE3_OUT_LEN], const uint8_t *data, size_t len) {
+    uint32_t stack[MAX_DEPTH][8];
+    int depth = 0;
+    uint32_t cv[8], m[16];
+    uint64_t chunk;
+    uint32_t block_len, flags;
+    int i;
+
+    /* Hash each chunk; all but the last go into the tree straight away, while
+     * the last block of the last one is held back until we know if it is the
+     * root of the tree */
+    for (chunk = 0;; chunk++) {
+        const uint8_t *p = data + chunk * BLAKE3_CHUNK_LENGTH;
+        size_t clen = len - chunk * BLAKE3_CHUNK_LENGTH;
+        uint64_t n;
+
+        if (clen > BLAKE3_CHUNK_LENGTH)
+            clen = BLAKE3_CHUNK_LENGTH;
+
+        memcpy(cv, blake3_iv, sizeof cv);
+        flags = CHUNK_START;
+        for (; clen > BLAKE3_BLOCK_LENGTH; clen -= BLAKE3_BLOCK_LENGTH) {
+            load_block(m, p, BLAKE3_BLOCK_LENGTH);
+            compress(cv, cv, m, chunk, BLAKE3_BLOCK_LENGTH, flags);
+            p += BLAKE3_BLOCK_LENGTH;
+            flags = 0;
+        }
+        load_block(m, p, clen);
+        block_len = clen;
+        flags |= CHUNK_END;
+
+        if ((chunk + 1) * BLAKE3_CHUNK_LENGTH >= len)
+            break;
+
+        /* Merge as many complete subtrees as this chunk completes */
+        compress(cv, cv, m, chunk, block_len, flags);
+        for (n = chunk + 1; !(n & 1); n >>= 1) {
+            memcpy(m, stack[--depth], sizeof stack[0]);
+            memcpy(m + 8, cv, sizeof cv);
+            compress(cv, blake3_iv, m, 0, BLAKE3_BLOCK_LENGTH, PARENT);
+        }
+        memcpy(stack[depth++], cv, sizeof cv);
+    }
+
+    /* Fold what's left of the tree down into the root */
+    while (depth > 0) {
+        uint32_t right[8];
+
+        compress(right, cv, m, chunk, block_len, flags);
+        memcpy(m, stack[--depth], sizeof stack[0]);
+        memcpy(m + 8, right, sizeof right);
+        memcpy(cv, blake3_iv, sizeof cv);
+        chunk = 0;
+        block_len = BLAKE3_BLOCK_LENGTH;
+        flags = PARENT;
+    }
+    compress(cv, cv, m, chunk, block_len, flags | ROOT);
+
+    for (i = 0; i < 8; i++) {
+        out[4 * i] = cv[i];
+        out[4 * i + 1] = cv[i] >> 8;
+        out[4 * i + 2] = cv[i] >> 16;
+        out[4 * i + 3] = cv[i] >> 24;
+    }
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define BLAKE3_X86_SIMD 1
+
+# define BLAKE3_LANES 4
+# define BLAKE3_TARGET "sse2"
+# define BLAKE3_KERNEL blake3_sse2
+# include "blake3lanes.h"
+# undef BLAKE3_LANES
+# undef BLAKE3_TARGET
+# undef BLAKE3_KERNEL
+
+# define BLAKE3_LANES 8
+# define BLAKE3_TARGET "avx2"
+# define BLAKE3_KERNEL blake3_avx2
+# include "blake3lanes.h"
+# undef BLAKE3_LANES
+# undef BLAKE3_TARGET
+# undef BLAKE3_KERNEL
+
+# define BLAKE3_LANES 16
+# define BLAKE3_TARGET "avx512f"
+# define BLAKE3_KERNEL blake3_avx512
+# include "blake3lanes.h"
+# undef BLAKE3_LANES
+# undef BLAKE3_TARGET
+# undef BLAKE3_KERNEL
+#endif
+
+/* blake3_blocks(checksums[], data[], nblocks, blocksize, max_lanes)
+ * As md4_blocks, but the BLAKE3 hashes (the first CHECKSUM_SIZE bytes of). */
+void blake3_blocks(unsigned char *c, const unsigned char *data,
+                   size_t nblocks, size_t blocksize, int max_lanes) {
+#ifdef BLAKE3_X86_SIMD
+    if (blocksize > 0) {
+        __builtin_cpu_init();
+        if (max_lanes >= 16 && __builtin_cpu_supports("avx512f"))
+            for (; nblocks >= 16; nblocks -= 16) {
+                blake3_avx512(c, data, blocksize);
+                c += 16 * CHECKSUM_SIZE;
+                data += 16 * blocksize;
+            }
+        if (max_lanes >= 8 && __builtin_cpu_supports("avx2"))
+            for (; nblocks >= 8; nblocks -= 8) {
+                blake3_avx2(c, data, blocksize);
+                c += 8 * CHECKSUM_SIZE;
+                data += 8 * blocksize;
+            }
+        if (max_lanes >= 4 && __builtin_cpu_supports("sse2"))
+            for (; nblocks >= 4; nblocks -= 4) {
+                blake3_sse2(c, data, blocksize);
+                c += 4 * CHECKSUM_SIZE;
+                data += 4 * blocksize;
+            }
+    }
+#endif
+    for (; nblocks > 0; nblocks--) {
+        uint8_t out[BLAKE3_OUT_LEN];
+
+        blake3(out, data, blocksize);
+        memcpy(c, out, CHECKSUM_SIZE);
+        c += CHECKSUM_SIZE;
+        data += blocksize;
+    }
+}
@@ -0,0 +1,132 @@
+/*
+ *   rcksum/lib - library for using the rsync algorithm to determine
+ *               which parts of a file you have and which you need.
+ *   Copyright (C) 2004,2005,2007,2009 Colin Phipps <cph@moria.org.uk>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* Template for a kernel calculating the BLAKE3 checksums of BLAKE3_LANES
+ * blocks at once, each block in its own lane of a vector; it follows blake3()
+ * step for step. blake3.c includes this once for each instruction set, with
+ * BLAKE3_LANES, BLAKE3_TARGET and BLAKE3_KERNEL defined.
+ *
+ * BLAKE3_KERNEL(checksums, data, len)
+ * Calculates the checksums of the BLAKE3_LANES consecutive blocks of len
+ * bytes in data[], into checksums[]. */
+__attribute__ ((target(BLAKE3_TARGET)))
+static void BLAKE3_KERNEL(unsigned char *out, const unsigned char *data,
+                          size_t len) {
+    typedef uint32_t vec __attribute__ ((vector_size(4 * BLAKE3_LANES)));
+    vec stack[MAX_DEPTH][8];
+    int depth = 0;
+    vec cv[8], m[16];
+    uint64_t chunk;
+    uint32_t block_len, flags;
+    int i, j;
+
+/* Load up to a block from each lane's data at offset pos, 0 padded */
+#define LOAD_BLOCK(pos, n) do { \
+        for (j = 0; j < BLAKE3_LANES; j++) { \
+            uint8_t buf[BLAKE3_BLOCK_LENGTH]; \
+            const uint8_t *p = data + j * len + (pos); \
+            if ((n) < BLAKE3_BLOCK_LENGTH) { \
+                memset(buf, 0, sizeof buf); \
+                memcpy(buf, p, (n)); \
+                p = buf; \
+            } \
+            for (i = 0; i < 16; i++) { \
+                uint32_t w; \
+                memcpy(&w, p + 4 * i, 4); \
+                m[i][j] = w; \
+            } \
+        } } while (0)
+
+/* The compression function, for all lanes; out = the new chaining values */
+#define COMPRESS(out, in, counter, block_len, flags) do { \
+        vec v[16]; int r; \
+        for (i = 0; i < 8; i++) v[i] = in[i]; \
+        for (i = 0; i < 4; i++) v[i + 8] = (vec) { 0 } + blake3_iv[i]; \
+        v[12] = (vec) { 0 } + (uint32_t) (counter); \
+        v[13] = (vec) { 0 } + (uint32_t) ((uint64_t) (counter) >> 32); \
+        v[14] = (vec) { 0 } + (block_len); \
+        v[15] = (vec) { 0 } + (flags); \
+        for (r = 0; r < 7; r++) \
+            ROUND(v, m, blake3_sigma[r]); \
+        for (i = 0; i < 8; i++) out[i] = v[i] ^ v[i + 8]; } while (0)
+
+    for (chunk = 0;; chunk++) {
+        size_t pos = chunk * BLAKE3_CHUNK_LENGTH;
+        size_t clen = len - pos;
+        uint64_t n;
+
+        if (clen > BLAKE3_CHUNK_LENGTH)
+            clen = BLAKE3_CHUNK_LENGTH;
+
+        for (i = 0; i < 8; i++)
+            cv[i] = (vec) { 0 } + blake3_iv[i];
+        flags = CHUNK_START;
+        for (; clen > BLAKE3_BLOCK_LENGTH; clen -= BLAKE3_BLOCK_LENGTH) {
+            LOAD_BLOCK(pos, BLAKE3_BLOCK_LENGTH);
+            COMPRESS(cv, cv, chunk, BLAKE3_BLOCK_LENGTH, flags);
+            pos += BLAKE3_BLOCK_LENGTH;
+            flags = 0;
+        }
+        LOAD_BLOCK(pos, clen);
+        block_len = clen;
+        flags |= CHUNK_END;
+
+        if ((chunk + 1) * BLAKE3_CHUNK_LENGTH >= len)
+            break;
+
+        COMPRESS(cv, cv, chunk, block_len, flags);
+        for (n = chunk + 1; !(n & 1); n >>= 1) {
+            vec iv[8];
+
+            depth--;
+            for (i = 0; i < 8; i++) {
+                m[i] = stack[depth][i];
+                m[i + 8] = cv[i];
+                iv[i] = (vec) { 0 } + blake3_iv[i];
+            }
+            COMPRESS(cv, iv, 0, BLAKE3_BLOCK_LENGTH, PARENT);
+        }
+        for (i = 0; i < 8; i++)
+            stack[depth][i] = cv[i];
+        depth++;
+    }
+
+    while (depth > 0) {
+        vec right[8];
+
+        COMPRESS(right, cv, chunk, block_len, flags);
+        depth--;
+        for (i = 0; i < 8; i++) {
+            m[i] = stack[depth][i];
+            m[i + 8] = right[i];
+            cv[i] = (vec) { 0 } + blake3_iv[i];
+        }
+        chunk = 0;
+        block_len = BLAKE3_BLOCK_LENGTH;
+        flags = PARENT;
+    }
+    COMPRESS(cv, cv, chunk, block_len, flags | ROOT);
+
+    /* Output words are little-endian (as is x86) */
+    for (j = 0; j < BLAKE3_LANES; j++)
+        for (i = 0; i < CHECKSUM_SIZE / 4; i++) {
+            uint32_t w = cv[i][j];
+            memcpy(out + j * CHECKSUM_SIZE + i * 4, &w, 4);
+        }
+
+#undef LOAD_BLOCK
+#undef COMPRESS
+}
@@ -0,0 +1,137 @@
+/*
+ *   rcksum/lib - library for using the rsync algorithm to determine
+ *               which parts of a file you have and which you need.
+ *   Copyright (C) 2004,2005,2007,2009 Colin Phipps <cph@moria.org.uk>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* Copying blocks found in a seed file straight from that file to the working
+ * output, without the data passing through us. Where the filesystem can share
+ * the data between the files (reflinks, on btrfs or XFS), the blocks are
+ * cloned, which costs neither I/O nor space; otherwise the kernel copies them
+ * (copy_file_range(2)); and failing that, we read and write them ourselves.
+ */
+
+#include "zsglobal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef __linux__
+# include <sys/ioctl.h>
+# include <sys/syscall.h>
+# include <linux/fs.h>
+#endif
+
+#ifdef WITH_DMALLOC
+# include <dmalloc.h>
+#endif
+
+#include "rcksum.h"
+#include "internal.h"
+
+/* copy_blocks(self, scan_state, src_offset, startblock, endblock)
+ * Writes the block range (inclusive) to our under-construction output file,
+ * taking the data from the scan's source file at offset src_offset; counting
+ * the writes in the scan's stats. */
+void copy_blocks(struct rcksum_state *z, struct scan_state *s, off_t src,
+                 zs_blockid bfrom, zs_blockid bto) {
+    const int src_fd = s->src_fd;
+    off_t len = ((off_t) (bto - bfrom + 1)) << z->blockshift;
+    off_t dst = ((off_t) bfrom) << z->blockshift;
+
+#ifdef FICLONERANGE
+    {   /* Clone the data, if it lies on whole filesystem blocks in both */
+        struct stat st;
+
+        if (fstat(z->fd, &st) == 0 && st.st_blksize > 0
+            && !(src % st.st_blksize) && !(dst % st.st_blksize)
+            && !(len % st.st_blksize)) {
+            struct file_clone_range r;
+
+            r.src_fd = src_fd;
+            r.src_offset = src;
+            r.src_length = len;
+            r.dest_offset = dst;
+            if (ioctl(z->fd, FICLONERANGE, &r) == 0) {
+                s->stats.writes++;
+                s->stats.bytes_written += len;
+                return;
+            }
+        }
+    }
+#endif
+
+#ifdef SYS_copy_file_range
+    /* Have the kernel copy it; it will give up if it can't do it between
+     * these two files, and then we carry on from wherever it got to. If the
+     * kernel hasn't got it at all, this scan stops asking; that's noted in
+     * its own scan state, as other threads may be copying too */
+    while (len > 0 && !s->no_copy_range) {
+        loff_t in = src, out = dst;
+        long rc = syscall(SYS_copy_file_range, src_fd, &in, z->fd, &out,
+                          (size_t) len, 0);
+
+        if (rc == -1 && errno == EINTR)
+            continue;
+        if (rc <= 0) {
+            if (rc == -1 && errno == ENOSYS)
+                s->no_copy_range = 1;
+            break;
+        }
+        s->stats.writes++;
+        s->stats.bytes_written += rc;
+        src += rc;
+        dst += rc;
+        len -= rc;
+    }
+#endif
+
+    {   /* Copy whatever's left ourselves */
+        unsigned char buf[65536];
+
+        while (len > 0) {
+            size_t l = len < (off_t) sizeof buf ? (size_t) len : sizeof buf;
+            ssize_t rc = pread(src_fd, buf, l, src);
+
+            if (rc == -1 && errno == EINTR)
+                continue;
+            if (rc == -1) {
+                fprintf(stderr, "IO error: %s\n", strerror(errno));
+                exit(-1);
+            }
+
+            /* We only copy data that is there in the source file, but if it
+             * has shrunk since, then the rest is gone; leave it as 0s */
+            if (rc == 0) {
+                memset(buf, 0, l);
+                rc = l;
+            }
+
+            /* Write; if not all of it, we'll read the rest again */
+            rc = pwrite(z->fd, buf, rc, dst);
+            if (rc == -1) {
+                fprintf(stderr, "IO error: %s\n", strerror(errno));
+                exit(-1);
+            }
+            s->stats.writes++;
+            s->stats.bytes_written += rc;
+            src += rc;
+            dst += rc;
+            len -= rc;
+        }
+    }
+}
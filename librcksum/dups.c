@@ -0,0 +1,388 @@
+/*
+ *   rcksum/lib - library for using the rsync algorithm to determine
+ *               which parts of a file you have and which you need.
+ *   Copyright (C) 2004,2005,2007,2009 Colin Phipps <cph@moria.org.uk>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* Blocks of the target that are the same as each other. Many targets (disk
+ * images, databases) have thousands of copies of the same block, such as
+ * blocks of zeros; once we have the data for any one of them, from a seed or
+ * from the network, we have it for them all. So we find the groups of blocks
+ * with the same rsum and checksum when we build the hash tables (and, where
+ * those have too few bits to tell blocks apart, the same following blocks);
+ * when one is found, the rest are recorded as known straight away (see
+ * record_blocks in rsum.c), and are filled in from it once it is written out.
+ * Only the first of each group is counted as needed, so each is only fetched
+ * once.
+ */
+
+#include "zsglobal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#ifdef WITH_DMALLOC
+# include <dmalloc.h>
+#endif
+
+#include "rcksum.h"
+#include "internal.h"
+
+/* same_block(self, a, b)
+ * Returns true iff the given blocks have the same rsum and checksum */
+static int same_block(const struct rcksum_state *z, zs_blockid a,
+                      zs_blockid b) {
+    struct rsum ra = block_rsum(z, a), rb = block_rsum(z, b);
+
+    if (ra.a != rb.a || ra.b != rb.b)
+        return 0;
+    if (z->rsum_high_mask) {
+        ra = block_rsum_high(z, a);
+        rb = block_rsum_high(z, b);
+        if (ra.a != rb.a || ra.b != rb.b)
+            return 0;
+    }
+    return !memcmp(block_checksum(z, a), block_checksum(z, b),
+                   z->checksum_bytes);
+}
+
+/* same_run(self, a, b, len)
+ * Returns true iff the len blocks from each of the given blocks are the same,
+ * as far as their rsums and checksums go */
+static int same_run(const struct rcksum_state *z, zs_blockid a, zs_blockid b,
+                    int len) {
+    int j;
+
+    for (j = 0; j < len; j++)
+        if (!same_block(z, a + j, b + j))
+            return 0;
+    return 1;
+}
+
+/* count_bits(x)
+ * Returns the number of bits set in x */
+static int count_bits(unsigned int x) {
+    int n = 0;
+
+    for (; x; x &= x - 1)
+        n++;
+    return n;
+}
+
+/* group_run_length(self)
+ * Returns how many blocks, from each of two blocks, must be the same for us
+ * to take them as the same block. Their rsums and checksums are truncated,
+ * so blocks that differ can share them by chance; with any of n blocks able
+ * to clash with any other, we want 2 log2(n) bits of them and 20 to spare,
+ * as zsyncmake allows for when it sizes them. If one block's aren't enough,
+ * we need the following blocks to match too, as a scan does: seq_matches in
+ * all, which is what the checksums were sized for. If even that isn't
+ * enough, returns 0, and we don't look for blocks that are the same. */
+static int group_run_length(const struct rcksum_state *z) {
+    const int bits = 16 + count_bits(z->rsum_a_mask)
+        + count_bits(z->rsum_high_mask) + 8 * z->checksum_bytes;
+    int need = 20;
+    zs_blockid n;
+
+    for (n = z->blocks; n > 1; n >>= 1)
+        need += 2;
+    return bits >= need ? 1 : z->seq_matches * bits >= need ? z->seq_matches
+        : 0;
+}
+
+/* run_key(self, id, len)
+ * Hash of the rsums and checksums of the len blocks from the given one, to
+ * find the same ones with */
+static uint64_t run_key(const struct rcksum_state *z, zs_blockid id, int len) {
+    uint64_t k = 0;
+    int i, j;
+
+    for (j = 0; j < len; j++) {
+        const unsigned char *c = block_checksum(z, id + j);
+
+        k = (k << 32 | k >> 32) ^ rsum_tag(z, block_rsum(z, id + j));
+        for (i = 0; i < z->checksum_bytes && i < 8; i++)
+            k = (k << 8 | k >> 56) ^ c[i];
+    }
+    return k * UINT64_C(0x9e3779b97f4a7c15);
+}
+
+/* find_group(self, table, id, len)
+ * Returns the slot in the table (of the first block of each group, by key,
+ * as big as the block index) for the group of the given block, taking blocks
+ * as the same where the len blocks from them are; either the slot that has
+ * it, or the empty slot where it goes. */
+static size_t find_group(const struct rcksum_state *z, const zs_blockid *t,
+                         zs_blockid id, int len) {
+    size_t n = hash_slot_of(run_key(z, id, len), z->hashslots);
+
+    while (t[n] != -1 && !same_run(z, t[n], id, len))
+        n = next_slot(z, n);
+    return n;
+}
+
+/* build_dup_tables(self)
+ * Finds the groups of blocks of the target that are the same as each other
+ * (see group_run_length), and fills in the tables of them (or leaves them
+ * NULL if there are none).
+ * Returns 0 if we couldn't (for want of memory). */
+int build_dup_tables(struct rcksum_state *z) {
+    const size_t words = KNOWN_WORDS(z->blocks);
+    const int len = group_run_length(z);
+    zs_blockid *first, id, k;
+    uint64_t *map, *follows;
+
+    free_dup_tables(z);
+    if (!len)
+        return 1;
+
+    /* Table of the first block of each group, sized as the block index */
+    first = malloc(z->hashslots * sizeof *first);
+    map = calloc(DUP_MAP_WORDS(z->blocks), sizeof *map);
+    if (!first || !map) {
+        free(first);
+        free(map);
+        return 0;
+    }
+    memset(first, -1, z->hashslots * sizeof *first);
+    follows = map + words;
+
+    /* Mark each block that has the same as an earlier one, and that one */
+    for (id = 0; id < z->blocks; id++) {
+        size_t n = find_group(z, first, id, len);
+
+        if (first[n] == -1) {
+            first[n] = id;
+            continue;
+        }
+        if (!(map[first[n] >> 6] & (UINT64_C(1) << (first[n] & 63)))) {
+            map[first[n] >> 6] |= UINT64_C(1) << (first[n] & 63);
+            z->ndups++;
+        }
+        map[id >> 6] |= UINT64_C(1) << (id & 63);
+        follows[id >> 6] |= UINT64_C(1) << (id & 63);
+        follows[words + (id >> 12)] |= UINT64_C(1) << ((id >> 6) & 63);
+        z->ndups++;
+    }
+    if (!z->ndups) {
+        free(first);
+        free(map);
+        return 1;
+    }
+
+    z->dup_ids = malloc(z->ndups * sizeof *(z->dup_ids));
+    z->dup_next = malloc(z->ndups * sizeof *(z->dup_next));
+    if (!z->dup_ids || !z->dup_next) {
+        free(first);
+        free(map);
+        free_dup_tables(z);
+        return 0;
+    }
+    z->dup_map = map;
+
+    /* List them in order; then link each group in a circle: the first in
+     * each comes before the others, and each other goes in just after it */
+    for (id = k = 0; id < z->blocks; id++)
+        if (has_duplicates(z, id))
+            z->dup_ids[k++] = id;
+    for (k = 0; k < z->ndups; k++) {
+        id = z->dup_ids[k];
+        if (follows[id >> 6] & (UINT64_C(1) << (id & 63))) {
+            zs_blockid f = find_duplicate(z,
+                first[find_group(z, first, id, len)]);
+
+            z->dup_next[k] = z->dup_next[f];
+            z->dup_next[f] = k;
+        }
+        else
+            z->dup_next[k] = k;
+    }
+    free(first);
+    return 1;
+}
+
+/* fill_known_duplicates(self)
+ * For when the tables of blocks that are the same are built after some blocks
+ * were found (as for a target whose checksums came in while source data was
+ * scanned): fills in the rest of each group that has any that we have, from
+ * that one, and takes them out of the rsum hash. */
+void fill_known_duplicates(struct rcksum_state *z) {
+    zs_blockid k;
+
+    flush_write_behind(z, &z->scan);
+    for (k = 0; k < z->ndups; k++) {
+        zs_blockid id = z->dup_ids[k], j = k, src = -1;
+
+        /* Once for each group, from the first in it: one that we have */
+        if (DUP_FOLLOWS(z)[id >> 6] & (UINT64_C(1) << (id & 63)))
+            continue;
+        do {
+            if (already_got_block(z, z->dup_ids[j]))
+                src = z->dup_ids[j];
+            j = z->dup_next[j];
+        } while (j != k && src == -1);
+        if (src == -1)
+            continue;
+
+        /* And the rest of the group are filled in from it */
+        j = k;
+        do {
+            zs_blockid dup = z->dup_ids[j];
+
+            if (!already_got_block(z, dup)) {
+                if (add_fill(&z->scan, src, dup))
+                    add_known_block(z, dup);
+                else
+                    forget_duplicate(z, dup);
+            }
+            j = z->dup_next[j];
+        } while (j != k);
+    }
+    fill_duplicates(z, &z->scan);
+    remove_known_blocks(z);
+}
+
+/* free_dup_tables(self)
+ * Frees the tables of blocks that are the same as others */
+void free_dup_tables(struct rcksum_state *z) {
+    free_table(z, z->dup_ids);
+    free_table(z, z->dup_next);
+    free_table(z, z->dup_map);
+    z->dup_ids = z->dup_next = NULL;
+    z->dup_map = NULL;
+    z->ndups = 0;
+}
+
+/* find_duplicate(self, id)
+ * Returns the place in dup_ids of the given block, which has duplicates */
+zs_blockid find_duplicate(const struct rcksum_state *z, zs_blockid id) {
+    zs_blockid lo = 0, hi = z->ndups - 1;
+
+    while (lo < hi) {
+        zs_blockid mid = lo + (hi - lo) / 2;
+
+        if (z->dup_ids[mid] < id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* dup_needs_hash(self, id)
+ * Returns false iff the given block can be left out of the rsum hash: it
+ * follows an earlier block the same (the one before it in its group), and the
+ * seq_matches - 1 blocks after each are the same too. Then any data that would
+ * match it matches that one, which is in the hash, or is left out for the
+ * same reason, and so on back to the first of the group; and finding that
+ * gets this one too. Leaving them out keeps the runs of slots short where
+ * there are many copies of a block. */
+int dup_needs_hash(const struct rcksum_state *z, zs_blockid id) {
+    zs_blockid prev;
+    int j;
+
+    if (!z->dup_map
+        || !(DUP_FOLLOWS(z)[id >> 6] & (UINT64_C(1) << (id & 63))))
+        return 1;
+    prev = z->dup_ids[z->dup_next[find_duplicate(z, id)]];
+    for (j = 1; j < z->seq_matches; j++)
+        if (!same_block(z, id + j, prev + j))
+            return 1;
+    return 0;
+}
+
+/* forget_duplicate(self, id)
+ * Stops counting the given block as following an earlier one the same, so it
+ * is fetched for itself; for when we can't fill it in from another. */
+void forget_duplicate(struct rcksum_state *z, zs_blockid id) {
+    DUP_FOLLOWS(z)[id >> 6] &= ~(UINT64_C(1) << (id & 63));
+}
+
+/* add_fill(scan_state, from, to)
+ * Records that block to is to be filled in from block from, once the scan has
+ * written that out. Returns 0 if we couldn't (for want of memory). */
+int add_fill(struct scan_state *s, zs_blockid from, zs_blockid to) {
+    if (s->nfills == s->fills_alloc) {
+        size_t n = s->fills_alloc ? 2 * s->fills_alloc : 64;
+        struct dup_fill *f = realloc(s->fills, n * sizeof *f);
+
+        if (!f)
+            return 0;
+        s->fills = f;
+        s->fills_alloc = n;
+    }
+    s->fills[s->nfills].from = from;
+    s->fills[s->nfills].to = to;
+    s->nfills++;
+    return 1;
+}
+
+/* fill_duplicates(self, scan_state)
+ * Fills in the blocks that the scan has recorded as the same as ones that it
+ * has found, from those, which must have been written out already; counting
+ * the writes in the scan's stats. */
+void fill_duplicates(struct rcksum_state *z, struct scan_state *s) {
+    unsigned char buf[65536];
+    zs_blockid have = -1;       /* block that buf[] holds, if all of one */
+    size_t i;
+
+    for (i = 0; i < s->nfills; i++) {
+        const struct dup_fill *f = &s->fills[i];
+        off_t src = ((off_t) f->from) << z->blockshift;
+        off_t dst = ((off_t) f->to) << z->blockshift;
+        size_t len = z->blocksize;
+
+        while (len) {
+            size_t l = len < sizeof buf ? len : sizeof buf;
+            ssize_t rc;
+
+            /* Runs of fills from the same block needn't read it again */
+            if (have != f->from) {
+                rc = pread(z->fd, buf, l, src);
+                if (rc == -1 && errno == EINTR)
+                    continue;
+                if (rc != (ssize_t) l) {
+                    fprintf(stderr, "IO error: %s\n",
+                            rc == -1 ? strerror(errno) : "short read");
+                    exit(-1);
+                }
+                have = l == z->blocksize ? f->from : -1;
+            }
+
+            rc = pwrite(z->fd, buf, l, dst);
+            if (rc == -1 && errno == EINTR)
+                continue;
+            if (rc == -1) {
+                fprintf(stderr, "IO error: %s\n", strerror(errno));
+                exit(-1);
+            }
+            s->stats.writes++;
+            s->stats.bytes_written += rc;
+
+            /* Carry on after what was written; any of the block left that
+             * we hold is no longer at the start of buf[] */
+            if ((size_t) rc != l)
+                have = -1;
+            src += rc;
+            dst += rc;
+            len -= rc;
+        }
+    }
+    free(s->fills);
+    s->fills = NULL;
+    s->nfills = s->fills_alloc = 0;
+}
@@ -36,64 +36,320 @@
  */
 void rcksum_add_target_block(struct rcksum_state *z, zs_blockid b,
                              struct rsum r, void *checksum) {
-    if (b < z->blocks) {
-        /* Get hash entry with checksums for this block */
-        struct hash_entry *e = &(z->blockhashes[b]);
-
+    if (b < z->blocks && !z->records) {
         /* Enter checksums */
-        memcpy(e->checksum, checksum, z->checksum_bytes);
-        e->r.a = r.a & z->rsum_a_mask;
-        e->r.b = r.b;
+        memcpy(z->checksums + (size_t) b * z->checksum_bytes, checksum,
+               z->checksum_bytes);
+        z->rsums[b].a = r.a & z->rsum_a_mask;
+        z->rsums[b].b = r.b;
 
         /* New checksums invalidate any existing checksum hash tables */
         if (z->rsum_hash) {
-            free(z->rsum_hash);
+            free_table(z, z->rsum_hash);
             z->rsum_hash = NULL;
-            free(z->bithash);
+            free_table(z, z->bithash);
             z->bithash = NULL;
+            free_dup_tables(z);
         }
     }
 }
 
-/* build_hash(self)
- * Build hash tables to quickly lookup a block based on its rsum value.
- * Returns non-zero if successful.
- */
-int build_hash(struct rcksum_state *z) {
-    zs_blockid id;
-    int i = 16;
+/* load_rsums(self, from, buf, stride, nblocks, rsum_bytes)
+ * Sets the rsums of the nblocks blocks from blockid from, which are every
+ * stride bytes in buf[]; inlined for each rsum_bytes, so the loop is compiled
+ * for that many bytes */
+static inline void load_rsums(struct rcksum_state *z, zs_blockid from,
+                              const unsigned char *buf, size_t stride,
+                              zs_blockid nblocks, int rsum_bytes) {
+    struct rsum *r = z->rsums + from;
+    struct rsum *high = z->rsums_high ? z->rsums_high + from : NULL;
+    zs_blockid i;
+
+    for (i = 0; i < nblocks; i++, buf += stride) {
+        /* The rsum bytes, as a big-endian number: high a, high b, a, b */
+        uint64_t v = 0;
+        int j;
+
+        for (j = 0; j < rsum_bytes; j++)
+            v = v << 8 | buf[j];
+        r[i].a = (v >> 16) & z->rsum_a_mask;
+        r[i].b = v;
+        if (high) {
+            high[i].a = v >> 48;
+            high[i].b = v >> 32;
+        }
+    }
+}
+
+/* load_checksums(self, from, buf, stride, nblocks)
+ * Sets the checksums of the nblocks blocks from blockid from, which are every
+ * stride bytes in buf[] */
+static void load_checksums(struct rcksum_state *z, zs_blockid from,
+                           const unsigned char *buf, size_t stride,
+                           zs_blockid nblocks) {
+    const size_t cb = z->checksum_bytes;
+    unsigned char *c = z->checksums + (size_t) from * cb;
+    zs_blockid i;
+
+    /* All in one, if they are together as in our table */
+    if (stride == cb) {
+        memcpy(c, buf, (size_t) nblocks * cb);
+        return;
+    }
+    for (i = 0; i < nblocks; i++, c += cb, buf += stride)
+        memcpy(c, buf, cb);
+}
+
+/* valid_record_sizes(self, rsum_bytes, checksum_bytes)
+ * Returns true iff blocks' records in a control file with the given numbers
+ * of bytes of rsum and checksum are what this target was made for */
+int valid_record_sizes(const struct rcksum_state *z, int rsum_bytes,
+                       int checksum_bytes) {
+    return checksum_bytes == z->checksum_bytes && rsum_bytes >= 1
+        && rsum_bytes <= RSUM_MAX_BYTES
+        && (rsum_bytes > 4) == (z->rsum_high_mask != 0);
+}
+
+/* start_load(self, from, nblocks)
+ * Checks that the given blocks can be loaded; if so, drops the hash tables
+ * (which new checksums invalidate) and returns 1, else 0 */
+static int start_load(struct rcksum_state *z, zs_blockid from,
+                      zs_blockid nblocks) {
+    if (from < 0 || nblocks < 0 || nblocks > z->blocks - from || z->records)
+        return 0;
+    if (z->rsum_hash) {
+        free_table(z, z->rsum_hash);
+        z->rsum_hash = NULL;
+        free_table(z, z->bithash);
+        z->bithash = NULL;
+        free_dup_tables(z);
+    }
+    return 1;
+}
+
+/* rcksum_load_target_rsums(self, from, buf, nblocks, rsum_bytes)
+ * Sets the rsums of the nblocks blocks from blockid from, which are in buf[]
+ * one after another, each the last rsum_bytes of the rsum (after the high
+ * halves, if more than 4), big-endian. Returns 0, or -1 if rsum_bytes is not
+ * as for rcksum_init or the blocks aren't all in the target. */
+int rcksum_load_target_rsums(struct rcksum_state *z, zs_blockid from,
+                             const unsigned char *buf, zs_blockid nblocks,
+                             int rsum_bytes) {
+    if (!valid_record_sizes(z, rsum_bytes, z->checksum_bytes)
+        || !start_load(z, from, nblocks))
+        return -1;
+
+    switch (rsum_bytes) {
+    case 2:
+        load_rsums(z, from, buf, 2, nblocks, 2);
+        break;
+    case 3:
+        load_rsums(z, from, buf, 3, nblocks, 3);
+        break;
+    case 4:
+        load_rsums(z, from, buf, 4, nblocks, 4);
+        break;
+    case 8:
+        load_rsums(z, from, buf, 8, nblocks, 8);
+        break;
+    default:
+        load_rsums(z, from, buf, rsum_bytes, nblocks, rsum_bytes);
+        break;
+    }
+    return 0;
+}
+
+/* rcksum_load_target_checksums(self, from, buf, nblocks, checksum_bytes)
+ * Sets the checksums of the nblocks blocks from blockid from, which are in
+ * buf[] one after another, checksum_bytes each. Returns 0, or -1 if
+ * checksum_bytes is not as for rcksum_init or the blocks aren't all in the
+ * target. */
+int rcksum_load_target_checksums(struct rcksum_state *z, zs_blockid from,
+                                 const unsigned char *buf, zs_blockid nblocks,
+                                 int checksum_bytes) {
+    if (checksum_bytes != z->checksum_bytes || !start_load(z, from, nblocks))
+        return -1;
+    load_checksums(z, from, buf, checksum_bytes, nblocks);
+    return 0;
+}
+
+/* rcksum_load_target_blocks(self, from, buf, nblocks, rsum_bytes, checksum_bytes)
+ * Sets the stored hash values for the nblocks blocks from blockid from, which
+ * are in buf[] as in a control file: for each block, the last rsum_bytes of
+ * the rsum (after the high halves, if more than 4), big-endian, and then
+ * checksum_bytes of the checksum. These must be as for rcksum_init. Returns 0,
+ * or -1 if they are not, or the blocks aren't all in the target. */
+int rcksum_load_target_blocks(struct rcksum_state *z, zs_blockid from,
+                              const unsigned char *buf, zs_blockid nblocks,
+                              int rsum_bytes, int checksum_bytes) {
+    const size_t record = rsum_bytes + checksum_bytes;
+
+    if (!valid_record_sizes(z, rsum_bytes, checksum_bytes)
+        || !start_load(z, from, nblocks))
+        return -1;
+
+    switch (rsum_bytes) {
+    case 2:
+        load_rsums(z, from, buf, record, nblocks, 2);
+        break;
+    case 3:
+        load_rsums(z, from, buf, record, nblocks, 3);
+        break;
+    case 4:
+        load_rsums(z, from, buf, record, nblocks, 4);
+        break;
+    case 8:
+        load_rsums(z, from, buf, record, nblocks, 8);
+        break;
+    default:
+        load_rsums(z, from, buf, record, nblocks, rsum_bytes);
+        break;
+    }
+    load_checksums(z, from, buf + rsum_bytes, record, nblocks);
+    return 0;
+}
+
+/* rcksum_add_target_block_high(self, blockid, high)
+ * Sets the high halves of the rsum for the given blockid, where the target
+ * has them; they are not in the hash tables, so don't affect those. */
+void rcksum_add_target_block_high(struct rcksum_state *z, zs_blockid b,
+                                  struct rsum high) {
+    if (b < z->blocks && z->rsums_high && !z->records) {
+        z->rsums_high[b].a = high.a;
+        z->rsums_high[b].b = high.b;
+    }
+}
+
+/* size_hash_tables(self)
+ * Works out the sizes of the hash tables for the target's blocks: a block
+ * index with a third more slots than there are blocks, so that it is at most
+ * 3/4 full and runs of occupied slots stay short, and with 32 bits of each
+ * for the block id unless it takes more; and a bithash of 2^i times
+ * 2^BITHASHBITS bits, 2^i being at least twice the number of blocks. Returns
+ * 0 if there are too many blocks to index. */
+int size_hash_tables(struct rcksum_state *z) {
+    int i = 4;
+
+    if ((size_t) z->blocks > HASH_MAX_SLOTS / 4 * 3)
+        return 0;
+    z->hashslots = (size_t) z->blocks + (size_t) z->blocks / 3 + 1;
+    z->hash_id_bits = 32;
+    while ((UINT64_C(1) << z->hash_id_bits) - 2 < (uint64_t) z->blocks)
+        z->hash_id_bits++;
+    while (((zs_blockid) 1 << (i - 1)) < z->blocks)
+        i++;
+    z->bithashshift = 64 - (i + BITHASHBITS);
+    return 1;
+}
 
-    /* Try hash size of 2^i; step down the value of i until we find a good size
-     */
-    while ((2 << (i - 1)) > z->blocks && i > 4)
-        i--;
+/* build_hash_tables(self)
+ * Does the work of build_hash, with the tables sized by size_hash_tables */
+static int build_hash_tables(struct rcksum_state *z) {
+    zs_blockid id;
+    size_t n;
 
     /* Allocate hash based on rsum */
-    z->hashmask = (2 << i) - 1;
-    z->rsum_hash = calloc(z->hashmask + 1, sizeof *(z->rsum_hash));
+    z->rsum_hash = malloc(z->hashslots * sizeof *(z->rsum_hash));
     if (!z->rsum_hash)
         return 0;
+    for (n = 0; n < z->hashslots; n++)
+        z->rsum_hash[n] = make_slot(z, SLOT_EMPTY, 0);
 
     /* Allocate bit-table based on rsum */
-    z->bithashmask = (2 << (i + BITHASHBITS)) - 1;
-    z->bithash = calloc(z->bithashmask + 1, 1);
+    z->bithash = calloc((size_t) 1 << (64 - z->bithashshift - 3), 1);
     if (!z->bithash) {
         free(z->rsum_hash);
         z->rsum_hash = NULL;
         return 0;
     }
 
-    /* Now fill in the hash tables */
-    for (id = 0; id < z->blocks; id++) {
-        struct hash_entry *e = z->blockhashes + id;
+    /* Now fill in the hash tables, with the blocks that we have the
+     * checksums of and still need; but not those that will be found along
+     * with an earlier one the same (see dup_needs_hash) */
+    for (id = 0; id < z->loaded; id++) {
+        uint64_t h;
+
+        if (already_got_block(z, id) || !dup_needs_hash(z, id))
+            continue;
+        h = calc_rhash(z, block_rsum(z, id), block_rsum(z, id + 1));
 
-        /* Prepend to linked list for this hash entry */
-        unsigned h = calc_rhash(z, e);
-        e->next = z->rsum_hash[h & z->hashmask];
-        z->rsum_hash[h & z->hashmask] = e;
+        /* Put it in the first free slot from where its hash says */
+        n = hash_slot_of(h, z->hashslots);
+        while (slot_id(z, z->rsum_hash[n]) != SLOT_EMPTY)
+            n = next_slot(z, n);
+        z->rsum_hash[n] = make_slot(z, id, rsum_tag(z, block_rsum(z, id)));
 
-        /* And set relevant bit in the bithash to 1 */
-        z->bithash[(h & z->bithashmask) >> 3] |= 1 << (h & 7);
+        {   /* And set relevant bit in the bithash to 1 */
+            uint64_t bit = h >> z->bithashshift;
+            z->bithash[bit >> 3] |= 1 << (bit & 7);
+        }
     }
     return 1;
 }
+
+/* build_hash(self)
+ * Build hash tables to quickly lookup a block based on its rsum value; and,
+ * once we have the checksums of all the blocks, first find the blocks that
+ * are the same as others (we can do without those, if we haven't the memory),
+ * so that most of them can be left out of the hash; any of those that are the
+ * same as blocks we already have are filled in now.
+ * Returns non-zero if successful.
+ */
+int build_hash(struct rcksum_state *z) {
+    struct phase_timer t;
+    int rc, dups;
+
+    phase_begin(&t);
+    rc = size_hash_tables(z);
+    dups = rc && z->loaded == z->blocks && build_dup_tables(z);
+    rc = rc && build_hash_tables(z);
+    if (!rc)
+        free_dup_tables(z);
+    else if (dups && z->gotblocks)
+        fill_known_duplicates(z);
+    phase_end(z, RCKSUM_PHASE_INDEX, &t);
+    return rc;
+}
+
+/* rcksum_set_blocks_loaded(self, nblocks)
+ * Says that only the checksums of the blocks before nblocks have been added
+ * so far, for a target whose checksums are still coming in; only those are
+ * looked for in source data, until this is called again with more (or all)
+ * of them. The hash tables are dropped, to be built again with the blocks
+ * that there are when next needed; there must be no scanners. */
+void rcksum_set_blocks_loaded(struct rcksum_state *z, zs_blockid nblocks) {
+    z->loaded = nblocks < 0 ? 0 : nblocks > z->blocks ? z->blocks : nblocks;
+    if (z->rsum_hash) {
+        free_table(z, z->rsum_hash);
+        z->rsum_hash = NULL;
+        free_table(z, z->bithash);
+        z->bithash = NULL;
+        free_dup_tables(z);
+    }
+}
+
+/* rcksum_build_index(self)
+ * Builds the hash tables for the target's blocks now, once they have all been
+ * added, rather than when they are first needed; so that the blocks that are
+ * the same as others are known before working out which blocks to fetch.
+ * Returns 0 on success. */
+int rcksum_build_index(struct rcksum_state *z) {
+    if (!z->rsum_hash)
+        if (!build_hash(z))
+            return -1;
+    return 0;
+}
+
+/* remove_known_blocks(self)
+ * Remove all blocks that we already have the data for from the rsum hash
+ * table, for when blocks have been found without unlinking them as we went. */
+void remove_known_blocks(struct rcksum_state *z) {
+    size_t n;
+
+    for (n = 0; n < z->hashslots; n++) {
+        zs_blockid id = slot_id(z, z->rsum_hash[n]);
+
+        if (id >= 0 && already_got_block(z, id))
+            z->rsum_hash[n] = make_slot(z, SLOT_DELETED, 0);
+    }
+}
@@ -0,0 +1,702 @@
+/*
+ *   rcksum/lib - library for using the rsync algorithm to determine
+ *               which parts of a file you have and which you need.
+ *   Copyright (C) 2004,2005,2007,2009 Colin Phipps <cph@moria.org.uk>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* Saving the target's block checksums, and the hash tables built from them,
+ * to an index file; and loading them back from one, so that another run for
+ * the same target need not read in all the checksums and build the tables
+ * again. The file is just the tables as they are in memory, after a header,
+ * so it is loaded by mapping it; the mapping is private, so we can still
+ * change the tables (as we do when removing blocks from the hash) without
+ * changing the file.
+ *
+ * Also mapping the block checksums of the control file itself, to read them
+ * in place rather than have tables of them in memory at all.
+ *
+ * Also the seed cache: files in a similar form with the checksums of every
+ * whole block of a seed file (at offsets that are multiples of the
+ * blocksize), for the aligned pass over that seed (see rsum.c) to use rather
+ * than reading it, so long as the seed is unchanged.
+ */
+
+#include "zsglobal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _POSIX_MAPPED_FILES
+# include <sys/mman.h>
+#endif
+
+#ifdef WITH_DMALLOC
+# include <dmalloc.h>
+#endif
+
+#include "rcksum.h"
+#include "internal.h"
+
+#define INDEX_MAGIC "rcksumI5"
+#define INDEX_ORDER 0x01020304u /* as written; other byte orders won't match */
+#define INDEX_ALIGN 64          /* each table starts on a multiple of this */
+#define SEED_MAGIC "rcksumS1"
+
+/* The header of an index file, with what it was made for, and where in it
+ * the tables are (offsets from the start of the file) */
+struct index_header {
+    char magic[8];
+    uint32_t order;
+    uint32_t slot_size;         /* of the block index */
+    int64_t blocks;
+    uint64_t blocksize;
+    uint32_t rsum_a_mask, checksum_bytes, hash, seq_matches;
+    uint64_t hashslots;
+    uint32_t bithashshift, rsum_high_mask;
+    uint64_t rsums, rsums_high, checksums, rsum_hash, bithash;
+    int64_t ndups;
+    uint64_t dup_ids, dup_next, dup_map;
+    uint64_t length;            /* of the whole file */
+};
+
+/* The header of a seed cache file, with the seed file that it is for, as it
+ * was when the checksums were made; and where the tables are. */
+struct seed_header {
+    char magic[8];
+    uint32_t order;
+    uint32_t hash;
+    uint64_t blocksize;
+    uint64_t dev, ino, size;
+    int64_t mtime, ctime;
+    int64_t mtime_ns, ctime_ns; /* where the system has them */
+    int64_t blocks;
+    uint64_t rsums, checksums;
+    uint64_t length;            /* of the whole file */
+};
+
+/* Sizes of each of the tables */
+static size_t rsums_size(const struct rcksum_state *z) {
+    return (size_t) (z->blocks + z->seq_matches) * sizeof *(z->rsums);
+}
+
+static size_t rsums_high_size(const struct rcksum_state *z) {
+    return z->rsum_high_mask ? rsums_size(z) : 0;
+}
+
+static size_t checksums_size(const struct rcksum_state *z) {
+    return (size_t) (z->blocks + z->seq_matches) * z->checksum_bytes;
+}
+
+static size_t rsum_hash_size(const struct rcksum_state *z) {
+    return z->hashslots * sizeof *(z->rsum_hash);
+}
+
+static size_t bithash_size(const struct rcksum_state *z) {
+    return (size_t) 1 << (64 - z->bithashshift - 3);
+}
+
+static size_t dup_ids_size(const struct rcksum_state *z) {
+    return (size_t) z->ndups * sizeof *(z->dup_ids);
+}
+
+static size_t dup_map_size(const struct rcksum_state *z) {
+    return z->ndups ? DUP_MAP_WORDS(z->blocks) * sizeof *(z->dup_map) : 0;
+}
+
+/* Return true iff a table of the given size at offset is within the file */
+static int in_index(uint64_t offset, size_t size, uint64_t length) {
+    return offset <= length && size <= length - offset;
+}
+
+/* Round up to where the next table goes */
+static uint64_t index_align(uint64_t offset) {
+    return (offset + INDEX_ALIGN - 1) & ~(uint64_t) (INDEX_ALIGN - 1);
+}
+
+/* write_at(fd, buf, len, offset)
+ * pwrite(2) all of buf[], retrying after short writes; returns 0 if it did. */
+static int write_at(int fd, const void *buf, size_t len, off_t offset) {
+    const char *p = buf;
+
+    while (len) {
+        ssize_t rc = pwrite(fd, p, len, offset);
+
+        if (rc == -1 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            return -1;
+        p += rc;
+        offset += rc;
+        len -= rc;
+    }
+    return 0;
+}
+
+/* fd = create_temp(path, &tmp)
+ * Creates a temporary file alongside path, to be moved into place once it is
+ * complete by commit_temp, so no-one ever sees a partial file; returns the
+ * descriptor, or -1 on error. */
+static int create_temp(const char *path, char **tmp) {
+    int fd;
+
+    *tmp = malloc(strlen(path) + 8);
+    if (!*tmp)
+        return -1;
+    strcpy(*tmp, path);
+    strcat(*tmp, ".XXXXXX");
+    fd = mkstemp(*tmp);
+    if (fd == -1)
+        free(*tmp);
+    return fd;
+}
+
+/* commit_temp(fd, tmp, path, rc)
+ * Closes the temporary file from create_temp and, if rc is 0 (it was written
+ * successfully), moves it to path; else removes it. Returns 0 on success. */
+static int commit_temp(int fd, char *tmp, const char *path, int rc) {
+    if (close(fd) != 0)
+        rc = -1;
+    if (rc == 0)
+        rc = rename(tmp, path);
+    if (rc != 0)
+        unlink(tmp);
+    free(tmp);
+    return rc;
+}
+
+/* free_table(self, table)
+ * Frees one of the tables of the rcksum_state, unless it is in the mapped
+ * index file */
+void free_table(struct rcksum_state *z, void *p) {
+    if (z->index_map && (unsigned char *)p >= (unsigned char *)z->index_map
+        && (unsigned char *)p < (unsigned char *)z->index_map + z->index_len)
+        return;
+    free(p);
+}
+
+/* free_tables(self)
+ * Frees all the tables of the rcksum_state for the target's checksums, and
+ * unmaps any index file or control file that they came from */
+void free_tables(struct rcksum_state *z) {
+    free_table(z, z->rsums);
+    free_table(z, z->rsums_high);
+    free_table(z, z->checksums);
+    free_table(z, z->rsum_hash);
+    free_table(z, z->bithash);
+    free_dup_tables(z);
+#ifdef _POSIX_MAPPED_FILES
+    if (z->records_map)
+        munmap(z->records_map, z->records_len);
+#endif
+    z->records = z->checksum_records = NULL;
+    z->records_map = NULL;
+    z->rsums = NULL;
+    z->rsums_high = NULL;
+    z->checksums = NULL;
+    z->rsum_hash = NULL;
+    z->bithash = NULL;
+#ifdef _POSIX_MAPPED_FILES
+    if (z->index_map)
+        munmap(z->index_map, z->index_len);
+#endif
+    z->index_map = NULL;
+}
+
+/* Blocks' checksums to write at a time, where they are read in place */
+#define WRITE_BATCH 4096
+
+/* write_block_tables(self, fd, header)
+ * Writes the tables of the blocks' checksums to the index file where the
+ * header says; working them out a batch at a time if they are read in place
+ * from the control file. Returns 0 if successful. */
+static int write_block_tables(const struct rcksum_state *z, int fd,
+                              const struct index_header *h) {
+    struct rsum r[WRITE_BATCH], high[WRITE_BATCH];
+    unsigned char *c;
+    zs_blockid id, end = z->blocks + z->seq_matches;
+    int rc = 0;
+
+    if (!z->records)
+        return write_at(fd, z->rsums, rsums_size(z), h->rsums) != 0
+            || (z->rsums_high
+                && write_at(fd, z->rsums_high, rsums_high_size(z),
+                            h->rsums_high) != 0)
+            || write_at(fd, z->checksums, checksums_size(z), h->checksums) != 0
+            ? -1 : 0;
+
+    c = malloc(WRITE_BATCH * z->checksum_bytes);
+    if (!c)
+        return -1;
+    for (id = 0; id < end && rc == 0; id += WRITE_BATCH) {
+        int i, n = end - id < WRITE_BATCH ? end - id : WRITE_BATCH;
+
+        for (i = 0; i < n; i++) {
+            r[i] = block_rsum(z, id + i);
+            if (z->rsum_high_mask)
+                high[i] = block_rsum_high(z, id + i);
+            memcpy(c + i * z->checksum_bytes, block_checksum(z, id + i),
+                   z->checksum_bytes);
+        }
+        if (write_at(fd, r, n * sizeof *r, h->rsums + id * sizeof *r) != 0
+            || (z->rsum_high_mask
+                && write_at(fd, high, n * sizeof *high,
+                            h->rsums_high + id * sizeof *high) != 0)
+            || write_at(fd, c, n * z->checksum_bytes,
+                        h->checksums + id * z->checksum_bytes) != 0)
+            rc = -1;
+    }
+    free(c);
+    return rc;
+}
+
+/* rcksum_save_index(self, path)
+ * Writes the target's checksums and the hash tables for them to an index file
+ * at path (replacing any there already), for rcksum_load_index. That must be
+ * done before any blocks are found, while the tables are still complete.
+ * Returns 0 if successful. */
+int rcksum_save_index(struct rcksum_state *z, const char *path) {
+    struct index_header h;
+    char *tmp;
+    int fd;
+    int rc = -1;
+
+    /* The hash tables lose the blocks that we find */
+    if (z->gotblocks)
+        return -1;
+    if (!z->rsum_hash)
+        if (!build_hash(z))
+            return -1;
+
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, INDEX_MAGIC, sizeof h.magic);
+    h.order = INDEX_ORDER;
+    h.slot_size = sizeof *(z->rsum_hash);
+    h.blocks = z->blocks;
+    h.blocksize = z->blocksize;
+    h.rsum_a_mask = z->rsum_a_mask;
+    h.checksum_bytes = z->checksum_bytes;
+    h.hash = z->hash;
+    h.seq_matches = z->seq_matches;
+    h.hashslots = z->hashslots;
+    h.bithashshift = z->bithashshift;
+    h.rsum_high_mask = z->rsum_high_mask;
+    h.rsums = index_align(sizeof h);
+    h.rsums_high = index_align(h.rsums + rsums_size(z));
+    h.checksums = index_align(h.rsums_high + rsums_high_size(z));
+    h.rsum_hash = index_align(h.checksums + checksums_size(z));
+    h.bithash = index_align(h.rsum_hash + rsum_hash_size(z));
+    h.ndups = z->ndups;
+    h.dup_ids = index_align(h.bithash + bithash_size(z));
+    h.dup_next = index_align(h.dup_ids + dup_ids_size(z));
+    h.dup_map = index_align(h.dup_next + dup_ids_size(z));
+    h.length = h.dup_map + dup_map_size(z);
+
+    fd = create_temp(path, &tmp);
+    if (fd == -1)
+        return -1;
+    if (write_at(fd, &h, sizeof h, 0) == 0
+        && write_block_tables(z, fd, &h) == 0
+        && write_at(fd, z->rsum_hash, rsum_hash_size(z), h.rsum_hash) == 0
+        && write_at(fd, z->bithash, bithash_size(z), h.bithash) == 0
+        && (!z->ndups
+            || (write_at(fd, z->dup_ids, dup_ids_size(z), h.dup_ids) == 0
+                && write_at(fd, z->dup_next, dup_ids_size(z), h.dup_next) == 0
+                && write_at(fd, z->dup_map, dup_map_size(z), h.dup_map) == 0)))
+        rc = 0;
+    return commit_temp(fd, tmp, path, rc);
+}
+
+/* valid_index_tables(self)
+ * Returns true iff the hash tables and the tables of blocks that are the same
+ * (just mapped from an index file) are such as we would have built: every
+ * slot of the hash empty, deleted or for a block of the target, with at least
+ * one empty to end the runs; dup_ids in order, with just the blocks marked in
+ * dup_map, and with the blocks marked as following others among them; and
+ * dup_next linking them all in circles. Otherwise a damaged file could have
+ * us read outside the tables, or go round the hash or a group for ever. */
+static int valid_index_tables(const struct rcksum_state *z) {
+    zs_blockid k, count = 0;
+    uint64_t *seen;
+    size_t n;
+    int rc = 1;
+
+    for (n = 0; n < z->hashslots; n++) {
+        zs_blockid id = slot_id(z, z->rsum_hash[n]);
+
+        if (id == SLOT_EMPTY)
+            count++;
+        else if (id != SLOT_DELETED && (id < 0 || id >= z->blocks))
+            return 0;
+    }
+    if (!count)
+        return 0;
+    if (!z->ndups)
+        return 1;
+
+    /* dup_map marks just the blocks in dup_ids, and only those follow */
+    for (n = 0, count = 0; n < (size_t) KNOWN_WORDS(z->blocks); n++) {
+        uint64_t w = z->dup_map[n];
+
+        if (DUP_FOLLOWS(z)[n] & ~w)
+            return 0;
+        for (; w; w &= w - 1)
+            count++;
+    }
+    if (count != z->ndups)
+        return 0;
+    for (k = 0; k < z->ndups; k++)
+        if (z->dup_ids[k] < (k ? z->dup_ids[k - 1] + 1 : 0)
+            || z->dup_ids[k] >= z->blocks
+            || !has_duplicates(z, z->dup_ids[k])
+            || z->dup_next[k] < 0 || z->dup_next[k] >= z->ndups)
+            return 0;
+
+    /* Each is next after just one, so that they are all in circles */
+    seen = calloc(KNOWN_WORDS(z->ndups), sizeof *seen);
+    if (!seen)
+        return 0;
+    for (k = 0; k < z->ndups && rc; k++) {
+        zs_blockid j = z->dup_next[k];
+
+        if (seen[j >> 6] & (UINT64_C(1) << (j & 63)))
+            rc = 0;
+        seen[j >> 6] |= UINT64_C(1) << (j & 63);
+    }
+    free(seen);
+    return rc;
+}
+
+/* load_index(self, path)
+ * Does the work of rcksum_load_index */
+static int load_index(struct rcksum_state *z, const char *path) {
+#ifdef _POSIX_MAPPED_FILES
+    struct index_header h;
+    struct rcksum_state t = *z;
+    struct stat st;
+    unsigned char *map;
+    int fd = open(path, O_RDONLY);
+
+    if (fd == -1)
+        return 0;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof h
+        || (off_t) (size_t) st.st_size != st.st_size
+        || pread(fd, &h, sizeof h, 0) != sizeof h) {
+        close(fd);
+        return 0;
+    }
+
+    /* Check it's an index made for a target like ours, on a system like
+     * ours, with the tables sized as we would, and all there */
+    if (!size_hash_tables(&t) || memcmp(h.magic, INDEX_MAGIC, sizeof h.magic)
+        || h.order != INDEX_ORDER || h.slot_size != sizeof *(z->rsum_hash)
+        || h.blocks != z->blocks || h.blocksize != z->blocksize
+        || h.rsum_a_mask != z->rsum_a_mask
+        || h.rsum_high_mask != z->rsum_high_mask
+        || h.checksum_bytes != (uint32_t) z->checksum_bytes
+        || h.hash != (uint32_t) z->hash
+        || h.seq_matches != (uint32_t) z->seq_matches
+        || h.hashslots != t.hashslots || h.bithashshift != t.bithashshift
+        || h.ndups < 0 || h.ndups > h.blocks
+        || h.length != (uint64_t) st.st_size) {
+        close(fd);
+        return 0;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return 0;
+
+    /* The tables must all be inside the file, and hold nothing that we
+     * wouldn't have put there */
+    t.ndups = h.ndups;
+    t.rsum_hash = (uint64_t *)(map + h.rsum_hash);
+    t.dup_ids = (zs_blockid *)(map + h.dup_ids);
+    t.dup_next = (zs_blockid *)(map + h.dup_next);
+    t.dup_map = h.ndups ? (uint64_t *)(map + h.dup_map) : NULL;
+    if (!in_index(h.rsums, rsums_size(&t), h.length)
+        || !in_index(h.rsums_high, rsums_high_size(&t), h.length)
+        || !in_index(h.checksums, checksums_size(&t), h.length)
+        || !in_index(h.rsum_hash, rsum_hash_size(&t), h.length)
+        || !in_index(h.bithash, bithash_size(&t), h.length)
+        || !in_index(h.dup_ids, dup_ids_size(&t), h.length)
+        || !in_index(h.dup_next, dup_ids_size(&t), h.length)
+        || !in_index(h.dup_map, dup_map_size(&t), h.length)
+        || !valid_index_tables(&t)) {
+        munmap(map, st.st_size);
+        return 0;
+    }
+
+    /* Use them in place of any tables that we have */
+    free_tables(z);
+    z->index_map = map;
+    z->index_len = st.st_size;
+    z->rsums = (struct rsum *)(map + h.rsums);
+    z->rsums_high = z->rsum_high_mask
+        ? (struct rsum *)(map + h.rsums_high) : NULL;
+    z->checksums = map + h.checksums;
+    z->rsum_hash = (uint64_t *)(map + h.rsum_hash);
+    z->bithash = map + h.bithash;
+    if (h.ndups) {
+        z->ndups = h.ndups;
+        z->dup_ids = (zs_blockid *)(map + h.dup_ids);
+        z->dup_next = (zs_blockid *)(map + h.dup_next);
+        z->dup_map = (uint64_t *)(map + h.dup_map);
+    }
+    z->hashslots = h.hashslots;
+    z->hash_id_bits = t.hash_id_bits;
+    z->bithashshift = h.bithashshift;
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+/* rcksum_load_index(self, path)
+ * Loads the target's checksums and the hash tables for them from the index
+ * file at path, written by rcksum_save_index for a target with the same
+ * properties as this one, in place of rcksum_add_target_block for every block.
+ * Returns 1 if it did; 0 if there is no such index (or it doesn't match). */
+int rcksum_load_index(struct rcksum_state *z, const char *path) {
+    struct phase_timer t;
+    int rc;
+
+    phase_begin(&t);
+    rc = load_index(z, path);
+    phase_end(z, RCKSUM_PHASE_INDEX, &t);
+    return rc;
+}
+
+#ifdef _POSIX_MAPPED_FILES
+/* fits_in_file(size, offset, stride, bytes, nblocks)
+ * Returns true iff nblocks items of the given bytes, every stride bytes from
+ * offset, are all within a file of the given size */
+static int fits_in_file(off_t size, off_t offset, size_t stride, size_t bytes,
+                        zs_blockid nblocks) {
+    return offset >= 0 && offset <= size
+        && (!nblocks || ((uint64_t) (size - offset) >= bytes
+                         && (uint64_t) (size - offset - bytes) / stride
+                         >= (uint64_t) (nblocks - 1)));
+}
+#endif
+
+/* map_records(self, fd, rsums_offset, rsum_stride, checksums_offset, checksum_stride, rsum_bytes, checksum_bytes)
+ * Has the checksums of the target's blocks read in place from the file open
+ * on fd: each block's rsum_bytes of rsum (as in a control file) every
+ * rsum_stride bytes from rsums_offset, and its checksum every checksum_stride
+ * bytes from checksums_offset. Returns 0 if successful, else -1. */
+static int map_records(struct rcksum_state *z, int fd, off_t rsums_offset,
+                       size_t rsum_stride, off_t checksums_offset,
+                       size_t checksum_stride, int rsum_bytes,
+                       int checksum_bytes) {
+#ifdef _POSIX_MAPPED_FILES
+    struct stat st;
+    void *map;
+
+    if (!valid_record_sizes(z, rsum_bytes, checksum_bytes)
+        || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)
+        || (off_t) (size_t) st.st_size != st.st_size
+        || !fits_in_file(st.st_size, rsums_offset, rsum_stride, rsum_bytes,
+                         z->blocks)
+        || !fits_in_file(st.st_size, checksums_offset, checksum_stride,
+                         checksum_bytes, z->blocks))
+        return -1;
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        return -1;
+    /* In place of the tables that we have (which needn't have taken any
+     * memory, as they've not been used) */
+    free_tables(z);
+    z->records_map = map;
+    z->records_len = st.st_size;
+    z->records = (const unsigned char *)map + rsums_offset;
+    z->record_bytes = rsum_stride;
+    z->record_rsum_bytes = rsum_bytes;
+    z->checksum_records = (const unsigned char *)map + checksums_offset;
+    z->checksum_record_bytes = checksum_stride;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/* rcksum_map_target_blocks(self, fd, offset, rsum_bytes, checksum_bytes)
+ * Has the checksums of the target's blocks read in place from the file open
+ * on fd, where they are from offset on, as for rcksum_load_target_blocks;
+ * rather than copied into tables in memory. The file is mapped, and must not
+ * change until rcksum_end. Returns 0 if successful; or -1 if the file can't
+ * be mapped, or doesn't have the blocks as described. */
+int rcksum_map_target_blocks(struct rcksum_state *z, int fd, off_t offset,
+                             int rsum_bytes, int checksum_bytes) {
+    const size_t record = rsum_bytes + checksum_bytes;
+
+    return map_records(z, fd, offset, record, offset + rsum_bytes, record,
+                       rsum_bytes, checksum_bytes);
+}
+
+/* rcksum_map_target_arrays(self, fd, rsums_offset, checksums_offset, rsum_bytes, checksum_bytes)
+ * As rcksum_map_target_blocks, where the rsums of all the blocks are at
+ * rsums_offset in the file, and then their checksums are in another array at
+ * checksums_offset; as for rcksum_load_target_rsums and _checksums. */
+int rcksum_map_target_arrays(struct rcksum_state *z, int fd,
+                             off_t rsums_offset, off_t checksums_offset,
+                             int rsum_bytes, int checksum_bytes) {
+    return map_records(z, fd, rsums_offset, rsum_bytes, checksums_offset,
+                       checksum_bytes, rsum_bytes, checksum_bytes);
+}
+
+/* seed_cache_path(self, st)
+ * Returns the (malloced) name of the seed cache file for the given seed */
+static char *seed_cache_path(const struct rcksum_state *z,
+                             const struct stat *st) {
+    char *path = malloc(strlen(z->seed_cache) + 100);
+
+    if (path)
+        sprintf(path, "%s/seed-%llx-%llx-%lu-%s.idx", z->seed_cache,
+                (unsigned long long) st->st_dev,
+                (unsigned long long) st->st_ino, (unsigned long) z->blocksize,
+                rcksum_hash_name(z->hash));
+    return path;
+}
+
+/* seed_header(self, st, &header)
+ * Fills in the header of a seed cache for the given seed */
+static void seed_header(const struct rcksum_state *z, const struct stat *st,
+                        struct seed_header *h) {
+    memset(h, 0, sizeof *h);
+    memcpy(h->magic, SEED_MAGIC, sizeof h->magic);
+    h->order = INDEX_ORDER;
+    h->hash = z->hash;
+    h->blocksize = z->blocksize;
+    h->dev = st->st_dev;
+    h->ino = st->st_ino;
+    h->size = st->st_size;
+    h->mtime = st->st_mtime;
+    h->ctime = st->st_ctime;
+#if defined(st_mtime) && defined(st_ctime)
+    /* st_mtime is st_mtim.tv_sec, so we have the nanoseconds too */
+    h->mtime_ns = st->st_mtim.tv_nsec;
+    h->ctime_ns = st->st_ctim.tv_nsec;
+#endif
+    h->blocks = st->st_size >> z->blockshift;
+    h->rsums = index_align(sizeof *h);
+    h->checksums = index_align(h->rsums + h->blocks * sizeof(struct rsum));
+    h->length = h->checksums + h->blocks * CHECKSUM_SIZE;
+}
+
+/* Blocks to checksum at once when making a seed cache */
+#define SEED_BATCH 64
+
+/* open_seed_cache(self, fd, data[], &cache)
+ * Gets the checksums of the whole blocks of the seed file open on fd (of
+ * which data[] is the whole contents), from its seed cache if there is one
+ * that is still valid; else calculates them from data[], and saves them in
+ * a new seed cache. Returns 1 if it got them, or 0 if there is no seed cache
+ * directory (or we can't get them). */
+int open_seed_cache(struct rcksum_state *z, int fd, const unsigned char *data,
+                    struct seed_cache *c) {
+    struct seed_header want, h;
+    struct stat st;
+    char *path, *tmp;
+    unsigned char *mem;
+    zs_blockid id;
+    int cfd, rc = -1;
+
+    memset(c, 0, sizeof *c);
+    if (!z->seed_cache || fstat(fd, &st) != 0
+        || (off_t) (size_t) st.st_size != st.st_size)
+        return 0;
+    seed_header(z, &st, &want);
+    path = seed_cache_path(z, &st);
+    if (!path)
+        return 0;
+
+#ifdef _POSIX_MAPPED_FILES
+    /* Use the one there if it is for the seed as it is now */
+    cfd = open(path, O_RDONLY);
+    if (cfd != -1) {
+        if (pread(cfd, &h, sizeof h, 0) == sizeof h
+            && !memcmp(&h, &want, sizeof h)
+            && fstat(cfd, &st) == 0 && (uint64_t) st.st_size == h.length) {
+            mem = mmap(NULL, h.length, PROT_READ, MAP_SHARED, cfd, 0);
+            if (mem != MAP_FAILED) {
+                close(cfd);
+                free(path);
+                c->mem = mem;
+                c->len = h.length;
+                c->mapped = 1;
+                c->rsums = (const struct rsum *)(mem + h.rsums);
+                c->checksums = mem + h.checksums;
+                return 1;
+            }
+        }
+        close(cfd);
+    }
+#endif
+
+    /* Otherwise make it */
+    mem = malloc(want.length);
+    if (!mem) {
+        free(path);
+        return 0;
+    }
+    memcpy(mem, &want, sizeof want);
+    memset(mem + sizeof want, 0, want.rsums - sizeof want);
+    c->mem = mem;
+    c->len = want.length;
+    c->rsums = (const struct rsum *)(mem + want.rsums);
+    c->checksums = mem + want.checksums;
+    for (id = 0; id < want.blocks; id += SEED_BATCH) {
+        zs_blockid i, n = want.blocks - id;
+        const unsigned char *p = data + ((size_t) id << z->blockshift);
+
+        if (n > SEED_BATCH)
+            n = SEED_BATCH;
+        for (i = 0; i < n; i++)
+            ((struct rsum *)(mem + want.rsums))[id + i] =
+                rcksum_calc_rsum_block(p + ((size_t) i << z->blockshift),
+                                       z->blocksize);
+        calc_checksums(z->hash, mem + want.checksums + id * CHECKSUM_SIZE, p,
+                       n, z->blocksize, CHECKSUM_ANY_LANES);
+    }
+    memset(mem + want.rsums + want.blocks * sizeof(struct rsum), 0,
+           want.checksums - want.rsums - want.blocks * sizeof(struct rsum));
+
+    /* If we can't save it, we still have it for now */
+    cfd = create_temp(path, &tmp);
+    if (cfd != -1) {
+        if (write_at(cfd, mem, want.length, 0) == 0)
+            rc = 0;
+        commit_temp(cfd, tmp, path, rc);
+    }
+    free(path);
+    return 1;
+}
+
+/* close_seed_cache(&cache)
+ * Frees the checksums got by open_seed_cache */
+void close_seed_cache(struct seed_cache *c) {
+#ifdef _POSIX_MAPPED_FILES
+    if (c->mapped) {
+        munmap(c->mem, c->len);
+        return;
+    }
+#endif
+    free(c->mem);
+}
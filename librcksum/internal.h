@@ -17,15 +17,82 @@
 
 /* Internal data structures to the library. Not to be included by code outside librcksum. */
 
+#include <stdint.h>
+#include <unistd.h>
+#ifdef _POSIX_THREADS
+# include <pthread.h>
+#endif
+
 /* Two types of checksum -
  * rsum: rolling Adler-style checksum
- * checksum: hopefully-collision-resistant MD4 checksum of the block
+ * checksum: hopefully-collision-resistant checksum of the block (MD4, or
+ *           another hash if the target's control file says so)
  */
 
-struct hash_entry {
-    struct hash_entry *next;    /* next entry with the same rsum */
-    struct rsum r;
-    unsigned char checksum[CHECKSUM_SIZE];
+/* The block index is an open-addressed hash table of 64-bit slots, looked up
+ * by the rsum of a block (and of the following block, if seq_matches > 1).
+ * Each has the block id (or one of the following) in its low hash_id_bits,
+ * and as much of the block's rsum_tag() as fits above that, which is all of
+ * it unless the target has more than 2^32-2 blocks; the tag lets us skip
+ * other blocks that share the slot without looking them up. See slot_id. */
+#define SLOT_EMPTY (-1)         /* never used; ends a run of slots */
+#define SLOT_DELETED (-2)       /* block removed from the index */
+
+struct rcksum_state;
+
+/* A roll kernel takes the rsums r[] for the window at the start of data[] and
+ * calculates the rsums at each of the next n offsets into r0[] (and those of
+ * the following block into r1[], if seq_matches > 1), leaving r[] holding the
+ * rsums for the window at data[n]. */
+typedef void roll_kernel(const struct rcksum_state *z, const unsigned char *data,
+                         int n, struct rsum r[2], struct rsum *r0,
+                         struct rsum *r1);
+
+/* Blocks found in source data, waiting to be written out to the working file
+ * in one go with any that follow them; either we hold the data, or, if src is
+ * not -1, they are to be copied from that offset in the source file */
+struct write_behind {
+    unsigned char *buf;         /* data for blocks [from, to), or NULL */
+    zs_blockid from, to;
+    off_t src;
+};
+
+/* A block of the target that is the same as one that a scan has found, to be
+ * filled in from that one once it is written out; see dups.c */
+struct dup_fill {
+    zs_blockid from, to;
+};
+
+/* Counts of the work done by a scan; see struct rcksum_stats */
+struct scan_stats {
+    long long bytes;
+    long long hashhit, weakhit, weakmiss, stronghit, checksummed;
+    long long chain[RCKSUM_CHAIN_BUCKETS];
+    long long writes, bytes_written;
+};
+
+/* State for one stream of source data being scanned for blocks of the target */
+struct scan_state {
+    struct rsum r[2];           /* Current rsums */
+    struct write_behind wb;
+
+    /* If the source is a file that we can copy blocks from (src_fd != -1),
+     * data at stream offset 0 is at src_base in it, and it ends at src_end;
+     * and the data[] passed to scan_source_data is at data_pos */
+    int src_fd;
+    off_t src_base, src_end;
+    const unsigned char *data;
+    off_t data_pos;
+    int no_copy_range;          /* copy_file_range(2) isn't there; see copy.c */
+
+    zs_blockid next_match;      /* block following the last match, or -1 */
+    int skip;                   /* skip forward on next submit_source_data */
+
+    /* Blocks to fill in from others once those are written out */
+    struct dup_fill *fills;
+    size_t nfills, fills_alloc;
+
+    struct scan_stats stats;
 };
 
 /* An rcksum_state contains the set of checksums of the blocks of a target
@@ -35,39 +102,93 @@ struct hash_entry {
  * over data looking for matching blocks. */
 
 struct rcksum_state {
-    struct rsum r[2];           /* Current rsums */
-
     zs_blockid blocks;          /* Number of blocks in the target file */
+    zs_blockid loaded;          /* Blocks before this have their checksums */
     size_t blocksize;           /* And how many bytes per block */
     int blockshift;             /* log2(blocksize) */
     unsigned short rsum_a_mask; /* The mask to apply to rsum values before looking up */
-    int checksum_bytes;         /* How many bytes of the MD4 checksum are available */
+    unsigned int rsum_high_mask;    /* and to the high halves, if we have any */
+    int checksum_bytes;         /* How many bytes of the checksum are available */
+    int hash;                   /* and which checksum it is, RCKSUM_HASH_* */
     int seq_matches;
 
     unsigned int context;       /* precalculated blocksize * seq_matches */
 
-    /* These are used by the library. Note, not thread safe. */
-    const struct hash_entry *rover;
-    const struct hash_entry *next_match;
-    int skip;                   /* skip forward on next submit_source_data */
+    /* These are used by the library. Scans through the rcksum_submit_*
+     * functions use the scan state here, so only one can run at a time;
+     * others can run at the same time through scanners (see scanner.c),
+     * each with a scan state of its own. */
+    struct scan_state scan;     /* for rcksum_submit_source_data */
+    roll_kernel *roll;          /* fastest rolling checksum kernel for this CPU */
+    int threads;                /* to scan source files with, where possible */
+    int copy_source;            /* copy blocks straight from seed files */
+    int aligned_scan;           /* try just the aligned blocks of sources first */
+    char *seed_cache;           /* directory for seed caches, or NULL */
+#ifdef _POSIX_THREADS
+    pthread_mutex_t *commit_lock;   /* set while threads are scanning */
+    pthread_mutex_t lock;       /* the commit_lock while there are scanners */
+#endif
+    int scanners;               /* how many scanners there are */
+    double phase_wall[RCKSUM_PHASES];   /* time spent in each phase */
+    double phase_cpu[RCKSUM_PHASES];
+
+    /* The checksums for each block of the target, in separate arrays so the
+     * rsums are packed together for comparing; and each checksum is only as
+     * long as we have of it. Both have seq_matches zeroed entries past the
+     * end, to stand for the blocks after the last. */
+    struct rsum *rsums;         /* masked with rsum_a_mask */
+    struct rsum *rsums_high;    /* the high halves, or NULL if we have none */
+    unsigned char *checksums;   /* checksum_bytes per block */
+
+    /* Or, if records is not NULL, the tables above are NULL and the checksums
+     * are read in place from a mapping of the control file: each block's
+     * record_rsum_bytes of rsum are every record_bytes from records, and its
+     * checksum every checksum_record_bytes from checksum_records (which for
+     * the usual format is in the same records, after the rsum); see
+     * rcksum_map_target_blocks, and block_rsum etc below */
+    const unsigned char *records;
+    size_t record_bytes;
+    int record_rsum_bytes;
+    const unsigned char *checksum_records;
+    size_t checksum_record_bytes;
+    void *records_map;
+    size_t records_len;
+
+    /* The index file that the tables above and below are mapped from, if
+     * any; see index.c */
+    void *index_map;
+    size_t index_len;
 
     /* Hash table for rsync algorithm */
-    unsigned int hashmask;
-    struct hash_entry *blockhashes;
-    struct hash_entry **rsum_hash;
+    size_t hashslots;           /* how many; see hash_slot_of */
+    int hash_id_bits;           /* of each slot, for the block id */
+    uint64_t *rsum_hash;
 
     /* And a 1-bit per rsum value table to allow fast negative lookups for hash
      * values that don't occur in the target file. */
-    unsigned int bithashmask;
+    int bithashshift;
     unsigned char *bithash;
 
-    /* Current state and stats for data collected by algorithm */
-    int numranges;
-    zs_blockid *ranges;
-    int gotblocks;
-    struct {
-        int hashhit, weakhit, stronghit, checksummed;
-    } stats;
+    /* The blocks of the target that are the same as others (same rsum and
+     * checksum), found along with the hash tables; see dups.c. dup_ids has
+     * them in order, and dup_next links each (by its place in dup_ids) to the
+     * next in its group of the same blocks, round in a circle. dup_map has a
+     * bitmap of them, then one of those that follow an earlier block of their
+     * group, then a summary of that as for known_any below. NULL if none. */
+    zs_blockid ndups;
+    zs_blockid *dup_ids;
+    zs_blockid *dup_next;
+    uint64_t *dup_map;
+
+    /* Current state and stats for data collected by algorithm: a bit for
+     * each block that we have the data for; and two summaries of that, with
+     * a bit for each 64-bit word of it, set where the word has any bits set
+     * and where it has all of them set respectively, to skip runs of blocks
+     * quickly. See range.c */
+    uint64_t *known;
+    uint64_t *known_any;
+    uint64_t *known_all;
+    zs_blockid gotblocks;
 
     /* Temp file for output */
     char *filename;
@@ -76,27 +197,265 @@ struct rcksum_state {
 
 #define BITHASHBITS 3
 
+/* Most slots in the block index: so that hash_slot_of can work in 64 bits,
+ * where there's no wider multiply, and the index (and the bithash) can be
+ * indexed with a size_t */
+#ifdef __SIZEOF_INT128__
+# define HASH_MAX_SLOTS (((size_t) -1) >> 4)
+#else
+# define HASH_MAX_SLOTS ((size_t) 1 << (sizeof(size_t) > 4 ? 32 : 28))
+#endif
+
+#define UPDATE_RSUM(a, b, oldc, newc, bshift) do { (a) += ((unsigned char)(newc)) - ((unsigned char)(oldc)); (b) += (a) - ((oldc) << (bshift)); } while (0)
+
 /* rcksum_state methods */
 
-/* From a hash entry, return the corresponding blockid */
-static inline zs_blockid get_HE_blockid(const struct rcksum_state *z,
-                                        const struct hash_entry *e) {
-    return e - z->blockhashes;
+/* Return the rsum bytes of the given block's record, as a big-endian number
+ * (high a, high b, a, b); where the checksums are read in place */
+static inline uint64_t record_rsum(const struct rcksum_state *z,
+                                   zs_blockid id) {
+    const unsigned char *p = z->records + (size_t) id * z->record_bytes;
+    uint64_t v = 0;
+    int i;
+
+    for (i = 0; i < z->record_rsum_bytes; i++)
+        v = v << 8 | p[i];
+    return v;
 }
 
-void add_to_ranges(struct rcksum_state *z, zs_blockid n);
-int already_got_block(struct rcksum_state *z, zs_blockid n);
+/* Return the rsum of the given block, masked with rsum_a_mask; 0 for those
+ * past the last */
+static inline struct rsum block_rsum(const struct rcksum_state *z,
+                                     zs_blockid id) {
+    struct rsum r = { 0, 0 };
 
-struct hash_entry *calc_hash_entry(void *data, size_t len);
+    if (!z->records)
+        return z->rsums[id];
+    if (id < z->blocks) {
+        uint64_t v = record_rsum(z, id);
 
-/* Hash the checksum values for the given hash entry and return the hash value */
-static inline unsigned calc_rhash(const struct rcksum_state *const z,
-                                  const struct hash_entry *const e) {
-    unsigned h = e[0].r.b;
+        r.a = (v >> 16) & z->rsum_a_mask;
+        r.b = v;
+    }
+    return r;
+}
 
-    h ^= ((z->seq_matches > 1) ? e[1].r.b : e[0].r.a) << BITHASHBITS;
+/* Return the high halves of the rsum of the given block, where the target has
+ * them (rsum_high_mask is not 0) */
+static inline struct rsum block_rsum_high(const struct rcksum_state *z,
+                                          zs_blockid id) {
+    struct rsum r = { 0, 0 };
 
-    return h;
+    if (!z->records)
+        return z->rsums_high[id];
+    if (id < z->blocks) {
+        uint64_t v = record_rsum(z, id);
+
+        r.a = v >> 48;
+        r.b = v >> 32;
+    }
+    return r;
 }
 
+/* Return the (first checksum_bytes of the) checksum of the given block */
+static inline const unsigned char *block_checksum(const struct rcksum_state *z,
+                                                  zs_blockid id) {
+    static const unsigned char none[CHECKSUM_SIZE];
+
+    if (!z->records)
+        return z->checksums + (size_t) id * z->checksum_bytes;
+    if (id >= z->blocks)
+        return none;
+    return z->checksum_records + (size_t) id * z->checksum_record_bytes;
+}
+
+/* Words in the known block bitmap, and in each summary of it */
+#define KNOWN_WORDS(blocks) (((blocks) + 63) / 64)
+#define KNOWN_SUMMARY_WORDS(blocks) ((KNOWN_WORDS(blocks) + 63) / 64)
+
+int add_known_block(struct rcksum_state *z, zs_blockid n);
+
+/* Return true iff we have the data for every block of the target, so there is
+ * nothing left to look for */
+static inline int all_blocks_known(const struct rcksum_state *z) {
+    return z->gotblocks == z->blocks;
+}
+
+/* Return true iff we already have the data for the given block */
+static inline int already_got_block(const struct rcksum_state *z,
+                                    zs_blockid n) {
+    return (z->known[n >> 6] >> (n & 63)) & 1;
+}
+
+/* The rsum as stored in the block index, with only as much of it as the
+ * target's checksums give us */
+static inline unsigned int rsum_tag(const struct rcksum_state *const z,
+                                    struct rsum r) {
+    return ((unsigned int)(r.a & z->rsum_a_mask) << 16) | r.b;
+}
+
+/* The high halves of an rsum worked out to 32 bits, with only as much of them
+ * as the target's checksums give us */
+static inline unsigned int rsum_high_tag(const struct rcksum_state *const z,
+                                         struct rsum high) {
+    return (((unsigned int) high.a << 16) | high.b) & z->rsum_high_mask;
+}
+
+/* Hash the rsums of a block and of the following block (which is only used if
+ * seq_matches > 1) and return the hash value; the top bits of this are what
+ * are used, to pick the slot in the block index and the bit in the bithash. */
+static inline uint64_t calc_rhash(const struct rcksum_state *const z,
+                                  struct rsum r0, struct rsum r1) {
+    uint64_t k = rsum_tag(z, r0);
+
+    if (z->seq_matches > 1)
+        k |= (uint64_t) rsum_tag(z, r1) << 32;
+
+    return k * UINT64_C(0x9e3779b97f4a7c15);
+}
+
+/* The slot for the given hash value in a table of the given number of slots:
+ * the top bits of the value scaled to the table, rather than masked off, so
+ * that the table can be just as big as it needs to be */
+static inline size_t hash_slot_of(uint64_t h, size_t slots) {
+#ifdef __SIZEOF_INT128__
+    return (size_t) (((unsigned __int128) h * slots) >> 64);
+#else
+    return (size_t) (((h >> 32) * slots) >> 32);
+#endif
+}
+
+/* The slot after the given one in the block index, going round to the start
+ * after the last */
+static inline size_t next_slot(const struct rcksum_state *z, size_t n) {
+    return ++n < z->hashslots ? n : 0;
+}
+
+/* Make a slot of the block index for the given block id (or SLOT_EMPTY or
+ * SLOT_DELETED), with the given rsum_tag() */
+static inline uint64_t make_slot(const struct rcksum_state *z, zs_blockid id,
+                                 unsigned int tag) {
+    const uint64_t mask = (UINT64_C(1) << z->hash_id_bits) - 1;
+
+    return (uint64_t) tag << z->hash_id_bits | ((uint64_t) id & mask);
+}
+
+/* The block id in the given slot of the block index, or SLOT_EMPTY or
+ * SLOT_DELETED (which are the two highest ids that fit, in the slot) */
+static inline zs_blockid slot_id(const struct rcksum_state *z, uint64_t s) {
+    const uint64_t mask = (UINT64_C(1) << z->hash_id_bits) - 1;
+    const uint64_t id = s & mask;
+
+    return id >= mask - 1 ? (zs_blockid) (id - mask) - 1 : (zs_blockid) id;
+}
+
+/* Return true if the tag in the given slot of the block index is the given
+ * rsum_tag(), as far as it goes */
+static inline int slot_tag_is(const struct rcksum_state *z, uint64_t s,
+                              unsigned int tag) {
+    return !((s ^ (uint64_t) tag << z->hash_id_bits) >> z->hash_id_bits);
+}
+
+/* Return true if the bithash says that the given hash value could be in the
+ * rsum hash */
+static inline int bithash_test(const struct rcksum_state *const z, uint64_t h) {
+    uint64_t bit = h >> z->bithashshift;
+    return (z->bithash[bit >> 3] & (1 << (bit & 7))) != 0;
+}
+
+int size_hash_tables(struct rcksum_state *z);
 int build_hash(struct rcksum_state *z);
+int valid_record_sizes(const struct rcksum_state *z, int rsum_bytes,
+                       int checksum_bytes);
+
+/* Blocks of the target that are the same as others, in dups.c */
+int build_dup_tables(struct rcksum_state *z);
+void free_dup_tables(struct rcksum_state *z);
+zs_blockid find_duplicate(const struct rcksum_state *z, zs_blockid id);
+int dup_needs_hash(const struct rcksum_state *z, zs_blockid id);
+void forget_duplicate(struct rcksum_state *z, zs_blockid id);
+int add_fill(struct scan_state *s, zs_blockid from, zs_blockid to);
+void fill_duplicates(struct rcksum_state *z, struct scan_state *s);
+void fill_known_duplicates(struct rcksum_state *z);
+
+/* Return true iff the given block is the same as others of the target */
+static inline int has_duplicates(const struct rcksum_state *z, zs_blockid n) {
+    return z->dup_map && (z->dup_map[n >> 6] >> (n & 63)) & 1;
+}
+
+/* The bitmap of blocks that follow an earlier block the same, and its summary */
+#define DUP_FOLLOWS(z) ((z)->dup_map + KNOWN_WORDS((z)->blocks))
+#define DUP_FOLLOWS_ANY(z) (DUP_FOLLOWS(z) + KNOWN_WORDS((z)->blocks))
+#define DUP_MAP_WORDS(blocks) \
+    (2 * KNOWN_WORDS(blocks) + KNOWN_SUMMARY_WORDS(blocks))
+
+/* Free the target's tables, which may be in an index file, in index.c */
+void free_table(struct rcksum_state *z, void *p);
+void free_tables(struct rcksum_state *z);
+void remove_known_blocks(struct rcksum_state *z);
+
+/* The checksums of every whole block of a seed file, from its seed cache;
+ * see index.c */
+struct seed_cache {
+    const struct rsum *rsums;
+    const unsigned char *checksums;     /* CHECKSUM_SIZE bytes per block */
+    void *mem;                  /* what they are in */
+    size_t len;
+    int mapped;
+};
+int open_seed_cache(struct rcksum_state *z, int fd, const unsigned char *data,
+                    struct seed_cache *c);
+void close_seed_cache(struct seed_cache *c);
+
+/* Keeping statistics, in stats.c */
+struct phase_timer {
+    double wall, cpu;
+};
+void phase_begin(struct phase_timer *t);
+void phase_end(struct rcksum_state *z, int phase, const struct phase_timer *t);
+void count_chain(struct scan_stats *st, int length);
+void add_scan_stats(struct scan_stats *to, const struct scan_stats *from);
+
+/* Write out (and so discard) the blocks held back by a scan_state */
+void flush_write_behind(struct rcksum_state *z, struct scan_state *s);
+
+/* Copy blocks from the scan's source file to the working file, in copy.c */
+void copy_blocks(struct rcksum_state *z, struct scan_state *s, off_t src,
+                 zs_blockid bfrom, zs_blockid bto);
+
+/* The core of the search for matching blocks, in rsum.c; and the search of a
+ * whole stream, done with the given scan state */
+zs_blockid scan_source_data(struct rcksum_state *z, struct scan_state *s,
+                            const unsigned char *data, size_t len,
+                            off_t offset);
+zs_blockid scan_source_file(struct rcksum_state *z, struct scan_state *s,
+                            FILE *f, int progress);
+
+#ifdef _POSIX_THREADS
+/* Scan a seed file split between several threads, in scanthreads.c */
+zs_blockid scan_source_fd_threaded(struct rcksum_state *z, int fd,
+                                   off_t start, off_t eof, int progress);
+#endif
+
+/* Available roll kernels are in scan.c */
+roll_kernel *select_roll_kernel(int max_lanes);
+#define ROLL_ANY_LANES 16
+
+/* Checksums of many blocks at once, CHECKSUM_SIZE bytes for each, using
+ * kernels that do at most max_lanes blocks at a time; for MD4 in md4batch.c,
+ * BLAKE3 in blake3.c, XXH3 in xxh3.c (whose kernels do one block at a time,
+ * in vectors of at most max_lanes words), and whichever the hash says in
+ * rsum.c */
+void md4_blocks(unsigned char *c, const unsigned char *data,
+                size_t nblocks, size_t blocksize, int max_lanes);
+void blake3_blocks(unsigned char *c, const unsigned char *data,
+                   size_t nblocks, size_t blocksize, int max_lanes);
+void xxh3_blocks(unsigned char *c, const unsigned char *data,
+                 size_t nblocks, size_t blocksize, int max_lanes);
+void calc_checksums(int hash, unsigned char *c, const unsigned char *data,
+                    size_t nblocks, size_t blocksize, int max_lanes);
+#define CHECKSUM_ANY_LANES 16
+
+/* Bounds on the number of offsets that we calculate rsums for in one go */
+#define ROLL_CHUNK_MIN 16
+#define ROLL_CHUNK 256
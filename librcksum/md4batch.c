@@ -0,0 +1,109 @@
+/*
+ *   rcksum/lib - library for using the rsync algorithm to determine
+ *               which parts of a file you have and which you need.
+ *   Copyright (C) 2004,2005,2007,2009 Colin Phipps <cph@moria.org.uk>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* Calculating the MD4 checksums of many blocks at once. MD4 of one block is a
+ * serial chain of dependent steps, but the blocks are independent, and all the
+ * same length; so the SIMD kernels here run the same steps on 4, 8 or 16
+ * blocks at once, one per lane of a vector of 32-bit words. Blocks are always
+ * whole numbers of MD4 input chunks (block sizes are powers of 2), so the
+ * final padding chunk is the same for every lane. Anything left over, or any
+ * odd length, is done one block at a time by the plain MD4 code.
+ */
+
+#include "zsglobal.h"
+
+#include <string.h>
+#include <sys/types.h>
+
+#ifdef WITH_DMALLOC
+# include <dmalloc.h>
+#endif
+
+#include "md4.h"
+#include "rcksum.h"
+#include "internal.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define MD4_X86_SIMD 1
+
+/* As in md4.c, but on vectors */
+# define F1(x, y, z) (z ^ (x & (y ^ z)))
+# define F2(x, y, z) ((x & y) | (x & z) | (y & z))
+# define F3(x, y, z) (x ^ y ^ z)
+# define MD4STEP(f, w, x, y, z, data, s) \
+	( w += f(x, y, z) + data,  w = w<<s | w>>(32-s) )
+
+# define MD4_LANES 4
+# define MD4_TARGET "sse2"
+# define MD4_KERNEL md4_sse2
+# include "md4lanes.h"
+# undef MD4_LANES
+# undef MD4_TARGET
+# undef MD4_KERNEL
+
+# define MD4_LANES 8
+# define MD4_TARGET "avx2"
+# define MD4_KERNEL md4_avx2
+# include "md4lanes.h"
+# undef MD4_LANES
+# undef MD4_TARGET
+# undef MD4_KERNEL
+
+# define MD4_LANES 16
+# define MD4_TARGET "avx512f"
+# define MD4_KERNEL md4_avx512
+# include "md4lanes.h"
+# undef MD4_LANES
+# undef MD4_TARGET
+# undef MD4_KERNEL
+#endif
+
+/* md4_blocks(checksums[], data[], nblocks, blocksize, max_lanes)
+ * Calculates the MD4 checksums of the nblocks consecutive blocks of blocksize
+ * bytes in data[], into checksums[] (CHECKSUM_SIZE bytes for each block),
+ * using kernels that do at most max_lanes blocks at a time (so 1 means just
+ * the plain MD4 code). */
+void md4_blocks(unsigned char *c, const unsigned char *data,
+                size_t nblocks, size_t blocksize, int max_lanes) {
+#ifdef MD4_X86_SIMD
+    if (blocksize % MD4_BLOCK_LENGTH == 0) {
+        __builtin_cpu_init();
+        if (max_lanes >= 16 && __builtin_cpu_supports("avx512f"))
+            for (; nblocks >= 16; nblocks -= 16) {
+                md4_avx512(c, data, blocksize);
+                c += 16 * CHECKSUM_SIZE;
+                data += 16 * blocksize;
+            }
+        if (max_lanes >= 8 && __builtin_cpu_supports("avx2"))
+            for (; nblocks >= 8; nblocks -= 8) {
+                md4_avx2(c, data, blocksize);
+                c += 8 * CHECKSUM_SIZE;
+                data += 8 * blocksize;
+            }
+        if (max_lanes >= 4 && __builtin_cpu_supports("sse2"))
+            for (; nblocks >= 4; nblocks -= 4) {
+                md4_sse2(c, data, blocksize);
+                c += 4 * CHECKSUM_SIZE;
+                data += 4 * blocksize;
+            }
+    }
+#endif
+    for (; nblocks > 0; nblocks--) {
+        rcksum_calc_checksum(c, data, blocksize);
+        c += CHECKSUM_SIZE;
+        data += blocksize;
+    }
+}
@@ -0,0 +1,121 @@
+/*
+ *   rcksum/lib - library for using the rsync algorithm to determine
+ *               which parts of a file you have and which you need.
+ *   Copyright (C) 2004,2005,2007,2009 Colin Phipps <cph@moria.org.uk>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* Template for a kernel calculating the MD4 checksums of MD4_LANES blocks at
+ * once, each block in its own lane of a vector. md4batch.c includes this once
+ * for each instruction set, with MD4_LANES, MD4_TARGET and MD4_KERNEL defined.
+ *
+ * MD4_KERNEL(checksums, data, len)
+ * Calculates the checksums of the MD4_LANES consecutive blocks of len bytes
+ * (a multiple of MD4_BLOCK_LENGTH) in data[], into checksums[]. */
+__attribute__ ((target(MD4_TARGET)))
+static void MD4_KERNEL(unsigned char *out, const unsigned char *data,
+                       size_t len) {
+    typedef uint32_t vec __attribute__ ((vector_size(4 * MD4_LANES)));
+    vec state[4], in[16];
+    size_t pos;
+    int i, j;
+
+    state[0] = (vec) { 0 } + 0x67452301;
+    state[1] = (vec) { 0 } + 0xefcdab89;
+    state[2] = (vec) { 0 } + 0x98badcfe;
+    state[3] = (vec) { 0 } + 0x10325476;
+
+    /* Each chunk of the blocks' data, then the padding and length (which are
+     * the same for every block, as they are all the same length) */
+    for (pos = 0; pos <= len; pos += MD4_BLOCK_LENGTH) {
+        vec a = state[0], b = state[1], c = state[2], d = state[3];
+
+        if (pos < len) {
+            for (i = 0; i < 16; i++)
+                for (j = 0; j < MD4_LANES; j++) {
+                    uint32_t w;
+                    memcpy(&w, data + j * len + pos + i * 4, 4);
+                    in[i][j] = w;
+                }
+        }
+        else {
+            for (i = 0; i < 16; i++)
+                in[i] = (vec) { 0 };
+            in[0] += 0x80;
+            in[14] += (uint32_t) (len << 3);
+            in[15] += (uint32_t) ((uint64_t) len >> 29);
+        }
+
+        MD4STEP(F1, a, b, c, d, in[ 0],  3);
+        MD4STEP(F1, d, a, b, c, in[ 1],  7);
+        MD4STEP(F1, c, d, a, b, in[ 2], 11);
+        MD4STEP(F1, b, c, d, a, in[ 3], 19);
+        MD4STEP(F1, a, b, c, d, in[ 4],  3);
+        MD4STEP(F1, d, a, b, c, in[ 5],  7);
+        MD4STEP(F1, c, d, a, b, in[ 6], 11);
+        MD4STEP(F1, b, c, d, a, in[ 7], 19);
+        MD4STEP(F1, a, b, c, d, in[ 8],  3);
+        MD4STEP(F1, d, a, b, c, in[ 9],  7);
+        MD4STEP(F1, c, d, a, b, in[10], 11);
+        MD4STEP(F1, b, c, d, a, in[11], 19);
+        MD4STEP(F1, a, b, c, d, in[12],  3);
+        MD4STEP(F1, d, a, b, c, in[13],  7);
+        MD4STEP(F1, c, d, a, b, in[14], 11);
+        MD4STEP(F1, b, c, d, a, in[15], 19);
+
+        MD4STEP(F2, a, b, c, d, in[ 0] + 0x5a827999,  3);
+        MD4STEP(F2, d, a, b, c, in[ 4] + 0x5a827999,  5);
+        MD4STEP(F2, c, d, a, b, in[ 8] + 0x5a827999,  9);
+        MD4STEP(F2, b, c, d, a, in[12] + 0x5a827999, 13);
+        MD4STEP(F2, a, b, c, d, in[ 1] + 0x5a827999,  3);
+        MD4STEP(F2, d, a, b, c, in[ 5] + 0x5a827999,  5);
+        MD4STEP(F2, c, d, a, b, in[ 9] + 0x5a827999,  9);
+        MD4STEP(F2, b, c, d, a, in[13] + 0x5a827999, 13);
+        MD4STEP(F2, a, b, c, d, in[ 2] + 0x5a827999,  3);
+        MD4STEP(F2, d, a, b, c, in[ 6] + 0x5a827999,  5);
+        MD4STEP(F2, c, d, a, b, in[10] + 0x5a827999,  9);
+        MD4STEP(F2, b, c, d, a, in[14] + 0x5a827999, 13);
+        MD4STEP(F2, a, b, c, d, in[ 3] + 0x5a827999,  3);
+        MD4STEP(F2, d, a, b, c, in[ 7] + 0x5a827999,  5);
+        MD4STEP(F2, c, d, a, b, in[11] + 0x5a827999,  9);
+        MD4STEP(F2, b, c, d, a, in[15] + 0x5a827999, 13);
+
+        MD4STEP(F3, a, b, c, d, in[ 0] + 0x6ed9eba1,  3);
+        MD4STEP(F3, d, a, b, c, in[ 8] + 0x6ed9eba1,  9);
+        MD4STEP(F3, c, d, a, b, in[ 4] + 0x6ed9eba1, 11);
+        MD4STEP(F3, b, c, d, a, in[12] + 0x6ed9eba1, 15);
+        MD4STEP(F3, a, b, c, d, in[ 2] + 0x6ed9eba1,  3);
+        MD4STEP(F3, d, a, b, c, in[10] + 0x6ed9eba1,  9);
+        MD4STEP(F3, c, d, a, b, in[ 6] + 0x6ed9eba1, 11);
+        MD4STEP(F3, b, c, d, a, in[14] + 0x6ed9eba1, 15);
+        MD4STEP(F3, a, b, c, d, in[ 1] + 0x6ed9eba1,  3);
+        MD4STEP(F3, d, a, b, c, in[ 9] + 0x6ed9eba1,  9);
+        MD4STEP(F3, c, d, a, b, in[ 5] + 0x6ed9eba1, 11);
+        MD4STEP(F3, b, c, d, a, in[13] + 0x6ed9eba1, 15);
+        MD4STEP(F3, a, b, c, d, in[ 3] + 0x6ed9eba1,  3);
+        MD4STEP(F3, d, a, b, c, in[11] + 0x6ed9eba1,  9);
+        MD4STEP(F3, c, d, a, b, in[ 7] + 0x6ed9eba1, 11);
+        MD4STEP(F3, b, c, d, a, in[15] + 0x6ed9eba1, 15);
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+    }
+
+    /* Digest is the state words, little-endian (as is x86) */
+    for (j = 0; j < MD4_LANES; j++)
+        for (i = 0; i < 4; i++) {
+            uint32_t w = state[i][j];
+            memcpy(out + j * MD4_DIGEST_LENGTH + i * 4, &w, 4);
+        }
+}
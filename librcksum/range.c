@@ -15,11 +15,20 @@
  *   COPYING file for details.
  */
 
-/* Manage storage of the set of ranges in the target file that we have so far
- * got data for. */
+/* Manage storage of the set of blocks in the target file that we have so far
+ * got data for, and work out from that the ranges of blocks that we still
+ * need.
+ *
+ * This is a bitmap with a bit per block, so recording a block is O(1) however
+ * scattered the blocks that we find are. To find ranges quickly, it has two
+ * summaries with a bit per 64-bit word of the bitmap: known_any, set where the
+ * word has any blocks that we have, and known_all, set where we have all the
+ * blocks in it; so a search for the next known or unknown block can pass over
+ * 4096 blocks at a time where there are none. */
 
 #include "zsglobal.h"
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
@@ -31,103 +40,85 @@
 #include "rcksum.h"
 #include "internal.h"
 
-/* r = range_before_block(self, x)
- * This determines which of the existing known ranges x falls in.
- * It returns -1 if it is inside an existing range (it doesn't tell you which
- *  one; if you already have it, that usually is enough to know).
- * Or it returns 0 if x is before the 1st range;
- * 1 if it is between ranges 1 and 2 (array indexes 0 and 1)
- * ...
- * numranges if it is after the last range
- */
-static int range_before_block(const struct rcksum_state* rs, zs_blockid x) {
-    /* Lowest number and highest number block that it could be inside (0 based) */
-    register int min = 0, max = rs->numranges-1;
-
-    /* By bisection */
-    for (; min<=max;) {
-        /* Range number to compare against */
-        register int r = (max+min)/2;
-
-        if (x > rs->ranges[2*r+1]) min = r+1;  /* After range r */
-        else if (x < rs->ranges[2*r]) max = r-1;/* Before range r */
-            else return -1;                     /* In range r */
+/* lowest_bit(x)
+ * Returns the index of the lowest set bit in x, which must be non-zero */
+static inline int lowest_bit(uint64_t x) {
+#ifdef __GNUC__
+    return __builtin_ctzll(x);
+#else
+    int i = 0;
+    while (!(x & 1)) {
+        x >>= 1;
+        i++;
     }
-
-    /* If we reach here, we know min = max + 1 and we were below range max+1
-     * and above range min-1.
-     * So we're between range max and max + 1
-     * So we return max + 1  (return value is 1 based)  ( = min )
-     */
-    return min;
+    return i;
+#endif
 }
 
-/* add_to_ranges(rs, blockid)
- * Mark the given blockid as known, updating the stored known ranges
- * appropriately */
-void add_to_ranges(struct rcksum_state *rs, zs_blockid x) {
-    int r = range_before_block(rs, x);
-
-    if (r == -1) {
-        /* Already have this block */
-    }
-    else {
-        rs->gotblocks++;
-
-        /* If between two ranges and exactly filling the hole between them,
-         * merge them */
-        if (r > 0 && r < rs->numranges
-            && rs->ranges[2 * (r - 1) + 1] == x - 1
-            && rs->ranges[2 * r] == x + 1) {
-
-            // This block fills the gap between two areas that we have got completely. Merge the adjacent ranges
-            rs->ranges[2 * (r - 1) + 1] = rs->ranges[2 * r + 1];
-            memmove(&rs->ranges[2 * r], &rs->ranges[2 * r + 2],
-                    (rs->numranges - r - 1) * sizeof(rs->ranges[0]) * 2);
-            rs->numranges--;
-        }
+/* add_known_block(rs, blockid)
+ * Mark the given blockid as known; returns 1 if it wasn't already */
+int add_known_block(struct rcksum_state *rs, zs_blockid x) {
+    size_t w = x >> 6;
+    uint64_t bit = UINT64_C(1) << (x & 63);
+
+    if (rs->known[w] & bit)
+        return 0;               /* Already have this block */
+
+    rs->gotblocks++;
+    rs->known[w] |= bit;
+    rs->known_any[w >> 6] |= UINT64_C(1) << (w & 63);
+    if (rs->known[w] == ~UINT64_C(0))
+        rs->known_all[w >> 6] |= UINT64_C(1) << (w & 63);
+    return 1;
+}
 
-        /* If adjoining a range below, add to it */
-        else if (r > 0 && rs->numranges && rs->ranges[2 * (r - 1) + 1] == x - 1) {
-            rs->ranges[2 * (r - 1) + 1] = x;
+/* next_block(rs, x, to, known)
+ * Returns the first block from x up to (but not including) to that is known,
+ * if known is true, or else that we still need; or to if there is none. Blocks
+ * that follow an earlier one the same count as known, as they are filled in
+ * from that one (see dups.c). */
+static zs_blockid next_block(const struct rcksum_state *rs, zs_blockid x,
+                             zs_blockid to, int known) {
+    const uint64_t *follows = rs->dup_map ? DUP_FOLLOWS(rs) : NULL;
+    const uint64_t *follows_any = rs->dup_map ? DUP_FOLLOWS_ANY(rs) : NULL;
+
+    while (x < to) {
+        size_t w = x >> 6;
+        uint64_t bits = rs->known[w] | (follows ? follows[w] : 0);
+
+        if (!known)
+            bits = ~bits;
+
+        /* Any in the rest of this word? */
+        bits &= ~UINT64_C(0) << (x & 63);
+        if (bits) {
+            x = (zs_blockid) (w << 6) + lowest_bit(bits);
+            return x < to ? x : to;
         }
 
-        /* If adjoining a range above, add to it */
-        else if (r < rs->numranges && rs->ranges[2 * r] == x + 1) {
-            rs->ranges[2 * r] = x;
-        }
+        /* No; so on to the next word that the summary says could have one */
+        for (w++; (zs_blockid) (w << 6) < to;) {
+            uint64_t s = known ? rs->known_any[w >> 6]
+                | (follows_any ? follows_any[w >> 6] : 0)
+                : ~rs->known_all[w >> 6];
 
-        else { /* New range for this block alone */
-            rs->ranges =
-                realloc(rs->ranges,
-                        (rs->numranges + 1) * 2 * sizeof(rs->ranges[0]));
-            memmove(&rs->ranges[2 * r + 2], &rs->ranges[2 * r],
-                    (rs->numranges - r) * 2 * sizeof(rs->ranges[0]));
-            rs->ranges[2 * r] = rs->ranges[2 * r + 1] = x;
-            rs->numranges++;
+            s &= ~UINT64_C(0) << (w & 63);
+            if (s) {
+                w = ((w >> 6) << 6) + lowest_bit(s);
+                break;
+            }
+            w = ((w >> 6) + 1) << 6;
         }
+        x = w << 6;
     }
-#if 0
-    {
-        int i;
-        for (i = 0; i < rs->numranges; i++)
-            fprintf(stderr, "%d-%d,", rs->ranges[i * 2], rs->ranges[i * 2 + 1]);
-        fprintf(stderr, " are the current ranges got (added %d, %d)\n\n", x, r);
-    }
-#endif
-}
-
-/* already_got_block
- * Return true iff blockid x of the target file is already known */
-int already_got_block(struct rcksum_state *rs, zs_blockid x) {
-    return (range_before_block(rs, x) == -1);
+    return to;
 }
 
 /* rcksum_needed_block_ranges
  * Return the block ranges needed to complete the target file */
 zs_blockid *rcksum_needed_block_ranges(const struct rcksum_state * rs, int *num,
                                        zs_blockid from, zs_blockid to) {
-    int i, n;
+    int n = 0;
     int alloc_n = 100;
     zs_blockid *r = malloc(2 * alloc_n * sizeof(zs_blockid));
 
@@ -136,49 +127,23 @@ zs_blockid *rcksum_needed_block_ranges(const struct rcksum_state * rs, int *num,
 
     if (to >= rs->blocks)
         to = rs->blocks;
-    r[0] = from;
-    r[1] = to;
-    n = 1;
-    /* Note r[2*n-1] is the last range in our prospective list */
-
-    for (i = 0; i < rs->numranges; i++) {
-        if (rs->ranges[2 * i] > r[2 * n - 1])
-            continue;
-        if (rs->ranges[2 * i + 1] < from)
-            continue;
-
-        /* Okay, they intersect */
-        if (n == 1 && rs->ranges[2 * i] <= from) {       /* Overlaps the start of our window */
-            r[0] = rs->ranges[2 * i + 1] + 1;
-        }
-        else {
-            /* If the last block that we still (which is the last window end -1, due
-             * to half-openness) then this range just cuts the end of our window */
-            if (rs->ranges[2 * i + 1] >= r[2 * n - 1] - 1) {
-                r[2 * n - 1] = rs->ranges[2 * i];
-            }
-            else {
-                /* In the middle of our range, split it */
-                r[2 * n] = rs->ranges[2 * i + 1] + 1;
-                r[2 * n + 1] = r[2 * n - 1];
-                r[2 * n - 1] = rs->ranges[2 * i];
-                n++;
-                if (n == alloc_n) {
-                    zs_blockid *r2;
-                    alloc_n += 100;
-                    r2 = realloc(r, 2 * alloc_n * sizeof *r);
-                    if (!r2) {
-                        free(r);
-                        return NULL;
-                    }
-                    r = r2;
-                }
+
+    /* Each range runs from a block we need to the next block that we have */
+    while ((from = next_block(rs, from, to, 0)) < to) {
+        if (n == alloc_n) {
+            zs_blockid *r2;
+            alloc_n *= 2;
+            r2 = realloc(r, 2 * alloc_n * sizeof *r);
+            if (!r2) {
+                free(r);
+                return NULL;
             }
+            r = r2;
         }
+        r[2 * n] = from;
+        from = r[2 * n + 1] = next_block(rs, from, to, 1);
+        n++;
     }
-    r = realloc(r, 2 * n * sizeof *r);
-    if (n == 1 && r[0] >= r[1])
-        n = 0;
 
     *num = n;
     return r;
@@ -186,10 +151,6 @@ zs_blockid *rcksum_needed_block_ranges(const struct rcksum_state * rs, int *num,
 
 /* rcksum_blocks_todo
  * Return the number of blocks still needed to complete the target file */
-int rcksum_blocks_todo(const struct rcksum_state *rs) {
-    int i, n = rs->blocks;
-    for (i = 0; i < rs->numranges; i++) {
-        n -= 1 + rs->ranges[2 * i + 1] - rs->ranges[2 * i];
-    }
-    return n;
+zs_blockid rcksum_blocks_todo(const struct rcksum_state *rs) {
+    return rs->blocks - rs->gotblocks;
 }
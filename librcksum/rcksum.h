@@ -16,11 +16,14 @@
 
 /* This is the library interface. Very changeable at this stage. */
 
+#include <limits.h>
 #include <stdio.h>
 
 struct rcksum_state;
 
-typedef int zs_blockid;
+/* Block ids, and counts of blocks; 64-bit, so that large targets with small
+ * blocks are not limited to 2^31 blocks */
+typedef long long zs_blockid;
 
 struct rsum {
 	unsigned short	a;
@@ -29,6 +32,19 @@ struct rsum {
 
 #define CHECKSUM_SIZE 16
 
+/* A target can have up to 8 bytes of rsum per block (rsum_bytes): beyond 4,
+ * the extra bytes are from the high halves of a and b worked out to 32 bits
+ * rather than 16 (the low halves being the rsum as above). These are only
+ * checked where the rsum matches, to save working out the checksum of data
+ * that would not match anyway; which matters for targets with very many
+ * blocks, where rsums alone match by chance much more often. In the control
+ * file, each block's rsum is the last rsum_bytes of the high halves then the
+ * rsum (a then b in each, big-endian). */
+#define RSUM_MAX_BYTES 8
+
+/* Most consecutive blocks that a target can require to match */
+#define RCKSUM_MAX_SEQ_MATCHES 4
+
 struct rcksum_state* rcksum_init(zs_blockid nblocks, size_t blocksize, int rsum_butes, int checksum_bytes, int require_consecutive_matches);
 void rcksum_end(struct rcksum_state* z);
 
@@ -40,10 +56,107 @@ char* rcksum_filename(struct rcksum_state* z);
 int rcksum_filehandle(struct rcksum_state* z);
 
 void rcksum_add_target_block(struct rcksum_state* z, zs_blockid b, struct rsum r, void* checksum);
+/* And the high halves, for a target with more than 4 bytes of rsum */
+void rcksum_add_target_block_high(struct rcksum_state* z, zs_blockid b, struct rsum high);
+/* Or many blocks at once, straight from the control file's format; returns
+ * 0, or -1 if the sizes don't fit the target */
+int rcksum_load_target_blocks(struct rcksum_state* z, zs_blockid from, const unsigned char* buf, zs_blockid nblocks, int rsum_bytes, int checksum_bytes);
+/* Or the rsums and the checksums separately, each in an array of their own */
+int rcksum_load_target_rsums(struct rcksum_state* z, zs_blockid from, const unsigned char* buf, zs_blockid nblocks, int rsum_bytes);
+int rcksum_load_target_checksums(struct rcksum_state* z, zs_blockid from, const unsigned char* buf, zs_blockid nblocks, int checksum_bytes);
+/* Or have them read in place, from a mapping of the control file open on fd,
+ * where they are from offset on, rather than held in memory; the file must
+ * not change until rcksum_end. Returns 0, or -1 if that can't be done. */
+int rcksum_map_target_blocks(struct rcksum_state* z, int fd, off_t offset, int rsum_bytes, int checksum_bytes);
+int rcksum_map_target_arrays(struct rcksum_state* z, int fd, off_t rsums_offset, off_t checksums_offset, int rsum_bytes, int checksum_bytes);
+/* While the checksums are still coming in, only the first nblocks have been
+ * added, and only those are looked for; call again as more are (the blocks
+ * found meanwhile stay found, so source data need only be scanned again for
+ * the rest). Not while there are scanners. */
+void rcksum_set_blocks_loaded(struct rcksum_state* z, zs_blockid nblocks);
 
 int rcksum_submit_blocks(struct rcksum_state* z, const unsigned char* data, zs_blockid bfrom, zs_blockid bto);
-int rcksum_submit_source_data(struct rcksum_state* z, unsigned char* data, size_t len, off_t offset);
-int rcksum_submit_source_file(struct rcksum_state* z, FILE* f, int progress);
+zs_blockid rcksum_submit_source_data(struct rcksum_state* z, unsigned char* data, size_t len, off_t offset);
+/* These return the number of blocks found in the source; or RCKSUM_COMPLETE
+ * if we now have every block of the target, in which case they stop reading
+ * there (and don't read at all if we had them all already) */
+zs_blockid rcksum_submit_source_file(struct rcksum_state* z, FILE* f, int progress);
+zs_blockid rcksum_submit_source_fd(struct rcksum_state* z, int fd, int progress);
+zs_blockid rcksum_submit_source_mmap(struct rcksum_state* z, const unsigned char* data, size_t len, int progress);
+#define RCKSUM_COMPLETE (-2)
+
+/* A scanner scans one stream of source data, as the functions above do, but
+ * with a scan state of its own; so several scanners for the same target can
+ * be used at once, each from its own thread. While there are any, the
+ * rcksum_submit_* functions above must not be used for the same target. The
+ * submit functions return the number of blocks found, as above. */
+struct rcksum_scanner;
+struct rcksum_scanner* rcksum_scanner_new(struct rcksum_state* z);
+zs_blockid rcksum_scanner_submit_data(struct rcksum_scanner* sc, const unsigned char* data, size_t len, off_t offset);
+zs_blockid rcksum_scanner_submit_file(struct rcksum_scanner* sc, FILE* f, int progress);
+void rcksum_scanner_end(struct rcksum_scanner* sc);
+
+/* Strong checksums that the blocks can have; MD4 unless set otherwise (and
+ * the others are truncated to CHECKSUM_SIZE). XXH3 (128-bit) is the fastest
+ * to work out by far; BLAKE3 is the one that resists data made to collide.
+ * rcksum_hash_by_name returns -1 for a name that we don't know. */
+enum rcksum_hash { RCKSUM_HASH_MD4, RCKSUM_HASH_BLAKE3, RCKSUM_HASH_XXH3 };
+int rcksum_hash_by_name(const char* name);
+const char* rcksum_hash_name(int hash);
+void rcksum_set_hash(struct rcksum_state* z, int hash);
+
+/* Number of threads that rcksum_submit_source_file may split each file between */
+void rcksum_set_threads(struct rcksum_state* z, int nthreads);
+
+/* Whether to first look for blocks just at whole-block offsets in each source
+ * file, before the full scan of what's left (on by default) */
+void rcksum_set_aligned_scan(struct rcksum_state* z, int on);
+
+/* A directory to cache the checksums of the aligned blocks of seed files in,
+ * keyed by inode, size and times of the file, so the aligned pass over the
+ * same file next time needn't read it; NULL (the default) for none */
+void rcksum_set_seed_cache(struct rcksum_state* z, const char* dir);
+
+/* An index file holds the target's checksums and the hash tables built from
+ * them; it can be loaded (mapped) in place of adding every block and building
+ * the tables again. rcksum_load_index returns 1 if it loaded an index made
+ * for a target with the same properties, else 0; rcksum_save_index returns 0
+ * on success, and must be done before any blocks are found. It is up to the
+ * caller to name the files so that they are for the same target. */
+int rcksum_load_index(struct rcksum_state* z, const char* path);
+int rcksum_save_index(struct rcksum_state* z, const char* path);
+
+/* Blocks of the target that are the same as each other are all filled in
+ * once any one of them is got, and rcksum_needed_block_ranges only asks for
+ * the first of them; these are found with the tables above, which are built
+ * when first needed, or once all the blocks have been added by
+ * rcksum_build_index (returning 0 on success). */
+int rcksum_build_index(struct rcksum_state* z);
+
+/* Statistics of the work done so far, from rcksum_get_stats. weakhit counts
+ * blocks whose rsums matched (weakmiss, those whose checksums then didn't;
+ * stronghit, those whose checksums did, and that were found along with the
+ * rest of their run), whether in the full scan or the aligned pass; and
+ * checksummed, the checksums worked out of blocks of seed data, which is
+ * only done for weak hits (and not for those read from a seed cache).
+ * chain[i] counts lookups in the block index that looked at from 2^i up to
+ * 2^(i+1)-1 entries (the last, any more than that); and times are in seconds,
+ * CPU time being that of the whole process (so all threads) */
+#define RCKSUM_CHAIN_BUCKETS 8
+enum rcksum_phase {
+    RCKSUM_PHASE_INDEX,         /* building the block index */
+    RCKSUM_PHASE_ALIGNED,       /* the aligned pass over seed files */
+    RCKSUM_PHASE_SCAN,          /* the full scan of seed data */
+    RCKSUM_PHASES
+};
+struct rcksum_stats {
+    long long bytes_scanned;
+    long long hashhit, weakhit, weakmiss, stronghit, checksummed;
+    long long chain[RCKSUM_CHAIN_BUCKETS];
+    long long writes, bytes_written;
+    double wall[RCKSUM_PHASES], cpu[RCKSUM_PHASES];
+};
+void rcksum_get_stats(const struct rcksum_state* z, struct rcksum_stats* stats);
 
 /* This reads back in data which is already known. */
 int rcksum_read_known_data(struct rcksum_state* z, unsigned char* buf, off_t offset, size_t len);
@@ -51,11 +164,17 @@ int rcksum_read_known_data(struct rcksum_state* z, unsigned char* buf, off_t off
 /* rcksum_needed_block_ranges tells you what blocks, within the given range,
  * are still unknown. It returns a list of block ranges in r[]
  * (at most max ranges, so spece for 2*max elements must be there)
- * these are half-open ranges, so r[0] <= x < r[1], r[2] <= x < r[3] etc are needed */
+ * these are half-open ranges, so r[0] <= x < r[1], r[2] <= x < r[3] etc are needed.
+ * to can be past the last block (RCKSUM_ALL_BLOCKS for all up to the end). */
+#define RCKSUM_ALL_BLOCKS LLONG_MAX
 zs_blockid* rcksum_needed_block_ranges(const struct rcksum_state* z, int* num, zs_blockid from, zs_blockid to);
-int rcksum_blocks_todo(const struct rcksum_state*);
+zs_blockid rcksum_blocks_todo(const struct rcksum_state*);
 
 /* For preparing rcksum control files - in both cases len is the block size. */
 struct rsum __attribute__((pure)) rcksum_calc_rsum_block(const unsigned char* data, size_t len);
+struct rsum __attribute__((pure)) rcksum_calc_rsum_high(const unsigned char* data, size_t len);
 void rcksum_calc_checksum(unsigned char *c, const unsigned char* data, size_t len);
+/* Checksums of nblocks consecutive blocks at once, CHECKSUM_SIZE bytes each into c */
+void rcksum_calc_checksums(unsigned char *c, const unsigned char* data, size_t nblocks, size_t blocksize);
+void rcksum_calc_hash_checksums(int hash, unsigned char *c, const unsigned char* data, size_t nblocks, size_t blocksize);
 
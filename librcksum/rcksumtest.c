@@ -0,0 +1,1769 @@
+/*
+ *   rcksum/lib - library for using the rsync algorithm to determine
+ *               which parts of a file you have and which you need.
+ *   Copyright (C) 2004,2005,2009 Colin Phipps <cph@moria.org.uk>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* Checks that the rolling checksum search finds the blocks that it should,
+ * that all the roll kernels agree with each other, and that splitting the
+ * search between threads works; that the MD4, BLAKE3 and XXH3 kernels are
+ * right; that the known blocks are tracked correctly, even past 2^32 of them;
+ * that the block index takes 8 bytes a slot, and a third more slots than
+ * blocks, and holds any block's id in a slot; that the quick pass over the
+ * aligned blocks of a seed finds what it should; that scanning stops once
+ * there is nothing left to find; and that a saved
+ * index of the target's checksums loads back to find the same, as does one of
+ * a seed's, and one that has been damaged is not loaded; that several scanners
+ * used at once find what scanning one seed after another does; that wide rsums
+ * save checksumming blocks; and that blocks of the target that are the same as
+ * others are only fetched once, are left out of the hash where they can be,
+ * and are linked in groups of just those that are the same, which blocks that
+ * only share truncated checksums are not put in; and that loading the
+ * checksums in bulk gets the same as one at a time, as does reading them
+ * in place from a control file, whether as records or as separate arrays; and
+ * that a seed scanned while only some of the checksums are in, and again once
+ * they all are, ends up finding the same. */
+
+#include "zsglobal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <pthread.h>
+
+#include "rcksum.h"
+#include "blake3.h"
+#include "xxh3.h"
+#include "internal.h"
+
+#define BLOCKSIZE 1024
+#define NBLOCKS 1500
+
+static unsigned long long rng = 88172645463325252ULL;
+
+/* Small deterministic PRNG (xorshift64) so runs are reproducible */
+static unsigned next_rand(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return (unsigned)(rng >> 32);
+}
+
+static void fill_random(unsigned char *p, size_t len) {
+    while (len--)
+        *p++ = next_rand();
+}
+
+/* make_target(target[], hash, rsum_bytes, checksum_bytes, seq_matches)
+ * Returns an rcksum_state loaded with the checksums of the given target data */
+static struct rcksum_state *make_target(const unsigned char *target, int hash,
+                                        int rsum_bytes, int checksum_bytes,
+                                        int seq_matches) {
+    struct rcksum_state *z = rcksum_init(NBLOCKS, BLOCKSIZE, rsum_bytes,
+                                         checksum_bytes, seq_matches);
+    zs_blockid id;
+
+    if (!z) {
+        fprintf(stderr, "rcksum_init failed\n");
+        exit(1);
+    }
+    rcksum_set_hash(z, hash);
+    for (id = 0; id < NBLOCKS; id++) {
+        unsigned char checksum[CHECKSUM_SIZE];
+        const unsigned char *p = target + id * BLOCKSIZE;
+
+        rcksum_calc_hash_checksums(hash, checksum, p, 1, BLOCKSIZE);
+        rcksum_add_target_block(z, id, rcksum_calc_rsum_block(p, BLOCKSIZE),
+                                checksum);
+        rcksum_add_target_block_high(z, id,
+                                     rcksum_calc_rsum_high(p, BLOCKSIZE));
+    }
+    return z;
+}
+
+/* check_kernels_agree(z)
+ * Run every roll kernel over the same random data, and check that they
+ * calculate the same rsums as the plain C one. */
+static int check_kernels_agree(const struct rcksum_state *z) {
+    static const int lanes[] = { 8, 16 };
+    enum { N = 1000 };
+    unsigned char *data = malloc(N + z->context);
+    unsigned i;
+    int rc = 0;
+
+    fill_random(data, N + z->context);
+
+    for (i = 0; i < sizeof(lanes) / sizeof(lanes[0]); i++) {
+        static struct rsum r0[2][N], r1[2][N];
+        struct rsum r[2][2];
+        int j, n = N - next_rand() % 32;
+
+        r[0][0] = r[1][0] = rcksum_calc_rsum_block(data, BLOCKSIZE);
+        r[0][1] = r[1][1] = rcksum_calc_rsum_block(data + BLOCKSIZE, BLOCKSIZE);
+        select_roll_kernel(1)(z, data, n, r[0], r0[0], r1[0]);
+        select_roll_kernel(lanes[i])(z, data, n, r[1], r0[1], r1[1]);
+
+        for (j = 0; j < n; j++) {
+            struct rsum c = rcksum_calc_rsum_block(data + j, BLOCKSIZE);
+            if (memcmp(&c, &r0[0][j], sizeof c)
+                || memcmp(&r0[0][j], &r0[1][j], sizeof c)
+                || memcmp(&r1[0][j], &r1[1][j], sizeof c)) {
+                fprintf(stderr, "%d-lane roll kernel wrong at offset %d\n",
+                        lanes[i], j);
+                rc = 1;
+                break;
+            }
+        }
+        if (memcmp(r[0], r[1], sizeof r[0])) {
+            fprintf(stderr, "%d-lane roll kernel ended wrong\n", lanes[i]);
+            rc = 1;
+        }
+    }
+    free(data);
+    return rc;
+}
+
+/* check_checksums_agree()
+ * Calculate checksums of runs of blocks with each MD4, BLAKE3 and XXH3 kernel,
+ * and
+ * check that they agree with the checksums calculated one block at a time. */
+static int check_checksums_agree(void) {
+    static const int lanes[] = { 1, 4, 8, 16 };
+    static const size_t blocksizes[] = { 64, 1024, 100, 4096 };
+    enum { N = 40 };
+    unsigned char *data = malloc(N * 4096);
+    unsigned char c[N][CHECKSUM_SIZE], c1[BLAKE3_OUT_LEN];
+    unsigned i, j, n, k;
+    int hash, rc = 0;
+
+    fill_random(data, N * 4096);
+
+    for (hash = RCKSUM_HASH_MD4; hash <= RCKSUM_HASH_XXH3; hash++)
+        for (i = 0; i < sizeof(lanes) / sizeof(lanes[0]); i++)
+            for (j = 0; j < sizeof(blocksizes) / sizeof(blocksizes[0]); j++)
+                for (n = 0; n <= N; n += 1 + n / 8) {
+                    memset(c, 0, sizeof c);
+                    calc_checksums(hash, c[0], data, n, blocksizes[j], lanes[i]);
+                    for (k = 0; k < N; k++) {
+                        memset(c1, 0, sizeof c1);
+                        if (k < n && hash == RCKSUM_HASH_MD4)
+                            rcksum_calc_checksum(c1, data + k * blocksizes[j],
+                                                 blocksizes[j]);
+                        else if (k < n && hash == RCKSUM_HASH_BLAKE3)
+                            blake3(c1, data + k * blocksizes[j], blocksizes[j]);
+                        else if (k < n)
+                            xxh3_128(c1, data + k * blocksizes[j],
+                                     blocksizes[j]);
+                        if (memcmp(c[k], c1, CHECKSUM_SIZE)) {
+                            fprintf(stderr, "%d-lane %s wrong for block %u of "
+                                    "%u, blocksize %u\n", lanes[i],
+                                    rcksum_hash_name(hash), k, n,
+                                    (unsigned)blocksizes[j]);
+                            rc = 1;
+                            break;
+                        }
+                    }
+                }
+    free(data);
+    return rc;
+}
+
+/* check_blake3()
+ * Check our BLAKE3 against the published test vectors (for input bytes
+ * counting up mod 251), for single and multiple chunk inputs. */
+static int check_blake3(void) {
+    static const struct {
+        size_t len;
+        const char *hash;
+    } vectors[] = {
+        { 0, "af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262" },
+        { 1, "2d3adedff11b61f14c886e35afa036736dcd87a74d27b5c1510225d0f592e213" },
+        { 1024, "42214739f095a406f3fc83deb889744ac00df831c10daa55189b5d121c855af7" },
+        { 1025, "d00278ae47eb27b34faecf67b4fe263f82d5412916c1ffd97c8cb7fb814b8444" },
+        { 2048, "e776b6028c7cd22a4d0ba182a8bf62205d2ef576467e838ed6f2529b85fba24a" },
+        { 3072, "b98cb0ff3623be03326b373de6b9095218513e64f1ee2edd2525c7ad1e5cffd2" },
+        { 102400, "bc3e3d41a1146b069abffad3c0d44860cf664390afce4d9661f7902e7943e085" },
+    };
+    unsigned char *data = malloc(102400);
+    unsigned i, j;
+    int rc = 0;
+
+    for (i = 0; i < 102400; i++)
+        data[i] = i % 251;
+    for (i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+        unsigned char out[BLAKE3_OUT_LEN];
+        char hex[2 * BLAKE3_OUT_LEN + 1];
+
+        blake3(out, data, vectors[i].len);
+        for (j = 0; j < BLAKE3_OUT_LEN; j++)
+            sprintf(hex + 2 * j, "%02x", out[j]);
+        if (strcmp(hex, vectors[i].hash)) {
+            fprintf(stderr, "BLAKE3 of %u bytes is %s\n",
+                    (unsigned)vectors[i].len, hex);
+            rc = 1;
+        }
+    }
+    free(data);
+    return rc;
+}
+
+/* check_xxh3()
+ * Check our XXH3-128 against the reference implementation's output (for input
+ * bytes counting up mod 251), at each of the sizes where it changes method,
+ * and over several blocks of stripes. */
+static int check_xxh3(void) {
+    static const struct {
+        size_t len;
+        const char *hash;
+    } vectors[] = {
+        { 0, "99aa06d3014798d86001c324468d497f" },
+        { 1, "a6cd5e9392000f6ac44bdff4074eecdb" },
+        { 3, "e3b55f57945a17cf5f4299fc161c9cbb" },
+        { 4, "eb70bf5fc779e9e6a6111d53e80a3db5" },
+        { 8, "e1e4432a62217fe4cfd50c61c8bb98c1" },
+        { 9, "16c769d83e4aebce907931979dca3746" },
+        { 16, "72950631827607e2842812cc870dcae2" },
+        { 17, "685bc458b37d057fc06e233df7729217" },
+        { 128, "14792fc3af88dc6c05321a0b64d67b41" },
+        { 129, "dd5e74ac6b45f54ebc30b63382b09a3b" },
+        { 240, "65b5be86da5540e7c92b68e16f83bbb6" },
+        { 241, "1da1cb61bcb8a2a102e8cd95421c6d02" },
+        { 1024, "d0ac1f7b93bf57b9e5d78bafa45b2aa5" },
+        { 2048, "a5141efedfefc1af25339063db861586" },
+        { 102400, "ecd387d36185351b1428e17f1cac2837" },
+    };
+    unsigned char *data = malloc(102400);
+    unsigned i, j;
+    int rc = 0;
+
+    for (i = 0; i < 102400; i++)
+        data[i] = i % 251;
+    for (i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+        unsigned char out[XXH3_OUT_LEN];
+        char hex[2 * XXH3_OUT_LEN + 1];
+
+        xxh3_128(out, data, vectors[i].len);
+        for (j = 0; j < XXH3_OUT_LEN; j++)
+            sprintf(hex + 2 * j, "%02x", out[j]);
+        if (strcmp(hex, vectors[i].hash)) {
+            fprintf(stderr, "XXH3-128 of %u bytes is %s\n",
+                    (unsigned)vectors[i].len, hex);
+            rc = 1;
+        }
+    }
+    free(data);
+    return rc;
+}
+
+/* check_large_target()
+ * A target of more than 2^32 blocks, with a few runs of blocks known, at and
+ * either side of 2^31 and 2^32 and at the end; only the known blocks bitmap
+ * is there, which is mostly never touched, so costs little memory. The count
+ * of blocks to do, and the needed ranges, must be right. */
+static int check_large_target(void) {
+    const zs_blockid nblocks = ((zs_blockid) 5 << 30) + 77;
+    const zs_blockid got[][2] = {
+        { 0, 1 },
+        { ((zs_blockid) 1 << 31) - 1, ((zs_blockid) 1 << 31) + 2 },
+        { ((zs_blockid) 1 << 32) - 64, ((zs_blockid) 1 << 32) + 200 },
+        { nblocks - 3, nblocks }
+    };
+    const int ngot = sizeof got / sizeof got[0];
+    struct rcksum_state z;
+    zs_blockid todo = nblocks, id, *r;
+    int i, n, rc = 0;
+
+    memset(&z, 0, sizeof z);
+    z.blocks = nblocks;
+    z.known = calloc(KNOWN_WORDS(nblocks) + 2 * KNOWN_SUMMARY_WORDS(nblocks),
+                     sizeof *(z.known));
+    if (!z.known) {
+        fprintf(stderr, "not enough memory to check a large target\n");
+        return 0;
+    }
+    z.known_any = z.known + KNOWN_WORDS(nblocks);
+    z.known_all = z.known_any + KNOWN_SUMMARY_WORDS(nblocks);
+
+    for (i = 0; i < ngot; i++)
+        for (id = got[i][0]; id < got[i][1]; id++) {
+            add_known_block(&z, id);
+            todo--;
+        }
+    if (rcksum_blocks_todo(&z) != todo
+        || !already_got_block(&z, ((zs_blockid) 1 << 32) + 199)
+        || already_got_block(&z, ((zs_blockid) 1 << 32) + 200)) {
+        fprintf(stderr, "large target: %lld blocks todo, not %lld\n",
+                rcksum_blocks_todo(&z), todo);
+        rc = 1;
+    }
+
+    /* Needed: just the gaps in between */
+    r = rcksum_needed_block_ranges(&z, &n, 0, RCKSUM_ALL_BLOCKS);
+    if (!r || n != ngot - 1)
+        rc = 1;
+    for (i = 0; i < n && !rc; i++)
+        if (r[2 * i] != got[i][1] || r[2 * i + 1] != got[i + 1][0])
+            rc = 1;
+    free(r);
+
+    /* And in part of it */
+    r = rcksum_needed_block_ranges(&z, &n, (zs_blockid) 1 << 32,
+                                   ((zs_blockid) 1 << 32) + 300);
+    if (!r || n != 1 || r[0] != ((zs_blockid) 1 << 32) + 200
+        || r[1] != ((zs_blockid) 1 << 32) + 300)
+        rc = 1;
+    free(r);
+
+    if (rc)
+        fprintf(stderr, "large target: wrong needed block ranges\n");
+    free(z.known);
+    return rc;
+}
+
+/* check_slot_size()
+ * The block index should take 8 bytes a slot, with a third more slots than
+ * blocks; and its slots should still hold every block id, and as much of
+ * the tag as fits, past 2^32 blocks. */
+static int check_slot_size(void) {
+    const zs_blockid sizes[] = {
+        NBLOCKS, ((zs_blockid) 1 << 32) - 2, ((zs_blockid) 1 << 32) - 1,
+        (zs_blockid) 5 << 30
+    };
+    const unsigned int tag = 0xdeadbeef;
+    struct rcksum_state z;
+    int i, rc = 0;
+
+    if (sizeof *(z.rsum_hash) != 8) {
+        fprintf(stderr, "block index slots take %d bytes, not 8\n",
+                (int) sizeof *(z.rsum_hash));
+        return 1;
+    }
+    for (i = 0; i < (int) (sizeof sizes / sizeof sizes[0]); i++) {
+        zs_blockid last;
+        uint64_t s;
+
+        memset(&z, 0, sizeof z);
+        z.blocks = sizes[i];
+        if (!size_hash_tables(&z)) {
+            if (sizeof(size_t) > 4)
+                rc = 1;
+            continue;
+        }
+        last = z.blocks - 1;
+        s = make_slot(&z, last, tag);
+        if (z.hashslots <= (size_t) z.blocks
+            || z.hashslots * sizeof *(z.rsum_hash) > (size_t) z.blocks * 11
+            || z.hash_id_bits != (last < ((zs_blockid) 1 << 32) - 2 ? 32 : 33)
+            || slot_id(&z, s) != last || !slot_tag_is(&z, s, tag)
+            || slot_tag_is(&z, s, tag ^ (1u << (63 - z.hash_id_bits)))
+            || slot_id(&z, make_slot(&z, SLOT_EMPTY, tag)) != SLOT_EMPTY
+            || slot_id(&z, make_slot(&z, SLOT_DELETED, tag)) != SLOT_DELETED) {
+            fprintf(stderr, "block index for %lld blocks: %lu slots of %d "
+                    "bits for the id\n", (long long) z.blocks,
+                    (unsigned long) z.hashslots, z.hash_id_bits);
+            rc = 1;
+        }
+    }
+    return rc;
+}
+
+/* check_needed_ranges()
+ * Mark blocks known in various patterns, and check the needed block ranges
+ * and count of blocks to do against what they should be. */
+static int check_needed_ranges(void) {
+    enum { N = 20000 };
+    static char known[N];
+    int pattern, rc = 0;
+
+    for (pattern = 0; pattern < 4 && !rc; pattern++) {
+        struct rcksum_state *z = rcksum_init(N, BLOCKSIZE, 4, 8, 1);
+        int i, n, todo = N;
+        zs_blockid from = next_rand() % 100, to = N - next_rand() % 100;
+        zs_blockid *r;
+
+        memset(known, 0, sizeof known);
+        for (i = 0; i < N; i++) {
+            /* Scattered blocks; runs; nearly everything; everything */
+            int want = pattern == 0 ? !(next_rand() % 3)
+                : pattern == 1 ? (i / 700) % 2 && i % 4096 != 5
+                : pattern == 2 ? i != 64 * 64 * 2 + 3 : 1;
+            if (want) {
+                add_known_block(z, i);
+                if (!(next_rand() % 5))
+                    add_known_block(z, i);
+                known[i] = 1;
+                todo--;
+            }
+        }
+        if (rcksum_blocks_todo(z) != todo) {
+            fprintf(stderr, "pattern %d: %lld blocks todo, not %d\n",
+                    pattern, rcksum_blocks_todo(z), todo);
+            rc = 1;
+        }
+
+        /* The ranges must be in order, not touching, and cover exactly the
+         * unknown blocks in [from, to) */
+        r = rcksum_needed_block_ranges(z, &n, from, to + N);
+        to = N;
+        for (i = 0; i < n && !rc; i++)
+            if (r[2 * i] >= r[2 * i + 1] || r[2 * i] < from
+                || (i > 0 && r[2 * i] <= r[2 * i - 1]))
+                rc = 1;
+        for (i = from; i < to && !rc; i++) {
+            int j, needed = 0;
+
+            for (j = 0; j < n; j++)
+                if (i >= r[2 * j] && i < r[2 * j + 1])
+                    needed = 1;
+            if (needed == known[i])
+                rc = 1;
+        }
+        if (rc)
+            fprintf(stderr, "pattern %d: wrong needed block ranges\n",
+                    pattern);
+        free(r);
+        rcksum_end(z);
+    }
+    return rc;
+}
+
+/* stream = open_pipe_from(file)
+ * Returns a stream reading the content of the given file through a pipe, so
+ * that it can only be read serially */
+static FILE *open_pipe_from(FILE *f) {
+    int fds[2];
+
+    if (pipe(fds) != 0)
+        return NULL;
+    switch (fork()) {
+    case -1:
+        return NULL;
+    case 0:
+        {
+            char buf[4096];
+            size_t len;
+
+            close(fds[0]);
+            rewind(f);
+            while ((len = fread(buf, 1, sizeof buf, f)) > 0)
+                if (write(fds[1], buf, len) != (ssize_t) len)
+                    _exit(1);
+            _exit(0);
+        }
+    default:
+        close(fds[1]);
+        return fdopen(fds[0], "r");
+    }
+}
+
+/* check_known_data(self, target[])
+ * Checks all the blocks that we were told we have are right. Returns the
+ * number of blocks still needed, or -1 if any were wrong. */
+static int check_known_data(struct rcksum_state *z,
+                            const unsigned char *target) {
+    unsigned char buf[BLOCKSIZE];
+    int todo = rcksum_blocks_todo(z);
+    int i, n;
+    zs_blockid *ranges = rcksum_needed_block_ranges(z, &n, 0, NBLOCKS);
+
+    for (i = 0; i < NBLOCKS; i++) {
+        int j, needed = 0;
+
+        for (j = 0; j < n; j++)
+            if (i >= ranges[2 * j] && i < ranges[2 * j + 1])
+                needed = 1;
+        if (needed)
+            continue;
+        if (rcksum_read_known_data(z, buf, (off_t)i * BLOCKSIZE, BLOCKSIZE) != BLOCKSIZE
+            || memcmp(buf, target + i * BLOCKSIZE, BLOCKSIZE)) {
+            fprintf(stderr, "wrong data for block %d\n", i);
+            todo = -1;
+        }
+    }
+    free(ranges);
+    return todo;
+}
+
+/* scan_seed(target[], seed_stream, hash, max_lanes, seq_matches, threads, piped, aligned, &stats)
+ * Scans the seed against the target with the given checksum, roll kernel and
+ * number of threads, checking that the data obtained is correct; reading the
+ * seed through a pipe if piped is set, and with the aligned pass first if
+ * aligned is set. Returns the number of blocks still needed. */
+static int scan_seed(const unsigned char *target, FILE *seed, int hash,
+                     int max_lanes, int seq_matches, int threads, int piped,
+                     int aligned, int *hashhit) {
+    struct rcksum_state *z = make_target(target, hash, 4, 8, seq_matches);
+    int todo, i;
+
+    z->roll = select_roll_kernel(max_lanes);
+    rcksum_set_threads(z, threads);
+    rcksum_set_aligned_scan(z, aligned);
+    if (piped) {
+        FILE *f = open_pipe_from(seed);
+
+        if (!f) {
+            perror("pipe");
+            exit(1);
+        }
+        rcksum_submit_source_file(z, f, 0);
+        fclose(f);
+        wait(NULL);
+    }
+    else {
+        rewind(seed);
+        rcksum_submit_source_file(z, seed, 0);
+    }
+    todo = check_known_data(z, target);
+    *hashhit = z->scan.stats.hashhit;
+
+    {   /* The stats should add up: every offset of the seed looked at, and
+         * every block found written out; and, with no seed cache, each block
+         * found checksummed, and each checksummed a weak hit first */
+        struct rcksum_stats st;
+        long long found = NBLOCKS - rcksum_blocks_todo(z);
+        long long chains = 0;
+
+        rcksum_get_stats(z, &st);
+        for (i = 0; i < RCKSUM_CHAIN_BUCKETS; i++)
+            chains += st.chain[i];
+        fseek(seed, 0, SEEK_END);
+        if (st.bytes_scanned != ftell(seed)
+            || st.bytes_written < found * BLOCKSIZE || st.stronghit < found
+            || st.weakhit < st.weakmiss || (found && !chains)) {
+            fprintf(stderr, "stats don't add up: scanned %lld of %ld, wrote "
+                    "%lld for %lld blocks\n", st.bytes_scanned, ftell(seed),
+                    st.bytes_written, found);
+            todo = -1;
+        }
+        if (st.stronghit > st.checksummed || st.checksummed > st.weakhit) {
+            fprintf(stderr, "stats don't add up: %lld strong hits, %lld "
+                    "checksummed, %lld weak hits%s\n", st.stronghit,
+                    st.checksummed, st.weakhit, aligned ? " (aligned)" : "");
+            todo = -1;
+        }
+    }
+    rcksum_end(z);
+    return todo;
+}
+
+/* check_aligned_scan(target[])
+ * For a seed that is the target with a few changes made in place, and then
+ * a few bytes inserted towards the end, the aligned pass (with the full scan
+ * of what it leaves) should find just what the full scan does. */
+static int check_aligned_scan(const unsigned char *target) {
+    FILE *seed = tmpfile();
+    int seq_matches, i, rc = 0;
+
+    if (!seed) {
+        perror("tmpfile");
+        return 1;
+    }
+    for (i = 0; i < NBLOCKS; i++) {
+        unsigned char block[BLOCKSIZE];
+
+        memcpy(block, target + i * BLOCKSIZE, BLOCKSIZE);
+        if (!(next_rand() % 20))
+            fill_random(block + next_rand() % BLOCKSIZE, 1);
+        if (i == NBLOCKS - 100)
+            fwrite("edit", 1, 4, seed);
+        fwrite(block, BLOCKSIZE, 1, seed);
+    }
+
+    for (seq_matches = 1; seq_matches <= 2; seq_matches++) {
+        int hitsfull, hitsaligned;
+        int todofull = scan_seed(target, seed, RCKSUM_HASH_MD4, ROLL_ANY_LANES,
+                                 seq_matches, 1, 0, 0, &hitsfull);
+        int todoaligned = scan_seed(target, seed, RCKSUM_HASH_MD4,
+                                    ROLL_ANY_LANES, seq_matches, 1, 0, 1,
+                                    &hitsaligned);
+
+        if (todofull < 0 || todoaligned != todofull) {
+            fprintf(stderr, "aligned scan got %d blocks todo, full scan %d\n",
+                    todoaligned, todofull);
+            rc = 1;
+        }
+    }
+    fclose(seed);
+    return rc;
+}
+
+/* check_stops_when_complete(target[])
+ * Scanning a seed that has all of the target, followed by junk, should stop
+ * once everything is found, and say so; as should scanning anything after. */
+static int check_stops_when_complete(const unsigned char *target) {
+    FILE *seed = tmpfile();
+    int threads, piped, rc = 0;
+
+    if (!seed) {
+        perror("tmpfile");
+        return 1;
+    }
+    fwrite(target, BLOCKSIZE, NBLOCKS, seed);
+    {
+        static unsigned char junk[256 * BLOCKSIZE];
+        fill_random(junk, sizeof junk);
+        fwrite(junk, 1, sizeof junk, seed);
+    }
+
+    for (threads = 1; threads <= 4; threads += 3)
+        for (piped = 0; piped <= (threads == 1); piped++) {
+            struct rcksum_state *z = make_target(target, RCKSUM_HASH_MD4,
+                                                 4, 8, 2);
+            zs_blockid got, again;
+
+            rcksum_set_threads(z, threads);
+            if (piped) {
+                FILE *f = open_pipe_from(seed);
+                char rest[BLOCKSIZE];
+                int n = 0;
+
+                if (!f) {
+                    perror("pipe");
+                    exit(1);
+                }
+                got = rcksum_submit_source_file(z, f, 0);
+
+                /* We should have stopped well before the end */
+                while (fread(rest, 1, sizeof rest, f) == sizeof rest)
+                    n++;
+                fclose(f);
+                wait(NULL);
+                if (n < 200) {
+                    fprintf(stderr, "read on past the end of the target\n");
+                    rc = 1;
+                }
+            }
+            else {
+                rewind(seed);
+                got = rcksum_submit_source_file(z, seed, 0);
+            }
+            rewind(seed);
+            again = rcksum_submit_source_file(z, seed, 0);
+            if (got != RCKSUM_COMPLETE || again != RCKSUM_COMPLETE
+                || rcksum_blocks_todo(z)) {
+                fprintf(stderr, "scan with %d threads%s returned %lld, %lld, "
+                        "%lld blocks todo\n", threads, piped ? ", piped" : "",
+                        got, again, rcksum_blocks_todo(z));
+                rc = 1;
+            }
+            rcksum_end(z);
+        }
+    fclose(seed);
+    return rc;
+}
+
+/* check_index(target[], seed_stream)
+ * A target loaded from a saved index should find just what one loaded block
+ * by block does; and an index should not load for a different target. */
+static int check_index(const unsigned char *target, FILE *seed) {
+    char path[] = "rcksumtest-index-XXXXXX";
+    struct rcksum_state *z = make_target(target, RCKSUM_HASH_MD4, 4, 8, 2);
+    int fd = mkstemp(path);
+    int hits, todo, rc = 0;
+
+    if (fd == -1) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+    if (rcksum_save_index(z, path) != 0) {
+        fprintf(stderr, "could not save index\n");
+        rc = 1;
+    }
+    rcksum_end(z);
+
+    todo = scan_seed(target, seed, RCKSUM_HASH_MD4, ROLL_ANY_LANES, 2, 1, 0, 1,
+                     &hits);
+    z = rcksum_init(NBLOCKS, BLOCKSIZE, 4, 8, 2);
+    rcksum_set_hash(z, RCKSUM_HASH_MD4);
+    if (rcksum_load_index(z, path) != 1) {
+        fprintf(stderr, "could not load index\n");
+        rc = 1;
+    }
+    else {
+        int todoindex;
+
+        rewind(seed);
+        rcksum_submit_source_file(z, seed, 0);
+        todoindex = check_known_data(z, target);
+        if (todoindex != todo) {
+            fprintf(stderr, "indexed target got %d blocks todo, not %d\n",
+                    todoindex, todo);
+            rc = 1;
+        }
+    }
+    rcksum_end(z);
+
+    z = rcksum_init(NBLOCKS, BLOCKSIZE, 4, 16, 2);
+    rcksum_set_hash(z, RCKSUM_HASH_MD4);
+    if (rcksum_load_index(z, path) != 0) {
+        fprintf(stderr, "loaded index for a different target\n");
+        rc = 1;
+    }
+    rcksum_end(z);
+
+    unlink(path);
+    return rc;
+}
+
+/* scan_cached(target[], seed_stream, dir)
+ * Scans the seed against the target, with the aligned pass, and the seed
+ * cache in dir; returns the number of blocks still needed, or -1 if any found
+ * were wrong. */
+static int scan_cached(const unsigned char *target, FILE *seed,
+                       const char *dir) {
+    struct rcksum_state *z = make_target(target, RCKSUM_HASH_MD4, 4, 8, 2);
+    int todo;
+
+    rcksum_set_seed_cache(z, dir);
+    fflush(seed);
+    rewind(seed);
+    rcksum_submit_source_file(z, seed, 0);
+    todo = check_known_data(z, target);
+    rcksum_end(z);
+    return todo;
+}
+
+/* count_files(dir, remove)
+ * Returns how many files there are in dir, removing them if remove is set */
+static int count_files(const char *dir, int remove) {
+    DIR *d = opendir(dir);
+    struct dirent *e;
+    int n = 0;
+
+    if (!d)
+        return -1;
+    while ((e = readdir(d)) != NULL) {
+        char *path;
+
+        if (e->d_name[0] == '.')
+            continue;
+        n++;
+        if (remove) {
+            path = malloc(strlen(dir) + strlen(e->d_name) + 2);
+            if (path) {
+                sprintf(path, "%s/%s", dir, e->d_name);
+                unlink(path);
+                free(path);
+            }
+        }
+    }
+    closedir(d);
+    return n;
+}
+
+/* check_seed_cache(target[])
+ * The aligned pass should find the same with the checksums from a seed cache
+ * as it does reading the seed; both when the cache is first made, and when
+ * it is used again after. And the cache must not be used once the seed has
+ * changed. */
+static int check_seed_cache(const unsigned char *target) {
+    char dir[] = "rcksumtest-seeds-XXXXXX";
+    FILE *seed = tmpfile();
+    int pass, i, rc = 0;
+
+    if (!seed || !mkdtemp(dir)) {
+        perror("setup");
+        return 1;
+    }
+    for (i = 0; i < NBLOCKS; i++) {
+        unsigned char block[BLOCKSIZE];
+
+        memcpy(block, target + i * BLOCKSIZE, BLOCKSIZE);
+        if (!(next_rand() % 20))
+            fill_random(block + next_rand() % BLOCKSIZE, 1);
+        fwrite(block, BLOCKSIZE, 1, seed);
+    }
+
+    for (pass = 0; pass < 3; pass++) {
+        int hits, todo, todocached;
+
+        /* The last time round, change the seed (so its size differs) */
+        if (pass == 2) {
+            fseek(seed, 10 * BLOCKSIZE, SEEK_SET);
+            fwrite(target + 20 * BLOCKSIZE, BLOCKSIZE, 50, seed);
+            fseek(seed, 0, SEEK_END);
+            fwrite(target, BLOCKSIZE, 1, seed);
+        }
+        todo = scan_seed(target, seed, RCKSUM_HASH_MD4, ROLL_ANY_LANES, 2, 1,
+                         0, 1, &hits);
+        todocached = scan_cached(target, seed, dir);
+        if (todocached < 0 || todocached != todo) {
+            fprintf(stderr, "seed cache pass %d got %d blocks todo, not %d\n",
+                    pass, todocached, todo);
+            rc = 1;
+        }
+        if (count_files(dir, 0) != 1) {
+            fprintf(stderr, "seed cache has %d files\n", count_files(dir, 0));
+            rc = 1;
+        }
+    }
+
+    count_files(dir, 1);
+    rmdir(dir);
+    fclose(seed);
+    return rc;
+}
+
+/* check_wide_rsums(target[])
+ * Against a target with bytes 200 and 72 at offsets 0 and 512 of each block,
+ * a seed of the same blocks with those two bytes swapped has the same rsums
+ * (the difference in b is 65536), but not the same high halves. So with a
+ * 4-byte rsum every block of the seed has to be checksummed, but with all 8
+ * none need be; and the target itself must still be found. */
+static int check_wide_rsums(const unsigned char *target) {
+    static unsigned char wide[NBLOCKS * BLOCKSIZE], seed[NBLOCKS * BLOCKSIZE];
+    long long checksummed[2];
+    int i, rc = 0;
+
+    memcpy(wide, target, sizeof wide);
+    for (i = 0; i < NBLOCKS; i++) {
+        wide[i * BLOCKSIZE] = 200;
+        wide[i * BLOCKSIZE + 512] = 72;
+    }
+    memcpy(seed, wide, sizeof seed);
+    for (i = 0; i < NBLOCKS; i++) {
+        seed[i * BLOCKSIZE] = 72;
+        seed[i * BLOCKSIZE + 512] = 200;
+    }
+
+    for (i = 0; i < 2; i++) {
+        struct rcksum_state *z = make_target(wide, RCKSUM_HASH_MD4,
+                                             i ? RSUM_MAX_BYTES : 4, 16, 1);
+        struct rcksum_stats st;
+
+        rcksum_set_aligned_scan(z, 0);
+        rcksum_submit_source_mmap(z, seed, sizeof seed, 0);
+        rcksum_get_stats(z, &st);
+        checksummed[i] = st.checksummed;
+        if (rcksum_blocks_todo(z) != NBLOCKS) {
+            fprintf(stderr, "found blocks in a seed with none\n");
+            rc = 1;
+        }
+        if (i && (rcksum_submit_source_mmap(z, wide, sizeof wide, 0)
+                  != RCKSUM_COMPLETE || check_known_data(z, wide) != 0)) {
+            fprintf(stderr, "wide rsums didn't find the target\n");
+            rc = 1;
+        }
+        rcksum_end(z);
+    }
+    if (checksummed[0] < NBLOCKS || checksummed[1] > NBLOCKS / 10) {
+        fprintf(stderr, "checksummed %lld blocks with 4-byte rsums, %lld "
+                "with 8\n", checksummed[0], checksummed[1]);
+        rc = 1;
+    }
+    return rc;
+}
+
+/* check_more_seq_matches(target[], seed_stream, todo2)
+ * Targets requiring 3 and 4 consecutive matching blocks find the right data,
+ * and no more than requiring 2 does (todo2 blocks left); the target itself
+ * as the seed is found whole; and more than RCKSUM_MAX_SEQ_MATCHES is refused. */
+static int check_more_seq_matches(const unsigned char *target, FILE *seed,
+                                  int todo2) {
+    int seq_matches, rc = 0;
+
+    for (seq_matches = 3; seq_matches <= RCKSUM_MAX_SEQ_MATCHES; seq_matches++) {
+        struct rcksum_state *z;
+        int hits;
+        int todo = scan_seed(target, seed, RCKSUM_HASH_MD4, ROLL_ANY_LANES,
+                             seq_matches, 1, 0, 0, &hits);
+
+        if (todo < todo2 || todo == NBLOCKS) {
+            fprintf(stderr, "seq_matches %d got %d blocks todo, with 2 %d\n",
+                    seq_matches, todo, todo2);
+            rc = 1;
+        }
+        z = make_target(target, RCKSUM_HASH_MD4, 4, 8, seq_matches);
+        rcksum_set_aligned_scan(z, 0);
+        if (rcksum_submit_source_mmap(z, target, NBLOCKS * BLOCKSIZE, 0)
+            != RCKSUM_COMPLETE || check_known_data(z, target) != 0) {
+            fprintf(stderr, "seq_matches %d didn't find the target in "
+                    "itself\n", seq_matches);
+            rc = 1;
+        }
+        rcksum_end(z);
+    }
+    if (rcksum_init(NBLOCKS, BLOCKSIZE, 4, 8, RCKSUM_MAX_SEQ_MATCHES + 1)) {
+        fprintf(stderr, "rcksum_init took too many seq_matches\n");
+        rc = 1;
+    }
+    return rc;
+}
+
+/* write_records(buf[], target[], rsum_bytes, checksum_bytes)
+ * Writes the checksums of the target's blocks into buf[], as they are in a
+ * control file (with MD4 checksums) */
+static void write_records(unsigned char *p, const unsigned char *target,
+                          int rb, int cb) {
+    zs_blockid id;
+
+    for (id = 0; id < NBLOCKS; id++) {
+        const unsigned char *data = target + id * BLOCKSIZE;
+        struct rsum r = rcksum_calc_rsum_block(data, BLOCKSIZE);
+        struct rsum h = rcksum_calc_rsum_high(data, BLOCKSIZE);
+        unsigned long long v = (unsigned long long) h.a << 48
+            | (unsigned long long) h.b << 32 | (unsigned) r.a << 16 | r.b;
+        unsigned char checksum[CHECKSUM_SIZE];
+        int j;
+
+        for (j = rb - 1; j >= 0; j--)
+            *p++ = v >> (8 * j);
+        rcksum_calc_checksum(checksum, data, BLOCKSIZE);
+        memcpy(p, checksum, cb);
+        p += cb;
+    }
+}
+
+/* split_records(rsums[], checksums[], records[], rsum_bytes, checksum_bytes)
+ * Splits records as from write_records into an array of the rsums and one of
+ * the checksums, as in the binary control file */
+static void split_records(unsigned char *rsums, unsigned char *checksums,
+                          const unsigned char *p, int rb, int cb) {
+    zs_blockid id;
+
+    for (id = 0; id < NBLOCKS; id++) {
+        memcpy(rsums + id * rb, p, rb);
+        memcpy(checksums + id * cb, p + rb, cb);
+        p += rb + cb;
+    }
+}
+
+/* check_load_target_blocks(target[])
+ * Loading the blocks' checksums in bulk, as they are in a control file, with
+ * each length of rsum, gives the same tables as adding them one at a time;
+ * as does loading the rsums and checksums from arrays of their own. */
+static int check_load_target_blocks(const unsigned char *target) {
+    static const int lengths[] = { 2, 3, 4, 6, 8 };
+    const int cb = 5, record = RSUM_MAX_BYTES + cb;
+    unsigned char *buf = malloc(2 * NBLOCKS * record);
+    unsigned i;
+    int rc = 0;
+
+    for (i = 0; i < sizeof lengths / sizeof lengths[0] && buf && !rc; i++) {
+        const int rb = lengths[i];
+        struct rcksum_state *z = make_target(target, RCKSUM_HASH_MD4, rb, cb, 2);
+        struct rcksum_state *y = rcksum_init(NBLOCKS, BLOCKSIZE, rb, cb, 2);
+        struct rcksum_state *x = rcksum_init(NBLOCKS, BLOCKSIZE, rb, cb, 2);
+        unsigned char *rsums = buf + NBLOCKS * record;
+        unsigned char *checksums = rsums + NBLOCKS * rb;
+        zs_blockid id;
+
+        write_records(buf, target, rb, cb);
+        split_records(rsums, checksums, buf, rb, cb);
+
+        /* In two parts, to check the offset is right */
+        if (!y || rcksum_load_target_blocks(y, 0, buf, 700, rb, cb) != 0
+            || rcksum_load_target_blocks(y, 700, buf + 700 * (rb + cb),
+                                         NBLOCKS - 700, rb, cb) != 0
+            || rcksum_load_target_blocks(y, 700, buf, NBLOCKS, rb, cb) == 0
+            || memcmp(y->rsums, z->rsums, NBLOCKS * sizeof *(z->rsums))
+            || memcmp(y->checksums, z->checksums, NBLOCKS * cb))
+            rc = 1;
+        if (!x || rcksum_load_target_rsums(x, 0, rsums, 700, rb) != 0
+            || rcksum_load_target_rsums(x, 700, rsums + 700 * rb,
+                                        NBLOCKS - 700, rb) != 0
+            || rcksum_load_target_checksums(x, 0, checksums, NBLOCKS, cb) != 0
+            || rcksum_load_target_checksums(x, 1, checksums, NBLOCKS, cb) == 0
+            || memcmp(x->rsums, z->rsums, NBLOCKS * sizeof *(z->rsums))
+            || memcmp(x->checksums, z->checksums, NBLOCKS * cb))
+            rc = 1;
+        for (id = 0; id < NBLOCKS && z->rsums_high && !rc; id++)
+            if (rsum_high_tag(z, z->rsums_high[id])
+                != rsum_high_tag(y, y->rsums_high[id])
+                || rsum_high_tag(z, z->rsums_high[id])
+                != rsum_high_tag(x, x->rsums_high[id]))
+                rc = 1;
+        if (rc)
+            fprintf(stderr, "loading blocks with %d-byte rsums went wrong\n",
+                    rb);
+        rcksum_end(z);
+        if (y)
+            rcksum_end(y);
+        if (x)
+            rcksum_end(x);
+    }
+    free(buf);
+    return rc;
+}
+
+/* check_map_target_blocks(target[], seed_stream, todo2)
+ * A target whose checksums are read in place from a control file, after some
+ * header, finds just what one loaded into memory does (todo2 blocks left), as
+ * does one loaded from an index saved from it, and one read in place from
+ * separate arrays of the rsums and checksums; and a file too short for all
+ * the blocks isn't mapped. */
+static int check_map_target_blocks(const unsigned char *target, FILE *seed,
+                                   int todo2) {
+    static const int lengths[] = { 4, 8 };
+    const int cb = 8, header = 37;
+    char path[] = "rcksumtest-index-XXXXXX";
+    unsigned char *buf = malloc(header + 2 * NBLOCKS * (RSUM_MAX_BYTES + cb));
+    int fd = mkstemp(path);
+    unsigned i;
+    int rc = 0;
+
+    if (!buf || fd == -1) {
+        perror("setup");
+        free(buf);
+        return 1;
+    }
+    close(fd);
+    for (i = 0; i < sizeof lengths / sizeof lengths[0] && !rc; i++) {
+        const int rb = lengths[i];
+        const size_t len = header + NBLOCKS * (rb + cb);
+        struct rcksum_state *z = rcksum_init(NBLOCKS, BLOCKSIZE, rb, cb, 2);
+        struct rcksum_state *y = rcksum_init(NBLOCKS, BLOCKSIZE, rb, cb, 2);
+        struct rcksum_state *x = rcksum_init(NBLOCKS, BLOCKSIZE, rb, cb, 2);
+        FILE *f = tmpfile();
+        int todomap = -1, todoindex = -1, todoarrays = -1;
+
+        /* The records after the header, then the same as arrays */
+        fill_random(buf, header);
+        write_records(buf + header, target, rb, cb);
+        split_records(buf + len, buf + len + NBLOCKS * rb, buf + header, rb,
+                      cb);
+        if (!z || !y || !x || !f || fwrite(buf, 1, 2 * len - header, f)
+            != 2 * len - header || fflush(f)) {
+            perror("setup");
+            rc = 1;
+        }
+        else if (rcksum_map_target_blocks(z, fileno(f), len + NBLOCKS * rb + 1,
+                                          rb, cb) == 0) {
+            fprintf(stderr, "mapped blocks past the end of the file\n");
+            rc = 1;
+        }
+        else if (rcksum_map_target_blocks(z, fileno(f), header, rb, cb) != 0
+                 || rcksum_save_index(z, path) != 0
+                 || rcksum_load_index(y, path) != 1
+                 || rcksum_map_target_arrays(x, fileno(f), len,
+                                             len + NBLOCKS * rb, rb, cb) != 0) {
+            fprintf(stderr, "could not map blocks, or index them\n");
+            rc = 1;
+        }
+        else {
+            rcksum_set_aligned_scan(z, 0);
+            rcksum_set_aligned_scan(y, 0);
+            rewind(seed);
+            rcksum_submit_source_file(z, seed, 0);
+            todomap = check_known_data(z, target);
+            rewind(seed);
+            rcksum_submit_source_file(y, seed, 0);
+            todoindex = check_known_data(y, target);
+            rcksum_set_aligned_scan(x, 0);
+            rewind(seed);
+            rcksum_submit_source_file(x, seed, 0);
+            todoarrays = check_known_data(x, target);
+            if (todomap != todo2 || todoindex != todo2
+                || todoarrays != todo2) {
+                fprintf(stderr, "mapped %d-byte rsums got %d blocks todo, "
+                        "indexed %d, as arrays %d, not %d\n", rb, todomap,
+                        todoindex, todoarrays, todo2);
+                rc = 1;
+            }
+        }
+        if (f)
+            fclose(f);
+        if (z)
+            rcksum_end(z);
+        if (y)
+            rcksum_end(y);
+        if (x)
+            rcksum_end(x);
+    }
+    unlink(path);
+    free(buf);
+    return rc;
+}
+
+/* count_needed(self)
+ * Returns the number of blocks in the needed block ranges */
+static int count_needed(const struct rcksum_state *z) {
+    int i, n, needed = 0;
+    zs_blockid *r = rcksum_needed_block_ranges(z, &n, 0, RCKSUM_ALL_BLOCKS);
+
+    for (i = 0; i < n; i++)
+        needed += r[2 * i + 1] - r[2 * i];
+    free(r);
+    return needed;
+}
+
+/* count_hashed(self)
+ * Returns how many blocks there are in the rsum hash */
+static zs_blockid count_hashed(const struct rcksum_state *z) {
+    zs_blockid n = 0;
+    size_t i;
+
+    for (i = 0; i < z->hashslots; i++)
+        if (slot_id(z, z->rsum_hash[i]) >= 0)
+            n++;
+    return n;
+}
+
+/* check_duplicates(target[])
+ * For a target with many blocks of zeros, and a run of copies of another
+ * block, only one of each should be needed; getting that one, from the
+ * network or from a seed, gets them all. An index saved for the target keeps
+ * the same. And the copies that would be found with an earlier one are left
+ * out of the hash. */
+static int check_duplicates(const unsigned char *target) {
+    static unsigned char dup[NBLOCKS * BLOCKSIZE];
+    char path[] = "rcksumtest-index-XXXXXX";
+    struct rcksum_state *z;
+    int i, n, zeros = 0, distinct, rc = 0;
+    zs_blockid *r;
+
+    memcpy(dup, target, sizeof dup);
+    for (i = 0; i < NBLOCKS; i++)
+        if (i % 7 == 3 && (i < 300 || i >= 350)) {
+            memset(dup + i * BLOCKSIZE, 0, BLOCKSIZE);
+            zeros++;
+        }
+    for (i = 300; i < 350; i++)
+        memcpy(dup + i * BLOCKSIZE, dup + 11 * BLOCKSIZE, BLOCKSIZE);
+    distinct = NBLOCKS - (zeros - 1) - 50;
+
+    /* From the network: just the blocks that we are asked for. Of the run
+     * of copies, only the first and last need be in the hash, as the others
+     * are found along with the one before them */
+    z = make_target(dup, RCKSUM_HASH_MD4, 4, 8, 2);
+    if (rcksum_build_index(z) != 0 || count_needed(z) != distinct) {
+        fprintf(stderr, "%d blocks needed, not %d distinct\n",
+                count_needed(z), distinct);
+        rc = 1;
+    }
+    if (count_hashed(z) != NBLOCKS - 48) {
+        fprintf(stderr, "%lld blocks in the hash, not %d\n", count_hashed(z),
+                NBLOCKS - 48);
+        rc = 1;
+    }
+    i = mkstemp(path);
+    if (i == -1 || close(i) != 0 || rcksum_save_index(z, path) != 0) {
+        fprintf(stderr, "could not save index\n");
+        rc = 1;
+    }
+    r = rcksum_needed_block_ranges(z, &n, 0, RCKSUM_ALL_BLOCKS);
+    for (i = 0; i < n; i++)
+        if (rcksum_submit_blocks(z, dup + r[2 * i] * BLOCKSIZE, r[2 * i],
+                                 r[2 * i + 1] - 1) != 0)
+            rc = 1;
+    free(r);
+    if (rc || check_known_data(z, dup) != 0) {
+        fprintf(stderr, "fetched blocks didn't fill the duplicates\n");
+        rc = 1;
+    }
+    rcksum_end(z);
+
+    /* From a seed with one block of zeros then one copy of the other */
+    z = rcksum_init(NBLOCKS, BLOCKSIZE, 4, 8, 2);
+    rcksum_set_hash(z, RCKSUM_HASH_MD4);
+    if (rcksum_load_index(z, path) != 1 || count_needed(z) != distinct) {
+        fprintf(stderr, "index lost the duplicate blocks\n");
+        rc = 1;
+    }
+    rcksum_set_aligned_scan(z, 0);
+    rcksum_submit_source_mmap(z, dup + 10 * BLOCKSIZE, 2 * BLOCKSIZE, 0);
+    if (check_known_data(z, dup) != NBLOCKS - zeros - 51
+        || count_needed(z) != distinct - 2) {
+        fprintf(stderr, "seed got %lld blocks todo, not %d\n",
+                rcksum_blocks_todo(z), NBLOCKS - zeros - 51);
+        rc = 1;
+    }
+    rcksum_end(z);
+
+    /* Or from the same seed, read while we had only the first half of the
+     * checksums: the rest are filled in once we have them all */
+    z = rcksum_init(NBLOCKS, BLOCKSIZE, 4, 8, 2);
+    if (rcksum_load_index(z, path) != 1) {
+        fprintf(stderr, "could not load index\n");
+        rc = 1;
+    }
+    rcksum_set_blocks_loaded(z, NBLOCKS / 2);
+    rcksum_set_aligned_scan(z, 0);
+    rcksum_submit_source_mmap(z, dup + 10 * BLOCKSIZE, 2 * BLOCKSIZE, 0);
+    rcksum_set_blocks_loaded(z, NBLOCKS);
+    if (rcksum_build_index(z) != 0
+        || check_known_data(z, dup) != NBLOCKS - zeros - 51
+        || count_needed(z) != distinct - 2) {
+        fprintf(stderr, "seed read early got %lld blocks todo, not %d\n",
+                rcksum_blocks_todo(z), NBLOCKS - zeros - 51);
+        rc = 1;
+    }
+    rcksum_end(z);
+    unlink(path);
+
+    /* Matching blocks one at a time, only the first of each group need be in
+     * the hash; and reading the target itself still finds all of it */
+    z = make_target(dup, RCKSUM_HASH_MD4, 4, 8, 1);
+    if (rcksum_build_index(z) != 0 || count_hashed(z) != distinct) {
+        fprintf(stderr, "%lld blocks in the hash, not %d distinct\n",
+                count_hashed(z), distinct);
+        rc = 1;
+    }
+    rcksum_set_aligned_scan(z, 0);
+    rcksum_submit_source_mmap(z, dup, sizeof dup, 0);
+    if (check_known_data(z, dup) != 0) {
+        fprintf(stderr, "target itself left %lld blocks todo\n",
+                rcksum_blocks_todo(z));
+        rc = 1;
+    }
+    rcksum_end(z);
+    return rc;
+}
+
+/* check_duplicate_groups(target[])
+ * For a target with many groups of the same block spread all through it, the
+ * duplicate tables list every block that has others the same, in order, and
+ * link each in a circle of just those blocks. */
+static int check_duplicate_groups(const unsigned char *target) {
+    static unsigned char dup[NBLOCKS * BLOCKSIZE];
+    struct rcksum_state *z;
+    zs_blockid i, j, k, ndups = 0;
+    int rc = 0;
+
+    memcpy(dup, target, sizeof dup);
+    for (i = 40; i < NBLOCKS; i++)
+        if (i % 5 == 2)
+            memcpy(dup + i * BLOCKSIZE, target + (i / 5 % 40) * BLOCKSIZE,
+                   BLOCKSIZE);
+
+    z = make_target(dup, RCKSUM_HASH_MD4, 4, 8, 2);
+    if (rcksum_build_index(z) != 0) {
+        fprintf(stderr, "could not build the duplicate tables\n");
+        rcksum_end(z);
+        return 1;
+    }
+    for (i = 0; i < NBLOCKS; i++)
+        for (j = 0; j < NBLOCKS; j++)
+            if (j != i && !memcmp(dup + i * BLOCKSIZE, dup + j * BLOCKSIZE,
+                                  BLOCKSIZE)) {
+                ndups++;
+                break;
+            }
+    if (z->ndups != ndups) {
+        fprintf(stderr, "%lld blocks with duplicates, not %lld\n",
+                z->ndups, ndups);
+        rc = 1;
+    }
+
+    for (k = 0; !rc && k < z->ndups; k++) {
+        const unsigned char *data = dup + z->dup_ids[k] * BLOCKSIZE;
+        zs_blockid same = 0, n = 0;
+
+        if (k && z->dup_ids[k - 1] >= z->dup_ids[k]) {
+            fprintf(stderr, "duplicate blocks not listed in order\n");
+            rc = 1;
+        }
+        for (i = 0; i < NBLOCKS; i++)
+            if (!memcmp(dup + i * BLOCKSIZE, data, BLOCKSIZE))
+                same++;
+
+        /* Round the circle, which must come back to where it started */
+        j = k;
+        do {
+            if (j < 0 || j >= z->ndups
+                || memcmp(dup + z->dup_ids[j] * BLOCKSIZE, data, BLOCKSIZE)) {
+                fprintf(stderr, "block %lld linked to one that differs\n",
+                        z->dup_ids[k]);
+                rc = 1;
+                break;
+            }
+            j = z->dup_next[j];
+        } while (++n <= z->ndups && j != k);
+        if (!rc && n != same) {
+            fprintf(stderr, "block %lld in a group of %lld, not %lld\n",
+                    z->dup_ids[k], n, same);
+            rc = 1;
+        }
+    }
+    rcksum_end(z);
+    return rc;
+}
+
+/* check_colliding_blocks(target[])
+ * Two blocks that differ, but have the same rsum and the same checksum as far
+ * as a target with 2-byte rsums and checksums keeps them, are not the same
+ * block: getting one mustn't fill in the other. That few bits can't tell the
+ * blocks apart, so only blocks that are followed by the same are grouped. */
+static int check_colliding_blocks(const unsigned char *target) {
+    static unsigned char dup[NBLOCKS * BLOCKSIZE];
+    unsigned char *a = dup + 100 * BLOCKSIZE, *b = dup + 700 * BLOCKSIZE;
+    unsigned char ca[CHECKSUM_SIZE], cb[CHECKSUM_SIZE];
+    struct rcksum_state *z;
+    struct rsum ra, rb;
+    zs_blockid *r;
+    int i, n, rc = 0;
+
+    memcpy(dup, target, sizeof dup);
+    for (i = 300; i < 350; i++)
+        memcpy(dup + i * BLOCKSIZE, dup + 11 * BLOCKSIZE, BLOCKSIZE);
+
+    /* Block b is block a with one byte up and the next down, and another
+     * down and the next up, which leaves the rsum the same; tried at places
+     * until the first 2 bytes of their checksums are the same too */
+    rcksum_calc_hash_checksums(RCKSUM_HASH_MD4, ca, a, 1, BLOCKSIZE);
+    for (i = 0; i < 1 << 22; i++) {
+        int x = next_rand() % (BLOCKSIZE - 1);
+        int y = next_rand() % (BLOCKSIZE - 1);
+
+        if (x < y + 2 && y < x + 2)
+            continue;
+        memcpy(b, a, BLOCKSIZE);
+        if (b[x] == 255 || !b[x + 1] || !b[y] || b[y + 1] == 255)
+            continue;
+        b[x]++;
+        b[x + 1]--;
+        b[y]--;
+        b[y + 1]++;
+        rcksum_calc_hash_checksums(RCKSUM_HASH_MD4, cb, b, 1, BLOCKSIZE);
+        if (!memcmp(ca, cb, 2))
+            break;
+    }
+    ra = rcksum_calc_rsum_block(a, BLOCKSIZE);
+    rb = rcksum_calc_rsum_block(b, BLOCKSIZE);
+    if (ra.a != rb.a || ra.b != rb.b || memcmp(ca, cb, 2)
+        || !memcmp(a, b, BLOCKSIZE)) {
+        fprintf(stderr, "could not make two blocks that collide\n");
+        return 1;
+    }
+
+    /* Only the run of copies (bar the last, followed by another block) make
+     * a group; and the blocks fetched fill in just what they should */
+    z = make_target(dup, RCKSUM_HASH_MD4, 2, 2, 2);
+    if (rcksum_build_index(z) != 0 || z->ndups != 49
+        || has_duplicates(z, 100) || has_duplicates(z, 700)) {
+        fprintf(stderr, "colliding blocks: %lld blocks with duplicates, "
+                "not 49\n", z->ndups);
+        rc = 1;
+    }
+    r = rcksum_needed_block_ranges(z, &n, 0, RCKSUM_ALL_BLOCKS);
+    for (i = 0; i < n; i++)
+        if (rcksum_submit_blocks(z, dup + r[2 * i] * BLOCKSIZE, r[2 * i],
+                                 r[2 * i + 1] - 1) != 0)
+            rc = 1;
+    free(r);
+    if (check_known_data(z, dup) != 0) {
+        fprintf(stderr, "colliding blocks filled in from each other\n");
+        rc = 1;
+    }
+    rcksum_end(z);
+    return rc;
+}
+
+/* find_table(file[], size, table, len)
+ * Returns where in the file the given table (of len bytes) was saved, at one
+ * of the multiples of 64 where tables start; or -1 if it isn't there */
+static long find_table(const unsigned char *file, long size, const void *table,
+                       size_t len) {
+    long off;
+
+    for (off = 0; off + (long)len <= size; off += 64)
+        if (!memcmp(file + off, table, len))
+            return off;
+    return -1;
+}
+
+/* check_damaged_index(target[])
+ * An index whose hash table, or tables of the blocks that are the same, have
+ * been damaged (to point outside the tables, or to go round for ever) should
+ * not be loaded; and the target's tables are then built as if there were no
+ * index, to need just what they would have. */
+static int check_damaged_index(const unsigned char *target) {
+    static unsigned char dup[NBLOCKS * BLOCKSIZE];
+    char path[] = "rcksumtest-index-XXXXXX";
+    struct rcksum_state *z;
+    unsigned char *file = NULL;
+    long size = 0, slots = -1, ids = -1, next = -1;
+    int i, needed, rc = 0;
+    FILE *f;
+
+    memcpy(dup, target, sizeof dup);
+    for (i = 100; i < NBLOCKS; i += 3)
+        memcpy(dup + i * BLOCKSIZE, target + (i % 30) * BLOCKSIZE, BLOCKSIZE);
+    z = make_target(dup, RCKSUM_HASH_MD4, 4, 8, 2);
+    i = mkstemp(path);
+    if (i == -1 || close(i) != 0 || rcksum_build_index(z) != 0
+        || rcksum_save_index(z, path) != 0 || z->ndups < 2) {
+        fprintf(stderr, "could not save index\n");
+        rcksum_end(z);
+        unlink(path);
+        return 1;
+    }
+    needed = count_needed(z);
+
+    /* Read it back, and find the tables in it */
+    f = fopen(path, "rb");
+    if (f && fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) > 0
+        && (file = malloc(size)) != NULL) {
+        rewind(f);
+        if (fread(file, 1, size, f) == (size_t)size) {
+            slots = find_table(file, size, z->rsum_hash,
+                               z->hashslots * sizeof *(z->rsum_hash));
+            ids = find_table(file, size, z->dup_ids,
+                             z->ndups * sizeof *(z->dup_ids));
+            next = find_table(file, size, z->dup_next,
+                              z->ndups * sizeof *(z->dup_next));
+        }
+    }
+    if (f)
+        fclose(f);
+    if (slots < 0 || ids < 0 || next < 0) {
+        fprintf(stderr, "could not find the tables in the index\n");
+        rc = 1;
+    }
+
+    for (i = 0; !rc && i < 6; i++) {
+        unsigned char *copy = malloc(size);
+        uint64_t *hs = (uint64_t *)(copy + slots);
+        zs_blockid *di = (zs_blockid *)(copy + ids);
+        zs_blockid *dn = (zs_blockid *)(copy + next);
+        struct rcksum_state *y;
+        size_t n;
+
+        memcpy(copy, file, size);
+        switch (i) {
+        case 1:                /* a block that isn't in the target */
+            for (n = 0; slot_id(z, hs[n]) < 0; n++);
+            hs[n] = make_slot(z, NBLOCKS, 0);
+            break;
+        case 2:                /* no empty slots, to end a search */
+            for (n = 0; n < z->hashslots; n++)
+                if (slot_id(z, hs[n]) == SLOT_EMPTY)
+                    hs[n] = make_slot(z, SLOT_DELETED, 0);
+            break;
+        case 3:                /* duplicates out of order */
+            di[0] = z->dup_ids[1];
+            di[1] = z->dup_ids[0];
+            break;
+        case 4:                /* linked outside the table */
+            dn[0] = z->ndups;
+            break;
+        case 5:                /* two linked to one, so not all in circles */
+            dn[1] = dn[0];
+            break;
+        }
+        f = fopen(path, "wb");
+        if (!f || fwrite(copy, 1, size, f) != (size_t)size || fclose(f)) {
+            fprintf(stderr, "could not write index\n");
+            rc = 1;
+        }
+        free(copy);
+
+        y = make_target(dup, RCKSUM_HASH_MD4, 4, 8, 2);
+        if (!rc && rcksum_load_index(y, path) != !i) {
+            fprintf(stderr, "index damaged in way %d %sloaded\n", i,
+                    i ? "" : "not ");
+            rc = 1;
+        }
+        if (!rc && (rcksum_build_index(y) != 0 || count_needed(y) != needed)) {
+            fprintf(stderr, "target with index damaged in way %d needs %d "
+                    "blocks, not %d\n", i, count_needed(y), needed);
+            rc = 1;
+        }
+        rcksum_end(y);
+    }
+    free(file);
+    rcksum_end(z);
+    unlink(path);
+    return rc;
+}
+
+/* check_blocks_loaded(target[], seed_stream, todo2)
+ * Scanning the seed while only the first part of the target's checksums are
+ * in finds just blocks from that part; scanning it again once they are all
+ * in finds the rest, so ending up with what one scan would (todo2 left). */
+static int check_blocks_loaded(const unsigned char *target, FILE *seed,
+                               int todo2) {
+    const int rb = 4, cb = 8, part = NBLOCKS / 3;
+    unsigned char *buf = malloc(NBLOCKS * (rb + cb));
+    struct rcksum_state *z = rcksum_init(NBLOCKS, BLOCKSIZE, rb, cb, 2);
+    int n, early = -1, todo = -1, rc = 0;
+    zs_blockid *r = NULL;
+
+    if (!buf || !z) {
+        perror("setup");
+        rc = 1;
+    }
+    else {
+        write_records(buf, target, rb, cb);
+        rcksum_set_aligned_scan(z, 0);
+        rcksum_set_blocks_loaded(z, 0);
+        rcksum_load_target_blocks(z, 0, buf, part, rb, cb);
+        rcksum_set_blocks_loaded(z, part);
+        rewind(seed);
+        rcksum_submit_source_file(z, seed, 0);
+        r = rcksum_needed_block_ranges(z, &n, part, RCKSUM_ALL_BLOCKS);
+        early = rcksum_blocks_todo(z);
+
+        rcksum_load_target_blocks(z, part, buf + part * (rb + cb),
+                                  NBLOCKS - part, rb, cb);
+        rcksum_set_blocks_loaded(z, NBLOCKS);
+        rewind(seed);
+        rcksum_submit_source_file(z, seed, 0);
+        todo = check_known_data(z, target);
+    }
+    if (!r || n != 1 || r[0] != part || r[1] != NBLOCKS
+        || early == NBLOCKS - part || todo != todo2) {
+        fprintf(stderr, "scanning with %d blocks in got %d blocks todo, then "
+                "%d, not %d\n", part, early, todo, todo2);
+        rc = 1;
+    }
+    free(r);
+    free(buf);
+    if (z)
+        rcksum_end(z);
+    return rc;
+}
+
+/* A seed for check_scanners, and the scanner to scan it with */
+struct scanner_job {
+    struct rcksum_scanner *sc;
+    FILE *seed;
+    int by_data;
+};
+
+static void *scanner_thread(void *arg) {
+    struct scanner_job *job = arg;
+
+    rewind(job->seed);
+    if (job->by_data) {
+        /* All in one go, padded with the context for the last blocks */
+        long len;
+        unsigned char *buf;
+
+        fseek(job->seed, 0, SEEK_END);
+        len = ftell(job->seed);
+        rewind(job->seed);
+        buf = calloc(1, len + 2 * BLOCKSIZE);
+        if (!buf || fread(buf, 1, len, job->seed) != (size_t)len) {
+            perror("read");
+            exit(1);
+        }
+        rcksum_scanner_submit_data(job->sc, buf, len + 2 * BLOCKSIZE, 0);
+        free(buf);
+    }
+    else
+        rcksum_scanner_submit_file(job->sc, job->seed, 0);
+    return NULL;
+}
+
+/* check_scanners(target[])
+ * Splits the target's blocks between a few seeds, with junk in between, and
+ * scans them all at once, each with a scanner in a thread of its own (one
+ * fed by rcksum_scanner_submit_data); this should find just what scanning
+ * them one after another does. */
+#define SCANNERS 3
+static int check_scanners(const unsigned char *target) {
+    struct scanner_job jobs[SCANNERS];
+    pthread_t threads[SCANNERS];
+    struct rcksum_state *z;
+    int i, todo, todoseq, rc = 0;
+
+    for (i = 0; i < SCANNERS; i++) {
+        jobs[i].seed = tmpfile();
+        jobs[i].by_data = !i;
+        if (!jobs[i].seed) {
+            perror("tmpfile");
+            return 1;
+        }
+    }
+    for (i = 0; i < NBLOCKS; i++) {
+        unsigned char junk[BLOCKSIZE];
+        FILE *seed = jobs[(i / 10) % SCANNERS].seed;
+
+        fwrite(target + i * BLOCKSIZE, BLOCKSIZE, 1, seed);
+        if (!(next_rand() % 8)) {
+            fill_random(junk, sizeof junk);
+            fwrite(junk, 1, next_rand() % sizeof junk, seed);
+        }
+    }
+
+    z = make_target(target, RCKSUM_HASH_MD4, 4, 8, 2);
+    for (i = 0; i < SCANNERS; i++) {
+        rewind(jobs[i].seed);
+        rcksum_submit_source_file(z, jobs[i].seed, 0);
+    }
+    todoseq = check_known_data(z, target);
+    rcksum_end(z);
+
+    z = make_target(target, RCKSUM_HASH_MD4, 4, 8, 2);
+    for (i = 0; i < SCANNERS; i++) {
+        jobs[i].sc = rcksum_scanner_new(z);
+        if (!jobs[i].sc
+            || pthread_create(&threads[i], NULL, scanner_thread, &jobs[i])) {
+            perror("scanner");
+            exit(1);
+        }
+    }
+    for (i = 0; i < SCANNERS; i++) {
+        pthread_join(threads[i], NULL);
+        rcksum_scanner_end(jobs[i].sc);
+        fclose(jobs[i].seed);
+    }
+    todo = check_known_data(z, target);
+    rcksum_end(z);
+
+    if (todoseq < 0 || todoseq == NBLOCKS || todo != todoseq) {
+        fprintf(stderr, "scanners got %d blocks todo, not %d\n", todo,
+                todoseq);
+        rc = 1;
+    }
+    return rc;
+}
+
+int main(void) {
+    unsigned char *target = malloc(NBLOCKS * BLOCKSIZE);
+    FILE *seed = tmpfile();
+    int rc = 0;
+    int seq_matches, todo2 = 0;
+
+    if (!target || !seed) {
+        perror("setup");
+        return 1;
+    }
+
+    /* Target is random; seed has the target's blocks, shifted by odd amounts
+     * and with some junk (and a few copies of the same block) in between */
+    fill_random(target, NBLOCKS * BLOCKSIZE);
+    {
+        unsigned char junk[3 * BLOCKSIZE];
+        int i = 0;
+
+        while (i < NBLOCKS) {
+            int run = 1 + next_rand() % 12;
+            if (i + run > NBLOCKS)
+                run = NBLOCKS - i;
+            if (next_rand() % 5)
+                fwrite(target + i * BLOCKSIZE, BLOCKSIZE, run, seed);
+            fill_random(junk, sizeof junk);
+            fwrite(junk, 1, next_rand() % sizeof junk, seed);
+            if (!(next_rand() % 7))
+                fwrite(target, BLOCKSIZE, 1, seed);
+            i += run;
+        }
+    }
+
+    for (seq_matches = 1; seq_matches <= 2; seq_matches++) {
+        const int md4 = RCKSUM_HASH_MD4;
+        int hits1, hits8, hits16, hitspiped, hitsthreaded, hitsblake3;
+        int hitsxxh3, hitsaligned;
+        int todo1 = scan_seed(target, seed, md4, 1, seq_matches, 1, 0, 0,
+                              &hits1);
+        int todo8 = scan_seed(target, seed, md4, 8, seq_matches, 1, 0, 0,
+                              &hits8);
+        int todo16 = scan_seed(target, seed, md4, 16, seq_matches, 1, 0, 0,
+                               &hits16);
+        int todopiped = scan_seed(target, seed, md4, ROLL_ANY_LANES,
+                                  seq_matches, 1, 1, 0, &hitspiped);
+        int todothreaded = scan_seed(target, seed, md4, ROLL_ANY_LANES,
+                                     seq_matches, 4, 0, 0, &hitsthreaded);
+        int todoblake3 = scan_seed(target, seed, RCKSUM_HASH_BLAKE3,
+                                   ROLL_ANY_LANES, seq_matches, 1, 0, 0,
+                                   &hitsblake3);
+        int todoxxh3 = scan_seed(target, seed, RCKSUM_HASH_XXH3,
+                                 ROLL_ANY_LANES, seq_matches, 1, 0, 0,
+                                 &hitsxxh3);
+        int todoaligned = scan_seed(target, seed, md4, ROLL_ANY_LANES,
+                                    seq_matches, 1, 0, 1, &hitsaligned);
+
+        if (todo1 < 0 || todo1 == NBLOCKS) {
+            fprintf(stderr, "scan failed with seq_matches %d\n", seq_matches);
+            rc = 1;
+        }
+        todo2 = todo1;
+        if (todo8 != todo1 || todo16 != todo1
+            || hits8 != hits1 || hits16 != hits1) {
+            fprintf(stderr, "roll kernels disagree: %d/%d/%d blocks todo, "
+                    "%d/%d/%d hash hits\n", todo1, todo8, todo16,
+                    hits1, hits8, hits16);
+            rc = 1;
+        }
+
+        /* Reading the file through a buffer or in place in memory should
+         * find exactly the same */
+        if (todopiped != todo1 || hitspiped != hits1) {
+            fprintf(stderr, "piped seed got %d blocks todo, %d hash hits; "
+                    "not %d, %d\n", todopiped, hitspiped, todo1, hits1);
+            rc = 1;
+        }
+
+        /* The strong checksum makes no difference to what we find */
+        if (todoblake3 != todo1 || hitsblake3 != hits1) {
+            fprintf(stderr, "BLAKE3 target got %d blocks todo, not %d\n",
+                    todoblake3, todo1);
+            rc = 1;
+        }
+        if (todoxxh3 != todo1 || hitsxxh3 != hits1) {
+            fprintf(stderr, "XXH3 target got %d blocks todo, not %d\n",
+                    todoxxh3, todo1);
+            rc = 1;
+        }
+
+        /* Threads start afresh at the start of their part of the file, so
+         * can differ in what they find just there; but not by much */
+        if (todothreaded < 0 || todothreaded > todo1 + 3 * seq_matches) {
+            fprintf(stderr, "threaded scan got %d blocks todo, not %d\n",
+                    todothreaded, todo1);
+            rc = 1;
+        }
+
+        /* Nor does trying the aligned blocks first, much, even where the
+         * blocks have all moved */
+        if (todoaligned < 0 || todoaligned > todo1 + 3 * seq_matches) {
+            fprintf(stderr, "aligned scan got %d blocks todo, not %d\n",
+                    todoaligned, todo1);
+            rc = 1;
+        }
+    }
+
+    if (check_more_seq_matches(target, seed, todo2)
+        || check_map_target_blocks(target, seed, todo2)
+        || check_blocks_loaded(target, seed, todo2))
+        rc = 1;
+    if (check_duplicates(target) || check_duplicate_groups(target)
+        || check_colliding_blocks(target) || check_damaged_index(target)
+        || check_load_target_blocks(target))
+        rc = 1;
+
+    {   /* And check the kernels directly */
+        struct rcksum_state *z = make_target(target, RCKSUM_HASH_MD4, 4, 8, 2);
+        if (check_kernels_agree(z))
+            rc = 1;
+        rcksum_end(z);
+    }
+    if (check_blake3() || check_xxh3() || check_checksums_agree())
+        rc = 1;
+    if (check_needed_ranges() || check_large_target()
+        || check_slot_size())
+        rc = 1;
+    if (check_aligned_scan(target))
+        rc = 1;
+    if (check_stops_when_complete(target))
+        rc = 1;
+    if (check_index(target, seed))
+        rc = 1;
+    if (check_seed_cache(target))
+        rc = 1;
+    if (check_scanners(target))
+        rc = 1;
+    if (check_wide_rsums(target))
+        rc = 1;
+
+    fclose(seed);
+    free(target);
+    return rc;
+}
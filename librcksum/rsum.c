@@ -24,7 +24,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _POSIX_MAPPED_FILES
+# include <sys/mman.h>
+#endif
 
 #ifdef WITH_DMALLOC
 # include <dmalloc.h>
@@ -34,8 +40,6 @@
 #include "rcksum.h"
 #include "internal.h"
 
-#define UPDATE_RSUM(a, b, oldc, newc, bshift) do { (a) += ((unsigned char)(newc)) - ((unsigned char)(oldc)); (b) += (a) - ((oldc) << (bshift)); } while (0)
-
 /* rcksum_calc_rsum_block(data, data_len)
  * Calculate the rsum for a single block of data. */
 struct rsum __attribute__ ((pure)) rcksum_calc_rsum_block(const unsigned char *data, size_t len) {
@@ -54,6 +58,25 @@ struct rsum __attribute__ ((pure)) rcksum_calc_rsum_block(const unsigned char *d
     }
 }
 
+/* rcksum_calc_rsum_high(data, data_len)
+ * Calculate the high halves of the rsum for a single block of data, worked
+ * out to 32 bits rather than 16. */
+struct rsum __attribute__ ((pure)) rcksum_calc_rsum_high(const unsigned char *data, size_t len) {
+    uint32_t a = 0;
+    uint32_t b = 0;
+
+    while (len) {
+        unsigned char c = *data++;
+        a += c;
+        b += len * c;
+        len--;
+    }
+    {
+        struct rsum r = { a >> 16, b >> 16 };
+        return r;
+    }
+}
+
 /* rcksum_calc_checksum(checksum_buf, data, data_len)
  * Returns the MD4 checksum (in checksum_buf) of the given data block */
 void rcksum_calc_checksum(unsigned char *c, const unsigned char *data,
@@ -64,26 +87,61 @@ void rcksum_calc_checksum(unsigned char *c, const unsigned char *data,
     MD4Final(c, &ctx);
 }
 
+/* calc_checksums(hash, checksums[], data[], nblocks, blocksize, max_lanes)
+ * Calculates the given kind of checksum of each of the nblocks consecutive
+ * blocks of blocksize bytes in data[], into checksums[] (CHECKSUM_SIZE bytes
+ * for each block), with kernels that do at most max_lanes blocks at a time. */
+void calc_checksums(int hash, unsigned char *c, const unsigned char *data,
+                    size_t nblocks, size_t blocksize, int max_lanes) {
+    switch (hash) {
+    case RCKSUM_HASH_BLAKE3:
+        blake3_blocks(c, data, nblocks, blocksize, max_lanes);
+        break;
+    case RCKSUM_HASH_XXH3:
+        xxh3_blocks(c, data, nblocks, blocksize, max_lanes);
+        break;
+    default:
+        md4_blocks(c, data, nblocks, blocksize, max_lanes);
+        break;
+    }
+}
+
+/* rcksum_calc_hash_checksums(hash, checksums[], data[], nblocks, blocksize)
+ * Calculates the given kind of checksum (RCKSUM_HASH_*) of the nblocks
+ * consecutive blocks of blocksize bytes in data[], into checksums[]
+ * (CHECKSUM_SIZE bytes for each block). */
+void rcksum_calc_hash_checksums(int hash, unsigned char *c,
+                                const unsigned char *data, size_t nblocks,
+                                size_t blocksize) {
+    calc_checksums(hash, c, data, nblocks, blocksize, CHECKSUM_ANY_LANES);
+}
+
+/* rcksum_calc_checksums(checksums[], data[], nblocks, blocksize)
+ * Calculates the MD4 checksums of the nblocks consecutive blocks of blocksize
+ * bytes in data[], into checksums[] (CHECKSUM_SIZE bytes for each block), as
+ * calling rcksum_calc_checksum for each block would. */
+void rcksum_calc_checksums(unsigned char *c, const unsigned char *data,
+                           size_t nblocks, size_t blocksize) {
+    md4_blocks(c, data, nblocks, blocksize, CHECKSUM_ANY_LANES);
+}
+
 /* unlink_block(self, block_id)
  * Remove the given data block from the rsum hash table, so it won't be
- * returned in a hash lookup again (e.g. because we now have the data)
+ * returned in a hash lookup again (e.g. because we now have the data). Its
+ * slot is marked deleted rather than emptied, so that lookups (including any
+ * in progress) still carry on past it to any other blocks in the same run.
  */
 static void unlink_block(struct rcksum_state *z, zs_blockid id) {
-    struct hash_entry *t = &(z->blockhashes[id]);
-
-    struct hash_entry **p = &(z->rsum_hash[calc_rhash(z, t) & z->hashmask]);
+    size_t n = hash_slot_of(calc_rhash(z, block_rsum(z, id),
+                                       block_rsum(z, id + 1)), z->hashslots);
+    zs_blockid s;
 
-    while (*p != NULL) {
-        if (*p == t) {
-            if (t == z->rover) {
-                z->rover = t->next;
-            }
-            *p = (*p)->next;
+    while ((s = slot_id(z, z->rsum_hash[n])) != SLOT_EMPTY) {
+        if (s == id) {
+            z->rsum_hash[n] = make_slot(z, SLOT_DELETED, 0);
             return;
         }
-        else {
-            p = &((*p)->next);
-        }
+        n = next_slot(z, n);
     }
 }
 
@@ -97,11 +155,12 @@ ssize_t pwrite(int d, const void *buf, size_t nbytes, off_t offset) {
 }
 #endif
 
-/* write_blocks(rcksum_state, buf, startblock, endblock)
+/* write_data(rcksum_state, scan_state, buf, startblock, endblock)
  * Writes the block range (inclusive) from the supplied buffer to our
- * under-construction output file */
-static void write_blocks(struct rcksum_state *z, const unsigned char *data,
-                         zs_blockid bfrom, zs_blockid bto) {
+ * under-construction output file; counting the writes in the scan's stats */
+static void write_data(struct rcksum_state *z, struct scan_state *s,
+                       const unsigned char *data,
+                       zs_blockid bfrom, zs_blockid bto) {
     off_t len = ((off_t) (bto - bfrom + 1)) << z->blockshift;
     off_t offset = ((off_t) bfrom) << z->blockshift;
 
@@ -120,6 +179,8 @@ static void write_blocks(struct rcksum_state *z, const unsigned char *data,
             fprintf(stderr, "IO error: %s\n", strerror(errno));
             exit(-1);
         }
+        s->stats.writes++;
+        s->stats.bytes_written += rc;
 
         /* Keep track of any data still to do */
         len -= rc;
@@ -128,18 +189,155 @@ static void write_blocks(struct rcksum_state *z, const unsigned char *data,
             offset += rc;
         }
     }
+}
+
+/* record_duplicates(rcksum_state, scan_state, blockid, startblock, endblock, unlink)
+ * Having just got the data for the given block, which is in the block range
+ * (inclusive) being recorded, we have it for the other blocks of the target
+ * that are the same: record those as well, removing them from the rsum hash
+ * if unlink is set; the scan fills in those outside the range from this
+ * block, once it is written out (see fill_duplicates). */
+static void record_duplicates(struct rcksum_state *z, struct scan_state *s,
+                              zs_blockid id, zs_blockid bfrom, zs_blockid bto,
+                              int unlink) {
+    const zs_blockid first = find_duplicate(z, id);
+    zs_blockid k = first;
+
+    while ((k = z->dup_next[k]) != first) {
+        zs_blockid dup = z->dup_ids[k];
+
+        if (already_got_block(z, dup))
+            continue;
+        if ((dup < bfrom || dup > bto) && !add_fill(s, id, dup)) {
+            /* Then it will have to be got for itself */
+            forget_duplicate(z, dup);
+            continue;
+        }
+        if (unlink)
+            unlink_block(z, dup);
+        add_known_block(z, dup);
+    }
+}
+
+/* record_blocks(rcksum_state, scan_state, startblock, endblock)
+ * Having got the data for the block range (inclusive), discard them from the
+ * rsum hashes (as we don't need to identify data for those blocks again, and
+ * this may speed up lookups (in particular if there are lots of identical
+ * blocks), and add them to the record of blocks that we have received and
+ * stored the data for; and any other blocks the same as them */
+static void record_blocks(struct rcksum_state *z, struct scan_state *s,
+                          zs_blockid bfrom, zs_blockid bto) {
+    zs_blockid id;
+
+#ifdef _POSIX_THREADS
+    /* But if several threads are scanning, the hash is shared by them and
+     * must stay as it is; just record the blocks, and the hash is pruned
+     * afterwards */
+    if (z->commit_lock) {
+        pthread_mutex_lock(z->commit_lock);
+        for (id = bfrom; id <= bto; id++)
+            if (add_known_block(z, id) && has_duplicates(z, id))
+                record_duplicates(z, s, id, bfrom, bto, 0);
+        pthread_mutex_unlock(z->commit_lock);
+        return;
+    }
+#endif
+    for (id = bfrom; id <= bto; id++) {
+        unlink_block(z, id);
+        if (add_known_block(z, id) && has_duplicates(z, id))
+            record_duplicates(z, s, id, bfrom, bto, 1);
+    }
+}
+
+/* write_blocks(rcksum_state, scan_state, buf, startblock, endblock)
+ * Writes the block range (inclusive) from the supplied buffer to our
+ * under-construction output file, and records that we have them */
+static void write_blocks(struct rcksum_state *z, struct scan_state *s,
+                         const unsigned char *data,
+                         zs_blockid bfrom, zs_blockid bto) {
+    write_data(z, s, data, bfrom, bto);
+    record_blocks(z, s, bfrom, bto);
+}
+
+/* Most data that we hold back from writing out for each scan */
+#define WRITE_BEHIND_BYTES (1 << 20)
+
+/* flush_write_behind(self, scan_state)
+ * Write out any blocks that the given scan is holding back; and then fill in
+ * the blocks that are the same as any that it has found */
+void flush_write_behind(struct rcksum_state *z, struct scan_state *s) {
+    struct write_behind *wb = &s->wb;
 
-    {   /* Having written those blocks, discard them from the rsum hashes (as
-         * we don't need to identify data for those blocks again, and this may
-         * speed up lookups (in particular if there are lots of identical
-         * blocks), and add the written blocks to the record of blocks that we
-         * have received and stored the data for */
-        int id;
-        for (id = bfrom; id <= bto; id++) {
-            unlink_block(z, id);
-            add_to_ranges(z, id);
+    if (wb->to > wb->from) {
+        if (wb->src != -1)
+            copy_blocks(z, s, wb->src, wb->from, wb->to - 1);
+        else
+            write_data(z, s, wb->buf, wb->from, wb->to - 1);
+    }
+    wb->from = wb->to = 0;
+    if (s->nfills)
+        fill_duplicates(z, s);
+}
+
+/* queue_blocks(self, scan_state, buf, startblock, endblock)
+ * As write_blocks, for blocks found by the given scan; but the data is held
+ * back to be written out later (by flush_write_behind), together with any
+ * blocks following on from these that the scan finds next; so that runs of
+ * matching blocks are written in large writes, not a block or two at a time.
+ * If the source is a file, we need not hold the data at all: just where it
+ * is in the file, to have it copied from there by copy_blocks.
+ */
+static void queue_blocks(struct rcksum_state *z, struct scan_state *s,
+                         const unsigned char *data, zs_blockid bfrom,
+                         zs_blockid bto) {
+    struct write_behind *wb = &s->wb;
+    zs_blockid max = WRITE_BEHIND_BYTES >> z->blockshift;
+    size_t held = (size_t) (wb->to - wb->from) << z->blockshift;
+    off_t src = -1;
+
+    /* Where the blocks are in the source file, if it's one we can copy from
+     * (and they aren't partly the 0 padding past its end) */
+    if (s->src_fd != -1 && z->copy_source) {
+        src = s->data_pos + (data - s->data);
+        if (src + (((off_t) (bto - bfrom + 1)) << z->blockshift) > s->src_end)
+            src = -1;
+    }
+
+    /* Write out what we have if these don't follow on from it, or won't fit */
+    if (held && (bfrom != wb->to || (src == -1) != (wb->src == -1)
+                 || (src != -1 && src != wb->src + (off_t) held)
+                 || (src == -1
+                     && wb->to - wb->from + bto - bfrom + 1 > max))) {
+        flush_write_behind(z, s);
+        held = 0;
+    }
+
+    if (src != -1) {
+        if (!held) {
+            wb->from = bfrom;
+            wb->src = src;
         }
+        wb->to = bto + 1;
+        record_blocks(z, s, bfrom, bto);
+        return;
+    }
+
+    if (!wb->buf && bto - bfrom + 1 <= max)
+        wb->buf = malloc(WRITE_BEHIND_BYTES);
+
+    /* Just write them now if we can't hold on to them */
+    if (!wb->buf || bto - bfrom + 1 > max) {
+        write_blocks(z, s, data, bfrom, bto);
+        return;
     }
+
+    if (!held) {
+        wb->from = wb->to = bfrom;
+        wb->src = -1;
+    }
+    memcpy(wb->buf + held, data, (size_t) (bto - bfrom + 1) << z->blockshift);
+    wb->to = bto + 1;
+    record_blocks(z, s, bfrom, bto);
 }
 
 /* rcksum_read_known_data(self, buf, offset, len)
@@ -147,10 +345,16 @@ static void write_blocks(struct rcksum_state *z, const unsigned char *data,
  * buf[] (which must be at least len bytes long) */
 int rcksum_read_known_data(struct rcksum_state *z, unsigned char *buf,
                            off_t offset, size_t len) {
-    int rc = pread(z->fd, buf, len, offset);
+    int rc;
+
+    flush_write_behind(z, &z->scan);
+    rc = pread(z->fd, buf, len, offset);
     return rc;
 }
 
+/* Blocks to calculate checksums for in one go in rcksum_submit_blocks */
+#define SUBMIT_BATCH 64
+
 /* rcksum_submit_blocks(self, data, startblock, endblock)
  * The data in data[] (which should be (endblock - startblock + 1) * blocksize * bytes)
  * is tested block-by-block as valid data against the target checksums for
@@ -163,33 +367,49 @@ int rcksum_read_known_data(struct rcksum_state *z, unsigned char *buf,
 int rcksum_submit_blocks(struct rcksum_state *const z, const unsigned char *data,
                          zs_blockid bfrom, zs_blockid bto) {
     zs_blockid x;
-    unsigned char md4sum[CHECKSUM_SIZE];
+    unsigned char md4sum[SUBMIT_BATCH][CHECKSUM_SIZE];
 
     /* Build checksum hash tables if we don't have them yet */
     if (!z->rsum_hash)
         if (!build_hash(z))
             return -1;
 
-    /* Check each block */
+    /* Check each block, calculating the checksums a batch at a time */
     for (x = bfrom; x <= bto; x++) {
-        rcksum_calc_checksum(&md4sum[0], data + ((x - bfrom) << z->blockshift),
-                             z->blocksize);
-        if (memcmp(&md4sum, &(z->blockhashes[x].checksum[0]), z->checksum_bytes)) {
+        int i = (x - bfrom) % SUBMIT_BATCH;
+
+        if (i == 0) {
+            zs_blockid n = bto - x + 1;
+
+            if (n > SUBMIT_BATCH)
+                n = SUBMIT_BATCH;
+            rcksum_calc_hash_checksums(z->hash, md4sum[0],
+                                       data + ((x - bfrom) << z->blockshift),
+                                       n, z->blocksize);
+        }
+        if (memcmp(md4sum[i], block_checksum(z, x), z->checksum_bytes)) {
             if (x > bfrom)      /* Write any good blocks we did get */
-                write_blocks(z, data, bfrom, x - 1);
+                write_blocks(z, &z->scan, data, bfrom, x - 1);
+            flush_write_behind(z, &z->scan);
             return -1;
         }
     }
 
-    /* All blocks are valid; write them and update our state */
-    write_blocks(z, data, bfrom, bto);
+    /* All blocks are valid; write them and update our state; and fill in any
+     * others that are the same */
+    write_blocks(z, &z->scan, data, bfrom, bto);
+    flush_write_behind(z, &z->scan);
     return 0;
 }
 
-/* check_checksums_on_hash_chain(self, &hash_entry, data[], onlyone)
- * Given a hash table entry, check the data in this block against every entry
- * in the linked list for this hash entry, checking the checksums for this
- * block against those recorded in the hash entries.
+/* check_checksums_on_hash_chain(self, scan_state, slot, data[], onlyone, checksums[])
+ * Given the slot in the block index where blocks with the current rsum(s)
+ * would start, check the data in this block against every block in the run of
+ * slots from there that has the same rsum, checking the checksums for this
+ * block against those recorded for the target blocks. Or if onlyone is set,
+ * just check against the block that follows the previous match. If checksums
+ * is not NULL, it has the checksums of this block and the following ones
+ * already, so we need not calculate them.
  *
  * If we get a hit (checksums match a desired block), write the data to that
  * block in the target file and update our state accordingly to indicate that
@@ -198,41 +418,56 @@ int rcksum_submit_blocks(struct rcksum_state *const z, const unsigned char *data
  * Return the number of blocks successfully obtained.
  */
 static int check_checksums_on_hash_chain(struct rcksum_state *const z,
-                                         const struct hash_entry *e,
+                                         struct scan_state *const s,
+                                         size_t slot,
                                          const unsigned char *data,
-                                         int onlyone) {
-    unsigned char md4sum[2][CHECKSUM_SIZE];
+                                         int onlyone,
+                                         const unsigned char *checksums) {
+    unsigned char md4sum[RCKSUM_MAX_SEQ_MATCHES][CHECKSUM_SIZE];
     signed int done_md4 = -1;
+    unsigned int high[RCKSUM_MAX_SEQ_MATCHES];  /* rsum_high_tag of each block */
+    signed int done_high = -1;
+    unsigned int tags[RCKSUM_MAX_SEQ_MATCHES];  /* rsum_tag of blocks past r[] */
+    signed int done_tag = 1;
     int got_blocks = 0;
-    register struct rsum r = z->r[0];
+    int probes = 0;             /* slots looked at, for the stats */
+    const unsigned int tag = rsum_tag(z, s->r[0]);
 
-    z->rover = e;
-
-    /* This is essentially a for (;e;e=e->next), but we want to remove links from
-     * the list as we find matches, without keeping too many temp variables.
-     */
-    while (z->rover) {
+    /* Loop over the slots until we reach an empty one (or just once, if
+     * onlyone). Matching blocks are removed from the index as we find them,
+     * but that only marks their slots as deleted, so we can just carry on. */
+    do {
         zs_blockid id;
+        int same_tag;
+
+        if (onlyone) {
+            id = s->next_match;
+            same_tag = rsum_tag(z, block_rsum(z, id)) == tag;
+        }
+        else {
+            const uint64_t e = z->rsum_hash[slot];
 
-        e = z->rover;
-        z->rover = onlyone ? NULL : e->next;
+            slot = next_slot(z, slot);
+            id = slot_id(z, e);
+            if (id == SLOT_EMPTY)
+                break;
+            probes++;
+            if (id == SLOT_DELETED)
+                continue;
+            same_tag = slot_tag_is(z, e, tag);
+        }
 
         /* Check weak checksum first */
 
-        z->stats.hashhit++;
-        if (e->r.a != (r.a & z->rsum_a_mask) || e->r.b != r.b) {
+        s->stats.hashhit++;
+        if (!same_tag) {
             continue;
         }
 
-        id = get_HE_blockid(z, e);
-
         if (!onlyone && z->seq_matches > 1
-            && (z->blockhashes[id + 1].r.a != (z->r[1].a & z->rsum_a_mask)
-                || z->blockhashes[id + 1].r.b != z->r[1].b))
+            && rsum_tag(z, block_rsum(z, id + 1)) != rsum_tag(z, s->r[1]))
             continue;
 
-        z->stats.weakhit++;
-
         {
             int ok = 1;
             signed int check_md4 = 0;
@@ -242,38 +477,84 @@ static int check_checksums_on_hash_chain(struct rcksum_state *const z,
              * or these could be preceding blocks that we have verified
              * already. */
             do {
-                /* We only calculate the MD4 once we need it; but need not do so twice */
+                /* Past the two blocks whose rsums we have rolled, check the
+                 * rsum of each further block before anything else */
+                if (check_md4 > 1 && !checksums) {
+                    if (check_md4 > done_tag) {
+                        tags[check_md4] = rsum_tag(z,
+                            rcksum_calc_rsum_block(data + z->blocksize * check_md4,
+                                                   z->blocksize));
+                        done_tag = check_md4;
+                    }
+                    if (tags[check_md4]
+                        != rsum_tag(z, block_rsum(z, id + check_md4))) {
+                        ok = 0;
+                        break;
+                    }
+                }
+
+                /* With the high halves of the rsums, check those first, as
+                 * they cost much less to work out than the checksum (which
+                 * we needn't if we have it already) */
+                if (z->rsum_high_mask && !checksums) {
+                    if (check_md4 > done_high) {
+                        high[check_md4] = rsum_high_tag(z,
+                            rcksum_calc_rsum_high(data + z->blocksize * check_md4,
+                                                  z->blocksize));
+                        done_high = check_md4;
+                    }
+                    if (high[check_md4]
+                        != rsum_high_tag(z, block_rsum_high(z, id + check_md4))) {
+                        ok = 0;
+                        break;
+                    }
+                }
+
+                /* The rsums match, so this block counts as a weak hit;
+                 * only now do we need its checksum, but not twice */
+                s->stats.weakhit++;
                 if (check_md4 > done_md4) {
-                    rcksum_calc_checksum(&md4sum[check_md4][0],
-                                         data + z->blocksize * check_md4,
-                                         z->blocksize);
+                    if (checksums)
+                        memcpy(&md4sum[check_md4][0],
+                               checksums + CHECKSUM_SIZE * check_md4,
+                               CHECKSUM_SIZE);
+                    else {
+                        calc_checksums(z->hash, &md4sum[check_md4][0],
+                                       data + z->blocksize * check_md4, 1,
+                                       z->blocksize, 1);
+                        s->stats.checksummed++;
+                    }
                     done_md4 = check_md4;
-                    z->stats.checksummed++;
                 }
 
                 /* Now check the strong checksum for this block */
                 if (memcmp(&md4sum[check_md4],
-                     z->blockhashes[id + check_md4].checksum,
-                     z->checksum_bytes))
+                     block_checksum(z, id + check_md4),
+                     z->checksum_bytes)) {
+                    s->stats.weakmiss++;
                     ok = 0;
+                }
 
                 check_md4++;
             } while (ok && !onlyone && check_md4 < z->seq_matches);
 
             if (ok) {
-                write_blocks(z, data, id, id + check_md4 - 1);
+                queue_blocks(z, s, data, id, id + check_md4 - 1);
                 got_blocks += check_md4;
-                z->stats.stronghit += check_md4;
-                z->next_match = z->blockhashes + id + check_md4;
+                s->stats.stronghit += check_md4;
+                s->next_match = id + check_md4;
             }
         }
-    }
+    } while (!onlyone);
+    if (!onlyone)
+        count_chain(&s->stats, probes);
     return got_blocks;
 }
 
-/* rcksum_submit_source_data(self, data, datalen, offset)
+/* scan_source_data(self, scan_state, data, datalen, offset)
  * Reads the supplied data (length datalen) and identifies any contained blocks
- * of data that can be used to make up the target file.
+ * of data that can be used to make up the target file; the state of the scan
+ * is kept in scan_state between calls for the same stream of data.
  *
  * offset should be 0 for a new data stream (or if our position in the data
  * stream has been changed and does not match the last call) or should be the
@@ -289,33 +570,55 @@ static int check_checksums_on_hash_chain(struct rcksum_state *const z,
  *        us past the end of the buffer
  * r[0] - rolling checksum of the first blocksize bytes of the buffer
  * r[1] - rolling checksum of the next blocksize bytes of the buffer (if seq_matches > 1)
+ *
+ * Rather than rolling the checksums forward a byte at a time in this loop, we
+ * get the roll kernel to calculate them for a run of offsets at once, and then
+ * probe the bithash for each; see scan.c.
  */
-int rcksum_submit_source_data(struct rcksum_state *const z, unsigned char *data,
-                              size_t len, off_t offset) {
+zs_blockid scan_source_data(struct rcksum_state *const z,
+                            struct scan_state *const s,
+                            const unsigned char *data, size_t len,
+                            off_t offset) {
     /* The window in data[] currently being considered is 
      * [x, x+bs)
      */
     int x = 0;
     register int bs = z->blocksize;
-    int got_blocks = 0;
+    zs_blockid got_blocks = 0;
+    int run = ROLL_CHUNK_MIN;   /* number of offsets to calculate rsums for at once */
+
+    /* Where this data is in the source file, for queue_blocks */
+    s->data = data;
+    s->data_pos = s->src_base + offset;
+    if (len > z->context)
+        s->stats.bytes += len - z->context;
 
     if (offset) {
-        x = z->skip;
+        x = s->skip;
+
+        /* The skip may take us past every window in this buffer */
+        if (x + z->context > len) {
+            s->skip = x + z->context - len;
+            return 0;
+        }
     }
     else {
-        z->next_match = NULL;
+        s->next_match = -1;
     }
 
     if (x || !offset) {
-        z->r[0] = rcksum_calc_rsum_block(data + x, bs);
+        s->r[0] = rcksum_calc_rsum_block(data + x, bs);
         if (z->seq_matches > 1)
-            z->r[1] = rcksum_calc_rsum_block(data + x + bs, bs);
+            s->r[1] = rcksum_calc_rsum_block(data + x + bs, bs);
     }
-    z->skip = 0;
+    s->skip = 0;
 
     /* Work through the block until the current blocksize bytes being
      * considered, starting at x, is at the end of the buffer */
     for (;;) {
+        int thismatch = 0;
+        int blocks_matched = 0;
+
         if (x + z->context == len) {
             return got_blocks;
         }
@@ -324,101 +627,632 @@ int rcksum_submit_source_data(struct rcksum_state *const z, unsigned char *data,
         {   /* Catch rolling checksum failure */
             int k = 0;
             struct rsum c = rcksum_calc_rsum_block(data + x + bs * k, bs);
-            if (c.a != z->r[k].a || c.b != z->r[k].b) {
+            if (c.a != s->r[k].a || c.b != s->r[k].b) {
                 fprintf(stderr, "rsum miscalc (%d) at %lld\n", k, offset + x);
                 exit(3);
             }
         }
 #endif
 
-        {
-            int thismatch = 0;
-            int blocks_matched = 0;
-
-            /* If the previous block was a match, but we're looking for
-             * sequential matches, then test this block against the block in
-             * the target immediately after our previous hit. */
-            if (z->next_match && z->seq_matches > 1) {
-                if (0 != (thismatch = check_checksums_on_hash_chain(z, z->next_match, data + x, 1))) {
-                    blocks_matched = 1;
-                }
-                else
-                    z->next_match = NULL;
+        /* If the previous block was a match, but we're looking for
+         * sequential matches, then test this block against the block in
+         * the target immediately after our previous hit. */
+        if (s->next_match != -1 && z->seq_matches > 1) {
+            if (0 != (thismatch = check_checksums_on_hash_chain(z, s, 0, data + x, 1, NULL))) {
+                blocks_matched = 1;
             }
-            if (!blocks_matched) {
-                const struct hash_entry *e;
-
-                /* Do a hash table lookup - first in the bithash (fast negative
-                 * check) and then in the rsum hash */
-                unsigned hash = z->r[0].b;
-                hash ^= ((z->seq_matches > 1) ? z->r[1].b : z->r[0].a) << BITHASHBITS;
-                if ((z->bithash[(hash & z->bithashmask) >> 3] & (1 << (hash & 7))) != 0
-                    && (e = z->rsum_hash[hash & z->hashmask]) != NULL) {
-
-                    /* Okay, we have a hash hit. Follow the hash chain and
-                     * check our block against all the entries. */
-                    thismatch = check_checksums_on_hash_chain(z, e, data + x, 0);
-                    if (thismatch)
+            else
+                s->next_match = -1;
+        }
+        if (!blocks_matched) {
+            /* Calculate the rsums for a run of offsets from here, then work
+             * through them doing a hash table lookup at each - first in the
+             * bithash (fast negative check) and then in the rsum hash */
+            struct rsum r0[ROLL_CHUNK], r1[ROLL_CHUNK];
+            struct rsum next[2];
+            int n = len - z->context - x;
+            int i;
+
+            if (n > run)
+                n = run;
+            next[0] = s->r[0];
+            next[1] = s->r[1];
+            z->roll(z, data + x, n, next, r0, r1);
+
+            for (i = 0; i < n; i++) {
+                uint64_t hash = calc_rhash(z, r0[i], r1[i]);
+                size_t slot = hash_slot_of(hash, z->hashslots);
+
+                if (bithash_test(z, hash)
+                    && slot_id(z, z->rsum_hash[slot]) != SLOT_EMPTY) {
+
+                    /* Okay, we have a hash hit. Follow the run of slots in
+                     * the index and check our block against all the entries. */
+                    s->r[0] = r0[i];
+                    if (z->seq_matches > 1)
+                        s->r[1] = r1[i];
+                    thismatch = check_checksums_on_hash_chain(z, s, slot, data + x + i, 0, NULL);
+                    if (thismatch) {
                         blocks_matched = z->seq_matches;
+                        break;
+                    }
                 }
             }
-            got_blocks += thismatch;
-
-            /* If we got a hit, skip forward (if a block in the target matches
-             * at x, it's highly unlikely to get a hit at x+1 as all the
-             * target's blocks are multiples of the blocksize apart. */
-            if (blocks_matched) {
-                x += bs + (blocks_matched > 1 ? bs : 0);
-
-                if (x + z->context > len) {
-                    /* can't calculate rsum for block after this one, because
-                     * it's not in the buffer. So leave a hint for next time so
-                     * we know we need to recalculate */
-                    z->skip = x + z->context - len;
-                    return got_blocks;
-                }
+            x += i;
 
-                /* If we are moving forward just 1 block, we already have the
-                 * following block rsum. If we are skipping both, then
-                 * recalculate both */
-                if (z->seq_matches > 1 && blocks_matched == 1)
-                    z->r[0] = z->r[1];
-                else
-                    z->r[0] = rcksum_calc_rsum_block(data + x, bs);
-                if (z->seq_matches > 1)
-                    z->r[1] = rcksum_calc_rsum_block(data + x + bs, bs);
+            /* No match in this run - carry on from the end of it, with the
+             * runs getting longer while there are no matches to be had */
+            if (!blocks_matched) {
+                s->r[0] = next[0];
+                s->r[1] = next[1];
+                if (run < ROLL_CHUNK)
+                    run *= 2;
                 continue;
             }
+            run = ROLL_CHUNK_MIN;
         }
+        got_blocks += thismatch;
 
-        /* Else - advance the window by 1 byte - update the rolling checksum
-         * and our offset in the buffer */
-        {
-            unsigned char Nc = data[x + bs * 2];
-            unsigned char nc = data[x + bs];
-            unsigned char oc = data[x];
-            UPDATE_RSUM(z->r[0].a, z->r[0].b, oc, nc, z->blockshift);
+        /* If we got a hit, skip forward (if a block in the target matches
+         * at x, it's highly unlikely to get a hit at x+1 as all the
+         * target's blocks are multiples of the blocksize apart. */
+        if (blocks_matched) {
+            x += bs * blocks_matched;
+
+            if (x + z->context > len) {
+                /* can't calculate rsum for block after this one, because
+                 * it's not in the buffer. So leave a hint for next time so
+                 * we know we need to recalculate */
+                s->skip = x + z->context - len;
+                return got_blocks;
+            }
+
+            /* If we are moving forward just 1 block, we already have the
+             * following block rsum. If we are skipping more, then
+             * recalculate both */
+            if (z->seq_matches > 1 && blocks_matched == 1)
+                s->r[0] = s->r[1];
+            else
+                s->r[0] = rcksum_calc_rsum_block(data + x, bs);
             if (z->seq_matches > 1)
-                UPDATE_RSUM(z->r[1].a, z->r[1].b, nc, Nc, z->blockshift);
+                s->r[1] = rcksum_calc_rsum_block(data + x + bs, bs);
         }
-        x++;
     }
 }
 
+/* rcksum_submit_source_data(self, data, datalen, offset)
+ * Reads the supplied data (length datalen) and identifies any contained blocks
+ * of data that can be used to make up the target file.
+ *
+ * offset should be 0 for a new data stream (or if our position in the data
+ * stream has been changed and does not match the last call) or should be the
+ * offset in the whole source stream otherwise.
+ *
+ * Returns the number of blocks in the target file that we obtained as a result
+ * of reading this buffer. 
+ */
+zs_blockid rcksum_submit_source_data(struct rcksum_state *const z,
+                                     unsigned char *data, size_t len,
+                                     off_t offset) {
+    return scan_source_data(z, &z->scan, data, len, offset);
+}
+
+/* scan_mapped(self, scan_state, data, len, end, progress, drop_behind)
+ * Scans the source data in memory, which is the whole of the rest of a source
+ * stream, for blocks of the target starting at offsets before end. If
+ * drop_behind is set, data[] is a mapped file and we discard the pages of it
+ * that we have finished with as we go. Returns the number of blocks obtained.
+ */
+#define SCAN_MAPPED_CHUNK (1 << 20)
+
+static zs_blockid scan_mapped(struct rcksum_state *z, struct scan_state *s,
+                              const unsigned char *data, size_t len,
+                              size_t end, int progress, int drop_behind) {
+    zs_blockid got_blocks = 0;
+    size_t x = 0;
+    size_t inside = len > z->context ? len - z->context : 0;
+#if defined(_POSIX_MAPPED_FILES) && defined(MADV_DONTNEED)
+    const unsigned char *dropped = data;
+    const uintptr_t pagemask = ~(uintptr_t) (sysconf(_SC_PAGESIZE) - 1);
+#endif
+
+    if (inside > end)
+        inside = end;
+
+    /* Offsets where the data for a match is all there in the mapping, we can
+     * scan in place. Do it a chunk at a time so we can report progress and
+     * drop pages behind us. */
+    while (x < inside && !all_blocks_known(z)) {
+        size_t n = inside - x;
+
+        if (n > SCAN_MAPPED_CHUNK)
+            n = SCAN_MAPPED_CHUNK;
+        got_blocks += scan_source_data(z, s, data + x, n + z->context, x);
+        x += n;
+
+#if defined(_POSIX_MAPPED_FILES) && defined(MADV_DONTNEED)
+        if (drop_behind) {
+            const unsigned char *p =
+                (const unsigned char *)((uintptr_t) (data + x) & pagemask);
+            if (p > dropped) {
+                madvise((void *)dropped, p - dropped, MADV_DONTNEED);
+                dropped = p;
+            }
+        }
+#endif
+        if (progress && (x - n) / 1000000 != x / 1000000)
+            fputc('*', stderr);
+    }
+
+    if (x < end && !all_blocks_known(z)) {
+        /* The last context bytes' worth of offsets need the data zero-padded
+         * at the end, as rcksum_submit_source_file does; so copy that little
+         * bit to a buffer with space for the padding */
+        unsigned char *tail = calloc(2, z->context);
+
+        if (tail) {
+            memcpy(tail, data + x, len - x);
+            got_blocks += scan_source_data(z, s, tail,
+                                           len - x + z->context, x);
+            free(tail);
+        }
+    }
+    return got_blocks;
+}
+
+/* How many blocks scan_aligned looks at before deciding whether it is worth
+ * carrying on, and the least fraction (1/n) of them it must find to do so */
+#define ALIGNED_TRIAL_BLOCKS 4096
+#define ALIGNED_MIN_FRACTION 4
+
+/* And how many blocks it checksums at once */
+#define ALIGNED_BATCH 64
+
+/* struct aligned_pass
+ * Where scan_aligned has got to */
+struct aligned_pass {
+    struct scan_state s;        /* for the blocks that it finds */
+    struct scan_state *main;    /* and for the full scan in between */
+    const unsigned char *data;
+    size_t len;
+    off_t base;                 /* data[] is at this offset in the source */
+    size_t gap;                 /* start of the stretch where nothing was found */
+    size_t found;               /* and how many bytes have been */
+    zs_blockid run;             /* start of the current run of blocks matching
+                                 * the target's at the same offset, or -1 */
+    zs_blockid got_blocks;
+};
+
+/* aligned_found(self, aligned_pass, start, end)
+ * Called when scan_aligned has found data for the target at [start, end) in
+ * the source data; first does the full scan of the stretch before it, where
+ * nothing was found. */
+static void aligned_found(struct rcksum_state *z, struct aligned_pass *p,
+                          size_t start, size_t end) {
+    if (start < p->gap)
+        start = p->gap;
+    if (p->gap < start) {
+        p->main->src_base = p->base + p->gap;
+        p->got_blocks += scan_mapped(z, p->main, p->data + p->gap,
+                                     p->len - p->gap, start - p->gap, 0, 0);
+        p->main->src_base = p->base;
+    }
+    p->found += end - start;
+    p->gap = end;
+}
+
+/* aligned_run_ends(self, aligned_pass, end)
+ * The run of blocks in the source that match those of the target at the same
+ * offset ends before block end. If it is long enough to count as a match,
+ * record the blocks (those that we don't have already). */
+static void aligned_run_ends(struct rcksum_state *z, struct aligned_pass *p,
+                             zs_blockid end) {
+    zs_blockid id = p->run;
+
+    if (id == -1)
+        return;
+    p->run = -1;
+    p->s.next_match = -1;
+    if (end - id < z->seq_matches)
+        return;
+
+    aligned_found(z, p, (size_t) id << z->blockshift,
+                  (size_t) end << z->blockshift);
+    while (id < end) {
+        zs_blockid from;
+
+        for (; id < end && already_got_block(z, id); id++);
+        for (from = id; id < end && !already_got_block(z, id); id++);
+        if (id > from) {
+            queue_blocks(z, &p->s, p->data + ((size_t) from << z->blockshift),
+                         from, id - 1);
+            p->got_blocks += id - from;
+            p->s.stats.stronghit += id - from;
+        }
+    }
+}
+
+/* scan_aligned(self, scan_state, data, len, cache, progress, drop_behind, &done)
+ * A quick first pass over source data in memory, as for scan_mapped, for the
+ * common case where the source is an older version of the target with the
+ * same layout. Only the whole blocks at multiples of the blocksize into data[]
+ * are looked at: first against the target's block at the same offset, with
+ * the checksums done many blocks at a time; and for those that don't match,
+ * in the block index, as the full scan would at that offset. Only the
+ * stretches in between where nothing was found get the full scan (which
+ * finds blocks that have moved by other than whole blocks). drop_behind is as
+ * for scan_mapped. If cache is not NULL, it has the rsums and checksums of the
+ * blocks of data[], so only the stretches that get the full scan (and blocks
+ * that we can't copy from the source file) need be read.
+ *
+ * If too few blocks are found like this for it to be worth it, it gives up;
+ * *done is set to how far into data[] it got, leaving the rest for the full
+ * scan. Returns the number of blocks obtained. */
+static zs_blockid scan_aligned(struct rcksum_state *z, struct scan_state *s,
+                               const unsigned char *data, size_t len,
+                               const struct seed_cache *cache,
+                               int progress, int drop_behind, size_t *done) {
+    struct aligned_pass p;
+    const size_t bs = z->blocksize;
+    const zs_blockid nblocks = len >> z->blockshift;
+    zs_blockid k = 0;
+    size_t chunk = 0;
+    int trial = 1;
+#if defined(_POSIX_MAPPED_FILES) && defined(MADV_DONTNEED)
+    const unsigned char *dropped = data;
+    const uintptr_t pagemask = ~(uintptr_t) (sysconf(_SC_PAGESIZE) - 1);
+#endif
+
+    /* The blocks found have a scan state of their own, as the full scan of
+     * the stretches in between uses the main one */
+    memset(&p, 0, sizeof p);
+    p.main = s;
+    p.s.next_match = -1;
+    p.s.src_fd = s->src_fd;
+    p.s.src_base = p.s.data_pos = s->src_base;
+    p.s.src_end = s->src_end;
+    p.s.no_copy_range = s->no_copy_range;
+    p.s.data = data;
+    p.data = data;
+    p.len = len;
+    p.base = s->src_base;
+    p.run = -1;
+
+    while (k < nblocks && !all_blocks_known(z)) {
+        struct rsum r[ALIGNED_BATCH + 1];
+        unsigned char checksums[ALIGNED_BATCH][CHECKSUM_SIZE];
+        char same[ALIGNED_BATCH];
+        zs_blockid n = nblocks - k;
+        int any = 0;
+        int i;
+
+        if (n > ALIGNED_BATCH)
+            n = ALIGNED_BATCH;
+
+        /* Which of this batch of blocks have the same rsum as the target's
+         * block at the same offset; and for those, the same checksum */
+        for (i = 0; i < n; i++) {
+            zs_blockid id = k + i;
+
+            r[i] = cache ? cache->rsums[id]
+                : rcksum_calc_rsum_block(data + ((size_t) id << z->blockshift), bs);
+            same[i] = id < z->loaded
+                && rsum_tag(z, block_rsum(z, id)) == rsum_tag(z, r[i]);
+            any |= same[i];
+        }
+        if (k + n < nblocks)
+            r[n] = cache ? cache->rsums[k + n]
+                : rcksum_calc_rsum_block(data + ((size_t) (k + n) << z->blockshift), bs);
+        if (any && cache)
+            memcpy(checksums[0], cache->checksums + (size_t) k * CHECKSUM_SIZE,
+                   n * CHECKSUM_SIZE);
+        else if (any) {
+            /* Just the runs of those blocks, each as one batch */
+            for (i = 0; i < n; i++) {
+                int j = i;
+
+                if (!same[i])
+                    continue;
+                while (i + 1 < n && same[i + 1])
+                    i++;
+                calc_checksums(z->hash, checksums[j],
+                               data + ((size_t) (k + j) << z->blockshift),
+                               i + 1 - j, bs, CHECKSUM_ANY_LANES);
+                p.s.stats.checksummed += i + 1 - j;
+            }
+        }
+        for (i = 0; i < n; i++) {
+            if (!same[i])
+                continue;
+            p.s.stats.weakhit++;
+            if (memcmp(checksums[i], block_checksum(z, k + i),
+                       z->checksum_bytes)) {
+                same[i] = 0;
+                p.s.stats.weakmiss++;
+            }
+        }
+
+        for (i = 0; i < n; i++) {
+            zs_blockid id = k + i;
+            size_t x = (size_t) id << z->blockshift;
+            uint64_t hash;
+            size_t slot;
+            int thismatch;
+
+            if (same[i]) {
+                if (p.run == -1)
+                    p.run = id;
+                continue;
+            }
+            aligned_run_ends(z, &p, id);
+
+            /* Otherwise look this block up as the full scan would; but only
+             * if we haven't already been past it */
+            if (x < p.gap || x + z->context > len)
+                continue;
+            p.s.r[0] = r[i];
+            if (z->seq_matches > 1)
+                p.s.r[1] = r[i + 1];
+
+            /* Just after blocks found like that, the full scan would try the
+             * block of the target following them on its own first; and that
+             * may be all that there is of it here, before other data */
+            if (p.s.next_match != -1 && x == p.gap && z->seq_matches > 1) {
+                thismatch = check_checksums_on_hash_chain(z, &p.s, 0, data + x, 1,
+                    cache ? cache->checksums + (size_t) id * CHECKSUM_SIZE : NULL);
+                if (thismatch) {
+                    aligned_found(z, &p, x, x + bs);
+                    p.got_blocks += thismatch;
+                    continue;
+                }
+            }
+            p.s.next_match = -1;
+
+            hash = calc_rhash(z, p.s.r[0], p.s.r[1]);
+            slot = hash_slot_of(hash, z->hashslots);
+            if (!bithash_test(z, hash)
+                || slot_id(z, z->rsum_hash[slot]) == SLOT_EMPTY)
+                continue;
+            thismatch = check_checksums_on_hash_chain(z, &p.s, slot, data + x, 0,
+                cache ? cache->checksums + (size_t) id * CHECKSUM_SIZE : NULL);
+            if (thismatch) {
+                aligned_found(z, &p, x, x + z->context);
+                p.got_blocks += thismatch;
+            }
+        }
+        k += n;
+
+        /* Report progress and drop pages behind us, a chunk at a time; we
+         * still need the pages of the stretch that hasn't had the full scan */
+        if (((size_t) k << z->blockshift) / SCAN_MAPPED_CHUNK != chunk) {
+            size_t x = (size_t) k << z->blockshift;
+#if defined(_POSIX_MAPPED_FILES) && defined(MADV_DONTNEED)
+            const unsigned char *q =
+                (const unsigned char *)((uintptr_t) (data + p.gap) & pagemask);
+            if (drop_behind && q > dropped) {
+                madvise((void *)dropped, q - dropped, MADV_DONTNEED);
+                dropped = q;
+            }
+#endif
+            if (progress && chunk * SCAN_MAPPED_CHUNK / 1000000 != x / 1000000)
+                fputc('*', stderr);
+            chunk = x / SCAN_MAPPED_CHUNK;
+        }
+
+        /* Give up if it's not finding much */
+        if (trial && k >= ALIGNED_TRIAL_BLOCKS) {
+            if (p.found < ((size_t) k << z->blockshift) / ALIGNED_MIN_FRACTION)
+                break;
+            trial = 0;
+        }
+    }
+    aligned_run_ends(z, &p, k);
+
+    /* Write out what we found, and add to the stats for this source */
+    flush_write_behind(z, &p.s);
+    free(p.s.wb.buf);
+    p.s.stats.bytes += p.found;
+    add_scan_stats(&s->stats, &p.s.stats);
+    s->no_copy_range |= p.s.no_copy_range;
+
+    *done = p.gap;
+    return p.got_blocks;
+}
+
+/* scan_source_fd(self, scan_state, fd, start, progress)
+ * Scans the file open on fd, from offset start to EOF, for blocks of the target.
+ * Returns the number of blocks obtained, or -1 if it isn't a plain file that
+ * we can read like this, in which case nothing has been read. */
+static zs_blockid scan_source_fd(struct rcksum_state *z, struct scan_state *s,
+                                 int fd, off_t start, int progress) {
+    struct stat st;
+    struct phase_timer t;
+    zs_blockid got_blocks = 0;
+    zs_blockid rc = -1;
+#ifdef _POSIX_MAPPED_FILES
+    unsigned char *map = MAP_FAILED;
+    size_t len;
+#endif
+
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < start)
+        return -1;
+
+#ifdef _POSIX_MAPPED_FILES
+    /* Map the file, to scan it in place (if it will fit in our address
+     * space, and isn't empty, which can't be mapped) */
+    len = st.st_size;
+    if ((off_t) len == st.st_size && len)
+        map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    if (map != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+        madvise(map, len, MADV_SEQUENTIAL);
+#endif
+
+        /* Blocks found can be copied from the file itself; but that must be
+         * done before we hand the file back */
+        s->src_fd = fd;
+        s->src_base = start;
+        s->src_end = st.st_size;
+
+        /* Try the quick pass first; the full scan need only do what's left.
+         * If we have a seed cache for the file, and we are at a whole block
+         * offset in it, it has the checksums for that. */
+        if (z->aligned_scan) {
+            struct seed_cache cache;
+            int cached;
+            size_t done;
+
+            phase_begin(&t);
+            cached = !(start & (z->blocksize - 1))
+                && open_seed_cache(z, fd, map, &cache);
+            if (cached) {
+                cache.rsums += start >> z->blockshift;
+                cache.checksums += (start >> z->blockshift) * CHECKSUM_SIZE;
+            }
+            got_blocks = scan_aligned(z, s, map + start, len - start,
+                                      cached ? &cache : NULL, progress,
+                                      1, &done);
+            if (cached)
+                close_seed_cache(&cache);
+            start += done;
+            s->src_base = start;
+            phase_end(z, RCKSUM_PHASE_ALIGNED, &t);
+        }
+    }
+#endif
+
+    phase_begin(&t);
+#ifdef _POSIX_THREADS
+    /* Split the file between several threads if we can; not for a scanner,
+     * which is already one of several scanning at once */
+    if (z->threads > 1 && s == &z->scan && !all_blocks_known(z))
+        rc = scan_source_fd_threaded(z, fd, start, st.st_size, progress);
+#endif
+
+#ifdef _POSIX_MAPPED_FILES
+    if (map != MAP_FAILED) {
+        if (rc < 0)
+            rc = scan_mapped(z, s, map + start, len - start, len - start,
+                             progress, 1);
+        flush_write_behind(z, s);
+        s->src_fd = -1;
+        munmap(map, len);
+    }
+#endif
+    phase_end(z, RCKSUM_PHASE_SCAN, &t);
+    return rc < 0 ? rc : got_blocks + rc;
+}
+
+/* scan_result(self, got_blocks)
+ * What rcksum_submit_source_* return, having found got_blocks blocks */
+static zs_blockid scan_result(const struct rcksum_state *z,
+                              zs_blockid got_blocks) {
+    return all_blocks_known(z) ? RCKSUM_COMPLETE : got_blocks;
+}
+
+/* rcksum_submit_source_fd(self, fd, progress)
+ * As rcksum_submit_source_file, but reading from the file descriptor (from its
+ * current position). A plain file is mapped into memory and scanned in place,
+ * rather than being copied through a buffer. */
+zs_blockid rcksum_submit_source_fd(struct rcksum_state *z, int fd,
+                                   int progress) {
+    off_t start;
+
+    if (all_blocks_known(z))
+        return RCKSUM_COMPLETE;
+    start = lseek(fd, 0, SEEK_CUR);
+
+    /* Build checksum hash tables ready to analyse the blocks we find */
+    if (!z->rsum_hash)
+        if (!build_hash(z))
+            return 0;
+
+    if (start != -1) {
+        zs_blockid rc = scan_source_fd(z, &z->scan, fd, start, progress);
+        if (rc >= 0) {
+            lseek(fd, 0, SEEK_END);
+            return scan_result(z, rc);
+        }
+    }
+
+    {   /* Something we can only read serially - do it through stdio on a
+         * copy of the descriptor, so it stays open for our caller */
+        int d = dup(fd);
+        FILE *f = d != -1 ? fdopen(d, "r") : NULL;
+        zs_blockid rc;
+
+        if (!f) {
+            perror("fdopen");
+            if (d != -1)
+                close(d);
+            return 0;
+        }
+        rc = rcksum_submit_source_file(z, f, progress);
+        fclose(f);
+        return rc;
+    }
+}
+
+/* rcksum_submit_source_mmap(self, data, len, progress)
+ * Scans the given data, which is the whole of a source stream (typically a
+ * file that the caller has mapped into memory), in place. */
+zs_blockid rcksum_submit_source_mmap(struct rcksum_state *z,
+                                     const unsigned char *data, size_t len,
+                                     int progress) {
+    struct phase_timer t;
+    zs_blockid got_blocks = 0;
+    size_t done = 0;
+
+    if (all_blocks_known(z))
+        return RCKSUM_COMPLETE;
+
+    /* Build checksum hash tables ready to analyse the blocks we find */
+    if (!z->rsum_hash)
+        if (!build_hash(z))
+            return 0;
+
+    if (z->aligned_scan) {
+        phase_begin(&t);
+        got_blocks = scan_aligned(z, &z->scan, data, len, NULL, progress, 0,
+                                  &done);
+        phase_end(z, RCKSUM_PHASE_ALIGNED, &t);
+    }
+    phase_begin(&t);
+    got_blocks += scan_mapped(z, &z->scan, data + done, len - done,
+                              len - done, progress, 0);
+    phase_end(z, RCKSUM_PHASE_SCAN, &t);
+    return scan_result(z, got_blocks);
+}
+
 /* rcksum_submit_source_file(self, stream, progress)
  * Read the given stream, applying the rsync rolling checksum algorithm to
  * identify any blocks of data in common with the target file. Blocks found are
  * written to our working target output. Progress reports if progress != 0
  */
-int rcksum_submit_source_file(struct rcksum_state *z, FILE * f, int progress) {
+zs_blockid rcksum_submit_source_file(struct rcksum_state *z, FILE * f,
+                                     int progress) {
+    return scan_source_file(z, &z->scan, f, progress);
+}
+
+/* scan_source_file(self, scan_state, stream, progress)
+ * Does the work of rcksum_submit_source_file, with the given scan state */
+zs_blockid scan_source_file(struct rcksum_state *z, struct scan_state *s,
+                            FILE * f, int progress) {
+    struct phase_timer t;
+
     /* Track progress */
-    int got_blocks = 0;
+    zs_blockid got_blocks = 0;
     off_t in = 0;
     int in_mb = 0;
+    register int bufsize;
+    unsigned char *buf;
+
+    if (all_blocks_known(z))
+        return RCKSUM_COMPLETE;
 
     /* Allocate buffer of 16 blocks */
-    register int bufsize = z->blocksize * 16;
-    unsigned char *buf = malloc(bufsize + z->context);
+    bufsize = z->blocksize * 16;
+    buf = malloc(bufsize + z->context);
     if (!buf)
         return 0;
 
@@ -429,7 +1263,23 @@ int rcksum_submit_source_file(struct rcksum_state *z, FILE * f, int progress) {
             return 0;
         }
 
-    while (!feof(f)) {
+    {   /* If this is a plain file, read it directly rather than through
+         * stdio; and leave the stream at EOF as if we had */
+        off_t start = ftello(f);
+
+        if (start != -1 && fileno(f) != -1) {
+            zs_blockid rc = scan_source_fd(z, s, fileno(f), start, progress);
+            if (rc >= 0) {
+                fseeko(f, 0, SEEK_END);
+                free(buf);
+                return scan_result(z, rc);
+            }
+        }
+    }
+
+    /* Stop reading once there is nothing left to find */
+    phase_begin(&t);
+    while (!feof(f) && !all_blocks_known(z)) {
         size_t len;
         off_t start_in = in;
 
@@ -455,6 +1305,7 @@ int rcksum_submit_source_file(struct rcksum_state *z, FILE * f, int progress) {
         if (ferror(f)) {
             perror("fread");
             free(buf);
+            phase_end(z, RCKSUM_PHASE_SCAN, &t);
             return got_blocks;
         }
         if (feof(f)) {          /* 0 pad to complete a block */
@@ -463,12 +1314,13 @@ int rcksum_submit_source_file(struct rcksum_state *z, FILE * f, int progress) {
         }
 
         /* Process the data in the buffer, and report progress */
-        got_blocks += rcksum_submit_source_data(z, buf, len, start_in);
+        got_blocks += scan_source_data(z, s, buf, len, start_in);
         if (progress && in_mb != in / 1000000) {
             in_mb = in / 1000000;
             fputc('*', stderr);
         }
     }
+    phase_end(z, RCKSUM_PHASE_SCAN, &t);
     free(buf);
-    return got_blocks;
+    return scan_result(z, got_blocks);
 }
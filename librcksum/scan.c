@@ -0,0 +1,216 @@
+/*
+ *   rcksum/lib - library for using the rsync algorithm to determine
+ *               which parts of a file you have and which you need.
+ *   Copyright (C) 2004,2005,2007,2009 Colin Phipps <cph@moria.org.uk>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* Rolling checksum kernels for the search for matching blocks. Each calculates
+ * the rsums at a run of consecutive offsets in the source data into arrays,
+ * which rcksum_submit_source_data then probes against the bithash; only
+ * offsets that hit there go on to the scalar hash chain walk. The run of rsums
+ * only depends on the data, not on whether there were hits, so it is only
+ * discarded if we actually match a block and jump forward.
+ *
+ * The plain C kernel advances one byte at a time. The SIMD kernels compute the
+ * rsums for 8 or 16 consecutive offsets at once: the rolling update of a is a
+ * prefix sum of (incoming byte - outgoing byte), and b is then a prefix sum of
+ * the a values (less the outgoing byte shifted by the blocksize), so both can
+ * be done in log2(lanes) vector adds. The 16-bit lanes wrap exactly as the
+ * unsigned shorts in struct rsum do, so the results are identical.
+ */
+
+#include "zsglobal.h"
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+#ifdef WITH_DMALLOC
+# include <dmalloc.h>
+#endif
+
+#include "rcksum.h"
+#include "internal.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define ROLL_X86_SIMD 1
+# include <immintrin.h>
+#endif
+
+/* roll_plain(self, data[], n, r[], r0[], r1[])
+ * Roll kernel in plain C, moving the window one byte at a time. */
+static void roll_plain(const struct rcksum_state *z, const unsigned char *data,
+                       int n, struct rsum r[2], struct rsum *r0,
+                       struct rsum *r1) {
+    const int bs = z->blocksize;
+    int x;
+
+    for (x = 0; x < n; x++) {
+        r0[x] = r[0];
+        UPDATE_RSUM(r[0].a, r[0].b, data[x], data[x + bs], z->blockshift);
+        if (z->seq_matches > 1) {
+            r1[x] = r[1];
+            UPDATE_RSUM(r[1].a, r[1].b, data[x + bs], data[x + bs * 2],
+                        z->blockshift);
+        }
+    }
+}
+
+#ifdef ROLL_X86_SIMD
+
+/* roll8_sse41(outgoing, incoming, shift, &rsum, out[])
+ * Given the 8 bytes leaving and the 8 bytes entering the window as it moves
+ * forward over 8 offsets, and the rsum at the first offset, store the rsums at
+ * each of those 8 offsets in out[], and update the rsum to the offset
+ * following them. */
+__attribute__ ((target("sse4.1")))
+static inline void roll8_sse41(__m128i o, __m128i n, __m128i shift,
+                               struct rsum *r, struct rsum *out) {
+    /* Running total of the change in a; gives a at offsets 1..8 */
+    __m128i a = _mm_sub_epi16(n, o);
+    a = _mm_add_epi16(a, _mm_slli_si128(a, 2));
+    a = _mm_add_epi16(a, _mm_slli_si128(a, 4));
+    a = _mm_add_epi16(a, _mm_slli_si128(a, 8));
+    a = _mm_add_epi16(a, _mm_set1_epi16((short)r->a));
+
+    {   /* The change in b at each step uses the a after that step */
+        __m128i b = _mm_sub_epi16(a, _mm_sll_epi16(o, shift));
+        b = _mm_add_epi16(b, _mm_slli_si128(b, 2));
+        b = _mm_add_epi16(b, _mm_slli_si128(b, 4));
+        b = _mm_add_epi16(b, _mm_slli_si128(b, 8));
+        b = _mm_add_epi16(b, _mm_set1_epi16((short)r->b));
+
+        {   /* Shift along one lane, bringing in the starting rsum, to get the
+             * values at offsets 0..7; and interleave them as struct rsums */
+            __m128i a0 = _mm_insert_epi16(_mm_slli_si128(a, 2), r->a, 0);
+            __m128i b0 = _mm_insert_epi16(_mm_slli_si128(b, 2), r->b, 0);
+            _mm_storeu_si128((__m128i *) out, _mm_unpacklo_epi16(a0, b0));
+            _mm_storeu_si128((__m128i *) (out + 4), _mm_unpackhi_epi16(a0, b0));
+        }
+
+        r->a = _mm_extract_epi16(a, 7);
+        r->b = _mm_extract_epi16(b, 7);
+    }
+}
+
+/* roll_sse41(self, data[], n, r[], r0[], r1[])
+ * Roll kernel calculating the rsums for 8 offsets at a time. */
+__attribute__ ((target("sse4.1")))
+static void roll_sse41(const struct rcksum_state *z, const unsigned char *data,
+                       int n, struct rsum r[2], struct rsum *r0,
+                       struct rsum *r1) {
+    const int bs = z->blocksize;
+    const __m128i shift = _mm_cvtsi32_si128(z->blockshift);
+    int x;
+
+    for (x = 0; x + 8 <= n; x += 8) {
+        __m128i o = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(data + x)));
+        __m128i m = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(data + x + bs)));
+
+        roll8_sse41(o, m, shift, &r[0], r0 + x);
+        if (z->seq_matches > 1) {
+            __m128i N = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(data + x + 2 * bs)));
+            roll8_sse41(m, N, shift, &r[1], r1 + x);
+        }
+    }
+    roll_plain(z, data + x, n - x, r, r0 + x, r1 + x);
+}
+
+/* prefix_avx2(v)
+ * Running sum along the 16 lanes of v */
+__attribute__ ((target("avx2")))
+static inline __m256i prefix_avx2(__m256i v) {
+    /* Within each 128-bit half first */
+    v = _mm256_add_epi16(v, _mm256_slli_si256(v, 2));
+    v = _mm256_add_epi16(v, _mm256_slli_si256(v, 4));
+    v = _mm256_add_epi16(v, _mm256_slli_si256(v, 8));
+
+    {   /* Then carry the total of the low half into the high half */
+        __m256i c = _mm256_permute2x128_si256(v, v, 0x08);
+        c = _mm256_shuffle_epi8(c, _mm256_set1_epi16(0x0f0e));
+        return _mm256_add_epi16(v, c);
+    }
+}
+
+/* shift_in_avx2(v, x)
+ * Move all lanes of v up by one, bringing x in to lane 0 */
+__attribute__ ((target("avx2")))
+static inline __m256i shift_in_avx2(__m256i v, unsigned short x) {
+    __m256i p = _mm256_permute2x128_si256(v, v, 0x08);
+    return _mm256_insert_epi16(_mm256_alignr_epi8(v, p, 14), x, 0);
+}
+
+/* roll16_avx2(outgoing, incoming, shift, &rsum, out[])
+ * As roll8_sse41, but for 16 offsets */
+__attribute__ ((target("avx2")))
+static inline void roll16_avx2(__m256i o, __m256i n, __m128i shift,
+                               struct rsum *r, struct rsum *out) {
+    __m256i a = prefix_avx2(_mm256_sub_epi16(n, o));
+    a = _mm256_add_epi16(a, _mm256_set1_epi16((short)r->a));
+
+    {
+        __m256i b = prefix_avx2(_mm256_sub_epi16(a, _mm256_sll_epi16(o, shift)));
+        b = _mm256_add_epi16(b, _mm256_set1_epi16((short)r->b));
+
+        {   /* Interleaving works within each 128-bit half, so the halves
+             * then need swapping around */
+            __m256i a0 = shift_in_avx2(a, r->a);
+            __m256i b0 = shift_in_avx2(b, r->b);
+            __m256i lo = _mm256_unpacklo_epi16(a0, b0);
+            __m256i hi = _mm256_unpackhi_epi16(a0, b0);
+            _mm256_storeu_si256((__m256i *) out, _mm256_permute2x128_si256(lo, hi, 0x20));
+            _mm256_storeu_si256((__m256i *) (out + 8), _mm256_permute2x128_si256(lo, hi, 0x31));
+        }
+
+        r->a = _mm256_extract_epi16(a, 15);
+        r->b = _mm256_extract_epi16(b, 15);
+    }
+}
+
+/* roll_avx2(self, data[], n, r[], r0[], r1[])
+ * Roll kernel calculating the rsums for 16 offsets at a time. */
+__attribute__ ((target("avx2")))
+static void roll_avx2(const struct rcksum_state *z, const unsigned char *data,
+                      int n, struct rsum r[2], struct rsum *r0,
+                      struct rsum *r1) {
+    const int bs = z->blocksize;
+    const __m128i shift = _mm_cvtsi32_si128(z->blockshift);
+    int x;
+
+    for (x = 0; x + 16 <= n; x += 16) {
+        __m256i o = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(data + x)));
+        __m256i m = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(data + x + bs)));
+
+        roll16_avx2(o, m, shift, &r[0], r0 + x);
+        if (z->seq_matches > 1) {
+            __m256i N = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(data + x + 2 * bs)));
+            roll16_avx2(m, N, shift, &r[1], r1 + x);
+        }
+    }
+    roll_sse41(z, data + x, n - x, r, r0 + x, r1 + x);
+}
+
+#endif
+
+/* select_roll_kernel(max_lanes)
+ * Returns the fastest roll kernel that this CPU supports, out of those that
+ * process at most max_lanes offsets at a time (so 1 gives the plain C one). */
+roll_kernel *select_roll_kernel(int max_lanes) {
+#ifdef ROLL_X86_SIMD
+    __builtin_cpu_init();
+    if (max_lanes >= 16 && __builtin_cpu_supports("avx2"))
+        return roll_avx2;
+    if (max_lanes >= 8 && __builtin_cpu_supports("sse4.1"))
+        return roll_sse41;
+#endif
+    return roll_plain;
+}
@@ -0,0 +1,118 @@
+/*
+ *   rcksum/lib - library for using the rsync algorithm to determine
+ *               which parts of a file you have and which you need.
+ *   Copyright (C) 2004,2005,2007,2009 Colin Phipps <cph@moria.org.uk>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* Scanners: scanning several streams of source data for blocks of the same
+ * target at once, from different threads. Each scanner has a scan state of
+ * its own, and the target's tables are shared; as when one file is scanned
+ * by several threads (see scanthreads.c), the block index is left as it is
+ * while there are any scanners, and blocks found are just recorded, under
+ * the rcksum_state's lock. Once the last scanner is done, the blocks found
+ * are removed from the index.
+ */
+
+#include "zsglobal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#ifdef WITH_DMALLOC
+# include <dmalloc.h>
+#endif
+
+#include "rcksum.h"
+#include "internal.h"
+
+struct rcksum_scanner {
+    struct rcksum_state *z;
+    struct scan_state s;
+};
+
+/* rcksum_scanner_new(rcksum_state)
+ * Creates and returns a scanner for source data for the given target, or
+ * NULL on error. */
+struct rcksum_scanner *rcksum_scanner_new(struct rcksum_state *z) {
+    struct rcksum_scanner *sc = calloc(1, sizeof *sc);
+    int ok;
+
+    if (!sc)
+        return NULL;
+    sc->z = z;
+    sc->s.next_match = -1;
+    sc->s.src_fd = -1;
+
+    /* The block index must be there before any scanning starts, and must
+     * stay as it is from then on */
+#ifdef _POSIX_THREADS
+    pthread_mutex_lock(&z->lock);
+#endif
+    ok = z->rsum_hash || build_hash(z);
+    if (ok && !z->scanners++) {
+#ifdef _POSIX_THREADS
+        z->commit_lock = &z->lock;
+#endif
+    }
+#ifdef _POSIX_THREADS
+    pthread_mutex_unlock(&z->lock);
+#endif
+    if (!ok) {
+        free(sc);
+        return NULL;
+    }
+    return sc;
+}
+
+/* rcksum_scanner_submit_data(scanner, data, len, offset)
+ * As rcksum_submit_source_data, for this scanner's stream */
+zs_blockid rcksum_scanner_submit_data(struct rcksum_scanner *sc,
+                                      const unsigned char *data, size_t len,
+                                      off_t offset) {
+    return scan_source_data(sc->z, &sc->s, data, len, offset);
+}
+
+/* rcksum_scanner_submit_file(scanner, stream, progress)
+ * As rcksum_submit_source_file, with this scanner; a plain file is read
+ * directly, with the aligned pass first, but is not split between threads. */
+zs_blockid rcksum_scanner_submit_file(struct rcksum_scanner *sc, FILE *f,
+                                      int progress) {
+    return scan_source_file(sc->z, &sc->s, f, progress);
+}
+
+/* rcksum_scanner_end(scanner)
+ * Writes out any blocks that the scanner has found and not yet written, and
+ * frees it. */
+void rcksum_scanner_end(struct rcksum_scanner *sc) {
+    struct rcksum_state *z = sc->z;
+
+    flush_write_behind(z, &sc->s);
+    free(sc->s.wb.buf);
+
+#ifdef _POSIX_THREADS
+    pthread_mutex_lock(&z->lock);
+#endif
+    add_scan_stats(&z->scan.stats, &sc->s.stats);
+    if (!--z->scanners) {
+#ifdef _POSIX_THREADS
+        z->commit_lock = NULL;
+#endif
+        remove_known_blocks(z);
+    }
+#ifdef _POSIX_THREADS
+    pthread_mutex_unlock(&z->lock);
+#endif
+    free(sc);
+}
@@ -0,0 +1,205 @@
+/*
+ *   rcksum/lib - library for using the rsync algorithm to determine
+ *               which parts of a file you have and which you need.
+ *   Copyright (C) 2004,2005,2007,2009 Colin Phipps <cph@moria.org.uk>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* Scanning a single source file with several threads. The file is split into
+ * consecutive segments, one per thread; each thread looks for blocks starting
+ * at offsets within its own segment, reading on past its end by the context
+ * that a match needs. The rsum hash and bithash are shared by all the threads
+ * and are not changed while they run; blocks found are recorded under a lock
+ * (see record_blocks), and are removed from the hash once all threads are
+ * done. Each thread holds back and writes out the blocks that it finds itself.
+ */
+
+#include "zsglobal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#ifdef WITH_DMALLOC
+# include <dmalloc.h>
+#endif
+
+#include "rcksum.h"
+#include "internal.h"
+
+#ifdef _POSIX_THREADS
+
+/* Don't split a file so finely that a thread gets less than this to do */
+#define MIN_SEGMENT_BLOCKS 256
+
+/* What the threads scanning one file share */
+struct scan_job {
+    struct rcksum_state *z;
+    int fd;
+    off_t eof;                  /* length of the file */
+    pthread_mutex_t lock;       /* for recording blocks found, and progress */
+
+    int progress;
+    off_t done;
+    int done_mb;
+};
+
+/* And what each has to itself */
+struct scan_thread {
+    struct scan_job *job;
+    pthread_t thread;
+    off_t start, end;           /* look for blocks starting in [start, end) */
+    struct scan_state s;
+};
+
+/* read_fully(fd, buf, len, offset)
+ * pread(2), but retrying after short reads; returns the number of bytes read,
+ * which is only less than len at EOF, or -1 on error. */
+static ssize_t read_fully(int fd, unsigned char *buf, size_t len, off_t offset) {
+    size_t got = 0;
+
+    while (got < len) {
+        ssize_t rc = pread(fd, buf + got, len - got, offset + got);
+        if (rc == -1 && errno == EINTR)
+            continue;
+        if (rc == -1)
+            return -1;
+        if (rc == 0)
+            break;
+        got += rc;
+    }
+    return got;
+}
+
+/* scan_segment(scan_thread)
+ * Thread body; scans this thread's segment of the file, as
+ * rcksum_submit_source_file does for a whole file. */
+static void *scan_segment(void *p) {
+    struct scan_thread *t = p;
+    struct scan_job *job = t->job;
+    struct rcksum_state *z = job->z;
+    const size_t bufsize = z->blocksize * 16 + z->context;
+    unsigned char *buf = malloc(bufsize);
+    off_t pos = t->start;
+
+    if (!buf)
+        return NULL;
+
+    while (pos < t->end) {
+        /* We need data up to context bytes past the last offset to look at;
+         * anything past the end of the file is 0 padded, as for a stream */
+        size_t len = bufsize;
+        ssize_t got;
+
+        if ((off_t) len > t->end + z->context - pos)
+            len = t->end + z->context - pos;
+        got = read_fully(job->fd, buf, len, pos);
+        if (got == -1) {
+            perror("pread");
+            break;
+        }
+        memset(buf + got, 0, len - got);
+
+        scan_source_data(z, &t->s, buf, len, pos - t->start);
+        pos += len - z->context;
+
+        /* Stop if the threads between them have found everything */
+        pthread_mutex_lock(&job->lock);
+        job->done += len - z->context;
+        if (job->progress && job->done_mb != job->done / 1000000) {
+            job->done_mb = job->done / 1000000;
+            fputc('*', stderr);
+        }
+        if (all_blocks_known(z))
+            pos = t->end;
+        pthread_mutex_unlock(&job->lock);
+    }
+    flush_write_behind(z, &t->s);
+    free(t->s.wb.buf);
+    free(buf);
+    return NULL;
+}
+
+/* scan_source_fd_threaded(self, fd, start, eof, progress)
+ * Scans the plain file open on fd, from offset start to its end at eof, with
+ * the file split between several threads. Returns the number of blocks
+ * obtained, or -1 if the file is too short to be worth splitting up, in which
+ * case nothing has been read. */
+zs_blockid scan_source_fd_threaded(struct rcksum_state *z, int fd,
+                                   off_t start, off_t eof, int progress) {
+    struct scan_job job;
+    struct scan_thread *threads;
+    zs_blockid gotblocks = z->gotblocks;
+    int n = z->threads;
+    int i;
+
+    job.fd = fd;
+    job.eof = eof;
+
+    if (n > (job.eof - start) / ((off_t) MIN_SEGMENT_BLOCKS << z->blockshift))
+        n = (job.eof - start) / ((off_t) MIN_SEGMENT_BLOCKS << z->blockshift);
+    if (n < 2)
+        return -1;
+
+    threads = calloc(n, sizeof *threads);
+    if (!threads)
+        return -1;
+
+    job.z = z;
+    job.progress = progress;
+    job.done = 0;
+    job.done_mb = 0;
+    pthread_mutex_init(&job.lock, NULL);
+    z->commit_lock = &job.lock;
+
+    for (i = 0; i < n; i++) {
+        threads[i].job = &job;
+        threads[i].start = start + (job.eof - start) * i / n;
+        threads[i].end = start + (job.eof - start) * (i + 1) / n;
+        threads[i].s.src_fd = fd;
+        threads[i].s.src_base = threads[i].start;
+        threads[i].s.src_end = job.eof;
+        threads[i].s.no_copy_range = z->scan.no_copy_range;
+    }
+
+    /* Start the threads; if we can't start one, scan its segment here */
+    for (i = 0; i < n; i++) {
+        if (pthread_create(&threads[i].thread, NULL, scan_segment,
+                           &threads[i]) != 0) {
+            scan_segment(&threads[i]);
+            threads[i].job = NULL;
+        }
+    }
+
+    /* Wait for them all, and collect up their stats (and what they learnt
+     * about copy_file_range) */
+    for (i = 0; i < n; i++) {
+        struct scan_state *s = &threads[i].s;
+
+        if (threads[i].job)
+            pthread_join(threads[i].thread, NULL);
+        add_scan_stats(&z->scan.stats, &s->stats);
+        z->scan.no_copy_range |= s->no_copy_range;
+    }
+    z->commit_lock = NULL;
+    pthread_mutex_destroy(&job.lock);
+    free(threads);
+
+    /* Now take out of the hash the blocks that the threads found */
+    remove_known_blocks(z);
+    return z->gotblocks - gotblocks;
+}
+
+#endif
@@ -23,6 +23,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 
 #ifdef WITH_DMALLOC
@@ -39,18 +40,37 @@ struct rcksum_state *rcksum_init(zs_blockid nblocks, size_t blocksize,
                                  int rsum_bytes, int checksum_bytes,
                                  int require_consecutive_matches) {
     /* Allocate memory for the object */
-    struct rcksum_state *z = malloc(sizeof(struct rcksum_state));
+    struct rcksum_state *z;
+    if (require_consecutive_matches < 1
+        || require_consecutive_matches > RCKSUM_MAX_SEQ_MATCHES)
+        return NULL;
+    z = malloc(sizeof(struct rcksum_state));
     if (z == NULL) return NULL;
 
     /* Enter supplied properties. */
     z->blocksize = blocksize;
     z->blocks = nblocks;
+    z->loaded = nblocks;
     z->rsum_a_mask = rsum_bytes < 3 ? 0 : rsum_bytes == 3 ? 0xff : 0xffff;
+    z->rsum_high_mask = rsum_bytes <= 4 ? 0 : rsum_bytes >= 8 ? 0xffffffff
+        : (1u << (8 * (rsum_bytes - 4))) - 1;
     z->checksum_bytes = checksum_bytes;
     z->seq_matches = require_consecutive_matches;
+    z->roll = select_roll_kernel(ROLL_ANY_LANES);
+    z->threads = 1;
+    z->copy_source = 1;
+    z->aligned_scan = 1;
+    z->seed_cache = NULL;
+    memset(z->phase_wall, 0, sizeof z->phase_wall);
+    memset(z->phase_cpu, 0, sizeof z->phase_cpu);
+    z->hash = RCKSUM_HASH_MD4;
+#ifdef _POSIX_THREADS
+    z->commit_lock = NULL;
+#endif
+    z->scanners = 0;
 
-    /* require_consecutive_matches is 1 if true; and if true we need 1 block of
-     * context to do block matching */
+    /* require_consecutive_matches is how many blocks must match one after
+     * another; we need that many blocks of context to do block matching */
     z->context = blocksize * require_consecutive_matches;
 
     /* Temporary file to hold the target file as we get blocks for it 
@@ -72,15 +92,22 @@ struct rcksum_state *rcksum_init(zs_blockid nblocks, size_t blocksize,
 
     /* Initialise to 0 various state & stats */
     z->gotblocks = 0;
-    memset(&(z->stats), 0, sizeof(z->stats));
-    z->ranges = NULL;
-    z->numranges = 0;
+    memset(&(z->scan), 0, sizeof(z->scan));
+    z->scan.next_match = -1;
+    z->scan.src_fd = -1;
+    z->known = NULL;
 
     /* Hashes for looking up checksums are generated when needed.
      * So initially store NULL so we know there's nothing there yet.
      */
     z->rsum_hash = NULL;
     z->bithash = NULL;
+    z->ndups = 0;
+    z->dup_ids = z->dup_next = NULL;
+    z->dup_map = NULL;
+    z->records = z->checksum_records = NULL;
+    z->records_map = NULL;
+    z->index_map = NULL;
 
     if (!(z->blocksize & (z->blocksize - 1)) && z->filename != NULL
             && z->blocks) {
@@ -99,11 +126,32 @@ struct rcksum_state *rcksum_init(zs_blockid nblocks, size_t blocksize,
                     }
             }
 
-            z->blockhashes =
-                malloc(sizeof(z->blockhashes[0]) *
-                        (z->blocks + z->seq_matches));
-            if (z->blockhashes != NULL)
+            /* Tables for the checksums of each block; zeroed, as the entries
+             * past the end are looked at as the blocks following the last */
+            z->rsums = calloc(z->blocks + z->seq_matches, sizeof *(z->rsums));
+            z->checksums = calloc(z->blocks + z->seq_matches,
+                                  z->checksum_bytes);
+            z->rsums_high = z->rsum_high_mask
+                ? calloc(z->blocks + z->seq_matches, sizeof *(z->rsums_high))
+                : NULL;
+
+            /* And the known blocks bitmap, followed by its summaries */
+            z->known = calloc(KNOWN_WORDS(z->blocks)
+                              + 2 * KNOWN_SUMMARY_WORDS(z->blocks),
+                              sizeof *(z->known));
+            if (z->rsums != NULL && z->checksums != NULL && z->known != NULL
+                && (z->rsums_high != NULL || !z->rsum_high_mask)) {
+                z->known_any = z->known + KNOWN_WORDS(z->blocks);
+                z->known_all = z->known_any + KNOWN_SUMMARY_WORDS(z->blocks);
+#ifdef _POSIX_THREADS
+                pthread_mutex_init(&z->lock, NULL);
+#endif
                 return z;
+            }
+            free(z->rsums);
+            free(z->rsums_high);
+            free(z->checksums);
+            free(z->known);
 
             /* All below is error handling */
         }
@@ -119,6 +167,10 @@ struct rcksum_state *rcksum_init(zs_blockid nblocks, size_t blocksize,
  * called again, and it is up to the caller to deal with the file. */
 char *rcksum_filename(struct rcksum_state *rs) {
     char *p = rs->filename;
+
+    /* It's the caller's now, so it had better be complete */
+    if (rs->fd != -1)
+        flush_write_behind(rs, &rs->scan);
     rs->filename = NULL;
     return p;
 }
@@ -129,29 +181,91 @@ char *rcksum_filename(struct rcksum_state *rs) {
  * called again, and it is up to the caller to close it. */
 int rcksum_filehandle(struct rcksum_state *rs) {
     int h = rs->fd;
+
+    if (h != -1)
+        flush_write_behind(rs, &rs->scan);
     rs->fd = -1;
     return h;
 }
 
+/* rcksum_set_threads(self, nthreads)
+ * Sets the number of threads to use to scan each source file. Where the file
+ * can be read at random (so not pipes), it is split into that many parts which
+ * are scanned at the same time. */
+void rcksum_set_threads(struct rcksum_state *z, int nthreads) {
+    z->threads = nthreads > 1 ? nthreads : 1;
+}
+
+/* rcksum_set_aligned_scan(self, on)
+ * Sets whether to first look for blocks at just the offsets in each source
+ * file that are multiples of the blocksize, which finds the blocks that have
+ * not moved (or moved by whole blocks) very quickly; the rest of the file is
+ * scanned as usual. On by default. */
+void rcksum_set_aligned_scan(struct rcksum_state *z, int on) {
+    z->aligned_scan = on;
+}
+
+/* rcksum_set_seed_cache(self, dir)
+ * Sets a directory in which to keep the checksums of the whole blocks of
+ * each seed file, for the aligned pass; so the next time the same, unchanged
+ * file is used as a seed with the same blocksize, that pass need not read
+ * it. NULL (the default) for none. */
+void rcksum_set_seed_cache(struct rcksum_state *z, const char *dir) {
+    free(z->seed_cache);
+    z->seed_cache = dir ? strdup(dir) : NULL;
+}
+
+/* Names of the checksums, as in the control file, by RCKSUM_HASH_* */
+static const char *const hash_names[] = { "MD4", "BLAKE3", "XXH3-128" };
+
+/* rcksum_hash_by_name(name)
+ * Returns the RCKSUM_HASH_* value for the named checksum, or -1 if unknown. */
+int rcksum_hash_by_name(const char *name) {
+    int i;
+
+    for (i = 0; i < (int)(sizeof(hash_names) / sizeof(hash_names[0])); i++)
+        if (!strcasecmp(name, hash_names[i]))
+            return i;
+    return -1;
+}
+
+/* rcksum_hash_name(hash)
+ * Returns the name of the given checksum, as rcksum_hash_by_name takes it. */
+const char *rcksum_hash_name(int hash) {
+    return hash_names[hash];
+}
+
+/* rcksum_set_hash(self, hash)
+ * Sets which checksum (RCKSUM_HASH_*) the target blocks' checksums are. */
+void rcksum_set_hash(struct rcksum_state *z, int hash) {
+    z->hash = hash;
+}
+
 /* rcksum_end - destructor */
 void rcksum_end(struct rcksum_state *z) {
     /* Free temporary file resources */
-    if (z->fd != -1)
+    if (z->fd != -1) {
+        flush_write_behind(z, &z->scan);
         close(z->fd);
+    }
     if (z->filename) {
         unlink(z->filename);
         free(z->filename);
     }
 
     /* Free other allocated memory */
-    free(z->rsum_hash);
-    free(z->blockhashes);
-    free(z->bithash);
-    free(z->ranges);            // Should be NULL already
+    free_tables(z);
+    free(z->known);
+    free(z->scan.wb.buf);
+    free(z->scan.fills);
+    free(z->seed_cache);
+#ifdef _POSIX_THREADS
+    pthread_mutex_destroy(&z->lock);
+#endif
 #ifdef DEBUG
-    fprintf(stderr, "hashhit %d, weakhit %d, checksummed %d, stronghit %d\n",
-            z->stats.hashhit, z->stats.weakhit, z->stats.checksummed,
-            z->stats.stronghit);
+    fprintf(stderr, "hashhit %lld, weakhit %lld, checksummed %lld, stronghit %lld\n",
+            z->scan.stats.hashhit, z->scan.stats.weakhit,
+            z->scan.stats.checksummed, z->scan.stats.stronghit);
 #endif
     free(z);
 }
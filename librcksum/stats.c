@@ -0,0 +1,129 @@
+/*
+ *   rcksum/lib - library for using the rsync algorithm to determine
+ *               which parts of a file you have and which you need.
+ *   Copyright (C) 2004,2005,2007,2009 Colin Phipps <cph@moria.org.uk>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* Statistics of the work done by the library: the counts kept by each scan,
+ * and the time spent in each phase, for rcksum_get_stats.
+ */
+
+#include "zsglobal.h"
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef WITH_DMALLOC
+# include <dmalloc.h>
+#endif
+
+#include "rcksum.h"
+#include "internal.h"
+
+/* clock_seconds(clock)
+ * Returns the time on the given clock in seconds, or 0 if we haven't got it */
+static double clock_seconds(int cpu) {
+#if defined(_POSIX_TIMERS) && _POSIX_TIMERS > 0
+    struct timespec ts;
+# if defined(_POSIX_CPUTIME) && _POSIX_CPUTIME >= 0
+    clockid_t id = cpu ? CLOCK_PROCESS_CPUTIME_ID : CLOCK_MONOTONIC;
+# else
+    clockid_t id = CLOCK_MONOTONIC;
+
+    if (cpu)
+        return 0;
+# endif
+    if (clock_gettime(id, &ts) == 0)
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+    return 0;
+}
+
+/* phase_begin(&timer)
+ * Starts timing a phase of the work */
+void phase_begin(struct phase_timer *t) {
+    t->wall = clock_seconds(0);
+    t->cpu = clock_seconds(1);
+}
+
+/* phase_end(self, phase, &timer)
+ * Adds the time since phase_begin to the total for the given RCKSUM_PHASE_* */
+void phase_end(struct rcksum_state *z, int phase, const struct phase_timer *t) {
+    double wall = clock_seconds(0) - t->wall;
+    double cpu = clock_seconds(1) - t->cpu;
+
+#ifdef _POSIX_THREADS
+    /* Scanners may be timing phases at the same time */
+    if (z->commit_lock)
+        pthread_mutex_lock(z->commit_lock);
+#endif
+    z->phase_wall[phase] += wall;
+    z->phase_cpu[phase] += cpu;
+#ifdef _POSIX_THREADS
+    if (z->commit_lock)
+        pthread_mutex_unlock(z->commit_lock);
+#endif
+}
+
+/* count_chain(stats, length)
+ * Counts a lookup in the block index that looked at length slots */
+void count_chain(struct scan_stats *st, int length) {
+    int i = 0;
+
+    while (length > 1 && i < RCKSUM_CHAIN_BUCKETS - 1) {
+        length >>= 1;
+        i++;
+    }
+    st->chain[i]++;
+}
+
+/* add_scan_stats(to, from)
+ * Adds the counts of one scan to those of another */
+void add_scan_stats(struct scan_stats *to, const struct scan_stats *from) {
+    int i;
+
+    to->bytes += from->bytes;
+    to->hashhit += from->hashhit;
+    to->weakhit += from->weakhit;
+    to->weakmiss += from->weakmiss;
+    to->stronghit += from->stronghit;
+    to->checksummed += from->checksummed;
+    for (i = 0; i < RCKSUM_CHAIN_BUCKETS; i++)
+        to->chain[i] += from->chain[i];
+    to->writes += from->writes;
+    to->bytes_written += from->bytes_written;
+}
+
+/* rcksum_get_stats(self, &stats)
+ * Fills in the statistics of the work done so far */
+void rcksum_get_stats(const struct rcksum_state *z, struct rcksum_stats *stats) {
+    const struct scan_stats *st = &z->scan.stats;
+    int i;
+
+    memset(stats, 0, sizeof *stats);
+    stats->bytes_scanned = st->bytes;
+    stats->hashhit = st->hashhit;
+    stats->weakhit = st->weakhit;
+    stats->weakmiss = st->weakmiss;
+    stats->stronghit = st->stronghit;
+    stats->checksummed = st->checksummed;
+    for (i = 0; i < RCKSUM_CHAIN_BUCKETS; i++)
+        stats->chain[i] = st->chain[i];
+    stats->writes = st->writes;
+    stats->bytes_written = st->bytes_written;
+    for (i = 0; i < RCKSUM_PHASES; i++) {
+        stats->wall[i] = z->phase_wall[i];
+        stats->cpu[i] = z->phase_cpu[i];
+    }
+}
@@ -0,0 +1,379 @@
+/*
+ *   rcksum/lib - library for using the rsync algorithm to determine
+ *               which parts of a file you have and which you need.
+ *   Copyright (C) 2004,2005,2007,2009 Colin Phipps <cph@moria.org.uk>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* The XXH3 hash, 128-bit, as a strong checksum for blocks that is much faster
+ * to work out than MD4. Like MD4 as zsync uses it, it is not there to resist
+ * data made to collide; it just needs to tell different blocks apart, which
+ * its 128 bits do as well. This is the plain form, with seed 0 and the
+ * default secret; inputs of up to 240 bytes have special cases, and longer
+ * ones (as blocks are) go through 8 accumulators, 64 bytes at a time.
+ *
+ * Unlike MD4 and BLAKE3 (see md4batch.c and blake3.c), there is no need to do
+ * several blocks at once to use vectors: the 8 accumulators of the one block
+ * are independent, so the kernels keep them in vectors (see xxh3lanes.h).
+ */
+
+#include "zsglobal.h"
+
+#include <string.h>
+#include <sys/types.h>
+
+#ifdef WITH_DMALLOC
+# include <dmalloc.h>
+#endif
+
+#include "xxh3.h"
+#include "rcksum.h"
+#include "internal.h"
+
+#define PRIME32_1 UINT32_C(0x9E3779B1)
+#define PRIME32_2 UINT32_C(0x85EBCA77)
+#define PRIME32_3 UINT32_C(0xC2B2AE3D)
+#define PRIME64_1 UINT64_C(0x9E3779B185EBCA87)
+#define PRIME64_2 UINT64_C(0xC2B2AE3D27D4EB4F)
+#define PRIME64_3 UINT64_C(0x165667B19E3779F9)
+#define PRIME64_4 UINT64_C(0x85EBCA77C2B2AE63)
+#define PRIME64_5 UINT64_C(0x27D4EB2F165667C5)
+#define PRIME_MX1 UINT64_C(0x165667919E3779F9)
+#define PRIME_MX2 UINT64_C(0x9FB21C651E98DF25)
+
+#define STRIPE_LEN 64
+#define SECRET_SIZE 192
+#define SECRET_SIZE_MIN 136
+#define SECRET_CONSUME_RATE 8
+#define STRIPES_PER_BLOCK ((SECRET_SIZE - STRIPE_LEN) / SECRET_CONSUME_RATE)
+#define BLOCK_LEN (STRIPE_LEN * STRIPES_PER_BLOCK)
+#define MIDSIZE_MAX 240
+#define MIDSIZE_STARTOFFSET 3
+#define MIDSIZE_LASTOFFSET 17
+#define SECRET_LASTACC_START 7
+#define SECRET_MERGEACCS_START 11
+
+/* The default secret */
+static const uint8_t xxh3_secret[SECRET_SIZE] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c,
+    0xf7, 0x21, 0xad, 0x1c, 0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb,
+    0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f, 0xcb, 0x79, 0xe6, 0x4e,
+    0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6,
+    0x81, 0x3a, 0x26, 0x4c, 0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb,
+    0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3, 0x71, 0x64, 0x48, 0x97,
+    0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7,
+    0xc7, 0x0b, 0x4f, 0x1d, 0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31,
+    0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64, 0xea, 0xc5, 0xac, 0x83,
+    0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26,
+    0x29, 0xd4, 0x68, 0x9e, 0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc,
+    0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce, 0x45, 0xcb, 0x3a, 0x8f,
+    0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+static uint32_t read32(const uint8_t *p) {
+    return p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16
+        | (uint32_t) p[3] << 24;
+}
+
+static uint64_t read64(const uint8_t *p) {
+    return read32(p) | (uint64_t) read32(p + 4) << 32;
+}
+
+static uint64_t swap64(uint64_t x) {
+    x = (x & UINT64_C(0x00ff00ff00ff00ff)) << 8
+        | (x >> 8 & UINT64_C(0x00ff00ff00ff00ff));
+    x = (x & UINT64_C(0x0000ffff0000ffff)) << 16
+        | (x >> 16 & UINT64_C(0x0000ffff0000ffff));
+    return x << 32 | x >> 32;
+}
+
+/* mult64to128(a, b, &lo, &hi)
+ * The full 128-bit product of a and b */
+static void mult64to128(uint64_t a, uint64_t b, uint64_t *lo, uint64_t *hi) {
+#ifdef __SIZEOF_INT128__
+    unsigned __int128 p = (unsigned __int128) a * b;
+
+    *lo = (uint64_t) p;
+    *hi = (uint64_t) (p >> 64);
+#else
+    uint64_t lo_lo = (a & 0xffffffff) * (b & 0xffffffff);
+    uint64_t hi_lo = (a >> 32) * (b & 0xffffffff);
+    uint64_t lo_hi = (a & 0xffffffff) * (b >> 32);
+    uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xffffffff) + lo_hi;
+
+    *hi = (hi_lo >> 32) + (cross >> 32) + (a >> 32) * (b >> 32);
+    *lo = cross << 32 | (lo_lo & 0xffffffff);
+#endif
+}
+
+static uint64_t mul128_fold64(uint64_t a, uint64_t b) {
+    uint64_t lo, hi;
+
+    mult64to128(a, b, &lo, &hi);
+    return lo ^ hi;
+}
+
+static uint64_t xxh64_avalanche(uint64_t h) {
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    return h ^ h >> 32;
+}
+
+static uint64_t avalanche(uint64_t h) {
+    h ^= h >> 37;
+    h *= PRIME_MX1;
+    return h ^ h >> 32;
+}
+
+/* mix16B(input, secret)
+ * Mixes 16 bytes of input with 16 of the secret, into 64 bits */
+static uint64_t mix16B(const uint8_t *in, const uint8_t *s) {
+    return mul128_fold64(read64(in) ^ read64(s), read64(in + 8) ^ read64(s + 8));
+}
+
+/* mix32B(&lo, &hi, input1, input2, secret)
+ * Mixes 16 bytes from each of two places in the input into the accumulator */
+static void mix32B(uint64_t *lo, uint64_t *hi, const uint8_t *in1,
+                   const uint8_t *in2, const uint8_t *s) {
+    *lo += mix16B(in1, s);
+    *lo ^= read64(in2) + read64(in2 + 8);
+    *hi += mix16B(in2, s + 16);
+    *hi ^= read64(in1) + read64(in1 + 8);
+}
+
+/* Loop over a long input, adding it into the accumulators */
+typedef void xxh3_long_kernel(uint64_t acc[8], const uint8_t *data, size_t len);
+
+static void accumulate_512(uint64_t acc[8], const uint8_t *p,
+                           const uint8_t *s) {
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        uint64_t d = read64(p + 8 * i);
+        uint64_t k = d ^ read64(s + 8 * i);
+
+        acc[i ^ 1] += d;
+        acc[i] += (k & 0xffffffff) * (k >> 32);
+    }
+}
+
+static void scramble(uint64_t acc[8], const uint8_t *s) {
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        uint64_t a = acc[i];
+
+        a ^= a >> 47;
+        a ^= read64(s + 8 * i);
+        acc[i] = a * PRIME32_1;
+    }
+}
+
+/* xxh3_long_scalar(acc, data, len)
+ * Adds the len (more than MIDSIZE_MAX) bytes of data[] into the 8 accumulators
+ * in acc[]: a stripe at a time, with the secret moved along by 8 bytes for
+ * each, and the accumulators scrambled after each block of stripes; the last
+ * stripe of the input is always added, with a secret of its own. */
+static void xxh3_long_scalar(uint64_t acc[8], const uint8_t *data, size_t len) {
+    size_t nblocks = (len - 1) / BLOCK_LEN, n, i;
+    const uint8_t *p;
+
+    for (n = 0; n < nblocks; n++) {
+        p = data + n * BLOCK_LEN;
+        for (i = 0; i < STRIPES_PER_BLOCK; i++)
+            accumulate_512(acc, p + i * STRIPE_LEN,
+                           xxh3_secret + i * SECRET_CONSUME_RATE);
+        scramble(acc, xxh3_secret + SECRET_SIZE - STRIPE_LEN);
+    }
+    p = data + nblocks * BLOCK_LEN;
+    for (i = 0; i < (len - 1 - nblocks * BLOCK_LEN) / STRIPE_LEN; i++)
+        accumulate_512(acc, p + i * STRIPE_LEN,
+                       xxh3_secret + i * SECRET_CONSUME_RATE);
+    accumulate_512(acc, data + len - STRIPE_LEN,
+                   xxh3_secret + SECRET_SIZE - STRIPE_LEN - SECRET_LASTACC_START);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define XXH3_X86_SIMD 1
+# include <immintrin.h>
+
+# define XXH3_LANES 2
+# define XXH3_TARGET "sse2"
+# define XXH3_KERNEL xxh3_long_sse2
+# define XXH3_MUL32(x, y) ((vec) _mm_mul_epu32((__m128i) (x), (__m128i) (y)))
+# include "xxh3lanes.h"
+# undef XXH3_LANES
+# undef XXH3_TARGET
+# undef XXH3_KERNEL
+# undef XXH3_MUL32
+
+# define XXH3_LANES 4
+# define XXH3_TARGET "avx2"
+# define XXH3_KERNEL xxh3_long_avx2
+# define XXH3_MUL32(x, y) ((vec) _mm256_mul_epu32((__m256i) (x), (__m256i) (y)))
+# include "xxh3lanes.h"
+# undef XXH3_LANES
+# undef XXH3_TARGET
+# undef XXH3_KERNEL
+# undef XXH3_MUL32
+
+# define XXH3_LANES 8
+# define XXH3_TARGET "avx512f"
+# define XXH3_KERNEL xxh3_long_avx512
+# define XXH3_MUL32(x, y) ((vec) _mm512_mul_epu32((__m512i) (x), (__m512i) (y)))
+# include "xxh3lanes.h"
+# undef XXH3_LANES
+# undef XXH3_TARGET
+# undef XXH3_KERNEL
+# undef XXH3_MUL32
+#endif
+
+/* merge_accs(acc, secret, start)
+ * Folds the 8 accumulators into 64 bits, with the given secret */
+static uint64_t merge_accs(const uint64_t acc[8], const uint8_t *s,
+                           uint64_t start) {
+    uint64_t r = start;
+    int i;
+
+    for (i = 0; i < 4; i++)
+        r += mul128_fold64(acc[2 * i] ^ read64(s + 16 * i),
+                           acc[2 * i + 1] ^ read64(s + 16 * i + 8));
+    return avalanche(r);
+}
+
+/* xxh3_digest(out, data, len, kernel)
+ * Returns in out[] the XXH3 128-bit hash of the given data, using the given
+ * kernel for long inputs */
+static void xxh3_digest(uint8_t out[XXH3_OUT_LEN], const uint8_t *in,
+                        size_t len, xxh3_long_kernel *kernel) {
+    const uint8_t *s = xxh3_secret;
+    uint64_t lo, hi;
+    int i;
+
+    if (len == 0) {
+        lo = xxh64_avalanche(read64(s + 64) ^ read64(s + 72));
+        hi = xxh64_avalanche(read64(s + 80) ^ read64(s + 88));
+    }
+    else if (len <= 3) {
+        uint32_t l = (uint32_t) in[0] << 16 | (uint32_t) in[len >> 1] << 24
+            | in[len - 1] | (uint32_t) len << 8;
+        uint32_t h = (l >> 24 | (l >> 8 & 0xff00) | (l << 8 & 0xff0000)
+                      | l << 24);
+
+        h = h << 13 | h >> 19;
+        lo = xxh64_avalanche(l ^ (uint64_t) (read32(s) ^ read32(s + 4)));
+        hi = xxh64_avalanche(h ^ (uint64_t) (read32(s + 8) ^ read32(s + 12)));
+    }
+    else if (len <= 8) {
+        uint64_t in64 = read32(in) + ((uint64_t) read32(in + len - 4) << 32);
+
+        mult64to128(in64 ^ read64(s + 16) ^ read64(s + 24),
+                    PRIME64_1 + (len << 2), &lo, &hi);
+        hi += lo << 1;
+        lo ^= hi >> 3;
+        lo ^= lo >> 35;
+        lo *= PRIME_MX2;
+        lo ^= lo >> 28;
+        hi = avalanche(hi);
+    }
+    else if (len <= 16) {
+        uint64_t in_lo = read64(in), in_hi = read64(in + len - 8);
+        uint64_t m_lo, m_hi;
+
+        mult64to128(in_lo ^ in_hi ^ read64(s + 32) ^ read64(s + 40),
+                    PRIME64_1, &m_lo, &m_hi);
+        m_lo += (uint64_t) (len - 1) << 54;
+        in_hi ^= read64(s + 48) ^ read64(s + 56);
+        m_hi += in_hi + (uint64_t) (uint32_t) in_hi * (PRIME32_2 - 1);
+        m_lo ^= swap64(m_hi);
+        mult64to128(m_lo, PRIME64_2, &lo, &hi);
+        hi += m_hi * PRIME64_2;
+        lo = avalanche(lo);
+        hi = avalanche(hi);
+    }
+    else if (len <= MIDSIZE_MAX) {
+        uint64_t a_lo = len * PRIME64_1, a_hi = 0;
+
+        if (len <= 128) {
+            /* Pairs of 16 bytes from the start and the end, working in */
+            for (i = (len - 1) / 32; i >= 0; i--)
+                mix32B(&a_lo, &a_hi, in + 16 * i, in + len - 16 * (i + 1),
+                       s + 32 * i);
+        }
+        else {
+            size_t j;
+
+            for (j = 32; j < 160; j += 32)
+                mix32B(&a_lo, &a_hi, in + j - 32, in + j - 16, s + j - 32);
+            a_lo = avalanche(a_lo);
+            a_hi = avalanche(a_hi);
+            for (j = 160; j <= len; j += 32)
+                mix32B(&a_lo, &a_hi, in + j - 32, in + j - 16,
+                       s + MIDSIZE_STARTOFFSET + j - 160);
+            mix32B(&a_lo, &a_hi, in + len - 16, in + len - 32,
+                   s + SECRET_SIZE_MIN - MIDSIZE_LASTOFFSET - 16);
+        }
+        lo = avalanche(a_lo + a_hi);
+        hi = 0 - avalanche(a_lo * PRIME64_1 + a_hi * PRIME64_4
+                           + len * PRIME64_2);
+    }
+    else {
+        uint64_t acc[8] = { PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3,
+                            PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1 };
+
+        kernel(acc, in, len);
+        lo = merge_accs(acc, s + SECRET_MERGEACCS_START, len * PRIME64_1);
+        hi = merge_accs(acc, s + SECRET_SIZE - sizeof acc
+                        - SECRET_MERGEACCS_START, ~(len * PRIME64_2));
+    }
+
+    for (i = 0; i < 8; i++) {
+        out[i] = hi >> (56 - 8 * i);
+        out[8 + i] = lo >> (56 - 8 * i);
+    }
+}
+
+/* xxh3_128(out, data, len)
+ * Returns in out[] the XXH3 128-bit hash of the given data */
+void xxh3_128(uint8_t out[XXH3_OUT_LEN], const uint8_t *data, size_t len) {
+    xxh3_digest(out, data, len, xxh3_long_scalar);
+}
+
+/* xxh3_blocks(checksums[], data[], nblocks, blocksize, max_lanes)
+ * As md4_blocks, but the XXH3 hashes; each block is hashed on its own, with
+ * its accumulators in vectors of at most max_lanes 32-bit words. */
+void xxh3_blocks(unsigned char *c, const unsigned char *data,
+                 size_t nblocks, size_t blocksize, int max_lanes) {
+    xxh3_long_kernel *kernel = xxh3_long_scalar;
+
+#ifdef XXH3_X86_SIMD
+    __builtin_cpu_init();
+    if (max_lanes >= 16 && __builtin_cpu_supports("avx512f"))
+        kernel = xxh3_long_avx512;
+    else if (max_lanes >= 8 && __builtin_cpu_supports("avx2"))
+        kernel = xxh3_long_avx2;
+    else if (max_lanes >= 4 && __builtin_cpu_supports("sse2"))
+        kernel = xxh3_long_sse2;
+#else
+    (void) max_lanes;
+#endif
+    for (; nblocks > 0; nblocks--) {
+        xxh3_digest(c, data, blocksize, kernel);
+        c += CHECKSUM_SIZE;
+        data += blocksize;
+    }
+}
@@ -0,0 +1,30 @@
+/*
+ *   rcksum/lib - library for using the rsync algorithm to determine
+ *               which parts of a file you have and which you need.
+ *   Copyright (C) 2004,2005,2007,2009 Colin Phipps <cph@moria.org.uk>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* XXH3 128-bit hash, with seed 0 and the default secret; the output is in the
+ * canonical (big-endian, high half first) form */
+
+#ifndef _XXH3_H_
+#define _XXH3_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define XXH3_OUT_LEN 16
+
+void xxh3_128(uint8_t out[XXH3_OUT_LEN], const uint8_t *data, size_t len);
+
+#endif /* _XXH3_H_ */
@@ -0,0 +1,77 @@
+/*
+ *   rcksum/lib - library for using the rsync algorithm to determine
+ *               which parts of a file you have and which you need.
+ *   Copyright (C) 2004,2005,2007,2009 Colin Phipps <cph@moria.org.uk>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* Template for a kernel for the loop over a long input of XXH3, with its 8
+ * accumulators held XXH3_LANES to a vector; it follows xxh3_long_scalar()
+ * step for step. xxh3.c includes this once for each instruction set, with
+ * XXH3_LANES, XXH3_TARGET and XXH3_KERNEL defined, and XXH3_MUL32(x, y) to
+ * multiply the low 32 bits of each lane of x and y into 64 (which the
+ * compiler does not work out for itself from masks and shifts). Only for
+ * little-endian machines, as the input is loaded straight into the vectors.
+ *
+ * XXH3_KERNEL(acc, data, len)
+ * Adds the len (more than MIDSIZE_MAX) bytes of data[] into the 8 accumulators
+ * in acc[]. */
+__attribute__ ((target(XXH3_TARGET)))
+static void XXH3_KERNEL(uint64_t acc[8], const uint8_t *data, size_t len) {
+    typedef uint64_t vec __attribute__ ((vector_size(8 * XXH3_LANES)));
+    enum { NV = 8 / XXH3_LANES };
+#if XXH3_LANES == 2
+    const vec swap = { 1, 0 };
+#elif XXH3_LANES == 4
+    const vec swap = { 1, 0, 3, 2 };
+#else
+    const vec swap = { 1, 0, 3, 2, 5, 4, 7, 6 };
+#endif
+    const vec prime = (vec) { 0 } + PRIME32_1;
+    const uint8_t *end = data + len;
+    size_t nblocks = (len - 1) / BLOCK_LEN, n, i;
+    vec a[NV];
+    int v;
+
+/* Add the stripe at p into the accumulators, with the secret at s */
+#define ACCUMULATE(p, s) do { \
+        for (v = 0; v < NV; v++) { \
+            vec d, k; \
+            memcpy(&d, (p) + v * sizeof d, sizeof d); \
+            memcpy(&k, (s) + v * sizeof k, sizeof k); \
+            k ^= d; \
+            a[v] += __builtin_shuffle(d, swap) + XXH3_MUL32(k, k >> 32); \
+        } } while (0)
+
+    memcpy(a, acc, sizeof a);
+    for (n = 0; n < nblocks; n++, data += BLOCK_LEN) {
+        for (i = 0; i < STRIPES_PER_BLOCK; i++)
+            ACCUMULATE(data + i * STRIPE_LEN,
+                       xxh3_secret + i * SECRET_CONSUME_RATE);
+        for (v = 0; v < NV; v++) {
+            vec k;
+
+            memcpy(&k, xxh3_secret + SECRET_SIZE - STRIPE_LEN + v * sizeof k,
+                   sizeof k);
+            a[v] ^= a[v] >> 47;
+            a[v] ^= k;
+            a[v] = XXH3_MUL32(a[v], prime)
+                + (XXH3_MUL32(a[v] >> 32, prime) << 32);
+        }
+    }
+    for (i = 0; i < (size_t) (end - 1 - data) / STRIPE_LEN; i++)
+        ACCUMULATE(data + i * STRIPE_LEN, xxh3_secret + i * SECRET_CONSUME_RATE);
+    ACCUMULATE(end - STRIPE_LEN,
+               xxh3_secret + SECRET_SIZE - STRIPE_LEN - SECRET_LASTACC_START);
+    memcpy(acc, a, sizeof a);
+#undef ACCUMULATE
+}
@@ -0,0 +1,282 @@
+/*
+ *   zsync - client side rsync over http
+ *   Copyright (C) 2004,2005,2007,2009 Colin Phipps <cph@moria.org.uk>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* Control file reader part of libzsync
+ * A .zsync can be gzip compressed as a whole (zsyncmake -g): the headers, any
+ * runs of blocks that are the same, and the Z-Map2 of a gzip target compress
+ * well, and the whole file is fetched for every download. So we look at the
+ * first bytes of the file; if it is gzip, we decompress it as we read it with
+ * the zlib that we have anyway, with no temporary file, and otherwise just
+ * read it with stdio as before.
+ */
+
+#include "zsglobal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef WITH_DMALLOC
+# include <dmalloc.h>
+#endif
+
+#include "zlib/zlib.h"
+
+#include "ctlfile.h"
+
+/* Bytes of the file to read, and to decompress, at a time */
+#define CTL_BUF 16384
+
+struct ctl_file {
+    FILE *f;
+    int gz;                     /* true if the file is gzip compressed */
+    off_t pos;                  /* bytes of the (decompressed) file read */
+
+    /* For a compressed file: the zlib stream, and the data that it has
+     * decompressed that we haven't yet returned */
+    z_stream zs;
+    int done;                   /* set at the end of the data, or an error */
+    int error;
+    const unsigned char *next;
+    size_t avail;
+    unsigned char in[CTL_BUF];
+    unsigned char out[CTL_BUF];
+};
+
+/* ctl_open(filehandle)
+ * Returns a reader for the control file open on the given filehandle, from
+ * where it is; or NULL if out of memory. */
+struct ctl_file *ctl_open(FILE * f) {
+    struct ctl_file *c = calloc(1, sizeof *c);
+    int ch;
+
+    if (!c)
+        return NULL;
+    c->f = f;
+
+    /* Just the first byte tells us, as a plain .zsync starts "zsync:"; the
+     * whole gzip magic number goes to zlib, which checks it */
+    ch = getc(f);
+    if (ch != 0x1f) {
+        if (ch != EOF)
+            ungetc(ch, f);
+        return c;
+    }
+
+    c->gz = 1;
+    c->in[0] = ch;
+    c->zs.next_in = c->in;
+    c->zs.avail_in = 1;
+    c->zs.zalloc = Z_NULL;
+    c->zs.zfree = Z_NULL;
+    c->zs.opaque = NULL;
+
+    /* windowBits + 16 to read the gzip header and trailer */
+    if (inflateInit2(&c->zs, MAX_WBITS + 16) != Z_OK) {
+        free(c);
+        return NULL;
+    }
+    return c;
+}
+
+/* fill(self)
+ * Decompresses more of a compressed control file, if we've returned all that
+ * we have so far. Returns 0 at the end of the data, or on error. */
+static int fill(struct ctl_file *c) {
+    while (!c->avail && !c->done) {
+        int rc;
+
+        /* More input, unless zlib may have more output from what it has */
+        if (!c->zs.avail_in && c->zs.avail_out) {
+            c->zs.avail_in = fread(c->in, 1, sizeof c->in, c->f);
+            c->zs.next_in = c->in;
+            if (!c->zs.avail_in) {
+                /* The file ended before the compressed data did */
+                fprintf(stderr, "premature end of compressed control file\n");
+                c->done = c->error = 1;
+                break;
+            }
+        }
+        c->zs.next_out = c->out;
+        c->zs.avail_out = sizeof c->out;
+        rc = inflate(&c->zs, Z_NO_FLUSH);
+        if (rc == Z_STREAM_END)
+            c->done = 1;
+        else if (rc != Z_OK && rc != Z_BUF_ERROR) {
+            fprintf(stderr, "bad compressed control file: %s\n",
+                    c->zs.msg ? c->zs.msg : "zlib error");
+            c->done = c->error = 1;
+        }
+        c->next = c->out;
+        c->avail = sizeof c->out - c->zs.avail_out;
+    }
+    return c->avail != 0;
+}
+
+/* ctl_gets(buf, size, self)
+ * As fgets: reads a line (up to size - 1 bytes of it) into buf[], with the
+ * newline if there is one; returns buf, or NULL at the end of the file. */
+char *ctl_gets(char *buf, int size, struct ctl_file *c) {
+    int l = 0;
+
+    if (!c->gz) {
+        if (!fgets(buf, size, c->f))
+            return NULL;
+        c->pos += strlen(buf);
+        return buf;
+    }
+
+    while (l < size - 1 && fill(c)) {
+        const unsigned char *nl = memchr(c->next, '\n', c->avail);
+        size_t n = nl ? (size_t) (nl - c->next) + 1 : c->avail;
+
+        if (n > (size_t) (size - 1 - l))
+            n = size - 1 - l;
+        memcpy(buf + l, c->next, n);
+        c->next += n;
+        c->avail -= n;
+        l += n;
+        if (buf[l - 1] == '\n')
+            break;
+    }
+    if (!l)
+        return NULL;
+    buf[l] = 0;
+    c->pos += l;
+    return buf;
+}
+
+/* ctl_read(buf, size, n, self)
+ * As fread: reads up to n items of size bytes into buf[]; returns how many
+ * whole items were read. */
+size_t ctl_read(void *p, size_t size, size_t n, struct ctl_file *c) {
+    unsigned char *q = p;
+    size_t want = size * n, got = 0;
+
+    if (!c->gz) {
+        n = fread(p, size, n, c->f);
+        c->pos += size * n;
+        return n;
+    }
+    if (!size)
+        return 0;
+
+    while (got < want && fill(c)) {
+        size_t l = want - got < c->avail ? want - got : c->avail;
+
+        memcpy(q + got, c->next, l);
+        c->next += l;
+        c->avail -= l;
+        got += l;
+    }
+    c->pos += got;
+    return got / size;
+}
+
+/* ctl_read_alloc(self, len)
+ * Reads the next len bytes of the control file into a malloced buffer, which
+ * grows as they come in, so that a length that the file doesn't have doesn't
+ * get that much memory first. Returns the buffer, or NULL if the file ended
+ * first or we are out of memory. */
+void *ctl_read_alloc(struct ctl_file *c, size_t len) {
+    unsigned char *p = NULL;
+    size_t got = 0, size = 0;
+
+    if (!len)
+        return malloc(1);
+    while (got < len) {
+        size_t n;
+
+        if (got == size) {
+            unsigned char *q;
+
+            size = len - size > size + CTL_BUF ? size * 2 + CTL_BUF : len;
+            q = realloc(p, size);
+            if (!q)
+                break;
+            p = q;
+        }
+        n = ctl_read(p + got, 1, size - got, c);
+        got += n;
+        if (got < size)
+            break;
+    }
+    if (got < len) {
+        free(p);
+        return NULL;
+    }
+    return p;
+}
+
+/* ctl_tell(self)
+ * Returns how many bytes of the control file (after decompressing it) have
+ * been read so far */
+off_t ctl_tell(const struct ctl_file *c) {
+    return c->pos;
+}
+
+/* ctl_skip(self, len)
+ * Skips over the next len bytes of the control file; seeking past them if we
+ * can. Returns 0, or -1 if the file ends first. */
+int ctl_skip(struct ctl_file *c, off_t len) {
+    unsigned char buf[4096];
+
+    if (!c->gz && fseeko(c->f, len, SEEK_CUR) == 0) {
+        c->pos += len;
+        return 0;
+    }
+    while (len > 0) {
+        size_t n = len < (off_t) sizeof buf ? (size_t) len : sizeof buf;
+
+        if (ctl_read(buf, 1, n, c) != n)
+            return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+/* ctl_error(self)
+ * Returns non-zero if there was an error reading the control file */
+int ctl_error(const struct ctl_file *c) {
+    return c->gz ? c->error : ferror(c->f);
+}
+
+/* ctl_size(self)
+ * Returns the length of the control file from where it was opened, where we
+ * know it (it is a regular file, not compressed); else -1. */
+off_t ctl_size(const struct ctl_file *c) {
+    struct stat st;
+
+    if (c->gz || fstat(fileno(c->f), &st) != 0 || !S_ISREG(st.st_mode))
+        return -1;
+    return st.st_size - (ftello(c->f) - c->pos);
+}
+
+/* ctl_plain_file(self)
+ * Returns the filehandle of the control file if it is not compressed, so it
+ * can be read directly (or mapped); else NULL. */
+FILE *ctl_plain_file(const struct ctl_file *c) {
+    return c->gz ? NULL : c->f;
+}
+
+/* ctl_close(self)
+ * Frees the reader, leaving the file open */
+void ctl_close(struct ctl_file *c) {
+    if (c->gz)
+        inflateEnd(&c->zs);
+    free(c);
+}
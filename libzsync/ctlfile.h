@@ -0,0 +1,41 @@
+/*
+ *   zsync - client side rsync over http
+ *   Copyright (C) 2004,2005,2007,2009 Colin Phipps <cph@moria.org.uk>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* Reading a .zsync control file, which may be gzip compressed; as with the
+ * stdio calls of the same names, but decompressing it as it is read if so. */
+
+struct ctl_file;
+
+struct ctl_file* ctl_open(FILE* f);
+char* ctl_gets(char* buf, int size, struct ctl_file* c);
+size_t ctl_read(void* p, size_t size, size_t n, struct ctl_file* c);
+int ctl_error(const struct ctl_file* c);
+
+/* Reads the next len bytes into a malloced buffer, without trusting len */
+void* ctl_read_alloc(struct ctl_file* c, size_t len);
+
+/* Bytes of the (decompressed) file read so far; and skipping ahead */
+off_t ctl_tell(const struct ctl_file* c);
+int ctl_skip(struct ctl_file* c, off_t len);
+
+/* Length of the file, where it is known (a plain file); else -1 */
+off_t ctl_size(const struct ctl_file* c);
+
+/* The file itself, where what is read from it is what is in it (so it is not
+ * compressed), and so it can be read in place; else NULL */
+FILE* ctl_plain_file(const struct ctl_file* c);
+
+/* Frees the reader; the file is left open */
+void ctl_close(struct ctl_file* c);
@@ -0,0 +1,80 @@
+/*
+ *   zsync - client side rsync over http
+ *   Copyright (C) 2004,2005,2007,2009 Colin Phipps <cph@moria.org.uk>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the Artistic License v2 (see the accompanying
+ *   file COPYING for the full license terms), or, at your option, any later
+ *   version of the same license.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   COPYING file for details.
+ */
+
+/* The binary .zsync format (version 2), which zsyncmake -2 writes.
+ *
+ * Rather than text headers followed by binary data that can only be found by
+ * reading everything before it, this is a table of sections, each of which
+ * can be found (and mapped, or fetched with a range request) on its own. All
+ * numbers are big-endian.
+ *
+ *   magic           8 bytes, ZS2_MAGIC
+ *   nsections       4 bytes
+ *   reserved        4 bytes, 0
+ *   section table   nsections entries of ZS2_ENTRY_SIZE bytes:
+ *                     type 4 bytes, flags 4 bytes, offset 8 bytes (from the
+ *                     start of the file), length 8 bytes
+ *   sections        each starting at a multiple of ZS2_ALIGN, in the order
+ *                   of the table
+ *
+ * A client skips sections of types that it doesn't know, unless they have
+ * ZS2_REQUIRED in their flags, in which case it must refuse the file.
+ */
+
+#include "zsglobal.h"
+
+#define ZS2_MAGIC "\x89zsync2\n"
+#define ZS2_MAGIC_SIZE 8
+#define ZS2_ALIGN 8
+#define ZS2_ENTRY_SIZE 24
+#define ZS2_MAX_SECTIONS 64
+
+#define ZS2_REQUIRED 1
+
+/* Sections. The header, and the rsums and checksums, must be there. */
+enum zs2_section {
+    /* ZS2_HEADER_SIZE bytes: length 8, blocksize 4, then a byte each for
+     * seq_matches, rsum_bytes, checksum_bytes and the block hash
+     * (RCKSUM_HASH_*); the MTime (in seconds since 1970, or -1 for none) 8,
+     * and the SHA-1 of the whole target 20; then 4 bytes 0 */
+    ZS2_SEC_HEADER = 1,
+    /* The other headers, as in the text format ("Filename: x" lines): the
+     * names, URLs and Z-URLs, Recompress and Safe */
+    ZS2_SEC_TEXT = 2,
+    /* The Z-Map2 of a compressed target, as in the text format */
+    ZS2_SEC_ZMAP = 3,
+    /* For each block, the last rsum_bytes of its rsum, as in the text format */
+    ZS2_SEC_RSUMS = 4,
+    /* And then, for each block, checksum_bytes of its checksum */
+    ZS2_SEC_CHECKSUMS = 5
+};
+
+#define ZS2_HEADER_SIZE 48
+
+static inline uint64_t zs2_get(const unsigned char *p, int bytes) {
+    uint64_t v = 0;
+    int i;
+
+    for (i = 0; i < bytes; i++)
+        v = v << 8 | p[i];
+    return v;
+}
+
+static inline void zs2_put(unsigned char *p, int bytes, uint64_t v) {
+    while (bytes--) {
+        p[bytes] = v & 0xff;
+        v >>= 8;
+    }
+}
@@ -36,13 +36,16 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <string.h>
 #include <ctype.h>
 #include <time.h>
-
-#include <arpa/inet.h>
+#ifdef _POSIX_THREADS
+# include <pthread.h>
+#endif
 
 #ifdef WITH_DMALLOC
 # include <dmalloc.h>
@@ -54,6 +57,8 @@
 #include "zsync.h"
 #include "sha1.h"
 #include "zmap.h"
+#include "ctlfile.h"
+#include "format2.h"
 
 /* Probably we really want a table of compression methods here. But I've only
  * implemented SHA1 so this is it for now. */
@@ -72,7 +77,7 @@ struct zsync_state {
     struct rcksum_state *rs;    /* rsync algorithm state, with block checksums and
                                  * holding the in-progress local version of the target */
     off_t filelen;              /* Length of the target file */
-    int blocks;                 /* Number of blocks in the target */
+    zs_blockid blocks;          /* Number of blocks in the target */
     long blocksize;             /* Blocksize */
 
     /* Checksum of the entire file, and checksum alg */
@@ -98,11 +103,49 @@ struct zsync_state {
     char *gzhead;               /* And this is the header of the gzip file (for the mtime) */
 
     time_t mtime;               /* MTime: from the .zsync, or -1 */
+
+    /* Reading the block checksums in the background, if we are; see
+     * zsync_load_blocksums */
+    struct blocksums_loader *loader;
 };
 
-static int zsync_read_blocksums(struct zsync_state *zs, FILE * f,
-                                int rsum_bytes, int checksum_bytes,
-                                int seq_matches);
+/* Settings from the .zsync for the rcksum_state, and how to make it, while
+ * we read the .zsync */
+struct zsync_settings {
+    int checksum_bytes, rsum_bytes, seq_matches, block_hash;
+
+    /* Field names that we can ignore if present and not
+     * understood. This allows new headers to be added without breaking
+     * backwards compatibility, and conversely to add headers that do break
+     * backwards compat and have old clients give meaningful errors. */
+    char *safelines;
+
+    const char *index_cache;
+    int flags;
+};
+
+static struct zsync_state *zsync_read_control(struct ctl_file *cf,
+                                              struct zsync_settings *st);
+static int zsync_read_control2(struct zsync_state *zs,
+                               struct zsync_settings *st,
+                               struct ctl_file *cf);
+static int valid_hash_lengths(const struct zsync_settings *st);
+static int zsync_start_blocksums(struct zsync_state *zs,
+                                 const struct zsync_settings *st,
+                                 char **index);
+static void zsync_end_blocksums(struct zsync_state *zs, char *index);
+static int zsync_load_array(struct zsync_state *zs, struct ctl_file *cf,
+                            int bytes,
+                            int (*load) (struct rcksum_state *, zs_blockid,
+                                         const unsigned char *, zs_blockid,
+                                         int));
+static int zsync_read_blocksums(struct zsync_state *zs,
+                                const struct zsync_settings *st,
+                                struct ctl_file *cf);
+static int zsync_start_loader(struct zsync_state *zs,
+                              const struct zsync_settings *st,
+                              struct ctl_file *cf, char *index);
+static void zsync_end_loader(struct zsync_state *zs);
 static int zsync_sha1(struct zsync_state *zs, int fh);
 static int zsync_recompress(struct zsync_state *zs);
 static time_t parse_822(const char* ts);
@@ -125,19 +168,185 @@ static char **append_ptrlist(int *n, char **p, char *a) {
 
 /* Constructor */
 struct zsync_state *zsync_begin(FILE * f) {
+    return zsync_begin_with_index_cache(f, NULL);
+}
+
+/* zsync_begin_with_index_cache(FILE*, dir)
+ * As zsync_begin, but keeping the block checksums of targets, and the hash
+ * tables for them, in index files in the given directory (if not NULL); so
+ * another run for the same target can load them instead of building them.
+ * Seed files' checksums are cached there too (see rcksum_set_seed_cache). */
+struct zsync_state *zsync_begin_with_index_cache(FILE * f,
+                                                 const char *index_cache) {
+    return zsync_begin_with_options(f, index_cache, 0);
+}
+
+/* zsync_begin_with_options(FILE*, dir, flags)
+ * As zsync_begin_with_index_cache; with ZSYNC_MAP_BLOCKSUMS in flags, the
+ * block checksums are read in place from the .zsync, if we can map it.
+ * A gzip compressed .zsync is decompressed as it is read. */
+struct zsync_state *zsync_begin_with_options(FILE * f, const char *index_cache,
+                                             int flags) {
     /* Defaults for the checksum bytes and sequential matches properties of the
      * rcksum_state. These are the defaults from versions of zsync before these
      * were variable. */
-    int checksum_bytes = 16, rsum_bytes = 4, seq_matches = 1;
+    struct zsync_settings st = { 16, 4, 1, RCKSUM_HASH_MD4, NULL, NULL, 0 };
+    struct ctl_file *cf = ctl_open(f);
+    struct zsync_state *zs;
 
-    /* Field names that we can ignore if present and not
-     * understood. This allows new headers to be added without breaking
-     * backwards compatibility, and conversely to add headers that do break
-     * backwards compat and have old clients give meaningful errors. */
-    char *safelines = NULL;
+    if (!cf)
+        return NULL;
+    st.index_cache = index_cache;
+    st.flags = flags;
+    zs = zsync_read_control(cf, &st);
+    free(st.safelines);
+
+    /* Unless the checksums are still being read from it */
+    if (!zs || !zs->loader)
+        ctl_close(cf);
+    return zs;
+}
+
+/* zsync_header(self, settings, control_file, line)
+ * Takes in one header line from the .zsync, with any line ending removed.
+ * The control file is where the line was read from, for the Z-Map2 that
+ * follows its header; NULL if the line is not from the text format, where
+ * that can't be. Returns 0, or -1 if the .zsync can't be used. */
+static int zsync_header(struct zsync_state *zs, struct zsync_settings *st,
+                        struct ctl_file *cf, char *buf) {
+    char *p = strchr(buf, ':');
+
+    if (!p || *(p + 1) != ' ') {
+        fprintf(stderr, "Bad line - not a zsync file? \"%s\"\n", buf);
+        return -1;
+    }
+    *p++ = 0;
+    p++;
+    if (!strcmp(buf, "zsync")) {
+        if (!strcmp(p, "0.0.4")) {
+            fprintf(stderr, "This version of zsync is not compatible with zsync 0.0.4 streams.\n");
+            return -1;
+        }
+    }
+    else if (!strcmp(buf, "Min-Version")) {
+        if (strcmp(p, VERSION) > 0) {
+            fprintf(stderr,
+                    "control file indicates that zsync-%s or better is required\n",
+                    p);
+            return -1;
+        }
+    }
+    else if (!strcmp(buf, "Length")) {
+        zs->filelen = atol(p);
+    }
+    else if (!strcmp(buf, "Filename")) {
+        zs->filename = strdup(p);
+    }
+    else if (!strcmp(buf, "Z-Filename")) {
+        zs->zfilename = strdup(p);
+    }
+    else if (!strcmp(buf, "URL")) {
+        zs->url = (char **)append_ptrlist(&(zs->nurl), zs->url, strdup(p));
+    }
+    else if (!strcmp(buf, "Z-URL")) {
+        zs->zurl = (char **)append_ptrlist(&(zs->nzurl), zs->zurl, strdup(p));
+    }
+    else if (!strcmp(buf, "Blocksize")) {
+        zs->blocksize = atol(p);
+        if (zs->blocksize < 0 || (zs->blocksize & (zs->blocksize - 1))) {
+            fprintf(stderr, "nonsensical blocksize %ld\n", zs->blocksize);
+            return -1;
+        }
+    }
+    else if (!strcmp(buf, "Hash-Lengths")) {
+        if (sscanf
+            (p, "%d,%d,%d", &st->seq_matches, &st->rsum_bytes,
+             &st->checksum_bytes) != 3 || !valid_hash_lengths(st)) {
+            fprintf(stderr, "nonsensical hash lengths line %s\n", p);
+            return -1;
+        }
+    }
+    else if (!strcmp(buf, "Block-Hash")) {
+        st->block_hash = rcksum_hash_by_name(p);
+        if (st->block_hash < 0) {
+            fprintf(stderr, "unknown block hash %s - you need a newer version of zsync.\n", p);
+            return -1;
+        }
+    }
+    else if (cf && zs->blocks && !strcmp(buf, "Z-Map2")) {
+        int nzblocks;
+        struct gzblock *zblock;
+
+        nzblocks = atoi(p);
+        if (nzblocks < 0) {
+            fprintf(stderr, "bad Z-Map line\n");
+            return -1;
+        }
+
+        zblock = malloc(nzblocks * sizeof *zblock);
+        if (zblock) {
+            if (ctl_read(zblock, sizeof *zblock, nzblocks, cf) < (size_t) nzblocks) {
+                fprintf(stderr, "premature EOF after Z-Map\n");
+                return -1;
+            }
 
+            zs->zmap = zmap_make(zblock, nzblocks);
+            free(zblock);
+        }
+    }
+    else if (!strcmp(buf, ckmeth_sha1)) {
+        if (strlen(p) != SHA1_DIGEST_LENGTH * 2) {
+            fprintf(stderr, "SHA-1 digest from control file is wrong length.\n");
+        }
+        else {
+            zs->checksum = strdup(p);
+            zs->checksum_method = ckmeth_sha1;
+        }
+    }
+    else if (!strcmp(buf, "Safe")) {
+        free(st->safelines);
+        st->safelines = strdup(p);
+    }
+    else if (!strcmp(buf, "Recompress")) {
+        zs->gzhead = strdup(p);
+        if (zs->gzhead) {
+            char *q = strchr(zs->gzhead, ' ');
+            if (!q)
+                q = zs->gzhead + strlen(zs->gzhead);
+
+            if (*q)
+                *q++ = 0;
+            /* Whitelist for safe options for gzip command line */
+            if (!strcmp(q, "--best") || !strcmp(q, "--rsync --best")
+                    || !strcmp(q, "--rsync") || !strcmp(q, ""))
+                zs->gzopts = strdup(q);
+            else {
+                fprintf(stderr, "bad recompress options, rejected\n");
+                free(zs->gzhead);
+            }
+        }
+    }
+    else if (!strcmp(buf, "MTime")) {
+        zs->mtime = parse_822(p);
+    }
+    else if (!st->safelines || !strstr(st->safelines, buf)) {
+        fprintf(stderr,
+                "unrecognised tag %s - you need a newer version of zsync.\n",
+                buf);
+        return -1;
+    }
+    if (zs->filelen && zs->blocksize)
+        zs->blocks = (zs->filelen + zs->blocksize - 1) / zs->blocksize;
+    return 0;
+}
+
+/* zsync_read_control(control_file, settings)
+ * Reads the .zsync, and returns the zsync_state for it; or NULL on error. */
+static struct zsync_state *zsync_read_control(struct ctl_file *cf,
+                                              struct zsync_settings *st) {
     /* Allocate memory for the object */
     struct zsync_state *zs = calloc(sizeof *zs, 1);
+    int first = 1;
 
     if (!zs)
         return NULL;
@@ -147,141 +356,32 @@ struct zsync_state *zsync_begin(FILE * f) {
 
     for (;;) {
         char buf[1024];
-        char *p = NULL;
         int l;
 
-        if (fgets(buf, sizeof(buf), f) != NULL) {
-            if (buf[0] == '\n')
-                break;
-            l = strlen(buf) - 1;
-            while (l >= 0
-                   && (buf[l] == '\n' || buf[l] == '\r' || buf[l] == ' '))
-                buf[l--] = 0;
-
-            p = strchr(buf, ':');
-        }
-        if (p && *(p + 1) == ' ') {
-            *p++ = 0;
-            p++;
-            if (!strcmp(buf, "zsync")) {
-                if (!strcmp(p, "0.0.4")) {
-                    fprintf(stderr, "This version of zsync is not compatible with zsync 0.0.4 streams.\n");
-                    free(zs);
-                    return NULL;
-                }
-            }
-            else if (!strcmp(buf, "Min-Version")) {
-                if (strcmp(p, VERSION) > 0) {
-                    fprintf(stderr,
-                            "control file indicates that zsync-%s or better is required\n",
-                            p);
-                    free(zs);
-                    return NULL;
-                }
-            }
-            else if (!strcmp(buf, "Length")) {
-                zs->filelen = atol(p);
-            }
-            else if (!strcmp(buf, "Filename")) {
-                zs->filename = strdup(p);
-            }
-            else if (!strcmp(buf, "Z-Filename")) {
-                zs->zfilename = strdup(p);
-            }
-            else if (!strcmp(buf, "URL")) {
-                zs->url = (char **)append_ptrlist(&(zs->nurl), zs->url, strdup(p));
-            }
-            else if (!strcmp(buf, "Z-URL")) {
-                zs->zurl = (char **)append_ptrlist(&(zs->nzurl), zs->zurl, strdup(p));
-            }
-            else if (!strcmp(buf, "Blocksize")) {
-                zs->blocksize = atol(p);
-                if (zs->blocksize < 0 || (zs->blocksize & (zs->blocksize - 1))) {
-                    fprintf(stderr, "nonsensical blocksize %ld\n", zs->blocksize);
-                    free(zs);
-                    return NULL;
-                }
-            }
-            else if (!strcmp(buf, "Hash-Lengths")) {
-                if (sscanf
-                    (p, "%d,%d,%d", &seq_matches, &rsum_bytes,
-                     &checksum_bytes) != 3 || rsum_bytes < 1 || rsum_bytes > 4
-                    || checksum_bytes < 3 || checksum_bytes > 16
-                    || seq_matches > 2 || seq_matches < 1) {
-                    fprintf(stderr, "nonsensical hash lengths line %s\n", p);
-                    free(zs);
-                    return NULL;
-                }
-            }
-            else if (zs->blocks && !strcmp(buf, "Z-Map2")) {
-                int nzblocks;
-                struct gzblock *zblock;
-
-                nzblocks = atoi(p);
-                if (nzblocks < 0) {
-                    fprintf(stderr, "bad Z-Map line\n");
-                    free(zs);
-                    return NULL;
-                }
-
-                zblock = malloc(nzblocks * sizeof *zblock);
-                if (zblock) {
-                    if (fread(zblock, sizeof *zblock, nzblocks, f) < nzblocks) {
-                        fprintf(stderr, "premature EOF after Z-Map\n");
-                        free(zs);
-                        return NULL;
-                    }
+        if (ctl_gets(buf, sizeof(buf), cf) == NULL) {
+            fprintf(stderr, "Bad line - not a zsync file? \"\"\n");
+            free(zs);
+            return NULL;
+        }
 
-                    zs->zmap = zmap_make(zblock, nzblocks);
-                    free(zblock);
-                }
-            }
-            else if (!strcmp(buf, ckmeth_sha1)) {
-                if (strlen(p) != SHA1_DIGEST_LENGTH * 2) {
-                    fprintf(stderr, "SHA-1 digest from control file is wrong length.\n");
-                }
-                else {
-                    zs->checksum = strdup(p);
-                    zs->checksum_method = ckmeth_sha1;
-                }
-            }
-            else if (!strcmp(buf, "Safe")) {
-                safelines = strdup(p);
-            }
-            else if (!strcmp(buf, "Recompress")) {
-                zs->gzhead = strdup(p);
-                if (zs->gzhead) {
-                    char *q = strchr(zs->gzhead, ' ');
-                    if (!q)
-                        q = zs->gzhead + strlen(zs->gzhead);
-
-                    if (*q)
-                        *q++ = 0;
-                    /* Whitelist for safe options for gzip command line */
-                    if (!strcmp(q, "--best") || !strcmp(q, "--rsync --best")
-                            || !strcmp(q, "--rsync") || !strcmp(q, ""))
-                        zs->gzopts = strdup(q);
-                    else {
-                        fprintf(stderr, "bad recompress options, rejected\n");
-                        free(zs->gzhead);
-                    }
-                }
-            }
-            else if (!strcmp(buf, "MTime")) {
-                zs->mtime = parse_822(p);
-            }
-            else if (!safelines || !strstr(safelines, buf)) {
-                fprintf(stderr,
-                        "unrecognised tag %s - you need a newer version of zsync.\n",
-                        buf);
+        /* The binary format is different from here on */
+        if (first && !strcmp(buf, ZS2_MAGIC)) {
+            if (zsync_read_control2(zs, st, cf) != 0) {
                 free(zs);
                 return NULL;
             }
-            if (zs->filelen && zs->blocksize)
-                zs->blocks = (zs->filelen + zs->blocksize - 1) / zs->blocksize;
+            return zs;
         }
-        else {
-            fprintf(stderr, "Bad line - not a zsync file? \"%s\"\n", buf);
+        first = 0;
+
+        if (buf[0] == '\n')
+            break;
+        l = strlen(buf) - 1;
+        while (l >= 0
+               && (buf[l] == '\n' || buf[l] == '\r' || buf[l] == ' '))
+            buf[l--] = 0;
+
+        if (zsync_header(zs, st, cf, buf) != 0) {
             free(zs);
             return NULL;
         }
@@ -291,55 +391,551 @@ struct zsync_state *zsync_begin(FILE * f) {
         free(zs);
         return NULL;
     }
-    if (zsync_read_blocksums(zs, f, rsum_bytes, checksum_bytes, seq_matches) != 0) {
+    if (zsync_read_blocksums(zs, st, cf) != 0) {
         free(zs);
         return NULL;
     }
     return zs;
 }
 
-/* zsync_read_blocksums(self, FILE*, rsum_bytes, checksum_bytes, seq_matches)
+/* Most of the text section of a binary .zsync that we'll read */
+#define ZS2_MAX_TEXT (1 << 20)
+
+/* zsync_read_control2(self, settings, control_file)
+ * Reads the rest of a binary (version 2, see format2.h) .zsync, after the
+ * magic number; its sections are read in order, skipping any that we don't
+ * know. Returns 0, or -1 on error. */
+static int zsync_read_control2(struct zsync_state *zs,
+                               struct zsync_settings *st,
+                               struct ctl_file *cf) {
+    struct {
+        unsigned type, flags;
+        off_t offset, len;
+    } sec[ZS2_MAX_SECTIONS];
+    unsigned char buf[ZS2_MAX_SECTIONS * ZS2_ENTRY_SIZE];
+    int rsums = -1, checksums = -1, header = 0, loaded = 0, i, n;
+    off_t size = ctl_size(cf);
+    char *index = NULL;
+
+    /* The section table */
+    if (ctl_read(buf, 8, 1, cf) != 1
+        || (n = zs2_get(buf, 4)) < 1 || n > ZS2_MAX_SECTIONS
+        || ctl_read(buf, ZS2_ENTRY_SIZE, n, cf) != (size_t) n) {
+        fprintf(stderr, "bad section table in control file\n");
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        const unsigned char *e = buf + i * ZS2_ENTRY_SIZE;
+
+        sec[i].type = zs2_get(e, 4);
+        sec[i].flags = zs2_get(e + 4, 4);
+        sec[i].offset = zs2_get(e + 8, 8);
+        sec[i].len = zs2_get(e + 16, 8);
+        if (sec[i].offset < (i ? sec[i - 1].offset + sec[i - 1].len
+                             : ctl_tell(cf))
+            || sec[i].len < 0
+            || (uint64_t) sec[i].offset + sec[i].len > INT64_MAX
+            || (size >= 0 && sec[i].offset + sec[i].len > size)) {
+            fprintf(stderr, "bad section table in control file\n");
+            return -1;
+        }
+        if (sec[i].type == ZS2_SEC_RSUMS)
+            rsums = i;
+        else if (sec[i].type == ZS2_SEC_CHECKSUMS)
+            checksums = i;
+    }
+    if (rsums < 0 || checksums < 0) {
+        fprintf(stderr, "control file has no block checksums\n");
+        return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (ctl_skip(cf, sec[i].offset - ctl_tell(cf)) != 0) {
+            fprintf(stderr, "premature EOF in control file\n");
+            goto bail;
+        }
+        switch (sec[i].type) {
+        case ZS2_SEC_HEADER:
+            if (sec[i].len < ZS2_HEADER_SIZE
+                || ctl_read(buf, ZS2_HEADER_SIZE, 1, cf) != 1) {
+                fprintf(stderr, "bad header in control file\n");
+                goto bail;
+            }
+            zs->filelen = zs2_get(buf, 8);
+            zs->blocksize = zs2_get(buf + 8, 4);
+            st->seq_matches = buf[12];
+            st->rsum_bytes = buf[13];
+            st->checksum_bytes = buf[14];
+            st->block_hash = buf[15];
+            zs->mtime = (time_t) (int64_t) zs2_get(buf + 16, 8);
+            if (!zs->filelen || zs->blocksize <= 0
+                || (zs->blocksize & (zs->blocksize - 1))
+                || !valid_hash_lengths(st)
+                || st->block_hash > RCKSUM_HASH_XXH3) {
+                fprintf(stderr, "nonsensical header in control file\n");
+                goto bail;
+            }
+            zs->blocks = (zs->filelen + zs->blocksize - 1) / zs->blocksize;
+            zs->checksum = malloc(SHA1_DIGEST_LENGTH * 2 + 1);
+            if (zs->checksum) {
+                int j;
+
+                for (j = 0; j < SHA1_DIGEST_LENGTH; j++)
+                    sprintf(zs->checksum + 2 * j, "%02x", buf[24 + j]);
+                zs->checksum_method = ckmeth_sha1;
+            }
+            header = 1;
+            break;
+
+        case ZS2_SEC_TEXT:
+            {   /* Header lines, as in the text format */
+                char *text = sec[i].len < ZS2_MAX_TEXT
+                    ? malloc(sec[i].len + 1) : NULL;
+                char *line, *next;
+                int rc = 0;
+
+                if (!text || ctl_read(text, sec[i].len, 1, cf) != 1) {
+                    fprintf(stderr, "bad text section in control file\n");
+                    free(text);
+                    goto bail;
+                }
+                text[sec[i].len] = 0;
+                for (line = text; rc == 0 && *line; line = next) {
+                    int l;
+
+                    next = strchr(line, '\n');
+                    next = next ? next + 1 : line + strlen(line);
+                    l = next - line;
+                    while (l > 0 && (line[l - 1] == '\n' || line[l - 1] == '\r'
+                                     || line[l - 1] == ' '))
+                        l--;
+                    line[l] = 0;
+                    if (l)
+                        rc = zsync_header(zs, st, NULL, line);
+                }
+                free(text);
+                if (rc != 0)
+                    goto bail;
+            }
+            break;
+
+        case ZS2_SEC_ZMAP:
+            {   /* A whole number of entries, no more than zmap takes; read
+                 * without trusting the length, where we don't know the
+                 * file's */
+                size_t nzblocks = sec[i].len / sizeof(struct gzblock);
+                struct gzblock *zblock = NULL;
+
+                if (sec[i].len % sizeof *zblock == 0 && nzblocks <= INT_MAX
+                    && (uint64_t) sec[i].len <= SIZE_MAX)
+                    zblock = ctl_read_alloc(cf, sec[i].len);
+                if (!zblock) {
+                    fprintf(stderr, "bad Z-Map in control file\n");
+                    goto bail;
+                }
+                zs->zmap = zmap_make(zblock, nzblocks);
+                free(zblock);
+            }
+            break;
+
+        case ZS2_SEC_RSUMS:
+            if (!header || i > checksums
+                || sec[i].len / st->rsum_bytes < zs->blocks
+                || sec[checksums].len / st->checksum_bytes < zs->blocks) {
+                fprintf(stderr, "bad block checksums in control file\n");
+                goto bail;
+            }
+            loaded = zsync_start_blocksums(zs, st, &index);
+            if (loaded < 0)
+                goto bail;
+
+            /* Map both arrays, if asked to and we can */
+            if (!loaded && (st->flags & ZSYNC_MAP_BLOCKSUMS)
+                && ctl_plain_file(cf)) {
+                FILE *f = ctl_plain_file(cf);
+                off_t base = ftello(f) - ctl_tell(cf);
+
+                loaded = rcksum_map_target_arrays(zs->rs, fileno(f),
+                                                  base + sec[i].offset,
+                                                  base + sec[checksums].offset,
+                                                  st->rsum_bytes,
+                                                  st->checksum_bytes) == 0;
+            }
+            if (!loaded && zsync_load_array(zs, cf, st->rsum_bytes,
+                                            rcksum_load_target_rsums) != 0)
+                goto bail;
+            break;
+
+        case ZS2_SEC_CHECKSUMS:
+            if (!loaded && zsync_load_array(zs, cf, st->checksum_bytes,
+                                            rcksum_load_target_checksums) != 0)
+                goto bail;
+            break;
+
+        default:
+            if (sec[i].flags & ZS2_REQUIRED) {
+                fprintf(stderr, "unknown section %u in control file - you need a newer version of zsync.\n", sec[i].type);
+                goto bail;
+            }
+            break;
+        }
+    }
+    zsync_end_blocksums(zs, index);
+    return 0;
+
+ bail:
+    if (zs->rs)
+        rcksum_end(zs->rs);
+    free(index);
+    return -1;
+}
+
+/* valid_hash_lengths(settings)
+ * Returns true iff the lengths of the hashes for each block, and the number of
+ * consecutive blocks to match, are ones that we can use */
+static int valid_hash_lengths(const struct zsync_settings *st) {
+    return st->rsum_bytes >= 1 && st->rsum_bytes <= RSUM_MAX_BYTES
+        && st->checksum_bytes >= 3 && st->checksum_bytes <= 16
+        && st->seq_matches >= 1 && st->seq_matches <= RCKSUM_MAX_SEQ_MATCHES;
+}
+
+/* Blocks' checksums to read from the control file at a time */
+#define BLOCKSUMS_BATCH 4096
+
+/* zsync_start_blocksums(self, settings, &index)
  * Called during construction only, this creates the rcksum_state that stores
  * the per-block checksums of the target file and holds the local working copy
- * of the in-progress target. And it populates the per-block checksums from the
- * given file handle, which must be reading from the .zsync at the start of the
- * checksums. 
- * rsum_bytes, checksum_bytes, seq_matches are settings for the checksums,
- * passed through to the rcksum_state. */
-static int zsync_read_blocksums(struct zsync_state *zs, FILE * f,
-                                int rsum_bytes, int checksum_bytes,
-                                int seq_matches) {
+ * of the in-progress target, with the settings from the .zsync. If there is
+ * an index file for this target in the settings' index_cache directory, the
+ * checksums are loaded from that, and it returns 1; otherwise it returns 0,
+ * for the caller to load them from the .zsync, and sets index to the
+ * (malloced) name to save one as, if any. Returns -1 on error. */
+static int zsync_start_blocksums(struct zsync_state *zs,
+                                 const struct zsync_settings *st,
+                                 char **index) {
+    *index = NULL;
+
     /* Make the rcksum_state first */
-    if (!(zs->rs = rcksum_init(zs->blocks, zs->blocksize, rsum_bytes,
-                               checksum_bytes, seq_matches))) {
+    if (!(zs->rs = rcksum_init(zs->blocks, zs->blocksize, st->rsum_bytes,
+                               st->checksum_bytes, st->seq_matches))) {
         return -1;
     }
+    rcksum_set_hash(zs->rs, st->block_hash);
+    rcksum_set_seed_cache(zs->rs, st->index_cache);
+
+    /* The index for this target is named for the target's SHA-1, and the
+     * settings for the checksums */
+    if (st->index_cache && zs->checksum) {
+        *index = malloc(strlen(st->index_cache) + 100);
+        if (*index) {
+            sprintf(*index, "%s/%s-%ld-%d-%d-%d-%s.idx", st->index_cache,
+                    zs->checksum, zs->blocksize, st->rsum_bytes,
+                    st->checksum_bytes, st->seq_matches,
+                    rcksum_hash_name(st->block_hash));
+            if (rcksum_load_index(zs->rs, *index)) {
+                free(*index);
+                *index = NULL;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
 
-    /* Now read in and store the checksums */
-    zs_blockid id = 0;
-    for (; id < zs->blocks; id++) {
-        struct rsum r = { 0, 0 };
-        unsigned char checksum[CHECKSUM_SIZE];
+/* zsync_end_blocksums(self, index)
+ * Once the block checksums are all loaded, builds the tables for them, and
+ * saves them in the given index file (if not NULL, which is freed) */
+static void zsync_end_blocksums(struct zsync_state *zs, char *index) {
+    /* Build the tables for the blocks now, so that we know which blocks are
+     * the same as others before we work out what we need to fetch (if we
+     * can't, they are tried again when needed) */
+    rcksum_build_index(zs->rs);
+
+    if (index) {
+        if (rcksum_save_index(zs->rs, index) != 0)
+            fprintf(stderr, "could not save index %s\n", index);
+        free(index);
+    }
+}
 
-        /* Read in */
-        if (fread(((char *)&r) + 4 - rsum_bytes, rsum_bytes, 1, f) < 1
-            || fread((void *)&checksum, checksum_bytes, 1, f) < 1) {
+/* zsync_load_array(self, control_file, bytes, load)
+ * Reads an array of bytes for each block from the control file, a batch of
+ * blocks at a time, passing each batch to the given rcksum_load_target_*
+ * function. Returns 0, or -1 on error. */
+static int zsync_load_array(struct zsync_state *zs, struct ctl_file *cf,
+                            int bytes,
+                            int (*load) (struct rcksum_state *, zs_blockid,
+                                         const unsigned char *, zs_blockid,
+                                         int)) {
+    unsigned char *buf = malloc(BLOCKSUMS_BATCH * bytes);
+    zs_blockid id;
+
+    for (id = 0; buf && id < zs->blocks; id += BLOCKSUMS_BATCH) {
+        zs_blockid n = zs->blocks - id;
+
+        if (n > BLOCKSUMS_BATCH)
+            n = BLOCKSUMS_BATCH;
+        if (ctl_read(buf, bytes, n, cf) < (size_t) n) {
+            fprintf(stderr, "short read on control file%s\n",
+                    ctl_error(cf) ? " (read error)" : "");
+            break;
+        }
+        load(zs->rs, id, buf, n, bytes);
+    }
+    free(buf);
+    return buf && id >= zs->blocks ? 0 : -1;
+}
+
+/* zsync_read_blocksums(self, settings, control_file)
+ * Creates the rcksum_state for the target (see zsync_start_blocksums) and
+ * populates the per-block checksums from the control file, which must be
+ * reading from the .zsync at the start of the checksums; or from the index
+ * file for this target, if there is one, or else saves one. With
+ * ZSYNC_MAP_BLOCKSUMS in the settings' flags, the checksums are left in the
+ * file, which is mapped, if it can be (so not if it is compressed); or with
+ * ZSYNC_PROGRESSIVE, they are read in the background (see zsync_start_loader
+ * below). */
+static int zsync_read_blocksums(struct zsync_state *zs,
+                                const struct zsync_settings *st,
+                                struct ctl_file *cf) {
+    char *index;
+    int loaded = zsync_start_blocksums(zs, st, &index);
+
+    if (loaded < 0)
+        return -1;
 
-            /* Error - free the rcksum_state and tell the caller to bail */
-            fprintf(stderr, "short read on control file; %s\n",
-                    strerror(ferror(f)));
+    /* Now read in and store the checksums, a batch of blocks at a time; or
+     * just map them, if asked to and we can */
+    if (!loaded && (st->flags & ZSYNC_MAP_BLOCKSUMS) && ctl_plain_file(cf))
+        loaded = rcksum_map_target_blocks(zs->rs, fileno(ctl_plain_file(cf)),
+                                          ftello(ctl_plain_file(cf)),
+                                          st->rsum_bytes,
+                                          st->checksum_bytes) == 0;
+    if (!loaded && (st->flags & ZSYNC_PROGRESSIVE)
+        && zsync_start_loader(zs, st, cf, index))
+        return 0;
+    if (!loaded) {
+        const int record = st->rsum_bytes + st->checksum_bytes;
+        unsigned char *buf = malloc(BLOCKSUMS_BATCH * record);
+        zs_blockid id;
+
+        for (id = 0; buf && id < zs->blocks; id += BLOCKSUMS_BATCH) {
+            zs_blockid n = zs->blocks - id;
+
+            if (n > BLOCKSUMS_BATCH)
+                n = BLOCKSUMS_BATCH;
+            if (ctl_read(buf, record, n, cf) < (size_t) n) {
+                fprintf(stderr, "short read on control file%s\n",
+                        ctl_error(cf) ? " (read error)" : "");
+                break;
+            }
+            rcksum_load_target_blocks(zs->rs, id, buf, n, st->rsum_bytes,
+                                      st->checksum_bytes);
+        }
+        free(buf);
+
+        /* Error - free the rcksum_state and tell the caller to bail */
+        if (!buf || id < zs->blocks) {
             rcksum_end(zs->rs);
+            free(index);
             return -1;
         }
+    }
+
+    zsync_end_blocksums(zs, index);
+    return 0;
+}
 
-        /* Convert to host endian and store */
-        r.a = ntohs(r.a);
-        r.b = ntohs(r.b);
-        rcksum_add_target_block(zs->rs, id, r, checksum);
+#ifdef _POSIX_THREADS
+/* A batch of blocks' checksums, as in the control file, read by the loader
+ * thread and waiting to be added to the rcksum_state */
+struct blocksums_batch {
+    struct blocksums_batch *next;
+    zs_blockid from, n;
+    unsigned char data[];
+};
+#endif
+
+/* For ZSYNC_PROGRESSIVE, a thread reads the blocks' checksums from the .zsync
+ * in batches, as it comes in; they are added to the rcksum_state by
+ * zsync_load_blocksums, so that only the caller's thread uses that. */
+struct blocksums_loader {
+#ifdef _POSIX_THREADS
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t more;        /* signalled as batches are read */
+    struct blocksums_batch *head, **tail;   /* read and not yet added */
+#endif
+    struct ctl_file *cf;
+    int rsum_bytes, checksum_bytes;
+    zs_blockid blocks;
+    int done;                   /* 1 once all are read, -1 if we couldn't */
+    char *index;                /* to save once they are all in, or NULL */
+};
+
+#ifdef _POSIX_THREADS
+/* blocksums_loader_thread(loader)
+ * Reads all the blocks' checksums from the control file, a batch at a time,
+ * queueing them up for zsync_load_blocksums; then closes the control file. */
+static void *blocksums_loader_thread(void *arg) {
+    struct blocksums_loader *l = arg;
+    const int record = l->rsum_bytes + l->checksum_bytes;
+    zs_blockid id;
+    int done = 1;
+
+    for (id = 0; id < l->blocks; id += BLOCKSUMS_BATCH) {
+        zs_blockid n = l->blocks - id;
+        struct blocksums_batch *b;
+
+        if (n > BLOCKSUMS_BATCH)
+            n = BLOCKSUMS_BATCH;
+        b = malloc(sizeof *b + n * record);
+        if (!b || ctl_read(b->data, record, n, l->cf) < (size_t) n) {
+            fprintf(stderr, "short read on control file%s\n",
+                    ctl_error(l->cf) ? " (read error)" : "");
+            free(b);
+            done = -1;
+            break;
+        }
+        b->next = NULL;
+        b->from = id;
+        b->n = n;
+        pthread_mutex_lock(&l->lock);
+        *l->tail = b;
+        l->tail = &b->next;
+        pthread_cond_signal(&l->more);
+        pthread_mutex_unlock(&l->lock);
     }
+    ctl_close(l->cf);
+
+    pthread_mutex_lock(&l->lock);
+    l->done = done;
+    pthread_cond_signal(&l->more);
+    pthread_mutex_unlock(&l->lock);
+    return NULL;
+}
+#endif
+
+/* zsync_start_loader(self, settings, control_file, index)
+ * Starts reading the blocks' checksums from the control file in the
+ * background; it is then the loader's, as is the index file name (see
+ * zsync_start_blocksums). Until they are added, none of the blocks are looked
+ * for. Returns 1 if started; 0 if not (as without threads), for the caller to
+ * read them now. */
+static int zsync_start_loader(struct zsync_state *zs,
+                              const struct zsync_settings *st,
+                              struct ctl_file *cf, char *index) {
+#ifdef _POSIX_THREADS
+    struct blocksums_loader *l = calloc(1, sizeof *l);
+
+    if (l) {
+        l->cf = cf;
+        l->rsum_bytes = st->rsum_bytes;
+        l->checksum_bytes = st->checksum_bytes;
+        l->blocks = zs->blocks;
+        l->index = index;
+        l->tail = &l->head;
+        pthread_mutex_init(&l->lock, NULL);
+        pthread_cond_init(&l->more, NULL);
+        if (pthread_create(&l->thread, NULL, blocksums_loader_thread, l) == 0) {
+            rcksum_set_blocks_loaded(zs->rs, 0);
+            zs->loader = l;
+            return 1;
+        }
+        pthread_cond_destroy(&l->more);
+        pthread_mutex_destroy(&l->lock);
+        free(l);
+    }
+#endif
     return 0;
 }
 
+/* zsync_load_blocksums(self, wait)
+ * Adds the blocks' checksums that the loader has read so far to the
+ * rcksum_state; or, with wait, all of them, as they are read. Once all are
+ * in, the tables for them are built, and saved as the index if no blocks have
+ * been found yet (else the index would be missing those). Returns 1 if all
+ * are in, 0 if not yet, -1 if they couldn't be read. */
+int zsync_load_blocksums(struct zsync_state *zs, int wait) {
+    struct blocksums_loader *l = zs->loader;
+    int done = 0;
+
+    if (!l)
+        return zs->rs ? 1 : -1;
+#ifdef _POSIX_THREADS
+    do {
+        struct blocksums_batch *b;
+        zs_blockid loaded = -1;
+
+        /* Take what has been read, waiting for some if asked to */
+        pthread_mutex_lock(&l->lock);
+        while (!l->head && !l->done && wait)
+            pthread_cond_wait(&l->more, &l->lock);
+        b = l->head;
+        l->head = NULL;
+        l->tail = &l->head;
+        done = l->done;
+        pthread_mutex_unlock(&l->lock);
+
+        while (b) {
+            struct blocksums_batch *next = b->next;
+
+            rcksum_load_target_blocks(zs->rs, b->from, b->data, b->n,
+                                      l->rsum_bytes, l->checksum_bytes);
+            loaded = b->from + b->n;
+            free(b);
+            b = next;
+        }
+        if (loaded != -1)
+            rcksum_set_blocks_loaded(zs->rs, loaded);
+    } while (wait && !done);
+    if (!done)
+        return 0;
+
+    /* All read, or we failed to */
+    done = l->done;
+    if (done > 0 && rcksum_blocks_todo(zs->rs) < zs->blocks) {
+        free(l->index);
+        l->index = NULL;
+    }
+    if (done > 0) {
+        zsync_end_blocksums(zs, l->index);
+        l->index = NULL;
+    }
+    zsync_end_loader(zs);
+    if (done < 0) {
+        rcksum_end(zs->rs);
+        zs->rs = NULL;
+        return -1;
+    }
+#endif
+    return 1;
+}
+
+/* zsync_end_loader(self)
+ * Waits for the loader thread to finish, and frees the loader and anything
+ * that it had read that was not yet added */
+static void zsync_end_loader(struct zsync_state *zs) {
+    struct blocksums_loader *l = zs->loader;
+
+    if (!l)
+        return;
+#ifdef _POSIX_THREADS
+    pthread_join(l->thread, NULL);
+    while (l->head) {
+        struct blocksums_batch *b = l->head;
+
+        l->head = b->next;
+        free(b);
+    }
+    pthread_cond_destroy(&l->more);
+    pthread_mutex_destroy(&l->lock);
+#endif
+    free(l->index);
+    free(l);
+    zs->loader = NULL;
+}
+
 /* parse_822(buf[])
  * Parse an RFC822 date string. Returns a time_t, or -1 on failure. 
  * E.g. Tue, 25 Jul 2006 20:02:17 +0000
@@ -389,7 +985,7 @@ time_t zsync_mtime(const struct zsync_state *zs) {
  * The caller should not rely on exact values 2+; just test >= 2. Values >2 may
  * be used in later versions of libzsync. */
 int zsync_status(const struct zsync_state *zs) {
-    int todo = rcksum_blocks_todo(zs->rs);
+    zs_blockid todo = rcksum_blocks_todo(zs->rs);
 
     if (todo == zs->blocks)
         return 0;
@@ -405,8 +1001,8 @@ void zsync_progress(const struct zsync_state *zs, long long *got,
                     long long *total) {
 
     if (got) {
-        int todo = zs->blocks - rcksum_blocks_todo(zs->rs);
-        *got = todo * zs->blocksize;
+        zs_blockid known = zs->blocks - rcksum_blocks_todo(zs->rs);
+        *got = known * zs->blocksize;
     }
     if (total)
         *total = zs->blocks * zs->blocksize;
@@ -444,7 +1040,8 @@ off_t *zsync_needed_byte_ranges(struct zsync_state * zs, int *num, int type) {
     int i;
 
     /* Request all needed block ranges */
-    zs_blockid *blrange = rcksum_needed_block_ranges(zs->rs, &nrange, 0, 0x7fffffff);
+    zs_blockid *blrange = rcksum_needed_block_ranges(zs->rs, &nrange, 0,
+                                                     RCKSUM_ALL_BLOCKS);
     if (!blrange)
         return NULL;
 
@@ -489,11 +1086,28 @@ off_t *zsync_needed_byte_ranges(struct zsync_state * zs, int *num, int type) {
  * Read the given stream, applying the rsync rolling checksum algorithm to
  * identify any blocks of data in common with the target file. Blocks found are
  * written to our local copy of the target in progress. Progress reports if
- * progress != 0  */
-int zsync_submit_source_file(struct zsync_state *zs, FILE * f, int progress) {
+ * progress != 0. Stops, returning RCKSUM_COMPLETE, once it has all of the
+ * target. */
+long long zsync_submit_source_file(struct zsync_state *zs, FILE * f,
+                                   int progress) {
     return rcksum_submit_source_file(zs->rs, f, progress);
 }
 
+/* zsync_set_threads(self, nthreads)
+ * Set how many threads zsync_submit_source_file can use to read each file */
+void zsync_set_threads(struct zsync_state *zs, int nthreads) {
+    rcksum_set_threads(zs->rs, nthreads);
+}
+
+/* zsync_get_stats(self, &stats)
+ * Fills in librcksum's statistics for this download so far */
+void zsync_get_stats(const struct zsync_state *zs, struct rcksum_stats *stats) {
+    if (zs->rs)
+        rcksum_get_stats(zs->rs, stats);
+    else
+        memset(stats, 0, sizeof *stats);
+}
+
 char *zsync_cur_filename(struct zsync_state *zs) {
     if (!zs->cur_filename)
         zs->cur_filename = rcksum_filename(zs->rs);
@@ -715,7 +1329,9 @@ char *zsync_end(struct zsync_state *zs) {
     int i;
     char *f = zsync_cur_filename(zs);
 
-    /* Free rcksum object and zmap */
+    /* Stop reading the checksums, if we still are; then free rcksum object
+     * and zmap */
+    zsync_end_loader(zs);
     if (zs->rs)
         rcksum_end(zs->rs);
     if (zs->zmap)
@@ -801,8 +1417,12 @@ struct zsync_receiver {
 
 /* Constructor */
 struct zsync_receiver *zsync_begin_receive(struct zsync_state *zs, int url_type) {
-    struct zsync_receiver *zr = malloc(sizeof(struct zsync_receiver));
+    struct zsync_receiver *zr;
 
+    /* We must know all the blocks to fetch them */
+    if (zsync_load_blocksums(zs, 1) != 1)
+        return NULL;
+    zr = malloc(sizeof(struct zsync_receiver));
     if (!zr)
         return NULL;
     zr->zs = zs;
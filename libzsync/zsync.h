@@ -19,6 +19,36 @@ struct zsync_state;
  */
 struct zsync_state* zsync_begin(FILE* cf);
 
+/* zsync_begin_with_index_cache - as zsync_begin, but keeping an index of the
+ * target's block checksums in the given directory, which later runs for the
+ * same target can load much faster than reading and indexing the checksums;
+ * and the checksums of the blocks of seed files, so that unchanged seeds
+ * needn't be read in full again.
+ */
+struct zsync_state* zsync_begin_with_index_cache(FILE* cf, const char* dir);
+
+/* zsync_begin_with_options - as zsync_begin_with_index_cache, with flags:
+ * ZSYNC_MAP_BLOCKSUMS to read the block checksums in place from a mapping of
+ * the .zsync, where it is a local file, rather than copying them into memory;
+ * the file must then not change until zsync_end.
+ */
+#define ZSYNC_MAP_BLOCKSUMS 1
+/* Or ZSYNC_PROGRESSIVE to return once the headers are read, and read the
+ * block checksums in the background (where the .zsync is still coming in, so
+ * that local data can be read meanwhile); see zsync_load_blocksums. The file
+ * must then be left open until they are all in. Only for the text format. */
+#define ZSYNC_PROGRESSIVE 2
+struct zsync_state* zsync_begin_with_options(FILE* cf, const char* dir, int flags);
+
+/* zsync_load_blocksums - for a zsync_state begun with ZSYNC_PROGRESSIVE, adds
+ * the blocks' checksums read so far to those that are looked for in local data
+ * (or, if wait is set, all of them, waiting for them to be read). Returns 1 if
+ * they are now all in (always, for a zsync_state not begun so), 0 if there are
+ * more to come, or -1 if the .zsync could not be read. Local data read before
+ * they were all in must be read again for the rest; and they must all be in
+ * before any blocks are fetched. */
+int zsync_load_blocksums(struct zsync_state* zs, int wait);
+
 /* zsync_hint_decompress - if it returns non-zero, this suggests that 
  *  compressed seed files should be decompressed */
 int zsync_hint_decompress(const struct zsync_state*);
@@ -48,8 +78,21 @@ int zsync_status(const struct zsync_state* zs);
 void zsync_progress(const struct zsync_state* zs, long long* got, long long* total);
 
 /* zsync_submit_source_file - submit local file data to zsync
+ * Returns the number of blocks of the target found in it; or a negative value
+ * if we now have all of the target (zsync_status >= 2), in which case it
+ * stops reading there - so there's no point submitting any more.
  */
-int zsync_submit_source_file(struct zsync_state* zs, FILE* f, int progress);
+long long zsync_submit_source_file(struct zsync_state* zs, FILE* f, int progress);
+
+/* zsync_set_threads - number of threads that zsync_submit_source_file can
+ * split the work of reading a (plain, not piped) file between */
+void zsync_set_threads(struct zsync_state* zs, int nthreads);
+
+/* zsync_get_stats - fills in the statistics of the search for blocks and the
+ * writes to the target so far (see rcksum_get_stats in librcksum/rcksum.h);
+ * only available until zsync_complete, after which they are all 0 */
+struct rcksum_stats;
+void zsync_get_stats(const struct zsync_state* zs, struct rcksum_stats* stats);
 
 /* zsync_get_url - returns a URL from which to get needed data.
  * Returns NULL on failure, or a array of pointers to URLs.
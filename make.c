@@ -44,6 +44,7 @@
 #include "librcksum/rcksum.h"
 #include "libzsync/zmap.h"
 #include "libzsync/sha1.h"
+#include "libzsync/format2.h"
 #include "zlib/zlib.h"
 #include "format_string.h"
 
@@ -52,11 +53,19 @@
 SHA1_CTX shactx;
 size_t blocksize = 0;
 off_t len = 0;
+int block_hash = RCKSUM_HASH_MD4;
 
 /* And settings from the command line */
 int verbose = 0;
 static int no_look_inside;
 
+/* Blocks that we read and checksum at a time */
+#define SUMS_BATCH 64
+
+/* Fewest blocks in a file for us to consider requiring more than 2
+ * consecutive matching blocks */
+#define SEQ_MATCHES_MIN_BLOCKS (1 << 22)
+
 /* stream_error(function, stream) - Exit with IO-related error message */
 void __attribute__ ((noreturn)) stream_error(const char *func, FILE * stream) {
     fprintf(stderr, "%s: %s\n", func, strerror(ferror(stream)));
@@ -64,27 +73,37 @@ void __attribute__ ((noreturn)) stream_error(const char *func, FILE * stream) {
 }
 
 /* write_block_sums(buffer[], num_bytes, output_stream)
- * Given one block of data, calculate the checksums for this block and write
- * them (as raw bytes) to the given output stream */
+ * Given one or more blocks of data, calculate the checksums for these blocks
+ * and write them (as raw bytes) to the given output stream */
 static void write_block_sums(unsigned char *buf, size_t got, FILE * f) {
-    struct rsum r;
-    unsigned char checksum[CHECKSUM_SIZE];
+    size_t nblocks = got ? (got + blocksize - 1) / blocksize : 1;
+    unsigned char checksums[SUMS_BATCH][CHECKSUM_SIZE];
+    size_t i;
 
     /* Pad for our checksum, if this is a short last block  */
-    if (got < blocksize)
-        memset(buf + got, 0, blocksize - got);
-
-    /* Do rsum and checksum, and convert to network endian */
-    r = rcksum_calc_rsum_block(buf, blocksize);
-    rcksum_calc_checksum(&checksum[0], buf, blocksize);
-    r.a = htons(r.a);
-    r.b = htons(r.b);
-
-    /* Write them raw to the stream */
-    if (fwrite(&r, sizeof r, 1, f) != 1)
-        stream_error("fwrite", f);
-    if (fwrite(checksum, sizeof checksum, 1, f) != 1)
-        stream_error("fwrite", f);
+    memset(buf + got, 0, nblocks * blocksize - got);
+
+    rcksum_calc_hash_checksums(block_hash, checksums[0], buf, nblocks,
+                               blocksize);
+
+    for (i = 0; i < nblocks; i++) {
+        /* Do rsum, with the high halves before it, and convert to network
+         * endian; it's up to fcopy_hashes how much of this we keep */
+        struct rsum r[2];
+
+        r[0] = rcksum_calc_rsum_high(buf + i * blocksize, blocksize);
+        r[1] = rcksum_calc_rsum_block(buf + i * blocksize, blocksize);
+        r[0].a = htons(r[0].a);
+        r[0].b = htons(r[0].b);
+        r[1].a = htons(r[1].a);
+        r[1].b = htons(r[1].b);
+
+        /* Write them raw to the stream */
+        if (fwrite(r, sizeof r, 1, f) != 1)
+            stream_error("fwrite", f);
+        if (fwrite(checksums[i], CHECKSUM_SIZE, 1, f) != 1)
+            stream_error("fwrite", f);
+    }
 }
 
 /* long long pos = in_position(z_stream*)
@@ -340,7 +359,7 @@ void do_zstream(FILE * fin, FILE * fout, const char *bufsofar, size_t got) {
  * given data. No compression handling.
  */
 void read_stream_write_blocksums(FILE * fin, FILE * fout) {
-    unsigned char *buf = malloc(blocksize);
+    unsigned char *buf = malloc(blocksize * SUMS_BATCH);
 
     if (!buf) {
         fprintf(stderr, "out of memory\n");
@@ -348,7 +367,8 @@ void read_stream_write_blocksums(FILE * fin, FILE * fout) {
     }
 
     while (!feof(fin)) {
-        int got = fread(buf, 1, blocksize, fin);
+        /* Just one block to start with, until we know it's not compressed */
+        int got = fread(buf, 1, len ? blocksize * SUMS_BATCH : blocksize, fin);
 
         if (got > 0) {
             if (!no_look_inside && len == 0 && buf[0] == 0x1f && buf[1] == 0x8b) {
@@ -395,14 +415,14 @@ void fcopy(FILE * fin, FILE * fout) {
  * parameters.
  */
 void fcopy_hashes(FILE * fin, FILE * fout, size_t rsum_bytes, size_t hash_bytes) {
-    unsigned char buf[20];
+    unsigned char buf[RSUM_MAX_BYTES + CHECKSUM_SIZE];
     size_t len;
 
     while ((len = fread(buf, 1, sizeof(buf), fin)) > 0) {
-        /* write trailing rsum_bytes of the rsum (trailing because the second part of the rsum is more useful in practice for hashing), and leading checksum_bytes of the checksum */
-        if (fwrite(buf + 4 - rsum_bytes, 1, rsum_bytes, fout) < rsum_bytes)
+        /* write trailing rsum_bytes of the rsum (trailing because the second part of the rsum is more useful in practice for hashing, and the high halves before it only matter for very large files), and leading checksum_bytes of the checksum */
+        if (fwrite(buf + RSUM_MAX_BYTES - rsum_bytes, 1, rsum_bytes, fout) < rsum_bytes)
             break;
-        if (fwrite(buf + 4, 1, hash_bytes, fout) < hash_bytes)
+        if (fwrite(buf + RSUM_MAX_BYTES, 1, hash_bytes, fout) < hash_bytes)
             break;
     }
     if (ferror(fin)) {
@@ -413,6 +433,151 @@ void fcopy_hashes(FILE * fin, FILE * fout, size_t rsum_bytes, size_t hash_bytes)
     }
 }
 
+/* fcopy_column(hash_stream, zsync_stream, offset, bytes)
+ * Copy one field of each block's checksums from their temporary store file to
+ * the .zsync: the given bytes from the given offset in each record. Returns
+ * the number of bytes written.
+ */
+static off_t fcopy_column(FILE * fin, FILE * fout, size_t offset, size_t bytes) {
+    unsigned char buf[RSUM_MAX_BYTES + CHECKSUM_SIZE];
+    off_t written = 0;
+
+    while (fread(buf, sizeof(buf), 1, fin) == 1) {
+        if (fwrite(buf + offset, 1, bytes, fout) < bytes)
+            break;
+        written += bytes;
+    }
+    if (ferror(fin)) {
+        stream_error("fread", fin);
+    }
+    if (ferror(fout)) {
+        stream_error("fwrite", fout);
+    }
+    return written;
+}
+
+/* write_binary_zsync(zsync_stream, header_stream, hash_stream, sha1, mtime, seq_matches, rsum_len, checksum_len)
+ * Writes a binary .zsync (see libzsync/format2.h): the header from the given
+ * settings, the other headers as written to the header stream, the zmap if
+ * any, and then the rsums and the checksums from the hash stream.
+ */
+static void write_binary_zsync(FILE * fout, FILE * hf, FILE * tf,
+                               const unsigned char *digest, time_t mtime,
+                               int seq_matches, int rsum_len,
+                               int checksum_len) {
+    const off_t nblocks = ftello(tf) / (RSUM_MAX_BYTES + CHECKSUM_SIZE);
+    unsigned char table[8 + 5 * ZS2_ENTRY_SIZE];
+    unsigned char header[ZS2_HEADER_SIZE];
+    struct {
+        int type;
+        off_t len;
+    } sec[5];
+    int n = 0, i;
+    off_t pos;
+
+    /* The sections, in order */
+    sec[n].type = ZS2_SEC_HEADER;
+    sec[n++].len = ZS2_HEADER_SIZE;
+    sec[n].type = ZS2_SEC_TEXT;
+    sec[n++].len = ftello(hf);
+    if (zmapentries) {
+        sec[n].type = ZS2_SEC_ZMAP;
+        sec[n++].len = zmapentries * (off_t) sizeof(struct gzblock);
+    }
+    sec[n].type = ZS2_SEC_RSUMS;
+    sec[n++].len = nblocks * rsum_len;
+    sec[n].type = ZS2_SEC_CHECKSUMS;
+    sec[n++].len = nblocks * checksum_len;
+
+    /* The table of them, each aligned */
+    memset(table, 0, sizeof table);
+    zs2_put(table, 4, n);
+    pos = ZS2_MAGIC_SIZE + 8 + n * ZS2_ENTRY_SIZE;
+    for (i = 0; i < n; i++) {
+        unsigned char *e = table + 8 + i * ZS2_ENTRY_SIZE;
+
+        pos = (pos + ZS2_ALIGN - 1) & ~(off_t) (ZS2_ALIGN - 1);
+        zs2_put(e, 4, sec[i].type);
+        zs2_put(e + 8, 8, pos);
+        zs2_put(e + 16, 8, sec[i].len);
+        pos += sec[i].len;
+    }
+
+    memset(header, 0, sizeof header);
+    zs2_put(header, 8, len);
+    zs2_put(header + 8, 4, blocksize);
+    header[12] = seq_matches;
+    header[13] = rsum_len;
+    header[14] = checksum_len;
+    header[15] = block_hash;
+    zs2_put(header + 16, 8, (int64_t) mtime);
+    memcpy(header + 24, digest, SHA1_DIGEST_LENGTH);
+
+    if (fwrite(ZS2_MAGIC, ZS2_MAGIC_SIZE, 1, fout) != 1
+        || fwrite(table, 8 + n * ZS2_ENTRY_SIZE, 1, fout) != 1)
+        stream_error("fwrite", fout);
+    pos = ZS2_MAGIC_SIZE + 8 + n * ZS2_ENTRY_SIZE;
+    for (i = 0; i < n; i++) {
+        /* Pad up to the start of the section */
+        while (pos & (ZS2_ALIGN - 1)) {
+            fputc(0, fout);
+            pos++;
+        }
+        switch (sec[i].type) {
+        case ZS2_SEC_HEADER:
+            if (fwrite(header, sizeof header, 1, fout) != 1)
+                stream_error("fwrite", fout);
+            break;
+        case ZS2_SEC_TEXT:
+            rewind(hf);
+            fcopy(hf, fout);
+            break;
+        case ZS2_SEC_ZMAP:
+            fcopy(zmap, fout);
+            break;
+        case ZS2_SEC_RSUMS:
+            rewind(tf);
+            fcopy_column(tf, fout, RSUM_MAX_BYTES - rsum_len, rsum_len);
+            break;
+        case ZS2_SEC_CHECKSUMS:
+            rewind(tf);
+            fcopy_column(tf, fout, RSUM_MAX_BYTES, checksum_len);
+            break;
+        }
+        pos += sec[i].len;
+    }
+    if (ferror(fout))
+        stream_error("fwrite", fout);
+}
+
+/* hash_lengths(len, seq_matches, &rsum_len, &checksum_len)
+ * Decide how long a rsum hash and checksum hash per block we need for a file
+ * of the given length, where the client must find seq_matches consecutive
+ * blocks matching. */
+static void hash_lengths(off_t len, int seq_matches, int *rsum_len,
+                         int *checksum_len) {
+    *rsum_len =
+        (7.9 +
+         ((log(len) + log(blocksize)) / log(2) - 8.6) / seq_matches) / 8;
+
+    /* min and max lengths of rsums to store */
+    if (*rsum_len > 4) *rsum_len = 4;
+    if (*rsum_len < 2) *rsum_len = 2;
+
+    /* Now the checksum length; min of two calculations */
+    *checksum_len =
+        (7.9 +
+         (20 +
+          (log(len) +
+           log(1 + len / blocksize)) / log(2)) / seq_matches) / 8;
+    {
+        int checksum_len2 =
+            (7.9 + (20 + log(1 + len / blocksize) / log(2))) / 8;
+        if (*checksum_len < checksum_len2)
+            *checksum_len = checksum_len2;
+    }
+}
+
 /* read_sample_and_close(stream, len, buf)
  * Reads len bytes from stream into buffer */
 static int read_sample_and_close(FILE * f, size_t l, void *buf) {
@@ -525,11 +690,17 @@ int main(int argc, char **argv) {
     int nUurls = 0;
     char *outfname = NULL;
     FILE *fout;
+    FILE *zsout;                /* where the .zsync goes, if fout is not it */
+    FILE *hout;                 /* where the text headers go */
     char *infname = NULL;
     int rsum_len, checksum_len, seq_matches;
     int do_compress = 0;
+    int gzip_zsync = 0;
+    int binary_zsync = 0;
     int do_recompress = -1;     // -1 means we decide for ourselves
     int do_exact = 0;
+    int wide_rsums = 0;
+    int more_seq_matches = 0;
     const char *gzopts = NULL;
     time_t mtime = -1;
 
@@ -538,14 +709,25 @@ int main(int argc, char **argv) {
 
     {   /* Options parsing */
         int opt;
-        while ((opt = getopt(argc, argv, "b:Ceo:f:u:U:vVzZ")) != -1) {
+        while ((opt = getopt(argc, argv, "2b:CeH:o:f:gSu:U:vVWzZ")) != -1) {
             switch (opt) {
+            case '2':
+                binary_zsync = 1;
+                break;
             case 'e':
                 do_exact = 1;
                 break;
             case 'C':
                 do_recompress = 0;
                 break;
+            case 'H':
+                block_hash = rcksum_hash_by_name(optarg);
+                if (block_hash < 0) {
+                    fprintf(stderr, "unknown block hash %s "
+                            "(MD4, BLAKE3 or XXH3-128)\n", optarg);
+                    exit(2);
+                }
+                break;
             case 'o':
                 if (outfname) {
                     fprintf(stderr, "specify -o only once\n");
@@ -560,6 +742,9 @@ int main(int argc, char **argv) {
                 }
                 fname = strdup(optarg);
                 break;
+            case 'g':
+                gzip_zsync = 1;
+                break;
             case 'b':
                 blocksize = atoi(optarg);
                 if ((blocksize & (blocksize - 1)) != 0) {
@@ -568,6 +753,9 @@ int main(int argc, char **argv) {
                     exit(2);
                 }
                 break;
+            case 'S':
+                more_seq_matches = 1;
+                break;
             case 'u':
                 url = realloc(url, (nurls + 1) * sizeof *url);
                 url[nurls++] = optarg;
@@ -584,6 +772,9 @@ int main(int argc, char **argv) {
                        __TIME__ ")\n" "By Colin Phipps <cph@moria.org.uk>\n"
                        "Published under the Artistic License v2, see the COPYING file for details.\n");
                 exit(0);
+            case 'W':
+                wide_rsums = 1;
+                break;
             case 'z':
                 do_compress = 1;
                 break;
@@ -670,28 +861,27 @@ int main(int argc, char **argv) {
     SHA1Init(&shactx);
     read_stream_write_blocksums(instream, tf);
 
-    {   /* Decide how long a rsum hash and checksum hash per block we need for this file */
+    {   /* Require 2 consecutive matching blocks; or, if asked, for very
+         * large files, where every byte per block adds up, more if that lets
+         * the hashes be shorter (only newer clients can use more than 2) */
+        int seq;
+
         seq_matches = 2;
-        rsum_len =
-            (7.9 +
-             ((log(len) + log(blocksize)) / log(2) - 8.6) / seq_matches) / 8;
-
-        /* min and max lengths of rsums to store */
-        if (rsum_len > 4) rsum_len = 4;
-        if (rsum_len < 2) rsum_len = 2;
-
-        /* Now the checksum length; min of two calculations */
-        checksum_len =
-            (7.9 +
-             (20 +
-              (log(len) +
-               log(1 + len / blocksize)) / log(2)) / seq_matches) / 8;
-        {
-            int checksum_len2 =
-                (7.9 + (20 + log(1 + len / blocksize) / log(2))) / 8;
-            if (checksum_len < checksum_len2)
-                checksum_len = checksum_len2;
-        }
+        hash_lengths(len, seq_matches, &rsum_len, &checksum_len);
+        if (more_seq_matches && len / blocksize >= SEQ_MATCHES_MIN_BLOCKS)
+            for (seq = 3; seq <= RCKSUM_MAX_SEQ_MATCHES; seq++) {
+                int r, c;
+
+                hash_lengths(len, seq, &r, &c);
+                if (r + c < rsum_len + checksum_len) {
+                    seq_matches = seq;
+                    rsum_len = r;
+                    checksum_len = c;
+                }
+            }
+
+        /* Or all of the rsum, with the high halves, if asked */
+        if (wide_rsums) rsum_len = RSUM_MAX_BYTES;
     }
 
     /* Recompression:
@@ -754,37 +944,60 @@ int main(int argc, char **argv) {
     }
     if (!outfname && fname) {
         outfname = malloc(strlen(fname) + 10);
-        sprintf(outfname, "%s.zsync", fname);
+        sprintf(outfname, gzip_zsync ? "%s.zsync.gz" : "%s.zsync", fname);
     }
 
     /* Open output file */
     if (outfname) {
-        fout = fopen(outfname, "wb");
-        if (!fout) {
+        zsout = fopen(outfname, "wb");
+        if (!zsout) {
             perror("open");
             exit(2);
         }
         free(outfname);
     }
     else {
-        fout = stdout;
+        zsout = stdout;
+    }
+
+    /* If the .zsync is to be compressed, write it out plain to a temporary
+     * file first, and compress that at the end */
+    fout = zsout;
+    if (gzip_zsync) {
+        fout = tmpfile();
+        if (!fout) {
+            perror("tmpfile");
+            exit(2);
+        }
+    }
+
+    /* For a binary .zsync, the headers that aren't in its header section are
+     * gathered up for the text section, and the rest is written at the end */
+    hout = fout;
+    if (binary_zsync) {
+        hout = tmpfile();
+        if (!hout) {
+            perror("tmpfile");
+            exit(2);
+        }
     }
 
     /* Okay, start writing the zsync file */
-    fprintf(fout, "zsync: " VERSION "\n");
+    if (!binary_zsync)
+        fprintf(fout, "zsync: " VERSION "\n");
 
     /* Lines we might include but which older clients can ignore */
     if (do_recompress) {
         if (zfname)
-            fprintf(fout, "Safe: Z-Filename Recompress MTime\nZ-Filename: %s\n",
+            fprintf(hout, "Safe: Z-Filename Recompress MTime\nZ-Filename: %s\n",
                     zfname);
         else
-            fprintf(fout, "Safe: Recompress MTime:\n");
+            fprintf(hout, "Safe: Recompress MTime:\n");
     }
 
     if (fname) {
-        fprintf(fout, "Filename: %s\n", fname);
-        if (mtime != -1) {
+        fprintf(hout, "Filename: %s\n", fname);
+        if (mtime != -1 && !binary_zsync) {
             char buf[32];
             struct tm mtime_tm;
 
@@ -797,58 +1010,87 @@ int main(int argc, char **argv) {
             }
         }
     }
-    fprintf(fout, "Blocksize: " SIZE_T_PF "\n", blocksize);
-    fprintf(fout, "Length: " OFF_T_PF "\n", len);
-    fprintf(fout, "Hash-Lengths: %d,%d,%d\n", seq_matches, rsum_len,
-            checksum_len);
+    if (!binary_zsync) {
+        fprintf(fout, "Blocksize: " SIZE_T_PF "\n", blocksize);
+        fprintf(fout, "Length: " OFF_T_PF "\n", len);
+        fprintf(fout, "Hash-Lengths: %d,%d,%d\n", seq_matches, rsum_len,
+                checksum_len);
+        /* Only if not the default, so that older clients can read the rest */
+        if (block_hash != RCKSUM_HASH_MD4)
+            fprintf(fout, "Block-Hash: %s\n", rcksum_hash_name(block_hash));
+    }
     {                           /* Write URLs */
         int i;
         for (i = 0; i < nurls; i++)
-            fprintf(fout, "%s: %s\n", zmapentries ? "Z-URL" : "URL", url[i]);
+            fprintf(hout, "%s: %s\n", zmapentries ? "Z-URL" : "URL", url[i]);
         for (i = 0; i < nUurls; i++)
-            fprintf(fout, "URL: %s\n", Uurl[i]);
+            fprintf(hout, "URL: %s\n", Uurl[i]);
     }
     if (nurls == 0 && infname) {
         /* Assume that we are in the public dir, and use relative paths.
          * Look for an uncompressed version and add a URL for that to if appropriate. */
-        fprintf(fout, "%s: %s\n", zmapentries ? "Z-URL" : "URL", infname);
+        fprintf(hout, "%s: %s\n", zmapentries ? "Z-URL" : "URL", infname);
         if (zmapentries && fname && !access(fname, R_OK)) {
-            fprintf(fout, "URL: %s\n", fname);
+            fprintf(hout, "URL: %s\n", fname);
         }
         fprintf(stderr,
                 "No URL given, so I am including a relative URL in the .zsync file - you must keep the file being served and the .zsync in the same public directory. Use -u %s to get this same result without this warning.\n",
                 infname);
     }
 
-    {   /* Write out SHA1 checksum of the entire file */
+    if (binary_zsync) {
         unsigned char digest[SHA1_DIGEST_LENGTH];
-        unsigned int i;
 
-        fputs("SHA-1: ", fout);
+        if (do_recompress)  /* Write Recompress header if wanted */
+            fprintf(hout, "Recompress: %s %s\n", zhead, gzopts);
 
+        /* Now the sections of the binary .zsync */
         SHA1Final(digest, &shactx);
-
-        for (i = 0; i < sizeof digest; i++)
-            fprintf(fout, "%02x", digest[i]);
-        fputc('\n', fout);
+        write_binary_zsync(fout, hout, tf, digest, mtime, seq_matches,
+                           rsum_len, checksum_len);
+        fclose(hout);
+        if (zmapentries)
+            fclose(zmap);
     }
+    else {
+        {   /* Write out SHA1 checksum of the entire file */
+            unsigned char digest[SHA1_DIGEST_LENGTH];
+            unsigned int i;
 
-    if (do_recompress)      /* Write Recompress header if wanted */
-        fprintf(fout, "Recompress: %s %s\n", zhead, gzopts);
+            fputs("SHA-1: ", fout);
 
-    /* If we have a zmap, write it, header first and then the map itself */
-    if (zmapentries) {
-        fprintf(fout, "Z-Map2: %d\n", zmapentries);
-        fcopy(zmap, fout);
-        fclose(zmap);
-    }
+            SHA1Final(digest, &shactx);
 
-    /* End of headers */
-    fputc('\n', fout);
+            for (i = 0; i < sizeof digest; i++)
+                fprintf(fout, "%02x", digest[i]);
+            fputc('\n', fout);
+        }
 
-    /* Now copy the actual block hashes to the .zsync */
-    rewind(tf);
-    fcopy_hashes(tf, fout, rsum_len, checksum_len);
+        if (do_recompress)  /* Write Recompress header if wanted */
+            fprintf(fout, "Recompress: %s %s\n", zhead, gzopts);
+
+        /* If we have a zmap, write it, header first and then the map itself */
+        if (zmapentries) {
+            fprintf(fout, "Z-Map2: %d\n", zmapentries);
+            fcopy(zmap, fout);
+            fclose(zmap);
+        }
+
+        /* End of headers */
+        fputc('\n', fout);
+
+        /* Now copy the actual block hashes to the .zsync */
+        rewind(tf);
+        fcopy_hashes(tf, fout, rsum_len, checksum_len);
+    }
+
+    /* Compress it into the real output file, if asked to */
+    if (gzip_zsync) {
+        rewind(fout);
+        if (gzip_stream(fout, zsout) != 0)
+            exit(2);
+        fclose(zsout);
+    }
 
     /* And cleanup */
     fclose(tf);
@@ -171,3 +171,69 @@ FILE *optimal_gzip(FILE * ffin, const char *fout, size_t blocksize) {
     rewind(ffout);
     return ffout;
 }
+
+/* Bytes of data to compress at a time in gzip_stream */
+#define GZIP_STREAM_BUF 65536
+
+/* gzip_stream(instream, outstream)
+ * Writes all the data from the input stream (from where it is, to EOF) to the
+ * output stream as a gzip file, compressed as much as zlib can. Unlike
+ * optimal_gzip, there is nothing special about the compression, as this is
+ * for files that are fetched whole (such as the .zsync itself). Returns 0 if
+ * successful, or -1 on error (having said what went wrong). */
+int gzip_stream(FILE * fin, FILE * fout) {
+    unsigned char *inbuf = malloc(GZIP_STREAM_BUF);
+    unsigned char *outbuf = malloc(GZIP_STREAM_BUF);
+    z_stream zs;
+    int err, flush, rc = 0;
+
+    zs.zalloc = Z_NULL;
+    zs.zfree = Z_NULL;
+    zs.opaque = NULL;
+
+    /* windowBits + 16 has zlib write the gzip header and footer for us */
+    if (!inbuf || !outbuf
+        || deflateInit2(&zs, 9, Z_DEFLATED, MAX_WBITS + 16, 8,
+                        Z_DEFAULT_STRATEGY) != Z_OK) {
+        fprintf(stderr, "could not set up compression\n");
+        free(inbuf);
+        free(outbuf);
+        return -1;
+    }
+
+    do {
+        zs.avail_in = fread(inbuf, 1, GZIP_STREAM_BUF, fin);
+        zs.next_in = inbuf;
+        if (ferror(fin)) {
+            perror("read");
+            rc = -1;
+            break;
+        }
+        flush = feof(fin) ? Z_FINISH : Z_NO_FLUSH;
+
+        /* Compress all that we read, writing out as much as it makes */
+        do {
+            size_t w;
+
+            zs.next_out = outbuf;
+            zs.avail_out = GZIP_STREAM_BUF;
+            err = deflate(&zs, flush);
+            if (err != Z_OK && err != Z_STREAM_END && err != Z_BUF_ERROR) {
+                fprintf(stderr, "zlib error: %s (%d)\n", zs.msg, err);
+                rc = -1;
+                break;
+            }
+            w = zs.next_out - outbuf;
+            if (w != fwrite(outbuf, 1, w, fout)) {
+                perror("write");
+                rc = -1;
+                break;
+            }
+        } while (zs.avail_out == 0);
+    } while (rc == 0 && flush != Z_FINISH);
+
+    deflateEnd(&zs);
+    free(outbuf);
+    free(inbuf);
+    return rc;
+}
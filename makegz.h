@@ -14,3 +14,4 @@
  */
 
 FILE* optimal_gzip(FILE* fin, const char* fout, size_t blocksize);
+int gzip_stream(FILE* fin, FILE* fout);